@@ -0,0 +1,341 @@
+#include "aabb_tree.h"
+
+static f32 Area(const Aabb& box)
+{
+    glm::vec3 d = box.max - box.min;
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+static bool Contains(const Aabb& outer, const Aabb& inner)
+{
+    return glm::all(glm::lessThanEqual(outer.min, inner.min)) && glm::all(glm::greaterThanEqual(outer.max, inner.max));
+}
+
+static u32 AllocateNode(AabbTree& tree)
+{
+    if (tree.freeList == AABB_TREE_NULL)
+    {
+        tree.nodes.push_back({});
+        tree.nodes.back().height = -1;
+        tree.nodes.back().parent = AABB_TREE_NULL;
+        tree.freeList = (u32)tree.nodes.size() - 1;
+    }
+
+    u32 nodeIdx = tree.freeList;
+    AabbTreeNode& node = tree.nodes[nodeIdx];
+    tree.freeList = node.parent;
+    node.parent = AABB_TREE_NULL;
+    node.children[0] = node.children[1] = AABB_TREE_NULL;
+    node.height = 0;
+    node.userData = 0;
+    return nodeIdx;
+}
+
+static void FreeNode(AabbTree& tree, u32 nodeIdx)
+{
+    tree.nodes[nodeIdx].parent = tree.freeList;
+    tree.nodes[nodeIdx].height = -1;
+    tree.freeList = nodeIdx;
+}
+
+// Rotates the subtree if it is imbalanced, returns its new root
+static u32 Balance(AabbTree& tree, u32 aIdx)
+{
+    std::vector<AabbTreeNode>& nodes = tree.nodes;
+    AabbTreeNode& a = nodes[aIdx];
+    if (a.height < 2)
+        return aIdx;
+
+    const u32 bIdx = a.children[0];
+    const u32 cIdx = a.children[1];
+    const i32 balance = nodes[cIdx].height - nodes[bIdx].height;
+    if (balance >= -1 && balance <= 1)
+        return aIdx;
+
+    // The higher child goes up, a goes down on the other side
+    const u32 upIdx = balance > 0 ? cIdx : bIdx;
+    const u32 downIdx = balance > 0 ? bIdx : cIdx;
+    const u32 upSide = balance > 0 ? 1 : 0;
+    AabbTreeNode& up = nodes[upIdx];
+    const u32 fIdx = up.children[0];
+    const u32 gIdx = up.children[1];
+
+    up.children[0] = aIdx;
+    up.parent = a.parent;
+    a.parent = upIdx;
+    if (up.parent == AABB_TREE_NULL)
+        tree.root = upIdx;
+    else if (nodes[up.parent].children[0] == aIdx)
+        nodes[up.parent].children[0] = upIdx;
+    else
+        nodes[up.parent].children[1] = upIdx;
+
+    // The higher grandchild stays with up, the other one replaces up under a
+    const bool fHigher = nodes[fIdx].height > nodes[gIdx].height;
+    const u32 keepIdx = fHigher ? fIdx : gIdx;
+    const u32 moveIdx = fHigher ? gIdx : fIdx;
+    up.children[1] = keepIdx;
+    a.children[upSide] = moveIdx;
+    nodes[moveIdx].parent = aIdx;
+
+    a.box = AabbUnion(nodes[downIdx].box, nodes[moveIdx].box);
+    up.box = AabbUnion(a.box, nodes[keepIdx].box);
+    a.height = 1 + glm::max(nodes[downIdx].height, nodes[moveIdx].height);
+    up.height = 1 + glm::max(a.height, nodes[keepIdx].height);
+    return upIdx;
+}
+
+// Refits the boxes and heights from nodeIdx up to the root, balancing on the way
+static void RefitAncestors(AabbTree& tree, u32 nodeIdx)
+{
+    std::vector<AabbTreeNode>& nodes = tree.nodes;
+    while (nodeIdx != AABB_TREE_NULL)
+    {
+        nodeIdx = Balance(tree, nodeIdx);
+        AabbTreeNode& node = nodes[nodeIdx];
+        const AabbTreeNode& child0 = nodes[node.children[0]];
+        const AabbTreeNode& child1 = nodes[node.children[1]];
+        node.height = 1 + glm::max(child0.height, child1.height);
+        node.box = AabbUnion(child0.box, child1.box);
+        nodeIdx = node.parent;
+    }
+}
+
+static void InsertLeaf(AabbTree& tree, u32 leafIdx)
+{
+    std::vector<AabbTreeNode>& nodes = tree.nodes;
+    if (tree.root == AABB_TREE_NULL)
+    {
+        tree.root = leafIdx;
+        nodes[leafIdx].parent = AABB_TREE_NULL;
+        return;
+    }
+
+    // Walk down to the sibling that grows the total area the least
+    const Aabb leafBox = nodes[leafIdx].box;
+    u32 siblingIdx = tree.root;
+    while (nodes[siblingIdx].height > 0)
+    {
+        const AabbTreeNode& node = nodes[siblingIdx];
+        const f32 area = Area(node.box);
+        const f32 combinedArea = Area(AabbUnion(node.box, leafBox));
+
+        // Cost of making a new parent for this node and the leaf, and the minimum
+        // cost added to the ancestors by pushing the leaf further down
+        const f32 cost = 2.0f * combinedArea;
+        const f32 inheritanceCost = 2.0f * (combinedArea - area);
+
+        f32 childCosts[2];
+        for (u32 i = 0; i < 2; ++i)
+        {
+            const AabbTreeNode& child = nodes[node.children[i]];
+            const f32 grownArea = Area(AabbUnion(child.box, leafBox));
+            childCosts[i] = child.height == 0 ? grownArea + inheritanceCost : grownArea - Area(child.box) + inheritanceCost;
+        }
+
+        if (cost < childCosts[0] && cost < childCosts[1])
+            break;
+        siblingIdx = childCosts[0] < childCosts[1] ? node.children[0] : node.children[1];
+    }
+
+    const u32 oldParentIdx = nodes[siblingIdx].parent;
+    const u32 newParentIdx = AllocateNode(tree); // May reallocate the nodes
+    AabbTreeNode& newParent = nodes[newParentIdx];
+    newParent.parent = oldParentIdx;
+    newParent.box = AabbUnion(leafBox, nodes[siblingIdx].box);
+    newParent.height = nodes[siblingIdx].height + 1;
+    newParent.children[0] = siblingIdx;
+    newParent.children[1] = leafIdx;
+    nodes[siblingIdx].parent = newParentIdx;
+    nodes[leafIdx].parent = newParentIdx;
+
+    if (oldParentIdx == AABB_TREE_NULL)
+        tree.root = newParentIdx;
+    else if (nodes[oldParentIdx].children[0] == siblingIdx)
+        nodes[oldParentIdx].children[0] = newParentIdx;
+    else
+        nodes[oldParentIdx].children[1] = newParentIdx;
+
+    RefitAncestors(tree, oldParentIdx);
+}
+
+static void RemoveLeaf(AabbTree& tree, u32 leafIdx)
+{
+    std::vector<AabbTreeNode>& nodes = tree.nodes;
+    if (leafIdx == tree.root)
+    {
+        tree.root = AABB_TREE_NULL;
+        return;
+    }
+
+    // The sibling takes the place of the parent
+    const u32 parentIdx = nodes[leafIdx].parent;
+    const u32 grandParentIdx = nodes[parentIdx].parent;
+    const u32 siblingIdx = nodes[parentIdx].children[0] == leafIdx ? nodes[parentIdx].children[1] : nodes[parentIdx].children[0];
+
+    nodes[siblingIdx].parent = grandParentIdx;
+    if (grandParentIdx == AABB_TREE_NULL)
+        tree.root = siblingIdx;
+    else if (nodes[grandParentIdx].children[0] == parentIdx)
+        nodes[grandParentIdx].children[0] = siblingIdx;
+    else
+        nodes[grandParentIdx].children[1] = siblingIdx;
+    FreeNode(tree, parentIdx);
+
+    RefitAncestors(tree, grandParentIdx);
+}
+
+static Aabb Fatten(const Aabb& box)
+{
+    return { box.min - glm::vec3(AABB_TREE_MARGIN), box.max + glm::vec3(AABB_TREE_MARGIN) };
+}
+
+u32 AabbTreeInsert(AabbTree& tree, const Aabb& box, u32 userData)
+{
+    const u32 leafIdx = AllocateNode(tree);
+    tree.nodes[leafIdx].box = Fatten(box);
+    tree.nodes[leafIdx].userData = userData;
+    InsertLeaf(tree, leafIdx);
+    tree.leafCount++;
+    return leafIdx;
+}
+
+void AabbTreeRemove(AabbTree& tree, u32 leaf)
+{
+    ASSERT(leaf < tree.nodes.size() && tree.nodes[leaf].height == 0, "Not a leaf of the tree");
+    RemoveLeaf(tree, leaf);
+    FreeNode(tree, leaf);
+    tree.leafCount--;
+}
+
+bool AabbTreeMove(AabbTree& tree, u32 leaf, const Aabb& box)
+{
+    ASSERT(leaf < tree.nodes.size() && tree.nodes[leaf].height == 0, "Not a leaf of the tree");
+    if (Contains(tree.nodes[leaf].box, box))
+        return false;
+
+    RemoveLeaf(tree, leaf);
+    tree.nodes[leaf].box = Fatten(box);
+    InsertLeaf(tree, leaf);
+    return true;
+}
+
+void AabbTreeClear(AabbTree& tree)
+{
+    tree.nodes.clear();
+    tree.root = AABB_TREE_NULL;
+    tree.freeList = AABB_TREE_NULL;
+    tree.leafCount = 0;
+}
+
+// Every leaf under nodeIdx
+static void CollectLeaves(const AabbTree& tree, u32 nodeIdx, std::vector<u32>& result, std::vector<u32>& stack)
+{
+    const size_t base = stack.size();
+    stack.push_back(nodeIdx);
+    while (stack.size() > base)
+    {
+        const AabbTreeNode& node = tree.nodes[stack.back()];
+        stack.pop_back();
+        if (node.height == 0)
+        {
+            result.push_back(node.userData);
+            continue;
+        }
+        stack.push_back(node.children[0]);
+        stack.push_back(node.children[1]);
+    }
+}
+
+void AabbTreeQueryFrustum(const AabbTree& tree, const Frustum& frustum, std::vector<u32>& intersecting, std::vector<u32>* inside)
+{
+    if (tree.root == AABB_TREE_NULL)
+        return;
+
+    std::vector<u32> stack;
+    stack.reserve(64);
+    stack.push_back(tree.root);
+    while (!stack.empty())
+    {
+        const u32 nodeIdx = stack.back();
+        stack.pop_back();
+        const AabbTreeNode& node = tree.nodes[nodeIdx];
+
+        const FrustumTest test = TestAabbFrustum(frustum, node.box);
+        if (test == FrustumTest_Outside)
+            continue;
+        if (test == FrustumTest_Inside)
+        {
+            CollectLeaves(tree, nodeIdx, inside ? *inside : intersecting, stack);
+            continue;
+        }
+        if (node.height == 0)
+        {
+            intersecting.push_back(node.userData);
+            continue;
+        }
+        stack.push_back(node.children[0]);
+        stack.push_back(node.children[1]);
+    }
+}
+
+void AabbTreeQuerySphere(const AabbTree& tree, const glm::vec3& center, f32 radius, std::vector<u32>& result)
+{
+    if (tree.root == AABB_TREE_NULL)
+        return;
+
+    const f32 radiusSq = radius * radius;
+    std::vector<u32> stack;
+    stack.reserve(64);
+    stack.push_back(tree.root);
+    while (!stack.empty())
+    {
+        const AabbTreeNode& node = tree.nodes[stack.back()];
+        stack.pop_back();
+
+        const glm::vec3 closest = glm::clamp(center, node.box.min, node.box.max);
+        const glm::vec3 d = closest - center;
+        if (glm::dot(d, d) > radiusSq)
+            continue;
+        if (node.height == 0)
+        {
+            result.push_back(node.userData);
+            continue;
+        }
+        stack.push_back(node.children[0]);
+        stack.push_back(node.children[1]);
+    }
+}
+
+void AabbTreeQueryRay(const AabbTree& tree, const glm::vec3& origin, const glm::vec3& direction, f32 maxDistance, std::vector<u32>& result)
+{
+    if (tree.root == AABB_TREE_NULL)
+        return;
+
+    // Division by 0 gives infinities, which the slab test handles
+    const glm::vec3 invDirection = 1.0f / direction;
+    std::vector<u32> stack;
+    stack.reserve(64);
+    stack.push_back(tree.root);
+    while (!stack.empty())
+    {
+        const AabbTreeNode& node = tree.nodes[stack.back()];
+        stack.pop_back();
+
+        const glm::vec3 t0 = (node.box.min - origin) * invDirection;
+        const glm::vec3 t1 = (node.box.max - origin) * invDirection;
+        const glm::vec3 tNear = glm::min(t0, t1);
+        const glm::vec3 tFar = glm::max(t0, t1);
+        const f32 enter = glm::max(glm::max(tNear.x, tNear.y), glm::max(tNear.z, 0.0f));
+        const f32 exit = glm::min(glm::min(tFar.x, tFar.y), glm::min(tFar.z, maxDistance));
+        if (enter > exit)
+            continue;
+        if (node.height == 0)
+        {
+            result.push_back(node.userData);
+            continue;
+        }
+        stack.push_back(node.children[0]);
+        stack.push_back(node.children[1]);
+    }
+}
@@ -0,0 +1,60 @@
+//
+// aabb_tree.h: Dynamic bounding volume hierarchy (binary AABB tree, inserted by
+// smallest area growth and kept balanced with rotations). Leaves store a fattened
+// box so objects that move a little don't need to be reinserted, and a user value
+// (the entity handle). Frustum, sphere and ray queries return the user values of
+// the leaves they touch.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "culling.h"
+
+#define AABB_TREE_NULL   0xffffffff
+#define AABB_TREE_MARGIN 0.1f // Leaf boxes are this much bigger than the object on every side
+
+struct AabbTreeNode
+{
+    Aabb box;
+    u32  parent;   // Next free node while the node is unused
+    u32  children[2];
+    i32  height;   // 0 for leaves, -1 for unused nodes
+    u32  userData;
+};
+
+struct AabbTree
+{
+    std::vector<AabbTreeNode> nodes;
+    u32 root = AABB_TREE_NULL;
+    u32 freeList = AABB_TREE_NULL;
+    u32 leafCount = 0;
+};
+
+/**
+ * Adds a leaf and returns its id, valid until AabbTreeRemove(). The id doesn't
+ * change when the leaf is moved.
+ */
+u32 AabbTreeInsert(AabbTree& tree, const Aabb& box, u32 userData);
+
+void AabbTreeRemove(AabbTree& tree, u32 leaf);
+
+/**
+ * Refits a leaf to the new box of its object. It is only reinserted when the box
+ * leaves the fattened one. Returns true if it was.
+ */
+bool AabbTreeMove(AabbTree& tree, u32 leaf, const Aabb& box);
+
+void AabbTreeClear(AabbTree& tree);
+
+/**
+ * Leaves overlapping the frustum. Subtrees completely inside it are added without
+ * testing their nodes, into inside when given (so the caller can skip its own finer
+ * tests), into intersecting otherwise.
+ */
+void AabbTreeQueryFrustum(const AabbTree& tree, const Frustum& frustum, std::vector<u32>& intersecting, std::vector<u32>* inside);
+
+void AabbTreeQuerySphere(const AabbTree& tree, const glm::vec3& center, f32 radius, std::vector<u32>& result);
+
+// Leaves whose box is hit by the segment origin + t * direction, 0 <= t <= maxDistance
+void AabbTreeQueryRay(const AabbTree& tree, const glm::vec3& origin, const glm::vec3& direction, f32 maxDistance, std::vector<u32>& result);
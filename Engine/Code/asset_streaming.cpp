@@ -0,0 +1,248 @@
+#include "asset_streaming.h"
+#include "engine.h"
+#include "assimp_model_loading.h"
+#include "job_system.h"
+#include "profiler.h"
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+struct StreamingUpload
+{
+    void* coroutine; // std::coroutine_handle<>::address()
+    u32   bytes;
+};
+
+struct StreamingQueue
+{
+    std::mutex                   mutex;
+    std::vector<StreamingUpload> uploads; // Oldest first, pushed by the workers
+    std::vector<void*>           live;    // Every coroutine not returned yet, wherever it is suspended
+};
+
+// Started by StartStreamingTask() and frees its frame once it returns, nobody waits for it
+struct StreamingTask
+{
+    struct promise_type
+    {
+        StreamingQueue* queue = NULL;
+
+        StreamingTask get_return_object() { return { std::coroutine_handle<promise_type>::from_promise(*this) }; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        // Returned, or destroyed by StreamingShutdown()
+        ~promise_type()
+        {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            const void* coroutine = std::coroutine_handle<promise_type>::from_promise(*this).address();
+            for (u32 i = 0; i < queue->live.size(); ++i)
+            {
+                if (queue->live[i] == coroutine)
+                {
+                    queue->live[i] = queue->live.back();
+                    queue->live.pop_back();
+                    break;
+                }
+            }
+        }
+    };
+
+    std::coroutine_handle<promise_type> coroutine;
+};
+
+static void StartStreamingTask(App* app, StreamingTask task)
+{
+    StreamingQueue& queue = *app->streaming.queue;
+    task.coroutine.promise().queue = &queue;
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.live.push_back(task.coroutine.address());
+    }
+    task.coroutine.resume();
+}
+
+// The decoded pixels go with the coroutine frame, uploaded or not
+struct StreamedImage
+{
+    Image image = {};
+    ~StreamedImage()
+    {
+        if (image.pixels)
+            FreeImage(image);
+    }
+};
+
+static void ResumeCoroutine(void* coroutine, u32, u32)
+{
+    std::coroutine_handle<>::from_address(coroutine).resume();
+}
+
+// co_await moves the coroutine to a worker thread, it stays on this one without workers
+struct ResumeOnWorker
+{
+    bool await_ready() const { return JobSystemThreadCount() == 1; }
+    void await_suspend(std::coroutine_handle<> coroutine) const { RunBackgroundJob(ResumeCoroutine, coroutine.address()); }
+    void await_resume() const {}
+};
+
+// co_await moves the coroutine to the render thread, UpdateStreaming() resumes it once
+// the frame budget has room for its upload
+struct ResumeOnRenderThread
+{
+    App* app;
+    u32  bytes;
+
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> coroutine) const
+    {
+        StreamingQueue& queue = *app->streaming.queue;
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.uploads.push_back({ coroutine.address(), bytes });
+    }
+    void await_resume() const {}
+};
+
+void StreamingInit(AssetStreaming& streaming)
+{
+    streaming.queue = new StreamingQueue;
+    streaming.budgetBytes = STREAMING_UPLOAD_BUDGET;
+    streaming.pending = 0;
+    streaming.uploadedBytes = 0;
+    streaming.loadedCount = 0;
+    streaming.failedCount = 0;
+}
+
+void StreamingShutdown(AssetStreaming& streaming)
+{
+    if (!streaming.queue)
+        return;
+
+    // Waiting for an upload or for a background job JobSystemShutdown() dropped, no
+    // thread resumes them anymore. Taken out first, the promises unregister themselves.
+    std::vector<void*> live;
+    {
+        std::lock_guard<std::mutex> lock(streaming.queue->mutex);
+        live.swap(streaming.queue->live);
+    }
+    for (void* coroutine : live)
+        std::coroutine_handle<>::from_address(coroutine).destroy();
+    delete streaming.queue;
+    streaming.queue = NULL;
+}
+
+static StreamingTask StreamTexture(App* app, u32 texIdx, std::string filepath)
+{
+    co_await ResumeOnWorker{};
+    StreamedImage streamed;
+    streamed.image = LoadImage(filepath.c_str());
+    const Image& image = streamed.image;
+
+    co_await ResumeOnRenderThread{ app, image.pixels ? (u32)(image.stride * image.size.y) : 0 };
+    Texture& texture = app->textures[texIdx];
+    if (image.pixels)
+    {
+        texture.handle = CreateTexture2DFromImage(app, image);
+        app->streaming.loadedCount++;
+    }
+    else
+    {
+        texture.handle = app->textures[app->magentaTexIdx].handle;
+        app->streaming.failedCount++;
+    }
+    app->streaming.pending--;
+}
+
+static StreamingTask StreamModel(App* app, u32 modelIdx, std::string filename)
+{
+    co_await ResumeOnWorker{};
+    ImportedModel imported;
+    const bool parsed = ImportModel(filename.c_str(), imported);
+
+    co_await ResumeOnRenderThread{ app, parsed ? ImportedModelBytes(imported) : 0 };
+    if (parsed)
+    {
+        CommitModel(app, modelIdx, imported, true);
+        ValidateModelVertexFormats(app, modelIdx, filename.c_str());
+
+        //the entities had an empty box until now
+        for (u32 i = 0; i < app->entities.size(); ++i)
+        {
+            if (app->entities[i].modelIndex == modelIdx)
+                RefitEntity(app, i);
+        }
+        app->renderQueue.dirty = true;
+        app->streaming.loadedCount++;
+    }
+    else
+    {
+        app->streaming.failedCount++;
+    }
+    app->streaming.pending--;
+}
+
+u32 LoadTexture2DAsync(App* app, const char* filepath, u32 placeholderIdx)
+{
+    for (u32 texIdx = 0; texIdx < app->textures.size(); ++texIdx)
+        if (app->textures[texIdx].filepath == filepath)
+            return texIdx;
+
+    Texture texture = {};
+    texture.handle = app->textures[placeholderIdx].handle;
+    texture.filepath = filepath;
+    app->textures.push_back(texture);
+    const u32 texIdx = (u32)app->textures.size() - 1;
+
+    app->streaming.pending++;
+    StartStreamingTask(app, StreamTexture(app, texIdx, filepath));
+    return texIdx;
+}
+
+u32 LoadModelAsync(App* app, const char* filename)
+{
+    const u32 modelIdx = ReserveModel(app);
+    app->streaming.pending++;
+    StartStreamingTask(app, StreamModel(app, modelIdx, filename));
+    return modelIdx;
+}
+
+void UpdateStreaming(App* app)
+{
+    PROFILE_FUNCTION();
+    AssetStreaming& streaming = app->streaming;
+    StreamingQueue& queue = *streaming.queue;
+
+    //oldest first while they fit in the budget
+    std::vector<StreamingUpload> uploads;
+    u64 bytes = 0;
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        u32 count = 0;
+        while (count < queue.uploads.size() && (count == 0 || bytes + queue.uploads[count].bytes <= streaming.budgetBytes))
+            bytes += queue.uploads[count++].bytes;
+        uploads.assign(queue.uploads.begin(), queue.uploads.begin() + count);
+        queue.uploads.erase(queue.uploads.begin(), queue.uploads.begin() + count);
+    }
+
+    //outside the lock, a model queues the streaming of its textures
+    for (const StreamingUpload& upload : uploads)
+        std::coroutine_handle<>::from_address(upload.coroutine).resume();
+    streaming.uploadedBytes = (u32)glm::min(bytes, (u64)UINT32_MAX);
+}
+
+void FinishStreaming(App* app)
+{
+    PROFILE_FUNCTION();
+    AssetStreaming& streaming = app->streaming;
+    const u32 budgetBytes = streaming.budgetBytes;
+    streaming.budgetBytes = UINT32_MAX;
+    while (streaming.pending > 0)
+    {
+        UpdateStreaming(app);
+        std::this_thread::yield();
+    }
+    streaming.budgetBytes = budgetBytes;
+}
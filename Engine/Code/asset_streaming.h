@@ -0,0 +1,56 @@
+//
+// asset_streaming.h: Models and textures loaded in the background. LoadModelAsync() and
+// LoadTexture2DAsync() return the model or texture index right away and start a
+// coroutine: it moves to a job system worker to parse the model file or decode the
+// image, then back to the render thread to create the GL objects. UpdateStreaming()
+// resumes those at the start of every frame, as many as fit in the upload budget.
+//
+// Meanwhile a texture shows the placeholder it was requested with (white, black, the
+// flat normal), and turns magenta if the file can't be read. A model has no submeshes
+// until it is uploaded, so its entities are not drawn; its materials then stream their
+// own textures.
+//
+
+#pragma once
+
+#include "platform.h"
+
+struct App;
+struct StreamingQueue;
+
+#define STREAMING_UPLOAD_BUDGET (8 << 20) // Bytes uploaded per frame
+
+struct AssetStreaming
+{
+    StreamingQueue* queue;
+    u32 budgetBytes;   // At least one upload per frame goes through, whatever its size
+    u32 pending;       // Requested and not uploaded yet
+
+    // Shown in the UI
+    u32 uploadedBytes; // Last UpdateStreaming()
+    u32 loadedCount;
+    u32 failedCount;
+};
+
+void StreamingInit(AssetStreaming& streaming);
+
+// After JobSystemShutdown(), destroys the coroutines that didn't finish, wherever they wait
+void StreamingShutdown(AssetStreaming& streaming);
+
+/**
+ * Reserves a texture showing the placeholder and streams the image in. The same path
+ * gives the same texture, loaded or not.
+ */
+u32 LoadTexture2DAsync(App* app, const char* filepath, u32 placeholderIdx);
+
+/**
+ * Reserves an empty model and streams the file in. Its vertex formats are validated
+ * once it is uploaded.
+ */
+u32 LoadModelAsync(App* app, const char* filename);
+
+// Runs the uploads of the frame on the render thread. Called by Update().
+void UpdateStreaming(App* app);
+
+// Blocks until every requested asset is uploaded, for runs that must not see placeholders
+void FinishStreaming(App* app);
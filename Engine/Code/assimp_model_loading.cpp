@@ -3,6 +3,8 @@
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 #include "assimp_model_loading.h"
+#include "asset_streaming.h"
+#include "profiler.h"
 
 void ProcessAssimpMesh(const aiScene* scene, aiMesh *mesh, Mesh *myMesh, u32 baseMeshMaterialIndex, std::vector<u32>& submeshMaterialIndices)
 {
@@ -87,10 +89,19 @@ void ProcessAssimpMesh(const aiScene* scene, aiMesh *mesh, Mesh *myMesh, u32 bas
     submesh.vertexBufferLayout = vertexBufferLayout;
     submesh.vertices.swap(vertices);
     submesh.indices.swap(indices);
+    ComputeSubmeshBounds(submesh);
     myMesh->submeshes.push_back( submesh );
 }
 
-void ProcessAssimpMaterial(App* app, aiMaterial *material, Material& myMaterial, String directory)
+// The file name relative to the model directory. Workers can't use the frame arena (MakePath()).
+static std::string TexturePath(const std::string& directory, aiMaterial* material, aiTextureType type)
+{
+    aiString filename;
+    material->GetTexture(type, 0, &filename);
+    return directory + "/" + filename.C_Str();
+}
+
+void ProcessAssimpMaterial(aiMaterial *material, ImportedMaterial& imported, const std::string& directory)
 {
     aiString name;
     aiColor3D diffuseColor;
@@ -103,47 +114,22 @@ void ProcessAssimpMaterial(App* app, aiMaterial *material, Material& myMaterial,
     material->Get(AI_MATKEY_COLOR_SPECULAR, specularColor);
     material->Get(AI_MATKEY_SHININESS, shininess);
 
+    Material& myMaterial = imported.material;
     myMaterial.name = name.C_Str();
     myMaterial.albedo = vec3(diffuseColor.r, diffuseColor.g, diffuseColor.b);
     myMaterial.emissive = vec3(emissiveColor.r, emissiveColor.g, emissiveColor.b);
     myMaterial.smoothness = shininess / 256.0f;
 
-    aiString aiFilename;
     if (material->GetTextureCount(aiTextureType_DIFFUSE) > 0)
-    {
-        material->GetTexture(aiTextureType_DIFFUSE, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.albedoTextureIdx = LoadTexture2D(app, filepath.str);
-    }
+        imported.albedoPath = TexturePath(directory, material, aiTextureType_DIFFUSE);
     if (material->GetTextureCount(aiTextureType_EMISSIVE) > 0)
-    {
-        material->GetTexture(aiTextureType_EMISSIVE, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.emissiveTextureIdx = LoadTexture2D(app, filepath.str);
-    }
+        imported.emissivePath = TexturePath(directory, material, aiTextureType_EMISSIVE);
     if (material->GetTextureCount(aiTextureType_SPECULAR) > 0)
-    {
-        material->GetTexture(aiTextureType_SPECULAR, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.specularTextureIdx = LoadTexture2D(app, filepath.str);
-    }
+        imported.specularPath = TexturePath(directory, material, aiTextureType_SPECULAR);
     if (material->GetTextureCount(aiTextureType_NORMALS) > 0)
-    {
-        material->GetTexture(aiTextureType_NORMALS, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.normalsTextureIdx = LoadTexture2D(app, filepath.str);
-    }
+        imported.normalsPath = TexturePath(directory, material, aiTextureType_NORMALS);
     if (material->GetTextureCount(aiTextureType_HEIGHT) > 0)
-    {
-        material->GetTexture(aiTextureType_HEIGHT, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.bumpTextureIdx = LoadTexture2D(app, filepath.str);
-    }
+        imported.bumpPath = TexturePath(directory, material, aiTextureType_HEIGHT);
 
     //myMaterial.createNormalFromBump();
 }
@@ -164,8 +150,10 @@ void ProcessAssimpNode(const aiScene* scene, aiNode *node, Mesh *myMesh, u32 bas
     }
 }
 
-u32 LoadModel(App* app, const char* filename)
+bool ImportModel(const char* filename, ImportedModel& imported)
 {
+    PROFILE_FUNCTION();
+
     const aiScene* scene = aiImportFile(filename,
                                         aiProcess_Triangulate           |
                                         aiProcess_GenSmoothNormals      |
@@ -179,70 +167,87 @@ u32 LoadModel(App* app, const char* filename)
     if (!scene)
     {
         ELOG("Error loading mesh %s: %s", filename, aiGetErrorString());
-        return UINT32_MAX;
+        return false;
     }
 
-    app->meshes.push_back(Mesh{});
-    Mesh& mesh = app->meshes.back();
-    u32 meshIdx = (u32)app->meshes.size() - 1u;
-
-    app->models.push_back(Model{});
-    Model& model = app->models.back();
-    model.meshIdx = meshIdx;
-    u32 modelIdx = (u32)app->models.size() - 1u;
-
-    String directory = GetDirectoryPart(MakeString(filename));
+    const std::string path = filename;
+    const size_t separator = path.find_last_of("/\\");
+    const std::string directory = separator == std::string::npos ? std::string(".") : path.substr(0, separator);
 
     // Create a list of materials
-    u32 baseMeshMaterialIndex = (u32)app->materials.size();
+    imported.materials.resize(scene->mNumMaterials);
     for (unsigned int i = 0; i < scene->mNumMaterials; ++i)
-    {
-        app->materials.push_back(Material{});
-        Material& material = app->materials.back();
-        ProcessAssimpMaterial(app, scene->mMaterials[i], material, directory);
-    }
+        ProcessAssimpMaterial(scene->mMaterials[i], imported.materials[i], directory);
 
-    ProcessAssimpNode(scene, scene->mRootNode, &mesh, baseMeshMaterialIndex, model.materialIdx);
+    ProcessAssimpNode(scene, scene->mRootNode, &imported.mesh, 0, imported.submeshMaterials);
 
     aiReleaseImport(scene);
+    return true;
+}
 
-    u32 vertexBufferSize = 0;
-    u32 indexBufferSize = 0;
-
-    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
-    {
-        vertexBufferSize += mesh.submeshes[i].vertices.size() * sizeof(float);
-        indexBufferSize  += mesh.submeshes[i].indices.size()  * sizeof(u32);
-    }
+u32 ImportedModelBytes(const ImportedModel& imported)
+{
+    u32 bytes = 0;
+    for (const Submesh& submesh : imported.mesh.submeshes)
+        bytes += (u32)(submesh.vertices.size() * sizeof(float) + submesh.indices.size() * sizeof(u32));
+    return bytes;
+}
 
-    glGenBuffers(1, &mesh.vertexBufferHandle);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBufferData(GL_ARRAY_BUFFER, vertexBufferSize, NULL, GL_STATIC_DRAW);
+u32 ReserveModel(App* app)
+{
+    app->meshes.push_back(Mesh{});
+    app->models.push_back(Model{});
+    Model& model = app->models.back();
+    model.meshIdx = (u32)app->meshes.size() - 1u;
+    return (u32)app->models.size() - 1u;
+}
 
-    glGenBuffers(1, &mesh.indexBufferHandle);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBufferSize, NULL, GL_STATIC_DRAW);
+static u32 LoadMaterialTexture(App* app, const std::string& filepath, u32 placeholderIdx, bool streamTextures)
+{
+    if (streamTextures)
+        return LoadTexture2DAsync(app, filepath.c_str(), placeholderIdx);
+    return LoadTexture2D(app, filepath.c_str());
+}
 
-    u32 indicesOffset = 0;
-    u32 verticesOffset = 0;
+void CommitModel(App* app, u32 modelIdx, ImportedModel& imported, bool streamTextures)
+{
+    PROFILE_FUNCTION();
 
-    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+    u32 baseMeshMaterialIndex = (u32)app->materials.size();
+    for (const ImportedMaterial& source : imported.materials)
     {
-        const void* verticesData = mesh.submeshes[i].vertices.data();
-        const u32   verticesSize = mesh.submeshes[i].vertices.size() * sizeof(float);
-        glBufferSubData(GL_ARRAY_BUFFER, verticesOffset, verticesSize, verticesData);
-        mesh.submeshes[i].vertexOffset = verticesOffset;
-        verticesOffset += verticesSize;
-
-        const void* indicesData = mesh.submeshes[i].indices.data();
-        const u32   indicesSize = mesh.submeshes[i].indices.size() * sizeof(u32);
-        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indicesOffset, indicesSize, indicesData);
-        mesh.submeshes[i].indexOffset = indicesOffset;
-        indicesOffset += indicesSize;
+        Material material = source.material;
+        if (!source.albedoPath.empty())
+            material.albedoTextureIdx = LoadMaterialTexture(app, source.albedoPath, app->whiteTexIdx, streamTextures);
+        if (!source.emissivePath.empty())
+            material.emissiveTextureIdx = LoadMaterialTexture(app, source.emissivePath, app->blackTexIdx, streamTextures);
+        if (!source.specularPath.empty())
+            material.specularTextureIdx = LoadMaterialTexture(app, source.specularPath, app->whiteTexIdx, streamTextures);
+        if (!source.normalsPath.empty())
+            material.normalsTextureIdx = LoadMaterialTexture(app, source.normalsPath, app->normalTexIdx, streamTextures);
+        if (!source.bumpPath.empty())
+            material.bumpTextureIdx = LoadMaterialTexture(app, source.bumpPath, app->blackTexIdx, streamTextures);
+        app->materials.push_back(material);
     }
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    Model& model = app->models[modelIdx];
+    Mesh& mesh = app->meshes[model.meshIdx];
+    mesh.submeshes.swap(imported.mesh.submeshes);
+    model.materialIdx.clear();
+    for (u32 materialIdx : imported.submeshMaterials)
+        model.materialIdx.push_back(baseMeshMaterialIndex + materialIdx);
+
+    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+        UploadSubmesh(app, mesh.submeshes[i]);
+}
+
+u32 LoadModel(App* app, const char* filename)
+{
+    ImportedModel imported;
+    if (!ImportModel(filename, imported))
+        return UINT32_MAX;
 
+    u32 modelIdx = ReserveModel(app);
+    CommitModel(app, modelIdx, imported, false);
     return modelIdx;
-}
\ No newline at end of file
+}
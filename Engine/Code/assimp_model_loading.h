@@ -1,4 +1,42 @@
 #pragma once
 #include "engine.h"
 
-u32 LoadModel(App* app, const char* filename);
\ No newline at end of file
+// Material of a model file, with the textures still to load
+struct ImportedMaterial
+{
+    Material    material;
+    std::string albedoPath;
+    std::string emissivePath;
+    std::string specularPath;
+    std::string normalsPath;
+    std::string bumpPath;
+};
+
+// A model file parsed into CPU memory
+struct ImportedModel
+{
+    Mesh                          mesh;
+    std::vector<ImportedMaterial> materials;
+    std::vector<u32>              submeshMaterials; // Index in materials of every submesh
+};
+
+/**
+ * Parses a model file with assimp. Touches neither the app nor GL, so it can run on
+ * any thread. Returns false (and logs why) if the file can't be read.
+ */
+bool ImportModel(const char* filename, ImportedModel& imported);
+
+// Vertex and index bytes CommitModel() uploads
+u32 ImportedModelBytes(const ImportedModel& imported);
+
+// Adds an empty model (and mesh) for CommitModel() to fill
+u32 ReserveModel(App* app);
+
+/**
+ * Creates the materials and uploads the submeshes of an imported model into a reserved
+ * one. Textures are loaded with LoadTexture2D(), or streamed in behind placeholders
+ * with LoadTexture2DAsync().
+ */
+void CommitModel(App* app, u32 modelIdx, ImportedModel& imported, bool streamTextures);
+
+u32 LoadModel(App* app, const char* filename);
@@ -0,0 +1,434 @@
+#include "benchmark.h"
+#include "job_system.h"
+#include "occlusion.h"
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+bool ParseBenchmarkArgs(int argc, char** argv, BenchmarkSettings& settings)
+{
+    settings.headless = false;
+    settings.frameCount = 300;
+    settings.warmupFrames = 10;
+    settings.resolution = glm::ivec2(1280, 720);
+    settings.mode = "patrick";
+    settings.reportPath = NULL;
+    settings.jobThreads = 0;
+    settings.pinThreads = false;
+    settings.jobsBenchmark = false;
+    settings.occlusionCheck = false;
+    settings.occlusionBenchmark = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--headless") == 0)       { settings.headless = true; continue; }
+        if (strcmp(arg, "--pin-threads") == 0)    { settings.pinThreads = true; continue; }
+        if (strcmp(arg, "--jobs-benchmark") == 0) { settings.jobsBenchmark = true; continue; }
+        if (strcmp(arg, "--occlusion-check") == 0)     { settings.occlusionCheck = true; continue; }
+        if (strcmp(arg, "--occlusion-benchmark") == 0) { settings.occlusionBenchmark = true; continue; }
+
+        if (!value)
+        {
+            ELOG("Missing value for command line argument %s", arg);
+            return false;
+        }
+
+        if      (strcmp(arg, "--frames") == 0) settings.frameCount = (u32)atoi(value);
+        else if (strcmp(arg, "--warmup") == 0) settings.warmupFrames = (u32)atoi(value);
+        else if (strcmp(arg, "--width") == 0)  settings.resolution.x = atoi(value);
+        else if (strcmp(arg, "--height") == 0) settings.resolution.y = atoi(value);
+        else if (strcmp(arg, "--mode") == 0)   settings.mode = value;
+        else if (strcmp(arg, "--report") == 0) settings.reportPath = value;
+        else if (strcmp(arg, "--jobs") == 0)   settings.jobThreads = (u32)atoi(value);
+        else
+        {
+            ELOG("Unknown command line argument %s", arg);
+            return false;
+        }
+        ++i;
+    }
+
+    if (settings.frameCount == 0 || settings.resolution.x <= 0 || settings.resolution.y <= 0)
+    {
+        ELOG("Invalid benchmark settings: frames and resolution must be greater than 0");
+        return false;
+    }
+
+    return true;
+}
+
+// Nearest-rank percentile over an already sorted array
+static f64 Percentile(const std::vector<f64>& sorted, f64 percentile)
+{
+    if (sorted.empty())
+        return 0.0;
+    size_t rank = (size_t)ceil(percentile / 100.0 * sorted.size());
+    rank = std::max<size_t>(rank, 1);
+    return sorted[std::min(rank, sorted.size()) - 1];
+}
+
+static void WriteSummary(FILE* file, const char* name, std::vector<f64> samples, bool last)
+{
+    std::sort(samples.begin(), samples.end());
+    f64 mean = 0.0;
+    for (f64 sample : samples)
+        mean += sample;
+    mean = samples.empty() ? 0.0 : mean / samples.size();
+
+    fprintf(file, "    \"%s\": { \"min\": %.4f, \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f }%s\n",
+            name,
+            samples.empty() ? 0.0 : samples.front(),
+            mean,
+            Percentile(samples, 50.0),
+            Percentile(samples, 95.0),
+            Percentile(samples, 99.0),
+            samples.empty() ? 0.0 : samples.back(),
+            last ? "" : ",");
+}
+
+bool WriteBenchmarkReport(const BenchmarkSettings& settings, const char* renderer, bool persistentMapping, const std::vector<BenchmarkFrame>& frames)
+{
+    FILE* file = stdout;
+    if (settings.reportPath)
+    {
+        file = fopen(settings.reportPath, "wb");
+        if (!file)
+        {
+            ELOG("fopen() failed writing benchmark report %s", settings.reportPath);
+            return false;
+        }
+    }
+
+    std::vector<f64> cpuMs, gpuMs, drawCalls, stateChanges;
+    for (const BenchmarkFrame& frame : frames)
+    {
+        cpuMs.push_back(frame.cpuMs);
+        gpuMs.push_back(frame.gpuMs);
+        drawCalls.push_back(frame.drawCalls);
+        stateChanges.push_back(frame.stateChanges);
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"renderer\": ");
+    WriteJsonString(file, renderer ? renderer : "unknown");
+    fprintf(file, ",\n  \"mode\": ");
+    WriteJsonString(file, settings.mode);
+    fprintf(file, ",\n");
+    fprintf(file, "  \"persistentMapping\": %s,\n", persistentMapping ? "true" : "false");
+    fprintf(file, "  \"width\": %d,\n", settings.resolution.x);
+    fprintf(file, "  \"height\": %d,\n", settings.resolution.y);
+    fprintf(file, "  \"warmupFrames\": %u,\n", settings.warmupFrames);
+    fprintf(file, "  \"frames\": %u,\n", (u32)frames.size());
+    fprintf(file, "  \"summary\": {\n");
+    WriteSummary(file, "cpuMs", cpuMs, false);
+    WriteSummary(file, "gpuMs", gpuMs, false);
+    WriteSummary(file, "drawCalls", drawCalls, false);
+    WriteSummary(file, "stateChanges", stateChanges, true);
+    fprintf(file, "  },\n");
+    fprintf(file, "  \"perFrame\": [\n");
+    for (size_t i = 0; i < frames.size(); ++i)
+    {
+        const BenchmarkFrame& frame = frames[i];
+        fprintf(file, "    { \"cpuMs\": %.4f, \"gpuMs\": %.4f, \"drawCalls\": %u, \"stateChanges\": %u }%s\n",
+                frame.cpuMs, frame.gpuMs, frame.drawCalls, frame.stateChanges,
+                i + 1 < frames.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+
+    if (file != stdout)
+        fclose(file);
+
+    if (!persistentMapping)
+    {
+        ELOG("glBufferStorage not available, the ring buffers were remapped every frame");
+        return false;
+    }
+
+    return true;
+}
+
+#define JOBS_BENCHMARK_EMPTY_JOBS  65536
+#define JOBS_BENCHMARK_BURST       1024    // Empty jobs pushed before waiting, under JOB_DEQUE_SIZE
+#define JOBS_BENCHMARK_ROUND_TRIPS 10000
+#define JOBS_BENCHMARK_OBJECTS     (1 << 20)
+#define JOBS_BENCHMARK_BATCH       256     // As the object packing of Update()
+#define JOBS_BENCHMARK_REPEATS     5       // The fastest one is kept
+
+struct JobsBenchmarkRun
+{
+    u32 threads;
+    f64 emptyJobNs;  // Push, steal or pop and run, per job
+    f64 roundTripNs; // One job submitted and waited for
+    f64 packingMs;   // JOBS_BENCHMARK_OBJECTS matrices
+};
+
+struct JobsBenchmarkPacking
+{
+    const glm::mat4* matrices;
+    u8*              rows;
+};
+
+static f64 BenchmarkNowNs()
+{
+    return (f64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void EmptyJob(void*, u32, u32)
+{
+}
+
+// Same work as the object params of Update(), 3 rows of 16 bytes per matrix
+static void PackMatrices(void* data, u32 begin, u32 end)
+{
+    const JobsBenchmarkPacking& packing = *(const JobsBenchmarkPacking*)data;
+    for (u32 i = begin; i < end; ++i)
+    {
+        const glm::mat4 rows = glm::transpose(packing.matrices[i]);
+        memcpy(packing.rows + i * sizeof(glm::vec4) * 3, glm::value_ptr(rows), sizeof(glm::vec4) * 3);
+    }
+}
+
+static f64 MeasureEmptyJobs()
+{
+    const f64 begin = BenchmarkNowNs();
+    for (u32 burst = 0; burst < JOBS_BENCHMARK_EMPTY_JOBS / JOBS_BENCHMARK_BURST; ++burst)
+    {
+        JobCounter counter;
+        for (u32 i = 0; i < JOBS_BENCHMARK_BURST; ++i)
+            RunJob(EmptyJob, NULL, 0, 0, &counter);
+        WaitForCounter(&counter);
+    }
+    return (BenchmarkNowNs() - begin) / JOBS_BENCHMARK_EMPTY_JOBS;
+}
+
+static f64 MeasureRoundTrips()
+{
+    JobCounter counter;
+    const f64 begin = BenchmarkNowNs();
+    for (u32 i = 0; i < JOBS_BENCHMARK_ROUND_TRIPS; ++i)
+    {
+        RunJob(EmptyJob, NULL, 0, 0, &counter);
+        WaitForCounter(&counter);
+    }
+    return (BenchmarkNowNs() - begin) / JOBS_BENCHMARK_ROUND_TRIPS;
+}
+
+static f64 MeasurePacking(JobsBenchmarkPacking& packing)
+{
+    const f64 begin = BenchmarkNowNs();
+    ParallelFor(JOBS_BENCHMARK_OBJECTS, JOBS_BENCHMARK_BATCH, PackMatrices, &packing);
+    return (BenchmarkNowNs() - begin) / 1000000.0;
+}
+
+int RunJobsBenchmark(const BenchmarkSettings& settings)
+{
+    const u32 maxThreads = glm::min(settings.jobThreads ? settings.jobThreads : glm::max(std::thread::hardware_concurrency(), 1u), (u32)JOB_MAX_THREADS);
+
+    std::vector<glm::mat4> matrices(JOBS_BENCHMARK_OBJECTS);
+    for (u32 i = 0; i < JOBS_BENCHMARK_OBJECTS; ++i)
+        matrices[i] = glm::translate(glm::vec3((f32)i, 0.0f, 0.0f));
+    std::vector<u8> rows(JOBS_BENCHMARK_OBJECTS * sizeof(glm::vec4) * 3);
+    JobsBenchmarkPacking packing = { matrices.data(), rows.data() };
+
+    std::vector<JobsBenchmarkRun> runs;
+    for (u32 threads = 1; threads <= maxThreads; ++threads)
+    {
+        JobSystemInit(threads, settings.pinThreads, false);
+        JobsBenchmarkRun run = { threads, DBL_MAX, DBL_MAX, DBL_MAX };
+        //the first round warms up the caches and wakes the workers
+        for (u32 repeat = 0; repeat <= JOBS_BENCHMARK_REPEATS; ++repeat)
+        {
+            const f64 emptyJobNs = MeasureEmptyJobs();
+            const f64 roundTripNs = MeasureRoundTrips();
+            const f64 packingMs = MeasurePacking(packing);
+            if (repeat == 0)
+                continue;
+            run.emptyJobNs = glm::min(run.emptyJobNs, emptyJobNs);
+            run.roundTripNs = glm::min(run.roundTripNs, roundTripNs);
+            run.packingMs = glm::min(run.packingMs, packingMs);
+        }
+        JobSystemShutdown();
+        runs.push_back(run);
+    }
+
+    FILE* file = stdout;
+    if (settings.reportPath)
+    {
+        file = fopen(settings.reportPath, "wb");
+        if (!file)
+        {
+            ELOG("fopen() failed writing benchmark report %s", settings.reportPath);
+            return -1;
+        }
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"hardwareThreads\": %u,\n", std::thread::hardware_concurrency());
+    fprintf(file, "  \"pinThreads\": %s,\n", settings.pinThreads ? "true" : "false");
+    fprintf(file, "  \"emptyJobs\": %u,\n", JOBS_BENCHMARK_EMPTY_JOBS);
+    fprintf(file, "  \"objects\": %u,\n", JOBS_BENCHMARK_OBJECTS);
+    fprintf(file, "  \"batch\": %u,\n", JOBS_BENCHMARK_BATCH);
+    fprintf(file, "  \"runs\": [\n");
+    for (size_t i = 0; i < runs.size(); ++i)
+    {
+        const JobsBenchmarkRun& run = runs[i];
+        const f64 speedup = runs[0].packingMs / run.packingMs;
+        fprintf(file, "    { \"threads\": %u, \"emptyJobNs\": %.1f, \"roundTripNs\": %.1f, \"packingMs\": %.4f, \"speedup\": %.2f, \"efficiency\": %.2f }%s\n",
+                run.threads, run.emptyJobNs, run.roundTripNs, run.packingMs, speedup, speedup / run.threads,
+                i + 1 < runs.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+
+    if (file != stdout)
+        fclose(file);
+
+    return 0;
+}
+
+#define OCCLUSION_BENCHMARK_OCCLUDERS 64
+#define OCCLUSION_BENCHMARK_OCCLUDEES 16384
+#define OCCLUSION_BENCHMARK_REPEATS   20 // The fastest one is kept
+
+struct OcclusionCheckBox
+{
+    const char* name;
+    Aabb        box;
+    bool        visible;
+};
+
+// Camera at the origin looking down -z, with the aspect ratio of the occlusion buffer
+static glm::mat4 OcclusionCheckViewProjection()
+{
+    const glm::mat4 projection = glm::perspective(glm::radians(90.0f), (f32)OCCLUSION_WIDTH / OCCLUSION_HEIGHT, 0.1f, 100.0f);
+    return projection * glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+}
+
+static Aabb BoxAround(const glm::vec3& center, const glm::vec3& halfSize)
+{
+    return { center - halfSize, center + halfSize };
+}
+
+int RunOcclusionCheck(const BenchmarkSettings& settings)
+{
+    JobSystemInit(settings.jobThreads, settings.pinThreads, false);
+
+    OcclusionCuller culler = {};
+    OcclusionInit(culler);
+    OcclusionBeginFrame(culler, OcclusionCheckViewProjection());
+
+    // A 6x6 wall 5 units away, its right edge ends in the middle of a tile (x = 0.3 in NDC,
+    // pixel 166.4), and a floor from behind the camera to far away, clipped by the near plane
+    OcclusionAddBox(culler, { glm::vec3(-3.0f, -3.0f, -5.1f), glm::vec3(3.0f, 3.0f, -5.0f) }, glm::mat4(1.0f));
+    OcclusionAddBox(culler, { glm::vec3(-20.0f, -20.0f, -40.0f), glm::vec3(20.0f, -1.0f, 5.0f) }, glm::mat4(1.0f));
+    OcclusionRasterize(culler);
+
+    const OcclusionCheckBox boxes[] = {
+        { "behind the wall",                  BoxAround(glm::vec3(0.0f, 0.0f, -10.0f), glm::vec3(1.0f)),        false },
+        { "in front of the wall",             BoxAround(glm::vec3(0.0f, 0.0f, -3.0f), glm::vec3(0.5f)),         true },
+        { "beside the wall",                  BoxAround(glm::vec3(9.0f, 0.0f, -10.0f), glm::vec3(1.0f)),        true },
+        { "half behind the wall edge",        BoxAround(glm::vec3(6.0f, 0.0f, -10.0f), glm::vec3(0.5f)),        true },
+        { "behind a partly covered tile",     BoxAround(glm::vec3(5.5f, 0.0f, -10.0f), glm::vec3(0.2f)),        false },
+        { "across the near plane",            { glm::vec3(-0.5f, -0.5f, -2.0f), glm::vec3(0.5f, 0.5f, 1.0f) }, true },
+        { "under the floor",                  BoxAround(glm::vec3(0.0f, -5.0f, -10.0f), glm::vec3(1.0f)),       false },
+        { "under the floor, near the camera", BoxAround(glm::vec3(0.0f, -2.0f, -3.0f), glm::vec3(0.3f)),        false },
+        { "on the floor",                     BoxAround(glm::vec3(9.0f, -0.5f, -10.0f), glm::vec3(0.5f)),       true },
+    };
+
+    u32 failures = 0;
+    for (const OcclusionCheckBox& check : boxes)
+    {
+        const bool visible = OcclusionTestAabb(culler, check.box);
+        if (visible != check.visible)
+        {
+            ELOG("Occlusion check failed: box %s is %s, expected %s", check.name, visible ? "visible" : "hidden", check.visible ? "visible" : "hidden");
+            failures++;
+        }
+    }
+    JobSystemShutdown();
+
+    ILOG("Occlusion check: %u of %u boxes right", (u32)ARRAY_COUNT(boxes) - failures, (u32)ARRAY_COUNT(boxes));
+    return failures == 0 ? 0 : -1;
+}
+
+int RunOcclusionBenchmark(const BenchmarkSettings& settings)
+{
+    if (RunOcclusionCheck(settings) != 0)
+        return -1;
+
+    // Same scene every run, walls up to 20 units away in front of boxes up to 60 units away
+    srand(1);
+    const auto random = [](f32 min, f32 max) { return min + (max - min) * ((f32)rand() / RAND_MAX); };
+    std::vector<Aabb> occluders(OCCLUSION_BENCHMARK_OCCLUDERS);
+    for (Aabb& occluder : occluders)
+        occluder = BoxAround(glm::vec3(random(-15.0f, 15.0f), random(-5.0f, 5.0f), random(-20.0f, -5.0f)), glm::vec3(random(0.5f, 3.0f), random(0.5f, 3.0f), 0.2f));
+    std::vector<Aabb> occludees(OCCLUSION_BENCHMARK_OCCLUDEES);
+    for (Aabb& occludee : occludees)
+        occludee = BoxAround(glm::vec3(random(-40.0f, 40.0f), random(-15.0f, 15.0f), random(-60.0f, -5.0f)), glm::vec3(random(0.2f, 1.5f)));
+
+    JobSystemInit(settings.jobThreads, settings.pinThreads, false);
+    OcclusionCuller culler = {};
+    OcclusionInit(culler);
+
+    f64 rasterizeMs = DBL_MAX;
+    f64 testMs = DBL_MAX;
+    u32 hidden = 0;
+    //the first round warms up the caches and wakes the workers
+    for (u32 repeat = 0; repeat <= OCCLUSION_BENCHMARK_REPEATS; ++repeat)
+    {
+        const f64 begin = BenchmarkNowNs();
+        OcclusionBeginFrame(culler, OcclusionCheckViewProjection());
+        for (const Aabb& occluder : occluders)
+            OcclusionAddBox(culler, occluder, glm::mat4(1.0f));
+        OcclusionRasterize(culler);
+        const f64 rasterized = BenchmarkNowNs();
+
+        hidden = 0;
+        for (const Aabb& occludee : occludees)
+            hidden += OcclusionTestAabb(culler, occludee) ? 0 : 1;
+        const f64 tested = BenchmarkNowNs();
+
+        if (repeat == 0)
+            continue;
+        rasterizeMs = glm::min(rasterizeMs, (rasterized - begin) / 1000000.0);
+        testMs = glm::min(testMs, (tested - rasterized) / 1000000.0);
+    }
+    const u32 threads = JobSystemThreadCount();
+    JobSystemShutdown();
+
+    FILE* file = stdout;
+    if (settings.reportPath)
+    {
+        file = fopen(settings.reportPath, "wb");
+        if (!file)
+        {
+            ELOG("fopen() failed writing benchmark report %s", settings.reportPath);
+            return -1;
+        }
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"threads\": %u,\n", threads);
+    fprintf(file, "  \"width\": %d,\n", OCCLUSION_WIDTH);
+    fprintf(file, "  \"height\": %d,\n", OCCLUSION_HEIGHT);
+    fprintf(file, "  \"occluders\": %u,\n", OCCLUSION_BENCHMARK_OCCLUDERS);
+    fprintf(file, "  \"triangles\": %u,\n", (u32)culler.triangles.size());
+    fprintf(file, "  \"occludees\": %u,\n", OCCLUSION_BENCHMARK_OCCLUDEES);
+    fprintf(file, "  \"hidden\": %u,\n", hidden);
+    fprintf(file, "  \"rasterizeMs\": %.4f,\n", rasterizeMs);
+    fprintf(file, "  \"testMs\": %.4f,\n", testMs);
+    fprintf(file, "  \"testNsPerBox\": %.1f\n", testMs * 1000000.0 / OCCLUSION_BENCHMARK_OCCLUDEES);
+    fprintf(file, "}\n");
+
+    if (file != stdout)
+        fclose(file);
+
+    return 0;
+}
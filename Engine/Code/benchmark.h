@@ -0,0 +1,72 @@
+//
+// benchmark.h: Headless run mode. The platform layer renders a fixed amount of frames
+// on an offscreen context and this module turns the collected timings into a JSON report.
+//
+
+#pragma once
+
+#include "platform.h"
+
+struct BenchmarkSettings
+{
+    bool        headless;
+    u32         frameCount;
+    u32         warmupFrames;   // Rendered but not reported (shader compilation, first uploads...)
+    glm::ivec2  resolution;
+    const char* mode;           // "patrick" or "quad"
+    const char* reportPath;     // NULL writes the report to stdout
+
+    // Job system
+    u32         jobThreads;     // Including the main thread, 0 for one per hardware thread
+    bool        pinThreads;     // Each job thread stays on its own core
+    bool        jobsBenchmark;  // Only measures the job system, no window nor GL
+
+    // Software occlusion culling, no window nor GL either
+    bool        occlusionCheck;     // Known scene, the exit code tells if every box is classified right
+    bool        occlusionBenchmark; // The check, then occluders rasterized and boxes tested
+};
+
+struct BenchmarkFrame
+{
+    f64 cpuMs;
+    f64 gpuMs;
+    u32 drawCalls;
+    u32 stateChanges;
+};
+
+/**
+ * Parses the command line arguments of the executable:
+ *   --headless --frames N --warmup N --width W --height H --mode patrick|quad --report file.json
+ *   --jobs N --pin-threads --jobs-benchmark --occlusion-check --occlusion-benchmark
+ * Returns false if the arguments are malformed.
+ */
+bool ParseBenchmarkArgs(int argc, char** argv, BenchmarkSettings& settings);
+
+/**
+ * Writes the per-frame samples plus their p50/p95/p99 summary as JSON. The report is
+ * still written if the ring buffers fell back from persistent mapping, but the run fails.
+ */
+bool WriteBenchmarkReport(const BenchmarkSettings& settings, const char* renderer, bool persistentMapping, const std::vector<BenchmarkFrame>& frames);
+
+/**
+ * Job system microbenchmark, with the job system stopped. Measures the cost of
+ * scheduling (empty jobs pushed and stolen, one job round trips) and how a parallel-for
+ * of the object packing Update() does scales from 1 to N threads, then writes the
+ * results as JSON. Returns the exit code.
+ */
+int RunJobsBenchmark(const BenchmarkSettings& settings);
+
+/**
+ * Rasterizes a wall and a floor crossing the near plane with the occlusion culler and
+ * checks which boxes it hides: behind, in front, beside, across the near plane, and
+ * against tiles the occluders only partly cover. Logs the boxes classified wrong and
+ * returns the exit code.
+ */
+int RunOcclusionCheck(const BenchmarkSettings& settings);
+
+/**
+ * Runs the occlusion check, then times rasterizing a fixed pseudo random set of box
+ * occluders on the job system and testing boxes against them. Writes the results as
+ * JSON and returns the exit code.
+ */
+int RunOcclusionBenchmark(const BenchmarkSettings& settings);
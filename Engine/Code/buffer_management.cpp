@@ -1,4 +1,5 @@
 #include "buffer_management.h"
+#include <string.h>
 
 
 bool IsPowerOf2(u32 value)
@@ -25,6 +26,163 @@ Buffer CreateBuffer(u32 size, GLenum type, GLenum usage)
     return buffer;
 }
 
+bool GrowBuffer(Buffer& buffer, u32 minSize)
+{
+    if (minSize <= buffer.size)
+        return false;
+
+    u32 size = buffer.size ? buffer.size : (1 << 20);
+    while (size < minSize)
+        size *= 2;
+
+    //copy targets, binding GL_ELEMENT_ARRAY_BUFFER would change the bound VAO
+    GLuint handle;
+    glGenBuffers(1, &handle);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, handle);
+    glBufferData(GL_COPY_WRITE_BUFFER, size, NULL, GL_STATIC_DRAW);
+    if (buffer.handle)
+    {
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer.handle);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, buffer.head);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glDeleteBuffers(1, &buffer.handle);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    buffer.handle = handle;
+    buffer.size = size;
+    return true;
+}
+
+// glBufferStorage is GL 4.4 (or ARB_buffer_storage), newer than the glad loader
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT   0x0080
+#define GL_DYNAMIC_STORAGE_BIT 0x0100
+#define GL_CLIENT_STORAGE_BIT 0x0200
+#endif
+typedef void (APIENTRYP PFNBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+
+static PFNBUFFERSTORAGEPROC LoadBufferStorage()
+{
+    bool supported = GLVersion.major > 4 || (GLVersion.major == 4 && GLVersion.minor >= 4);
+    if (!supported)
+    {
+        GLint extensionCount = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+        for (GLint i = 0; i < extensionCount && !supported; ++i)
+            supported = strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), "GL_ARB_buffer_storage") == 0;
+    }
+    return supported ? (PFNBUFFERSTORAGEPROC)GetGLProcAddress("glBufferStorage") : NULL;
+}
+
+Buffer CreateRingBuffer(u32 regionSize, GLenum type)
+{
+    static PFNBUFFERSTORAGEPROC bufferStorage = LoadBufferStorage();
+
+    Buffer buffer = {};
+    buffer.type = type;
+    buffer.regionSize = regionSize;
+    buffer.regionIdx = BUFFER_RING_FRAMES - 1; //first BeginRingFrame() moves to region 0
+    buffer.size = regionSize * BUFFER_RING_FRAMES;
+
+    glGenBuffers(1, &buffer.handle);
+    glBindBuffer(type, buffer.handle);
+    if (bufferStorage)
+    {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        bufferStorage(type, buffer.size, NULL, flags);
+        buffer.data = glMapBufferRange(type, 0, buffer.size, flags);
+        buffer.persistent = buffer.data != NULL;
+    }
+    if (!buffer.persistent)
+    {
+        ILOG("glBufferStorage not available, ring buffer remapped every frame");
+        glBufferData(type, buffer.size, NULL, GL_STREAM_DRAW);
+        buffer.data = NULL;
+    }
+    glBindBuffer(type, 0);
+
+    return buffer;
+}
+
+void BeginRingFrame(Buffer& buffer)
+{
+    ASSERT(buffer.regionSize > 0, "Not a ring buffer");
+    buffer.regionIdx = (buffer.regionIdx + 1) % BUFFER_RING_FRAMES;
+    buffer.head = buffer.regionIdx * buffer.regionSize;
+
+    GLsync& fence = buffer.fences[buffer.regionIdx];
+    if (fence)
+    {
+        PROFILE_SCOPE("Wait ring buffer fence");
+        GLbitfield waitFlags = 0;
+        for (;;)
+        {
+            GLenum result = glClientWaitSync(fence, waitFlags, 1000000);
+            if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED)
+                break;
+            if (result == GL_WAIT_FAILED)
+            {
+                ELOG("glClientWaitSync() failed on ring buffer region %u", buffer.regionIdx);
+                break;
+            }
+            waitFlags = GL_SYNC_FLUSH_COMMANDS_BIT;
+        }
+        glDeleteSync(fence);
+        fence = 0;
+    }
+
+    if (!buffer.persistent)
+    {
+        //the fence already guarantees the region is free, don't let the driver synchronize again
+        glBindBuffer(buffer.type, buffer.handle);
+        buffer.data = glMapBufferRange(buffer.type, buffer.head, buffer.regionSize,
+                                       GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        buffer.mappedOffset = buffer.head;
+        glBindBuffer(buffer.type, 0);
+    }
+}
+
+void DestroyRingBuffer(Buffer& buffer)
+{
+    for (u32 i = 0; i < BUFFER_RING_FRAMES; ++i)
+    {
+        if (buffer.fences[i])
+        {
+            glClientWaitSync(buffer.fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            glDeleteSync(buffer.fences[i]);
+        }
+    }
+    if (buffer.persistent || buffer.data)
+    {
+        glBindBuffer(buffer.type, buffer.handle);
+        glUnmapBuffer(buffer.type);
+        glBindBuffer(buffer.type, 0);
+    }
+    glDeleteBuffers(1, &buffer.handle);
+    buffer = {};
+}
+
+void EndRingFrame(Buffer& buffer)
+{
+    if (!buffer.persistent)
+    {
+        glBindBuffer(buffer.type, buffer.handle);
+        glUnmapBuffer(buffer.type);
+        glBindBuffer(buffer.type, 0);
+        buffer.data = NULL;
+    }
+}
+
+void FenceRingFrame(Buffer& buffer)
+{
+    GLsync& fence = buffer.fences[buffer.regionIdx];
+    if (fence)
+        glDeleteSync(fence);
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
 //#define CreateConstantBuffer(size) CreateBuffer(size, GL_UNIFORM_BUFFER, GL_STREAM_DRAW)
 //#define CreateStaticVertexBuffer(size) CreateBuffer(size, GL_ARRAY_BUFFER, GL_STATIC_DRAW)
 //#define CreateStaticIndexBuffer(size) CreateBuffer(size, GL_ELEMENT_ARRAY_BUFFER, GL_STATIC_DRAW)
@@ -39,6 +197,7 @@ void MapBuffer(Buffer& buffer, GLenum access)
     glBindBuffer(buffer.type, buffer.handle);
     buffer.data = (u8*)glMapBuffer(buffer.type, access);
     buffer.head = 0;
+    buffer.mappedOffset = 0;
 }
 
 void UnmapBuffer(Buffer& buffer)
@@ -57,8 +216,21 @@ void PushAlignedData(Buffer& buffer, const void* data, u32 size, u32 alignment)
 {
     ASSERT(buffer.data != NULL, "The buffer must be mapped first");
     AlignHead(buffer, alignment);
-    memcpy((u8*)buffer.data + buffer.head, data, size);
+    const u32 end = buffer.regionSize > 0 ? (buffer.regionIdx + 1) * buffer.regionSize : buffer.size;
+    ASSERT(buffer.head + size <= end, "Buffer overflow, the data doesn't fit in the buffer (or ring region)");
+    memcpy((u8*)buffer.data + buffer.head - buffer.mappedOffset, data, size);
+    buffer.head += size;
+}
+
+void* ReserveAlignedData(Buffer& buffer, u32 size, u32 alignment)
+{
+    ASSERT(buffer.data != NULL, "The buffer must be mapped first");
+    AlignHead(buffer, alignment);
+    const u32 end = buffer.regionSize > 0 ? (buffer.regionIdx + 1) * buffer.regionSize : buffer.size;
+    ASSERT(buffer.head + size <= end, "Buffer overflow, the data doesn't fit in the buffer (or ring region)");
+    void* data = (u8*)buffer.data + buffer.head - buffer.mappedOffset;
     buffer.head += size;
+    return data;
 }
 
 //#define PushData(buffer, data, size) PushAlignedData(buffer, data, size, 1)
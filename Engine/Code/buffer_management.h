@@ -11,6 +11,38 @@ Buffer CreateBuffer(u32 size, GLenum type, GLenum usage);
 #define CreateStaticVertexBuffer(size) CreateBuffer(size, GL_ARRAY_BUFFER, GL_STATIC_DRAW)
 #define CreateStaticIndexBuffer(size) CreateBuffer(size, GL_ELEMENT_ARRAY_BUFFER, GL_STATIC_DRAW)
 
+/**
+ * Makes room for at least minSize bytes, reallocating a static buffer (by powers of 2)
+ * and copying the first buffer.head bytes over. Returns true if the handle changed,
+ * so whatever references the old one (VAOs) has to be updated.
+ */
+bool GrowBuffer(Buffer& buffer, u32 minSize);
+
+/**
+ * Creates a buffer split in BUFFER_RING_FRAMES regions of regionSize bytes. It stays
+ * persistently mapped when glBufferStorage is available, so writing per-frame data
+ * never stalls on the GPU as long as it is less than BUFFER_RING_FRAMES frames behind.
+ */
+Buffer CreateRingBuffer(u32 regionSize, GLenum type);
+
+/**
+ * Moves to the next region, waiting for its fence if the GPU is still reading it.
+ * Push* calls write into that region until EndRingFrame().
+ */
+void BeginRingFrame(Buffer& buffer);
+
+/**
+ * Waits for the GPU to be done with every region and deletes the buffer.
+ */
+void DestroyRingBuffer(Buffer& buffer);
+
+void EndRingFrame(Buffer& buffer);
+
+/**
+ * Inserts the fence of the current region. Call it once the last command reading it has been issued.
+ */
+void FenceRingFrame(Buffer& buffer);
+
 void BindBuffer(const Buffer& buffer);
 
 void MapBuffer(Buffer& buffer, GLenum access);
@@ -21,10 +53,19 @@ void AlignHead(Buffer& buffer, u32 alignment);
 
 void PushAlignedData(Buffer& buffer, const void* data, u32 size, u32 alignment);
 
+/**
+ * Moves the head past size bytes like PushAlignedData() and returns where they start in
+ * the mapped memory, for jobs filling them in parallel.
+ */
+void* ReserveAlignedData(Buffer& buffer, u32 size, u32 alignment);
+
 #define PushData(buffer, data, size) PushAlignedData(buffer, data, size, 1)
 #define PushUInt(buffer, value) { u32 v = value; PushAlignedData(buffer, &v, sizeof(v), 4); }
 #define PushFloat(buffer, value) { float v = value; PushAlignedData(buffer, &v, sizeof(v), 4); }
+#define PushVec2(buffer, value) PushAlignedData(buffer, value_ptr(value), sizeof(value), sizeof(vec2))
 #define PushVec3(buffer, value) PushAlignedData(buffer, value_ptr(value), sizeof(value), sizeof(vec4))
 #define PushVec4(buffer, value) PushAlignedData(buffer, value_ptr(value), sizeof(value), sizeof(vec4))
 #define PushMat3(buffer, value) PushAlignedData(buffer, value_ptr(value), sizeof(value), sizeof(vec4))
-#define PushMat4(buffer, value) PushAlignedData(buffer, value_ptr(value), sizeof(value), sizeof(vec4))
\ No newline at end of file
+#define PushMat4(buffer, value) PushAlignedData(buffer, value_ptr(value), sizeof(value), sizeof(vec4))
+// Affine matrix as 3 rows (a transposed mat3x4 in GLSL), std430 packs them at 48 bytes
+#define PushMat3x4(buffer, value) { glm::mat4 t = glm::transpose(value); PushAlignedData(buffer, value_ptr(t), sizeof(vec4) * 3, sizeof(vec4)); }
\ No newline at end of file
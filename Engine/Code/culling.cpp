@@ -0,0 +1,174 @@
+#include "culling.h"
+#include <float.h>
+#include <immintrin.h>
+
+Aabb ComputeAabb(const f32* vertices, u32 vertexCount, u32 stride, u32 offset)
+{
+    Aabb aabb = { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
+    if (vertexCount == 0)
+        return { glm::vec3(0.0f), glm::vec3(0.0f) };
+
+    const u8* bytes = (const u8*)vertices + offset;
+    for (u32 i = 0; i < vertexCount; ++i)
+    {
+        const f32* position = (const f32*)(bytes + i * stride);
+        glm::vec3 p(position[0], position[1], position[2]);
+        aabb.min = glm::min(aabb.min, p);
+        aabb.max = glm::max(aabb.max, p);
+    }
+    return aabb;
+}
+
+glm::vec4 ComputeBoundingSphere(const Aabb& aabb)
+{
+    glm::vec3 center = (aabb.min + aabb.max) * 0.5f;
+    return glm::vec4(center, glm::length(aabb.max - center));
+}
+
+void TransformAabb(const Aabb& aabb, const glm::mat4& matrix, glm::vec3& center, glm::vec3& extent)
+{
+    glm::vec3 localCenter = (aabb.min + aabb.max) * 0.5f;
+    glm::vec3 localExtent = (aabb.max - aabb.min) * 0.5f;
+    center = glm::vec3(matrix * glm::vec4(localCenter, 1.0f));
+    glm::mat3 absolute = glm::mat3(glm::abs(glm::vec3(matrix[0])), glm::abs(glm::vec3(matrix[1])), glm::abs(glm::vec3(matrix[2])));
+    extent = absolute * localExtent;
+}
+
+Frustum FrustumFromMatrix(const glm::mat4& viewProjection)
+{
+    // Rows of the matrix, glm is column major
+    glm::mat4 m = glm::transpose(viewProjection);
+    Frustum frustum;
+    frustum.planes[0] = m[3] + m[0]; // Left
+    frustum.planes[1] = m[3] - m[0]; // Right
+    frustum.planes[2] = m[3] + m[1]; // Bottom
+    frustum.planes[3] = m[3] - m[1]; // Top
+    frustum.planes[4] = m[3] + m[2]; // Near
+    frustum.planes[5] = m[3] - m[2]; // Far
+    for (u32 i = 0; i < 6; ++i)
+        frustum.planes[i] /= glm::length(glm::vec3(frustum.planes[i]));
+    return frustum;
+}
+
+FrustumTest TestAabbFrustum(const Frustum& frustum, const Aabb& aabb)
+{
+    const glm::vec3 center = (aabb.min + aabb.max) * 0.5f;
+    const glm::vec3 extent = (aabb.max - aabb.min) * 0.5f;
+    FrustumTest result = FrustumTest_Inside;
+    for (u32 i = 0; i < 6; ++i)
+    {
+        const glm::vec3 normal = glm::vec3(frustum.planes[i]);
+        const f32 distance = glm::dot(normal, center) + frustum.planes[i].w;
+        const f32 radius = glm::dot(glm::abs(normal), extent);
+        if (distance + radius < 0.0f)
+            return FrustumTest_Outside;
+        if (distance - radius < 0.0f)
+            result = FrustumTest_Intersect;
+    }
+    return result;
+}
+
+void ResizeCullBounds(CullBounds& bounds, u32 count)
+{
+    // Padding boxes have zero extents at the origin, their result is never read
+    const u32 padded = (count + CULL_BATCH_WIDTH - 1) / CULL_BATCH_WIDTH * CULL_BATCH_WIDTH;
+    bounds.centerX.assign(padded, 0.0f);
+    bounds.centerY.assign(padded, 0.0f);
+    bounds.centerZ.assign(padded, 0.0f);
+    bounds.extentX.assign(padded, 0.0f);
+    bounds.extentY.assign(padded, 0.0f);
+    bounds.extentZ.assign(padded, 0.0f);
+    bounds.count = count;
+}
+
+// A box is outside a plane when dot(n, c) + d < -dot(|n|, e)
+#if defined(__AVX__)
+
+static u32 CullBatch(const CullBounds& bounds, u32 first, const Frustum* frustums, u32 frustumCount)
+{
+    const __m256 cx = _mm256_loadu_ps(&bounds.centerX[first]);
+    const __m256 cy = _mm256_loadu_ps(&bounds.centerY[first]);
+    const __m256 cz = _mm256_loadu_ps(&bounds.centerZ[first]);
+    const __m256 ex = _mm256_loadu_ps(&bounds.extentX[first]);
+    const __m256 ey = _mm256_loadu_ps(&bounds.extentY[first]);
+    const __m256 ez = _mm256_loadu_ps(&bounds.extentZ[first]);
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+
+    __m256 anyInside = _mm256_setzero_ps();
+    for (u32 f = 0; f < frustumCount; ++f)
+    {
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (u32 p = 0; p < 6; ++p)
+        {
+            const glm::vec4& plane = frustums[f].planes[p];
+            const __m256 nx = _mm256_set1_ps(plane.x);
+            const __m256 ny = _mm256_set1_ps(plane.y);
+            const __m256 nz = _mm256_set1_ps(plane.z);
+            __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, cx), _mm256_mul_ps(ny, cy)),
+                                            _mm256_add_ps(_mm256_mul_ps(nz, cz), _mm256_set1_ps(plane.w)));
+            __m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_andnot_ps(signMask, nx), ex),
+                                                        _mm256_mul_ps(_mm256_andnot_ps(signMask, ny), ey)),
+                                          _mm256_mul_ps(_mm256_andnot_ps(signMask, nz), ez));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(distance, radius), _mm256_setzero_ps(), _CMP_GE_OQ));
+        }
+        anyInside = _mm256_or_ps(anyInside, inside);
+    }
+    return (u32)_mm256_movemask_ps(anyInside);
+}
+
+#else
+
+static u32 CullBatch4(const CullBounds& bounds, u32 first, const Frustum* frustums, u32 frustumCount)
+{
+    const __m128 cx = _mm_loadu_ps(&bounds.centerX[first]);
+    const __m128 cy = _mm_loadu_ps(&bounds.centerY[first]);
+    const __m128 cz = _mm_loadu_ps(&bounds.centerZ[first]);
+    const __m128 ex = _mm_loadu_ps(&bounds.extentX[first]);
+    const __m128 ey = _mm_loadu_ps(&bounds.extentY[first]);
+    const __m128 ez = _mm_loadu_ps(&bounds.extentZ[first]);
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+
+    __m128 anyInside = _mm_setzero_ps();
+    for (u32 f = 0; f < frustumCount; ++f)
+    {
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (u32 p = 0; p < 6; ++p)
+        {
+            const glm::vec4& plane = frustums[f].planes[p];
+            const __m128 nx = _mm_set1_ps(plane.x);
+            const __m128 ny = _mm_set1_ps(plane.y);
+            const __m128 nz = _mm_set1_ps(plane.z);
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, cx), _mm_mul_ps(ny, cy)),
+                                         _mm_add_ps(_mm_mul_ps(nz, cz), _mm_set1_ps(plane.w)));
+            __m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(signMask, nx), ex),
+                                                  _mm_mul_ps(_mm_andnot_ps(signMask, ny), ey)),
+                                       _mm_mul_ps(_mm_andnot_ps(signMask, nz), ez));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+        }
+        anyInside = _mm_or_ps(anyInside, inside);
+    }
+    return (u32)_mm_movemask_ps(anyInside);
+}
+
+static u32 CullBatch(const CullBounds& bounds, u32 first, const Frustum* frustums, u32 frustumCount)
+{
+    return CullBatch4(bounds, first, frustums, frustumCount) | (CullBatch4(bounds, first + 4, frustums, frustumCount) << 4);
+}
+
+#endif
+
+u32 CullFrustums(const CullBounds& bounds, const Frustum* frustums, u32 frustumCount, u8* visible)
+{
+    u32 visibleCount = 0;
+    for (u32 first = 0; first < bounds.count; first += CULL_BATCH_WIDTH)
+    {
+        const u32 mask = CullBatch(bounds, first, frustums, frustumCount);
+        const u32 batchCount = glm::min(bounds.count - first, (u32)CULL_BATCH_WIDTH);
+        for (u32 i = 0; i < batchCount; ++i)
+        {
+            visible[first + i] = (mask >> i) & 1;
+            visibleCount += visible[first + i];
+        }
+    }
+    return visibleCount;
+}
@@ -0,0 +1,82 @@
+//
+// culling.h: Bounding volumes and frustum tests. World space bounds are kept as
+// structure of arrays (centers and half extents of AABBs) so the plane tests run
+// over 4 (SSE) or 8 (AVX, when the compiler targets it) boxes at a time.
+//
+
+#pragma once
+
+#include "platform.h"
+
+#define CULL_BATCH_WIDTH 8 // Bounds arrays are padded to a multiple of this
+
+struct Aabb
+{
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+inline Aabb AabbUnion(const Aabb& a, const Aabb& b)
+{
+    return { glm::min(a.min, b.min), glm::max(a.max, b.max) };
+}
+
+// Planes as (normal, distance), normalized and pointing inside: dot(n, p) + d >= 0
+struct Frustum
+{
+    glm::vec4 planes[6];
+};
+
+enum FrustumTest
+{
+    FrustumTest_Outside,
+    FrustumTest_Intersect,
+    FrustumTest_Inside
+};
+
+struct CullBounds
+{
+    std::vector<f32> centerX, centerY, centerZ;
+    std::vector<f32> extentX, extentY, extentZ;
+    u32 count;
+};
+
+/**
+ * Bounds of the positions of a vertex array, position being 3 floats at offset
+ * bytes of every stride bytes.
+ */
+Aabb ComputeAabb(const f32* vertices, u32 vertexCount, u32 stride, u32 offset);
+
+glm::vec4 ComputeBoundingSphere(const Aabb& aabb); // Center and radius
+
+/**
+ * World AABB of a transformed box, from the transformed center and the absolute
+ * matrix applied to the half extents.
+ */
+void TransformAabb(const Aabb& aabb, const glm::mat4& matrix, glm::vec3& center, glm::vec3& extent);
+
+/**
+ * Extracts the planes of a view projection matrix (Gribb/Hartmann). Works for
+ * perspective and orthographic projections.
+ */
+Frustum FrustumFromMatrix(const glm::mat4& viewProjection);
+
+FrustumTest TestAabbFrustum(const Frustum& frustum, const Aabb& aabb);
+
+void ResizeCullBounds(CullBounds& bounds, u32 count);
+
+inline void SetCullBounds(CullBounds& bounds, u32 idx, const glm::vec3& center, const glm::vec3& extent)
+{
+    bounds.centerX[idx] = center.x;
+    bounds.centerY[idx] = center.y;
+    bounds.centerZ[idx] = center.z;
+    bounds.extentX[idx] = extent.x;
+    bounds.extentY[idx] = extent.y;
+    bounds.extentZ[idx] = extent.z;
+}
+
+/**
+ * Sets visible[i] to 1 if box i is inside or intersects any of the frustums, 0 otherwise.
+ * Returns the number of visible boxes. visible must hold bounds.count entries.
+ */
+u32 CullFrustums(const CullBounds& bounds, const Frustum* frustums, u32 frustumCount, u8* visible);
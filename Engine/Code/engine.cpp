@@ -2,9 +2,12 @@
 #include "buffer_management.h"
 #include "assimp_model_loading.h"
 #include "engine_ui.h"
+#include "profiler.h"
+#include "job_system.h"
 #include <imgui.h>
 #include <stb_image.h>
 #include <stb_image_write.h>
+#include <thread>
 
 #define DEGTORAD 0.0174533f
 
@@ -119,6 +122,57 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName, boo
     return programHandle;
 }
 
+GLuint CreateComputeProgramFromSource(String programSource, const char* shaderName)
+{
+    GLchar  infoLogBuffer[1024] = {};
+    GLsizei infoLogBufferSize = sizeof(infoLogBuffer);
+    GLsizei infoLogSize;
+    GLint   success;
+
+    char versionString[] = "#version 430\n";
+    char shaderNameDefine[128];
+    sprintf(shaderNameDefine, "#define %s\n", shaderName);
+    char computeShaderDefine[] = "#define COMPUTE\n";
+
+    const GLchar* computeShaderSource[] = {
+        versionString,
+        shaderNameDefine,
+        computeShaderDefine,
+        programSource.str
+    };
+    const GLint computeShaderLengths[] = {
+        (GLint) strlen(versionString),
+        (GLint) strlen(shaderNameDefine),
+        (GLint) strlen(computeShaderDefine),
+        (GLint) programSource.len
+    };
+
+    GLuint cshader = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(cshader, ARRAY_COUNT(computeShaderSource), computeShaderSource, computeShaderLengths);
+    glCompileShader(cshader);
+    glGetShaderiv(cshader, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(cshader, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+        ELOG("glCompileShader() failed with compute shader %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+    }
+
+    GLuint programHandle = glCreateProgram();
+    glAttachShader(programHandle, cshader);
+    glLinkProgram(programHandle);
+    glGetProgramiv(programHandle, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        glGetProgramInfoLog(programHandle, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+        ELOG("glLinkProgram() failed with program %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+    }
+
+    glDetachShader(programHandle, cshader);
+    glDeleteShader(cshader);
+
+    return programHandle;
+}
+
 void LoadProgramAttributes(Program& program)
 {
     int maxVariableNameLength;
@@ -300,6 +354,136 @@ void LoadProgramAttributes(Program& program)
 }
 
 
+struct UniformSlotInfo
+{
+    const char* name;
+    GLenum      type;
+    GLint       textureUnit; // -1 if not a sampler
+};
+
+static const UniformSlotInfo UniformSlotInfos[] =
+{
+    { "uTexture",         GL_SAMPLER_2D,   TextureUnit_Albedo },
+    { "normalMap",        GL_SAMPLER_2D,   TextureUnit_Normal },
+    { "heightMap",        GL_SAMPLER_2D,   TextureUnit_Height },
+    { "uTextureAlb",      GL_SAMPLER_2D,   TextureUnit_Albedo },
+    { "uTextureNorm",     GL_SAMPLER_2D,   TextureUnit_Normal },
+    { "shadowMap",        GL_SAMPLER_2D,   TextureUnit_Shadow },
+    { "shadowMatrices",   GL_FLOAT_MAT4,   -1 },
+    { "lightPos",         GL_FLOAT_VEC3,   -1 },
+    { "farPlane",         GL_FLOAT,        -1 },
+    { "uDepthTexture",    GL_SAMPLER_2D,   TextureUnit_Depth },
+    { "uDepthPyramid",    GL_SAMPLER_2D,   TextureUnit_Depth },
+    { "uPrevViewProjection", GL_FLOAT_MAT4, -1 },
+    { "uItemCount",       GL_UNSIGNED_INT, -1 },
+    { "uDrawableCount",   GL_UNSIGNED_INT, -1 },
+    { "uUseDepthPyramid", GL_UNSIGNED_INT, -1 },
+    { "uFaceMask",        GL_UNSIGNED_INT, -1 },
+    { "uShadowRects",     GL_FLOAT_VEC4,   -1 },
+    { "uDebugView",       GL_UNSIGNED_INT, -1 },
+};
+static_assert(ARRAY_COUNT(UniformSlotInfos) == UniformSlot_Count, "Missing uniform slot info");
+
+void LoadProgramUniforms(Program& program)
+{
+    for (u32 slot = 0; slot < UniformSlot_Count; ++slot)
+        program.uniformSlots[slot] = -1;
+
+    //default block uniforms
+    const GLenum uniformProperties[] = { GL_NAME_LENGTH, GL_TYPE, GL_ARRAY_SIZE, GL_LOCATION, GL_BLOCK_INDEX };
+    GLint uniformCount = 0;
+    glGetProgramInterfaceiv(program.handle, GL_UNIFORM, GL_ACTIVE_RESOURCES, &uniformCount);
+    for (GLint i = 0; i < uniformCount; ++i)
+    {
+        GLint values[ARRAY_COUNT(uniformProperties)];
+        glGetProgramResourceiv(program.handle, GL_UNIFORM, i, ARRAY_COUNT(uniformProperties), uniformProperties, ARRAY_COUNT(values), NULL, values);
+        if (values[4] != -1)
+            continue; //member of a uniform block
+
+        std::vector<char> name(values[0] + 1, '\0');
+        glGetProgramResourceName(program.handle, GL_UNIFORM, i, (GLsizei)name.size(), NULL, name.data());
+
+        ProgramUniform uniform = {};
+        uniform.name = name.data();
+        uniform.name = uniform.name.substr(0, uniform.name.find('['));
+        uniform.type = (GLenum)values[1];
+        uniform.arraySize = values[2];
+        uniform.location = values[3];
+        program.uniforms.push_back(uniform);
+
+        for (u32 slot = 0; slot < UniformSlot_Count; ++slot)
+        {
+            const UniformSlotInfo& info = UniformSlotInfos[slot];
+            if (uniform.name != info.name)
+                continue;
+
+            if (uniform.type != info.type)
+            {
+                ELOG("Uniform %s in program %s doesn't have the expected type", info.name, program.programName.c_str());
+                break;
+            }
+            program.uniformSlots[slot] = uniform.location;
+            if (info.textureUnit >= 0)
+                glProgramUniform1i(program.handle, uniform.location, info.textureUnit);
+            break;
+        }
+    }
+
+    //uniform and shader storage blocks
+    const GLenum blockProperties[] = { GL_NAME_LENGTH, GL_BUFFER_BINDING, GL_BUFFER_DATA_SIZE };
+    const GLenum blockInterfaces[] = { GL_UNIFORM_BLOCK, GL_SHADER_STORAGE_BLOCK };
+    for (u32 j = 0; j < ARRAY_COUNT(blockInterfaces); ++j)
+    {
+        GLint blockCount = 0;
+        glGetProgramInterfaceiv(program.handle, blockInterfaces[j], GL_ACTIVE_RESOURCES, &blockCount);
+        for (GLint i = 0; i < blockCount; ++i)
+        {
+            GLint values[ARRAY_COUNT(blockProperties)];
+            glGetProgramResourceiv(program.handle, blockInterfaces[j], i, ARRAY_COUNT(blockProperties), blockProperties, ARRAY_COUNT(values), NULL, values);
+
+            std::vector<char> name(values[0] + 1, '\0');
+            glGetProgramResourceName(program.handle, blockInterfaces[j], i, (GLsizei)name.size(), NULL, name.data());
+
+            ProgramBlock block = {};
+            block.name = name.data();
+            block.binding = values[1];
+            block.dataSize = values[2];
+            block.storage = blockInterfaces[j] == GL_SHADER_STORAGE_BLOCK;
+            program.blocks.push_back(block);
+        }
+    }
+}
+
+void SetUniform(const Program& program, UniformSlot slot, f32 value)
+{
+    if (program.uniformSlots[slot] != -1)
+        glUniform1f(program.uniformSlots[slot], value);
+}
+
+void SetUniform(const Program& program, UniformSlot slot, u32 value)
+{
+    if (program.uniformSlots[slot] != -1)
+        glUniform1ui(program.uniformSlots[slot], value);
+}
+
+void SetUniform(const Program& program, UniformSlot slot, const glm::vec3& value)
+{
+    if (program.uniformSlots[slot] != -1)
+        glUniform3fv(program.uniformSlots[slot], 1, glm::value_ptr(value));
+}
+
+void SetUniform(const Program& program, UniformSlot slot, const glm::vec4* values, u32 count)
+{
+    if (program.uniformSlots[slot] != -1)
+        glUniform4fv(program.uniformSlots[slot], count, glm::value_ptr(values[0]));
+}
+
+void SetUniform(const Program& program, UniformSlot slot, const glm::mat4* values, u32 count)
+{
+    if (program.uniformSlots[slot] != -1)
+        glUniformMatrix4fv(program.uniformSlots[slot], count, GL_FALSE, glm::value_ptr(values[0]));
+}
+
 u32 LoadProgram(App* app, const char* filepath, const char* programName, bool geometryShader = false)
 {
     String programSource = ReadTextFile(filepath);
@@ -311,6 +495,24 @@ u32 LoadProgram(App* app, const char* filepath, const char* programName, bool ge
     program.lastWriteTimestamp = GetFileLastWriteTimestamp(filepath);
 
     LoadProgramAttributes(program);
+    LoadProgramUniforms(program);
+
+    app->programs.push_back(program);
+
+    return app->programs.size() - 1;
+}
+
+u32 LoadComputeProgram(App* app, const char* filepath, const char* programName)
+{
+    String programSource = ReadTextFile(filepath);
+
+    Program program = {};
+    program.handle = CreateComputeProgramFromSource(programSource, programName);
+    program.filepath = filepath;
+    program.programName = programName;
+    program.lastWriteTimestamp = GetFileLastWriteTimestamp(filepath);
+
+    LoadProgramUniforms(program);
 
     app->programs.push_back(program);
 
@@ -320,7 +522,8 @@ u32 LoadProgram(App* app, const char* filepath, const char* programName, bool ge
 Image LoadImage(const char* filename)
 {
     Image img = {};
-    stbi_set_flip_vertically_on_load(true);
+    //per thread, the streaming decodes on the workers
+    stbi_set_flip_vertically_on_load_thread(true);
     img.pixels = stbi_load(filename, &img.size.x, &img.size.y, &img.nchannels, 0);
     if (img.pixels)
     {
@@ -338,7 +541,7 @@ void FreeImage(Image image)
     stbi_image_free(image.pixels);
 }
 
-GLuint CreateTexture2DFromImage(Image image)
+GLuint CreateTexture2DFromImage(App* app, Image image)
 {
     GLenum internalFormat = GL_RGB8;
     GLenum dataFormat     = GL_RGB;
@@ -353,7 +556,8 @@ GLuint CreateTexture2DFromImage(Image image)
 
     GLuint texHandle;
     glGenTextures(1, &texHandle);
-    glBindTexture(GL_TEXTURE_2D, texHandle);
+    //through the state cache, the streaming uploads in the middle of the frame
+    GLStateBindTexture(app->glState, TextureUnit_Albedo, GL_TEXTURE_2D, texHandle);
     glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, image.size.x, image.size.y, 0, dataFormat, dataType, image.pixels);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
@@ -361,7 +565,6 @@ GLuint CreateTexture2DFromImage(Image image)
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glGenerateMipmap(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, 0);
 
     return texHandle;
 }
@@ -377,7 +580,7 @@ u32 LoadTexture2D(App* app, const char* filepath)
     if (image.pixels)
     {
         Texture tex = {};
-        tex.handle = CreateTexture2DFromImage(image);
+        tex.handle = CreateTexture2DFromImage(app, image);
         tex.filepath = filepath;
 
         u32 texIdx = app->textures.size();
@@ -461,13 +664,8 @@ u32 CreateSphere(App* app)
         }
     }
 
-    glGenBuffers(1, &mesh.vertexBufferHandle);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBufferData(GL_ARRAY_BUFFER, subMesh.vertices.size()*sizeof(float), subMesh.vertices.data(), GL_STATIC_DRAW);
-
-    glGenBuffers(1, &mesh.indexBufferHandle);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, subMesh.indices.size()*sizeof(u32), subMesh.indices.data(), GL_STATIC_DRAW);
+    ComputeSubmeshBounds(subMesh);
+    UploadSubmesh(app, subMesh);
 
     Material mat = {};
     mat.albedoTextureIdx = app->magentaTexIdx;
@@ -517,19 +715,14 @@ u32 CreateWall(App* app)
     for (int i = 0; i < indexCount; ++i)
         subMesh.indices.push_back(indices[i]);
 
-    glGenBuffers(1, &mesh.vertexBufferHandle);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBufferData(GL_ARRAY_BUFFER, subMesh.vertices.size() * sizeof(float), subMesh.vertices.data(), GL_STATIC_DRAW);
-
-    glGenBuffers(1, &mesh.indexBufferHandle);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, subMesh.indices.size() * sizeof(u32), subMesh.indices.data(), GL_STATIC_DRAW);
+    ComputeSubmeshBounds(subMesh);
+    UploadSubmesh(app, subMesh);
 
     app->materials.push_back(Material{});
     Material& material = app->materials.back();
-    material.albedoTextureIdx = LoadTexture2D(app, "diffuse.png");
-    material.normalsTextureIdx = LoadTexture2D(app, "normal.png");
-    material.bumpTextureIdx = LoadTexture2D(app, "displacement.png");
+    material.albedoTextureIdx = LoadTexture2DAsync(app, "diffuse.png", app->whiteTexIdx);
+    material.normalsTextureIdx = LoadTexture2DAsync(app, "normal.png", app->normalTexIdx);
+    material.bumpTextureIdx = LoadTexture2DAsync(app, "displacement.png", app->blackTexIdx);
     model.materialIdx.push_back(app->materials.size() - 1);
 
     Mesh planeMesh = mesh;
@@ -580,14 +773,13 @@ void LoadTexturesQuad(App* app)
     glBindVertexArray(0);
 
     app->texturedGeometryProgramIdx = LoadProgram(app, "shaders.glsl", "TEXTURED_GEOMETRY");
-    Program& texturedGeometryProgram = app->programs.back();
-    app->programUniformTexture = glGetUniformLocation(texturedGeometryProgram.handle, "uTexture");
 
-    app->diceTexIdx = LoadTexture2D(app, "dice.png");
+    //the placeholders of the streamed textures, loaded right away
     app->whiteTexIdx = LoadTexture2D(app, "color_white.png");
     app->blackTexIdx = LoadTexture2D(app, "color_black.png");
     app->normalTexIdx = LoadTexture2D(app, "color_normal.png");
     app->magentaTexIdx = LoadTexture2D(app, "color_magenta.png");
+    app->diceTexIdx = LoadTexture2DAsync(app, "dice.png", app->whiteTexIdx);
 
     //app->mode = Mode_TexturedQuad;
 }
@@ -621,110 +813,280 @@ constexpr vec3 GetAttenuationValuesFromRange(unsigned int range)
     else if (range <= 3250) { return vec3(1, 0.0014, 0.000007); }
 }
 
-GLuint GenerateFrameBuffer(App*app)
+//internal format of each GBufferAttachment: 16 bytes per pixel with the depth
+static const GLenum GBufferFormats[GBuffer_Count] = { GL_R11F_G11F_B10F, GL_RGBA8, GL_RG16 };
+static const char* GBufferNames[GBuffer_Count] = { "Light", "Albedo", "Normals" };
+
+// Grows the objects buffer (by powers of 2) so it fits count objects per frame
+void ReserveObjects(App* app, u32 count)
+{
+    ASSERT(count <= MAX_OBJECTS, "Too many objects, raise MAX_OBJECTS");
+    if (count <= app->objectsCapacity)
+        return;
+
+    u32 capacity = app->objectsCapacity ? app->objectsCapacity : 1024;
+    while (capacity < count)
+        capacity *= 2;
+
+    if (app->objectsBuffer.handle)
+        DestroyRingBuffer(app->objectsBuffer);
+    app->objectsBuffer = CreateRingBuffer(Align(capacity * sizeof(vec4) * 3, app->storageBlockAlignment), GL_SHADER_STORAGE_BUFFER);
+    app->objectsCapacity = capacity;
+}
+
+static u64 HashVertexBufferLayout(const VertexBufferLayout& layout)
 {
-    const unsigned int colorAttachments = 5;
-    app->ColorAttachmentHandles.reserve(colorAttachments);
-    for (unsigned int i = 0; i < colorAttachments; ++i)
+    //FNV-1a over the attributes and the stride
+    u64 hash = 14695981039346656037ull;
+    auto mix = [&hash](u8 value) { hash = (hash ^ value) * 1099511628211ull; };
+    for (const VertexBufferAttribute& attribute : layout.attributes)
     {
-        app->ColorAttachmentHandles.push_back(0);
-        glGenTextures(1, &app->ColorAttachmentHandles[i]);
-        glBindTexture(GL_TEXTURE_2D, app->ColorAttachmentHandles[i]);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_FLOAT, NULL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        mix(attribute.location);
+        mix(attribute.componentCount);
+        mix(attribute.offset);
     }
+    mix(layout.stride);
+    return hash;
+}
 
-    glGenTextures(1, &app->depthAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, app->displaySize.x, app->displaySize.y, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glBindTexture(GL_TEXTURE_2D, 0);
+static bool SameVertexBufferLayout(const VertexBufferLayout& a, const VertexBufferLayout& b)
+{
+    if (a.stride != b.stride || a.attributes.size() != b.attributes.size())
+        return false;
+    for (u32 i = 0; i < a.attributes.size(); ++i)
+    {
+        if (a.attributes[i].location != b.attributes[i].location ||
+            a.attributes[i].componentCount != b.attributes[i].componentCount ||
+            a.attributes[i].offset != b.attributes[i].offset)
+            return false;
+    }
+    return true;
+}
+
+u32 FindOrCreateVertexFormat(App* app, const VertexBufferLayout& layout)
+{
+    //on a collision with a different layout, probe the next key
+    u64 key = HashVertexBufferLayout(layout);
+    for (auto it = app->vertexFormatLookup.find(key); it != app->vertexFormatLookup.end(); it = app->vertexFormatLookup.find(++key))
+    {
+        if (SameVertexBufferLayout(app->vertexFormats[it->second].layout, layout))
+            return it->second;
+    }
+
+    VertexFormat format = {};
+    format.layout = layout;
+    glGenVertexArrays(1, &format.vao);
+    GLStateBindVertexArray(app->glState, format.vao);
+    for (const VertexBufferAttribute& attribute : layout.attributes)
+    {
+        glVertexAttribFormat(attribute.location, attribute.componentCount, GL_FLOAT, GL_FALSE, attribute.offset);
+        glVertexAttribBinding(attribute.location, VERTEX_BUFFER_BINDING);
+        glEnableVertexAttribArray(attribute.location);
+    }
+
+    //one value per instance, so the draw base instance selects the object
+    glVertexAttribIFormat(OBJECT_INDEX_LOCATION, 1, GL_UNSIGNED_INT, 0);
+    glVertexAttribBinding(OBJECT_INDEX_LOCATION, OBJECT_INDEX_BUFFER_BINDING);
+    glVertexBindingDivisor(OBJECT_INDEX_BUFFER_BINDING, 1);
+    glBindVertexBuffer(OBJECT_INDEX_BUFFER_BINDING, app->attachedInstanceBuffer, 0, sizeof(u32));
+    glEnableVertexAttribArray(OBJECT_INDEX_LOCATION);
+    GLStateBindVertexArray(app->glState, 0);
+    //arenas are attached by UploadSubmesh() once they exist
+
+    u32 formatIdx = (u32)app->vertexFormats.size();
+    app->vertexFormats.push_back(format);
+    app->vertexFormatLookup[key] = formatIdx;
+    return formatIdx;
+}
+
+void AttachInstanceBuffer(App* app, GLuint buffer)
+{
+    app->attachedInstanceBuffer = buffer;
+    for (const VertexFormat& format : app->vertexFormats)
+    {
+        GLStateBindVertexArray(app->glState, format.vao);
+        glBindVertexBuffer(OBJECT_INDEX_BUFFER_BINDING, buffer, 0, sizeof(u32));
+    }
+    GLStateBindVertexArray(app->glState, 0);
+}
+
+void ComputeSubmeshBounds(Submesh& submesh)
+{
+    const VertexBufferLayout& layout = submesh.vertexBufferLayout;
+    u32 positionOffset = 0;
+    for (const VertexBufferAttribute& attribute : layout.attributes)
+    {
+        if (attribute.location == 0)
+            positionOffset = attribute.offset;
+    }
+
+    const u32 vertexCount = (u32)(submesh.vertices.size() * sizeof(float) / layout.stride);
+    submesh.aabb = ComputeAabb(submesh.vertices.data(), vertexCount, layout.stride, positionOffset);
+    submesh.boundingSphere = ComputeBoundingSphere(submesh.aabb);
+}
+
+Aabb EntityWorldAabb(App* app, const Entity& entity)
+{
+    const Mesh& mesh = app->meshes[app->models[entity.modelIndex].meshIdx];
+    if (mesh.submeshes.empty())
+    {
+        //still streaming in, a point until RefitEntity()
+        const glm::vec3 position = glm::vec3(entity.worldMatrix[3]);
+        return { position, position };
+    }
+    Aabb local = mesh.submeshes[0].aabb;
+    for (u32 i = 1; i < mesh.submeshes.size(); ++i)
+        local = AabbUnion(local, mesh.submeshes[i].aabb);
+
+    glm::vec3 center, extent;
+    TransformAabb(local, entity.worldMatrix, center, extent);
+    return { center - extent, center + extent };
+}
+
+u32 AddEntity(App* app, const Entity& entity)
+{
+    u32 handle;
+    if (!app->freeEntityHandles.empty())
+    {
+        handle = app->freeEntityHandles.back();
+        app->freeEntityHandles.pop_back();
+    }
+    else
+    {
+        handle = app->entityIndices.size();
+        app->entityIndices.push_back(UINT32_MAX);
+    }
+
+    app->entityIndices[handle] = app->entities.size();
+    app->entities.push_back(entity);
+    Entity& added = app->entities.back();
+    added.handle = handle;
+    added.treeLeaf = AabbTreeInsert(app->entityTree, EntityWorldAabb(app, added), handle);
+    added.movedFrame = 0;
+    InvalidateShadowCasters(app, app->entityTree.nodes[added.treeLeaf].box);
+    app->renderQueue.dirty = true;
+    return handle;
+}
+
+void RemoveEntity(App* app, u32 entityIdx)
+{
+    const Entity& entity = app->entities[entityIdx];
+    if (!IsDynamicCaster(app, entity))
+        InvalidateShadowCasters(app, app->entityTree.nodes[entity.treeLeaf].box);
+    AabbTreeRemove(app->entityTree, entity.treeLeaf);
+    app->entityIndices[entity.handle] = UINT32_MAX;
+    app->freeEntityHandles.push_back(entity.handle);
+
+    app->entities.erase(app->entities.begin() + entityIdx);
+    for (u32 i = entityIdx; i < app->entities.size(); ++i)
+        app->entityIndices[app->entities[i].handle] = i;
+    app->renderQueue.dirty = true;
+}
+
+void RefitEntity(App* app, u32 entityIdx)
+{
+    Entity& entity = app->entities[entityIdx];
+    MarkShadowCasterMoved(app, entity);
+    AabbTreeMove(app->entityTree, entity.treeLeaf, EntityWorldAabb(app, entity));
+}
+
+static void AttachArenas(App* app, const VertexFormat& format)
+{
+    GLStateBindVertexArray(app->glState, format.vao);
+    glBindVertexBuffer(VERTEX_BUFFER_BINDING, format.vertexArena.handle, 0, format.layout.stride);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app->indexArena.handle);
+    GLStateBindVertexArray(app->glState, 0);
+}
+
+void UploadSubmesh(App* app, Submesh& submesh)
+{
+    const u32 formatCount = (u32)app->vertexFormats.size();
+    submesh.vertexFormatIdx = FindOrCreateVertexFormat(app, submesh.vertexBufferLayout);
+    VertexFormat& format = app->vertexFormats[submesh.vertexFormatIdx];
+    Buffer& vertexArena = format.vertexArena;
+    Buffer& indexArena = app->indexArena;
+
+    //vertices start on a multiple of the stride so baseVertex can address them
+    const u32 stride = format.layout.stride;
+    const u32 vertexStart = (vertexArena.head + stride - 1) / stride * stride;
+    const u32 verticesSize = (u32)(submesh.vertices.size() * sizeof(float));
+    const u32 indexStart = indexArena.head;
+    const u32 indicesSize = (u32)(submesh.indices.size() * sizeof(u32));
+
+    bool vertexArenaMoved = GrowBuffer(vertexArena, vertexStart + verticesSize);
+    bool indexArenaMoved = GrowBuffer(indexArena, indexStart + indicesSize);
+    if (indexArenaMoved)
+    {
+        for (const VertexFormat& other : app->vertexFormats)
+            AttachArenas(app, other);
+    }
+    else if (vertexArenaMoved || submesh.vertexFormatIdx == formatCount)
+    {
+        AttachArenas(app, format);
+    }
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, vertexArena.handle);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, vertexStart, verticesSize, submesh.vertices.data());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, indexArena.handle);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, indexStart, indicesSize, submesh.indices.data());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
 
-    GLuint frameBufferHandle;
-    glGenFramebuffers(1, &frameBufferHandle);
-    glBindFramebuffer(GL_FRAMEBUFFER, frameBufferHandle);
-    for (unsigned int i = 0; i < colorAttachments; ++i)
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, app->ColorAttachmentHandles[i], 0);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, app->depthAttachmentHandle, 0);
+    vertexArena.head = vertexStart + verticesSize;
+    indexArena.head = indexStart + indicesSize;
+    submesh.baseVertex = vertexStart / stride;
+    submesh.firstIndex = indexStart / sizeof(u32);
+}
 
-    GLenum frameBufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (frameBufferStatus != GL_FRAMEBUFFER_COMPLETE)
+bool ValidateVertexFormat(App* app, const Submesh& submesh, const Program& program, const char* modelName)
+{
+    bool valid = true;
+    for (const VertexShaderAttribute& input : program.vertexInputLayout.attributes)
     {
-        switch(frameBufferStatus)
+        if (input.location == OBJECT_INDEX_LOCATION)
+            continue;
+
+        bool found = false;
+        for (const VertexBufferAttribute& attribute : submesh.vertexBufferLayout.attributes)
+            found = found || attribute.location == input.location;
+        if (!found)
         {
-        case GL_FRAMEBUFFER_UNDEFINED: ELOG("GL_FRAMEBUFFER_UNDEFINED"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT: ELOG("GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT: ELOG("GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER: ELOG("GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER: ELOG("GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER"); break;
-        case GL_FRAMEBUFFER_UNSUPPORTED: ELOG("GL_FRAMEBUFFER_UNSUPPORTED"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE: ELOG("GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS: ELOG("GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS"); break;
-        default: ELOG("Unknown framebuffer status error");
+            ELOG("%s: vertex layout has no attribute at location %u, read by program %s", modelName, input.location, program.programName.c_str());
+            valid = false;
         }
     }
+    return valid;
+}
 
-    GLenum buffers[colorAttachments];
-    for (unsigned int i = 0; i < colorAttachments; ++i)
-        buffers[i] = GL_COLOR_ATTACHMENT0 + i;
-    glDrawBuffers(colorAttachments, buffers);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-    app->currentAttachmentTextureHandle = app->ColorAttachmentHandles[0];
-    app->currentAttachmentType = AttachmentOutputs::SCENE;
-
-    //------------------------------------------------------------------------------------------------------------
-    glGenFramebuffers(1, &app->shadowFramebufferHandle);
-    glBindFramebuffer(GL_FRAMEBUFFER, app->shadowFramebufferHandle);
-
-    glGenTextures(1, &app->shadowDepthAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->shadowDepthAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, app->shadowMapWidth, app->shadowMapHeight, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-    float clampColor[] = { 1.f,1.f,1.f,1.f };
-    glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, clampColor);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, app->shadowDepthAttachmentHandle, 0);
-    glDrawBuffer(GL_NONE);
-    glReadBuffer(GL_NONE);
-
-    glGenFramebuffers(1, &app->shadowPointFramebufferHandle);
-    glGenTextures(1, &app->shadowPointDepthAttachmentHandle);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, app->shadowPointDepthAttachmentHandle);
-    for (unsigned int i = 0; i < 6; ++i)
-        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT, app->shadowMapWidth, app->shadowMapHeight, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    
-    glBindFramebuffer(GL_FRAMEBUFFER, app->shadowPointFramebufferHandle);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, app->shadowPointDepthAttachmentHandle, 0);
-    glDrawBuffer(GL_NONE);
-    glReadBuffer(GL_NONE);
-
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+void ValidateModelVertexFormats(App* app, u32 modelIdx, const char* modelName)
+{
+    if (modelIdx >= app->models.size())
+        return;
 
-    return frameBufferHandle;
+    const Model& model = app->models[modelIdx];
+    const Mesh& mesh = app->meshes[model.meshIdx];
+    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+    {
+        const Submesh& submesh = mesh.submeshes[i];
+        const Material& material = app->materials[model.materialIdx[i]];
+        ValidateVertexFormat(app, submesh, app->programs[app->geometryPassIdx], modelName);
+        ValidateVertexFormat(app, submesh, app->programs[app->noFragmentIdx], modelName);
+        ValidateVertexFormat(app, submesh, app->programs[app->shadowCubemapIdx], modelName);
+        ValidateVertexFormat(app, submesh, app->programs[app->shadowCubeFaceIdx], modelName);
+        ValidateVertexFormat(app, submesh, app->programs[app->shadowCascadesIdx], modelName);
+        //normal/relief programs are only picked for materials that have the maps
+        if (material.normalsTextureIdx != 0)
+            ValidateVertexFormat(app, submesh, app->programs[app->normGeoPassIdx], modelName);
+        if (material.normalsTextureIdx != 0 && material.bumpTextureIdx != 0)
+            ValidateVertexFormat(app, submesh, app->programs[app->relGeoPassIdx], modelName);
+    }
 }
 
 void Init(App* app)
 {
+    PROFILE_FUNCTION();
+
+    StreamingInit(app->streaming);
+
     // TODO: Initialize your resources here!
     // - vertex buffers
     // - element/index buffers
@@ -951,7 +1313,7 @@ void Init(App* app)
     //
     //app->mode = Mode_TexturedQuad;
     
-    app->framebufferHandle = GenerateFrameBuffer(app);
+    CreateShadowAtlas(app);
 
     app->geometryPassIdx = LoadProgram(app, "GeometryPass.glsl", "GEO_PASS");
     app->normGeoPassIdx = LoadProgram(app, "NormGeometryPass.glsl", "NORM_GEO_PASS");
@@ -960,27 +1322,46 @@ void Init(App* app)
     app->pointLightIdx = LoadProgram(app, "PointLight.glsl", "POINT_LIGHT");
     app->noFragmentIdx = LoadProgram(app, "NoFragment.glsl", "NO_FRAGMENT");
     app->shadowCubemapIdx = LoadProgram(app, "ShadowCubemap.glsl", "SHADOW_CUBEMAP", true);
+    app->shadowCubeFaceIdx = LoadProgram(app, "ShadowCubeFace.glsl", "SHADOW_CUBE_FACE");
+    app->shadowCascadesIdx = LoadProgram(app, "ShadowCascades.glsl", "SHADOW_CASCADES", true);
+    app->clusteredLightingIdx = LoadProgram(app, "ClusteredLighting.glsl", "CLUSTERED_LIGHTING");
+    app->gbufferDebugIdx = LoadProgram(app, "GBufferDebug.glsl", "GBUFFER_DEBUG");
+    app->gpuCulling.cullProgramIdx = LoadComputeProgram(app, "GpuCulling.glsl", "GPU_CULLING");
+    app->gpuCulling.pyramidCopyProgramIdx = LoadComputeProgram(app, "DepthPyramid.glsl", "DEPTH_PYRAMID_COPY");
+    app->gpuCulling.pyramidReduceProgramIdx = LoadComputeProgram(app, "DepthPyramid.glsl", "DEPTH_PYRAMID_REDUCE");
+    InitGpuCulling(app);
 
     //for the screen quad
     LoadTexturesQuad(app);
-    app->patrickModelIdx = LoadModel(app, "Patrick/Patrick.obj");
-    app->rockModelIdx = LoadModel(app, "Rocks/Models/rock1.fbx");
-    app->cyborgModelIdx = LoadModel(app, "Rocks/cyborg.fbx");
+
+    //drawn once they are parsed and uploaded, the first frame doesn't wait for them
+    app->patrickModelIdx = LoadModelAsync(app, "Patrick/Patrick.obj");
+    app->rockModelIdx = LoadModelAsync(app, "Rocks/Models/rock1.fbx");
+    app->cyborgModelIdx = LoadModelAsync(app, "Rocks/cyborg.fbx");
     app->sphereModelIdx = CreateSphere(app);
     app->wallModelIdx = CreateWall(app);
 
-    app->cbuffer.head = 0;
-    app->cbuffer.data = nullptr;
+    ValidateModelVertexFormats(app, app->sphereModelIdx, "Sphere");
+    ValidateModelVertexFormats(app, app->wallModelIdx, "Wall");
+    ValidateModelVertexFormats(app, app->planeModelIdx, "Plane");
+    //light volumes
+    ValidateVertexFormat(app, app->meshes[app->models[app->sphereModelIdx].meshIdx].submeshes[0], app->programs[app->pointLightIdx], "Sphere");
+
     GLint maxUniformBufferSize;
     glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &maxUniformBufferSize);
-    app->cbuffer.size = maxUniformBufferSize;
     glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &app->uniformBlockAlignment);
-    app->cbuffer.type = GL_UNIFORM_BUFFER;
+    //one region per frame in flight, so Update() never writes data the GPU is still reading
+    app->cbuffer = CreateRingBuffer(Align(maxUniformBufferSize, app->uniformBlockAlignment), GL_UNIFORM_BUFFER);
+
+    //per-object data, draws pick their object with the base instance through the object index attribute
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &app->storageBlockAlignment);
+    app->objectsCapacity = 0;
+    ReserveObjects(app, 1024);
 
-    glGenBuffers(1, &app->cbuffer.handle);
-    glBindBuffer(GL_UNIFORM_BUFFER, app->cbuffer.handle);
-    glBufferData(GL_UNIFORM_BUFFER, app->cbuffer.size, NULL, GL_STREAM_DRAW);
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    //the floor and the wall are single quads, cheap to rasterize and solid
+    app->models[app->planeModelIdx].occluder = OccluderShape_Mesh;
+    app->models[app->wallModelIdx].occluder = OccluderShape_Mesh;
+    OcclusionInit(app->occlusion);
 
     float x = -2.6f;
     float z = -1.5f;
@@ -992,10 +1373,8 @@ void Init(App* app)
         one.scale = vec3(0.45f);
         one.worldMatrix = TransformPositionScale(one.pos, one.scale);
         one.modelIndex = app->patrickModelIdx;
-        one.localParamsOffset = 0;
-        one.localParamsSize = 0;
         one.name = "Patrick " + std::to_string(i);
-        app->entities.push_back(one);
+        AddEntity(app, one);
     
         x += 3;
         z -= 3;
@@ -1007,10 +1386,8 @@ void Init(App* app)
     rock.scale = vec3(0.45f);
     rock.worldMatrix = TransformPositionScale(rock.pos, rock.scale);
     rock.modelIndex = app->rockModelIdx;
-    rock.localParamsOffset = 0;
-    rock.localParamsSize = 0;
     rock.name = "Rock " + std::to_string(app->entities.size());
-    app->entities.push_back(rock);
+    AddEntity(app, rock);
     
     Entity plane = {};
     plane.pos = vec3(0.f, 0.f, 0.f);
@@ -1019,10 +1396,8 @@ void Init(App* app)
     plane.worldMatrix = TransformPositionScale(plane.pos, plane.scale);
     plane.worldMatrix = glm::rotate(plane.worldMatrix, -90 * DEGTORAD, glm::vec3(1.f, 0.f, 0.f));
     plane.modelIndex = app->planeModelIdx;
-    plane.localParamsOffset = 0;
-    plane.localParamsSize = 0;
     plane.name = "Plane " + std::to_string(app->models.size() - 1);
-    app->entities.push_back(plane);
+    AddEntity(app, plane);
 
     Entity plane2 = {};
     plane2.pos = vec3(0.f, 1.5f, 0.f);
@@ -1031,10 +1406,8 @@ void Init(App* app)
     plane2.worldMatrix = TransformPositionScale(plane2.pos, plane2.scale);
     plane2.worldMatrix = glm::rotate(plane2.worldMatrix, 0 * DEGTORAD, glm::vec3(1.f, 0.f, 0.f));
     plane2.modelIndex = app->wallModelIdx;
-    plane2.localParamsOffset = 0;
-    plane2.localParamsSize = 0;
     plane2.name = "wall " + std::to_string(app->models.size() - 1);
-    app->entities.push_back(plane2);
+    AddEntity(app, plane2);
 
     Entity cyborg = {};
     cyborg.pos = vec3(0.f, 0.f, 0.5f);
@@ -1042,47 +1415,81 @@ void Init(App* app)
     cyborg.scale = vec3(1.f);
     cyborg.worldMatrix = TransformPositionScale(cyborg.pos, cyborg.scale);
     cyborg.modelIndex = app->cyborgModelIdx;
-    cyborg.localParamsOffset = 0;
-    cyborg.localParamsSize = 0;
     cyborg.name = "Cyborg " + std::to_string(app->entities.size());
-    app->entities.push_back(cyborg);
+    AddEntity(app, cyborg);
     
     //loading lights
     //app->lights.push_back({vec3(1,1,1), vec3(1,-1,-1), vec3(0,0,0), LightType_Directional });
     //TODO: Load screen filling quad model to models for the directional
     //float radius = 103.f;
-    //app->lights.push_back({ vec3(0.1569f,0.651f,0.8039f), GetAttenuationValuesFromRange(radius), radius , LightType::LightType_Point, TransformPositionScale(vec3(0.3f, 3.f, 0.f), vec3(radius)), app->sphereModelIdx, 0, 0, 0, 0, vec3(0.3f, 3.f, 0.f) });
+    //app->lights.push_back({ vec3(0.1569f,0.651f,0.8039f), GetAttenuationValuesFromRange(radius), radius , LightType::LightType_Point, TransformPositionScale(vec3(0.3f, 3.f, 0.f), vec3(radius)), app->sphereModelIdx, 0, 0, 0, vec3(0.3f, 3.f, 0.f) });
     //radius = 35.f;
-    //app->lights.push_back({ vec3(1.f,1.f,1.f), GetAttenuationValuesFromRange(radius), radius , LightType::LightType_Point, TransformPositionScale(vec3(0.75f, 3.f, -4.3f), vec3(radius)), app->sphereModelIdx, 0, 0, 0, 0, vec3(0.75f, 3.f, -4.3f) });
+    //app->lights.push_back({ vec3(1.f,1.f,1.f), GetAttenuationValuesFromRange(radius), radius , LightType::LightType_Point, TransformPositionScale(vec3(0.75f, 3.f, -4.3f), vec3(radius)), app->sphereModelIdx, 0, 0, 0, vec3(0.75f, 3.f, -4.3f) });
     //app->lights.push_back({ vec3(1,1,1), vec3(1,1,1), radius , LightType::LightType_Directional, TransformScale(vec3(1.f)), app->sphereModelIdx, 0, 0, 0, 0 });
    
     float radius = 77.f;
-    app->lights.push_back({ vec3(0.878f,0.878f,0.f), GetAttenuationValuesFromRange(radius), radius , LightType::LightType_Point, TransformPositionScale(vec3(-2.2f, 3.f, 1.4f), vec3(radius)), app->sphereModelIdx, 0, 0, 0, 0, vec3(-2.2f, 3.f, 1.4f) });
+    app->lights.push_back({ vec3(0.878f,0.878f,0.f), GetAttenuationValuesFromRange(radius), radius , LightType::LightType_Point, TransformPositionScale(vec3(-2.2f, 3.f, 1.4f), vec3(radius)), app->sphereModelIdx, 0, 0, 0, vec3(-2.2f, 3.f, 1.4f) });
     radius = 79.f;
-    app->lights.push_back({ vec3(0.239f,0.f,1.f), GetAttenuationValuesFromRange(radius), radius , LightType::LightType_Point, TransformPositionScale(vec3(0.75f, 3.f, -8.15f), vec3(radius)), app->sphereModelIdx, 0, 0, 0, 0, vec3(0.75f, 3.f, -8.15f) });
+    app->lights.push_back({ vec3(0.239f,0.f,1.f), GetAttenuationValuesFromRange(radius), radius , LightType::LightType_Point, TransformPositionScale(vec3(0.75f, 3.f, -8.15f), vec3(radius)), app->sphereModelIdx, 0, 0, 0, vec3(0.75f, 3.f, -8.15f) });
     radius = 66.f;
-    app->lights.push_back({ vec3(0.976f,0.f,0.f), GetAttenuationValuesFromRange(radius), radius , LightType::LightType_Point, TransformPositionScale(vec3(0.75f, 3.f, -2.65f), vec3(radius)), app->sphereModelIdx, 0, 0, 0, 0, vec3(0.75f, 3.f, -2.65f) });
+    app->lights.push_back({ vec3(0.976f,0.f,0.f), GetAttenuationValuesFromRange(radius), radius , LightType::LightType_Point, TransformPositionScale(vec3(0.75f, 3.f, -2.65f), vec3(radius)), app->sphereModelIdx, 0, 0, 0, vec3(0.75f, 3.f, -2.65f) });
     radius = 49.f;
-    app->lights.push_back({ vec3(1.f,1.f,1.f), GetAttenuationValuesFromRange(radius), radius , LightType::LightType_Point, TransformPositionScale(vec3(0.f, 3.f, -0.95f), vec3(radius)), app->sphereModelIdx, 0, 0, 0, 0, vec3(0.f, 3.f, -0.95f) });
+    app->lights.push_back({ vec3(1.f,1.f,1.f), GetAttenuationValuesFromRange(radius), radius , LightType::LightType_Point, TransformPositionScale(vec3(0.f, 3.f, -0.95f), vec3(radius)), app->sphereModelIdx, 0, 0, 0, vec3(0.f, 3.f, -0.95f) });
 
 
     glEnable(GL_CULL_FACE);
     glCullFace(GL_BACK);
 
+    GpuTimersInit(app->gpuTimers);
+
+    app->renderQueue.dirty = true;
     app->mode = Mode::Mode_Patrick;
 }
 
 void Gui(App* app)
 {
+    PROFILE_FUNCTION();
+
     //DOCKING
     InitializeDocking();
 
     ImGui::Begin("Info");
     ImGui::Separator();
     ImGui::Text("FPS: %f", 1.0f / app->deltaTime);
+    ImGui::Text("Render proxies: %u (rebuilt %u times)", (u32)app->renderQueue.proxies.size(), app->renderQueue.rebuildCount);
+    ImGui::Text("Draw calls: %u (%u indirect commands in %u batches, %u instances)", app->stats.drawCalls, app->stats.drawCommands, (u32)app->renderQueue.batches.size(), app->stats.instances);
+    const RenderGraph& graph = app->renderGraph;
+    ImGui::Text("Render graph: %u of %u passes culled, %u transient textures in %u pooled", graph.culledPasses, (u32)graph.passes.size(), graph.transientCount, graph.pooledCount);
+    const JobSystemStats jobs = JobSystemFrameStats();
+    ImGui::Text("Jobs: %u run last frame (%u stolen) on %u threads", jobs.executed, jobs.stolen, jobs.threadCount);
     ImGui::Separator();
+    ProfilerSettings(app);
+    GpuTimersSettings(app);
+    GLStateSettings(app);
+    CullingSettings(app);
+    RenderTargetSettings(app);
+    StreamingSettings(app);
     ImGui::Checkbox("Use normal maps", &app->useNormalMap);
     ImGui::Checkbox("Use relif maps", &app->useRelifMap);
+    ImGui::Checkbox("Use occlusion culling", &app->useOcclusionCulling);
+    ImGui::Checkbox("Use GPU culling", &app->useGpuCulling);
+    ImGui::Checkbox("Use clustered lighting", &app->useClusteredLighting);
+    ImGui::Checkbox("Point shadows through a geometry shader", &app->usePointShadowGS);
+    if (app->useClusteredLighting)
+        ImGui::Text("Light clusters: %u of %u froxels lit, up to %u lights each", app->lightClusters.usedClusters, CLUSTER_COUNT, app->lightClusters.maxClusterLights);
+    ShadowCache& cache = app->shadowCache;
+    int faceBudget = (int)cache.faceBudget;
+    if (ImGui::SliderInt("Shadow faces per frame", &faceBudget, 1, 64))
+        cache.faceBudget = (u32)faceBudget;
+    ImGui::Text("Shadow faces: %u redrawn, %u composited, %u pending", cache.refreshedFaces, cache.compositedFaces, cache.pendingFaces);
+    ShadowAtlas& atlas = app->shadowAtlas;
+    ImGui::SliderFloat("Shadow resolution scale", &atlas.resolutionScale, 0.25f, 2.0f);
+    ImGui::Text("Shadow atlas: %.1f%% used, %u lights without shadow", 100.0f * atlas.usedTexels / ((f32)SHADOW_ATLAS_SIZE * SHADOW_ATLAS_SIZE), atlas.shadowlessLights);
+    int cascadeCount = (int)app->cascadeCount;
+    if (ImGui::SliderInt("Shadow cascades", &cascadeCount, 2, SHADOW_MAX_CASCADES))
+        app->cascadeCount = (u32)cascadeCount;
+    ImGui::SliderFloat("Cascade split lambda", &app->cascadeSplitLambda, 0.0f, 1.0f);
+    ImGui::SliderFloat("Shadow distance", &app->shadowDistance, 10.0f, app->zFar);
     SelectFrameBufferTexture(app);
     CameraSettings(app);
     LightsSettings(app);
@@ -1092,6 +1499,11 @@ void Gui(App* app)
 
 void Update(App* app)
 {
+    PROFILE_FUNCTION();
+
+    //the models and textures done loading go in before anything looks at them
+    UpdateStreaming(app);
+
     float aspectRario = (float)app->displaySize.x / (float)app->displaySize.y;
     glm::mat4 projection = glm::perspective(glm::radians(60.f), aspectRario, app->zNear, app->zFar);
     // UNRELATED RAMI
@@ -1108,12 +1520,7 @@ void Update(App* app)
     rot = glm::rotate(rot, app->cameraRot.x * DEGTORAD, glm::vec3(1, 0, 0));
     glm::mat4 view = glm::lookAt(app->cameraPos, app->cameraPos + glm::vec3(glm::normalize(rot * glm::vec4(0,0,1,0))), glm::vec3(0, 1, 0));
 
-    glBindBuffer(GL_UNIFORM_BUFFER, app->cbuffer.handle);
-
-    //u8* bufferData = (u8*)glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY);
-    //u32 bufferHead = 0;
-    app->cbuffer.head = 0;
-    app->cbuffer.data = glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY);
+    BeginRingFrame(app->cbuffer);
 
     // -- Global Params
     //TODO: cal pujar els global params cada frame???
@@ -1128,135 +1535,404 @@ void Update(App* app)
     PushVec3(app->cbuffer, app->cameraPos);
     PushFloat(app->cbuffer, app->zNear);
     PushFloat(app->cbuffer, app->zFar);
+    //the lighting passes rebuild the position from the depth buffer
+    glm::mat4 inverseViewProjection = glm::inverse(app->vpMatrix);
+    PushMat4(app->cbuffer, inverseViewProjection);
+    const vec2 viewportSize = vec2(app->displaySize);
+    PushVec2(app->cbuffer, viewportSize);
     //PushUInt(app->cbuffer, app->lights.size());
     app->cameraParamsSize = app->cbuffer.head - app->cameraParamsOffset;
     
-    for (u32 i = 0; i < app->lights.size(); ++i)
+    //every light block has the same size, so each job knows where its lights go
+    const u32 lightCount = (u32)app->lights.size();
+    const u32 lightParamsSize = 2 * sizeof(vec4) + sizeof(vec3);
+    const u32 lightParamsStride = Align(lightParamsSize, app->uniformBlockAlignment);
+    AlignHead(app->cbuffer, app->uniformBlockAlignment);
+    const u32 lightParamsBase = app->cbuffer.head;
+    u8* lightParams = (u8*)ReserveAlignedData(app->cbuffer, lightCount * lightParamsStride, app->uniformBlockAlignment);
+    ParallelFor(lightCount, 32, [&](u32 begin, u32 end)
     {
-        //AlignHead(app->cbuffer, sizeof(vec4));
-        AlignHead(app->cbuffer, app->uniformBlockAlignment);
-        app->lights[i].lightParamsOffset = app->cbuffer.head;
-        
-        Light& light = app->lights[i];
-        PushVec3(app->cbuffer, light.color);
-        PushVec3(app->cbuffer, light.direction);
-        //PushVec3(app->cbuffer, light.position);
-        //PushUInt(app->cbuffer, light.type);
-        //PushFloat(app->cbuffer, light.radius);
-        PushVec3(app->cbuffer, light.pos);
-        light.lightParamsSize = app->cbuffer.head - light.lightParamsOffset;
-    }
-
-    // -- Local Params
-    for (int i = 0; i<app->entities.size(); ++i)
+        PROFILE_SCOPE("Light params");
+        for (u32 i = begin; i < end; ++i)
+        {
+            Light& light = app->lights[i];
+            light.lightParamsOffset = lightParamsBase + i * lightParamsStride;
+            light.lightParamsSize = lightParamsSize;
+            u8* params = lightParams + i * lightParamsStride;
+            memcpy(params, value_ptr(light.color), sizeof(vec3));
+            memcpy(params + sizeof(vec4), value_ptr(light.direction), sizeof(vec3));
+            memcpy(params + 2 * sizeof(vec4), value_ptr(light.pos), sizeof(vec3));
+
+            //cube faces for the point shadow maps
+            if (light.type != LightType::LightType_Point)
+                continue;
+
+            //nothing past the radius is lit, the whole depth range goes to it
+            glm::mat4 lightProjection = glm::perspective(glm::radians(90.f), 1.0f, 0.1f, light.radius);
+            light.shadowMatrixCount = 6;
+            light.shadowMatrices[0] = lightProjection * glm::lookAt(light.pos, light.pos + glm::vec3(1.0, 0.0, 0.0), glm::vec3(0.0, -1.0, 0.0));
+            light.shadowMatrices[1] = lightProjection * glm::lookAt(light.pos, light.pos + glm::vec3(-1.0, 0.0, 0.0), glm::vec3(0.0, -1.0, 0.0));
+            light.shadowMatrices[2] = lightProjection * glm::lookAt(light.pos, light.pos + glm::vec3(0.0, 1.0, 0.0), glm::vec3(0.0, 0.0, 1.0));
+            light.shadowMatrices[3] = lightProjection * glm::lookAt(light.pos, light.pos + glm::vec3(0.0, -1.0, 0.0), glm::vec3(0.0, 0.0, -1.0));
+            light.shadowMatrices[4] = lightProjection * glm::lookAt(light.pos, light.pos + glm::vec3(0.0, 0.0, 1.0), glm::vec3(0.0, -1.0, 0.0));
+            light.shadowMatrices[5] = lightProjection * glm::lookAt(light.pos, light.pos + glm::vec3(0.0, 0.0, -1.0), glm::vec3(0.0, -1.0, 0.0));
+        }
+    });
+
+    //the cascades are fitted to the atlas tiles
+    UpdateShadowAtlas(app, view, projection);
+    UpdateShadowCascades(app, view, projection);
+    if (app->useClusteredLighting)
+        BuildLightClusters(app, view, projection);
+    UpdateShadowCache(app);
+
+    EndRingFrame(app->cbuffer);
+
+    // -- Object Params
+    ReserveObjects(app, app->entities.size() + app->lights.size());
+    BeginRingFrame(app->objectsBuffer);
+    app->objectsParamsOffset = app->objectsBuffer.head;
+    //entities sharing a model are consecutive, each model submesh is drawn instanced
+    AssignObjectIndices(app);
+    //light volumes go right after the entities, the jobs write 48 byte rows at their index
+    const std::vector<u32>& instanceEntities = app->renderQueue.instanceEntities;
+    const u32 instanceCount = (u32)instanceEntities.size();
+    const u32 objectStride = sizeof(vec4) * 3;
+    u8* objects = (u8*)ReserveAlignedData(app->objectsBuffer, (instanceCount + lightCount) * objectStride, sizeof(vec4));
+    ParallelFor(instanceCount + lightCount, 256, [&](u32 begin, u32 end)
     {
+        PROFILE_SCOPE("Object params");
+        for (u32 i = begin; i < end; ++i)
+        {
+            glm::mat4 worldMatrix;
+            if (i < instanceCount)
+            {
+                worldMatrix = app->entities[instanceEntities[i]].worldMatrix;
+            }
+            else
+            {
+                Light& light = app->lights[i - instanceCount];
+                light.objectIndex = app->entities.size() + i - instanceCount;
+                worldMatrix = light.worldMatrix;
+            }
+            const glm::mat4 rows = glm::transpose(worldMatrix);
+            memcpy(objects + i * objectStride, value_ptr(rows), objectStride);
+        }
+    });
+    app->objectsParamsSize = app->objectsBuffer.regionSize;
+    EndRingFrame(app->objectsBuffer);
 
-        AlignHead(app->cbuffer, app->uniformBlockAlignment);
-        app->entities[i].localParamsOffset = app->cbuffer.head;
+    UpdateRenderQueue(app);
 
-        PushMat4(app->cbuffer, app->entities[i].worldMatrix);
+}
 
-        app->entities[i].localParamsSize = app->cbuffer.head - app->entities[i].localParamsOffset;
-    }
-    //pushing light matrices
-    for (u32 i = 0; i < app->lights.size(); ++i)
-    {
-        AlignHead(app->cbuffer, app->uniformBlockAlignment);
-        app->lights[i].localParamsOffset = app->cbuffer.head;
+void RenderEntities(App* app)
+{
+    PROFILE_FUNCTION();
+    GPU_PROFILE_SCOPE(app->gpuTimers, "Geometry pass");
 
-        PushMat4(app->cbuffer, app->lights[i].worldMatrix);
+    SubmitRenderView(app, RENDER_VIEW_CAMERA);
+}
 
-        app->lights[i].localParamsSize = app->cbuffer.head - app->lights[i].localParamsOffset;
-    }
-    glUnmapBuffer(GL_UNIFORM_BUFFER);
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+// Clears a tile of the bound atlas, the scissor keeps the rest
+static void ClearShadowTile(App* app, const ShadowTile& tile)
+{
+    GLStateEnable(app->glState, GL_SCISSOR_TEST);
+    glScissor(tile.x, tile.y, tile.size, tile.size);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    GLStateDisable(app->glState, GL_SCISSOR_TEST);
+}
 
+static void CopyShadowTile(App* app, const ShadowTile& tile)
+{
+    const ShadowAtlas& atlas = app->shadowAtlas;
+    glCopyImageSubData(atlas.staticTexture, GL_TEXTURE_2D, 0, tile.x, tile.y, 0,
+                       atlas.texture, GL_TEXTURE_2D, 0, tile.x, tile.y, 0,
+                       tile.size, tile.size, 1);
 }
 
-GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program) {
-    Submesh& submesh = mesh.submeshes[submeshIndex];
-    for (u32 i = 0; i < (u32)submesh.vaos.size(); ++i)
+// The casters of a light in the given faces. With a geometry shader one view draws every
+// face, the faces of point lights otherwise get a view and a draw of their own.
+static void SubmitShadowCasters(App* app, const Program& program, u32 lightIdx, ShadowCasters casters, u32 faces)
+{
+    const Light& light = app->lights[lightIdx];
+    if (light.type == LightType::LightType_Directional || app->usePointShadowGS)
+    {
+        SetUniform(program, UniformSlot_FaceMask, faces);
+        SubmitRenderView(app, LightRenderView(lightIdx, casters));
+        return;
+    }
+
+    const ShadowAtlasLight& tiles = app->shadowAtlas.lights[lightIdx];
+    for (u32 f = 0; f < tiles.tileCount; ++f)
     {
-        if (submesh.vaos[i].programHandle == program.handle)
-            return submesh.vaos[i].handle;
-    }      GLuint vaoHandle = 0;
-    //Create a Vao
-    glGenVertexArrays(1, &vaoHandle);
-    glBindVertexArray(vaoHandle);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
-    for (u32 i = 0; i < program.vertexInputLayout.attributes.size(); ++i)
+        if (!(faces & (1u << f)))
+            continue;
+        GLStateViewport(app->glState, tiles.tiles[f].x, tiles.tiles[f].y, tiles.tiles[f].size, tiles.tiles[f].size);
+        SetUniform(program, UniformSlot_ShadowMatrices, &light.shadowMatrices[f], 1);
+        SubmitRenderView(app, LightRenderView(lightIdx, casters, f));
+    }
+}
+
+// Every shadow map, before any lighting. Only the tiles the shadow cache picked are touched.
+void RenderShadows(App* app)
+{
+    PROFILE_FUNCTION();
+    GPU_PROFILE_SCOPE(app->gpuTimers, "Shadow atlas");
+    const ShadowAtlas& atlas = app->shadowAtlas;
+    const ShadowCache& cache = app->shadowCache;
+    GLStateEnable(app->glState, GL_DEPTH_TEST);
+    GLStateDepthMask(app->glState, GL_TRUE);
+    GLStateDisable(app->glState, GL_BLEND);
+    //casters between a cascade and the light are flattened on its near plane instead of clipped
+    GLStateEnable(app->glState, GL_DEPTH_CLAMP);
+
+    //the geometry shaders send cascade or cube face f to viewport f + 1, set to its tile.
+    //viewport 0 is left to the state cache, the faces drawn one at a time use it.
+    for (u32 i = 0; i < app->lights.size(); ++i)
     {
-        bool attributeWasLinked = false;
-        for (u32 j = 0; j < submesh.vertexBufferLayout.attributes.size(); ++j)
+        const Light& light = app->lights[i];
+        const ShadowCacheEntry& entry = cache.lights[i];
+        if (!entry.compositeFaces)
+            continue;
+
+        const ShadowAtlasLight& tiles = atlas.lights[i];
+        for (u32 f = 0; f < tiles.tileCount; ++f)
+            glViewportIndexedf(f + 1, (f32)tiles.tiles[f].x, (f32)tiles.tiles[f].y, (f32)tiles.tiles[f].size, (f32)tiles.tiles[f].size);
+        u32 programIdx = app->shadowCascadesIdx;
+        if (light.type == LightType::LightType_Point)
+            programIdx = app->usePointShadowGS ? app->shadowCubemapIdx : app->shadowCubeFaceIdx;
+        Program& shadowProgram = app->programs[programIdx];
+        GLStateUseProgram(app->glState, shadowProgram.handle);
+        SetUniform(shadowProgram, UniformSlot_ShadowMatrices, light.shadowMatrices, light.shadowMatrixCount);
+        SetUniform(shadowProgram, UniformSlot_LightPos, light.pos);
+        SetUniform(shadowProgram, UniformSlot_FarPlane, light.radius);
+        if (entry.refreshFaces)
         {
-            if (program.vertexInputLayout.attributes[i].location == submesh.vertexBufferLayout.attributes[j].location)
+            GLStateBindFramebuffer(app->glState, atlas.staticFramebuffer);
+            for (u32 f = 0; f < tiles.tileCount; ++f)
             {
-                const u32 index = submesh.vertexBufferLayout.attributes[j].location;
-                const u32 ncomp = submesh.vertexBufferLayout.attributes[j].componentCount;
-                const u32 offset = submesh.vertexBufferLayout.attributes[j].offset + submesh.vertexOffset;
-                const u32 stride = submesh.vertexBufferLayout.stride;
-                glVertexAttribPointer(index, ncomp, GL_FLOAT, GL_FALSE, stride, (void*)(u64)offset);
-                glEnableVertexAttribArray(index);
-                attributeWasLinked = true;
-                break;
+                if (entry.refreshFaces & (1u << f))
+                    ClearShadowTile(app, tiles.tiles[f]);
             }
+            SubmitShadowCasters(app, shadowProgram, i, ShadowCasters_Static, entry.refreshFaces);
+        }
+        for (u32 f = 0; f < tiles.tileCount; ++f)
+        {
+            if (entry.compositeFaces & (1u << f))
+                CopyShadowTile(app, tiles.tiles[f]);
+        }
+        if (entry.dynamicFaces)
+        {
+            GLStateBindFramebuffer(app->glState, atlas.framebuffer);
+            SubmitShadowCasters(app, shadowProgram, i, ShadowCasters_Dynamic, entry.dynamicFaces);
         }
-        assert(attributeWasLinked);
     }
-    glBindVertexArray(0);
-    Vao vao = { vaoHandle, program.handle };
-    submesh.vaos.push_back(vao);
-    return vaoHandle;
+
+    GLStateDisable(app->glState, GL_DEPTH_CLAMP);
+    GLStateDepthMask(app->glState, GL_FALSE);
+    GLStateDisable(app->glState, GL_DEPTH_TEST);
 }
 
-void RenderEntities(App* app)
+// Render graph resources of the G-buffer
+struct GBufferResources
+{
+    RenderResource color[GBuffer_Count]; // GBufferAttachment order
+    RenderResource depth;
+};
+
+static void BindGBufferTextures(App* app, const RenderGraph& graph, const GBufferResources& gbuffer)
+{
+    GLStateBindTexture(app->glState, TextureUnit_Albedo, GL_TEXTURE_2D, RenderGraphTexture(graph, gbuffer.color[GBuffer_Albedo]));
+    GLStateBindTexture(app->glState, TextureUnit_Normal, GL_TEXTURE_2D, RenderGraphTexture(graph, gbuffer.color[GBuffer_Normals]));
+    GLStateBindTexture(app->glState, TextureUnit_Depth, GL_TEXTURE_2D, RenderGraphTexture(graph, gbuffer.depth));
+}
+
+// Adds up the lights into the light buffer, the render graph bound it with the depth
+void RenderLights(App* app, const RenderGraph& graph, const GBufferResources& gbuffer)
 {
-    Program* textureMeshProgram = &app->programs[app->geometryPassIdx];
-    glUseProgram(textureMeshProgram->handle);
-    for (Entity entity : app->entities)
+    PROFILE_FUNCTION();
+    GPU_PROFILE_SCOPE(app->gpuTimers, "Lighting pass");
+
+    GLStateBindVertexArray(app->glState, 0);
+    GLStateUseProgram(app->glState, 0);
+    GLStateDrawBuffer(app->glState, GL_COLOR_ATTACHMENT0);
+    GLStateDepthMask(app->glState, GL_FALSE);
+    GLStateDisable(app->glState, GL_DEPTH_TEST);
+    GLStateEnable(app->glState, GL_BLEND);
+    GLStateBlendEquation(app->glState, GL_FUNC_ADD);
+    GLStateBlendFunc(app->glState, GL_ONE, GL_ONE);
+
+    glClear(GL_COLOR_BUFFER_BIT |GL_STENCIL_BUFFER_BIT);
+
+    for (int i = 0; i < app->lights.size(); ++i)
     {
-        //binding local uniform buffer params
-        glBindBufferRange(GL_UNIFORM_BUFFER, 1, app->cbuffer.handle, entity.localParamsOffset, entity.localParamsSize);
-        Model& model = app->models[entity.modelIndex];
-        Mesh& mesh = app->meshes[model.meshIdx];
-        for (u32 i = 0; i < mesh.submeshes.size(); ++i) {
-            u32 submeshMaterialIdx = model.materialIdx[i];
-            Material& submeshMaterial = app->materials[submeshMaterialIdx];
-            if (submeshMaterial.normalsTextureIdx != 0 && app->useNormalMap) {
-                if(submeshMaterial.bumpTextureIdx != 0 && app->useRelifMap)
-                    textureMeshProgram = &app->programs[app->relGeoPassIdx];
-                else
-                    textureMeshProgram = &app->programs[app->normGeoPassIdx];
-                glUseProgram(textureMeshProgram->handle);
-                glUniform1i(glGetUniformLocation(textureMeshProgram->handle, "normalMap"), 1);
-                glActiveTexture(GL_TEXTURE1);
-                glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.normalsTextureIdx].handle);
-                if (submeshMaterial.bumpTextureIdx != 0 && app->useRelifMap)
-                {
-                    glUniform1i(glGetUniformLocation(textureMeshProgram->handle, "heightMap"), 2);
-                    glActiveTexture(GL_TEXTURE2);
-                    glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.bumpTextureIdx].handle);
-                }
+        PROFILE_SCOPE(app->lights[i].type == LightType::LightType_Point ? "Point light" : "Directional light");
+        GLStateBindBufferRange(app->glState, GL_UNIFORM_BUFFER, 0, app->cbuffer.handle, app->lights[i].lightParamsOffset, app->lights[i].lightParamsSize);
+
+        Program* currProgram = &app->programs[app->directionalLightIdx];
+        switch (app->lights[i].type)
+        {
+        case LightType::LightType_Directional: currProgram = &app->programs[app->directionalLightIdx]; break;
+        case LightType::LightType_Point:currProgram = &app->programs[app->pointLightIdx]; break;
+        default: ELOG("Light type unknown: BAD SHADER PROGRAM FOR LIGHT")break;
+        }
+
+        GLStateUseProgram(app->glState, currProgram->handle);
+        BindGBufferTextures(app, graph, gbuffer);
+
+        //unsigned int idx = 1;
+        //for (; idx < app->ColorAttachmentHandles.size(); ++idx)
+        //{
+        //    glActiveTexture(GL_TEXTURE0 + (idx - 1));
+        //    glBindTexture(GL_TEXTURE_2D, app->ColorAttachmentHandles[idx]);
+        //}
+
+        //the shadow maps were drawn up front by RenderShadows()
+        const ShadowAtlasLight& shadowTiles = app->shadowAtlas.lights[i];
+        glm::vec4 shadowRects[6];
+        for (u32 face = 0; face < ARRAY_COUNT(shadowRects); ++face)
+            shadowRects[face] = ShadowTileRect(shadowTiles, face);
+        SetUniform(*currProgram, UniformSlot_ShadowRects, shadowRects, ARRAY_COUNT(shadowRects));
+        if (app->lights[i].type == LightType::LightType_Directional)
+            SetUniform(*currProgram, UniformSlot_ShadowMatrices, app->lights[i].shadowMatrices, app->lights[i].shadowMatrixCount);
+        else
+            SetUniform(*currProgram, UniformSlot_FarPlane, app->lights[i].radius);
+        GLStateBindTexture(app->glState, TextureUnit_Shadow, GL_TEXTURE_2D, app->shadowAtlas.texture);
+
+        if (app->lights[i].type == LightType::LightType_Directional) 
+        {
+            //one timer per kind of pass, added up over the lights
+            GPU_PROFILE_SCOPE(app->gpuTimers, "Fullscreen lights");
+            GLStateBindVertexArray(app->glState, app->vao);
+            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+            app->stats.drawCalls++;
+        }
+        else
+        {
+            GpuTimerBegin(app->gpuTimers, "Stencil volumes");
+            GLStateDisable(app->glState, GL_CULL_FACE);
+            GLStateEnable(app->glState, GL_DEPTH_TEST); //glDepthMask(GL_FALSE);
+            GLStateEnable(app->glState, GL_STENCIL_TEST);
+            GLStateStencilMask(app->glState, GL_TRUE);
+            GLStateStencilFunc(app->glState, GL_ALWAYS, 0, 0);
+            GLStateStencilOpSeparate(app->glState, GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+            GLStateStencilOpSeparate(app->glState, GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+            //glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+            GLStateDrawBuffer(app->glState, GL_NONE);
+            
+            GLStateUseProgram(app->glState, app->programs[app->noFragmentIdx].handle);
+            Model& model = app->models[app->lights[i].modelIndex];
+            Mesh& mesh = app->meshes[model.meshIdx];
+            for (u32 j = 0; j < mesh.submeshes.size(); ++j) {
+                Submesh& submesh = mesh.submeshes[j];
+                GLStateBindVertexArray(app->glState, app->vertexFormats[submesh.vertexFormatIdx].vao);
+                glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)(submesh.firstIndex * sizeof(u32)), 1, submesh.baseVertex, app->lights[i].instanceIdx);
+                app->stats.drawCalls++;
             }
-            glUniform1i(glGetUniformLocation(textureMeshProgram->handle, "uTexture"), 0);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.albedoTextureIdx].handle);
-
-            GLuint vao = FindVAO(mesh, i, *textureMeshProgram);
-            glBindVertexArray(vao);
-
-            Submesh& submesh = mesh.submeshes[i];
-            glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
-            //TODO: arreglar aquest canvi de shader cada cop
-            textureMeshProgram = &app->programs[app->geometryPassIdx];
-            glUseProgram(textureMeshProgram->handle);
+            GpuTimerEnd(app->gpuTimers);
+
+            //glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+            GLStateDrawBuffer(app->glState, GL_COLOR_ATTACHMENT0);
+            GLStateStencilFunc(app->glState, GL_NOTEQUAL, 0, 0xFF);
+            GLStateStencilMask(app->glState, GL_FALSE);
+            GLStateEnable(app->glState, GL_CULL_FACE);
+            GLStateCullFace(app->glState, GL_FRONT);
+            GLStateDisable(app->glState, GL_DEPTH_TEST);
+
+            GpuTimerBegin(app->gpuTimers, "Light volumes");
+            GLStateUseProgram(app->glState, currProgram->handle);
+            model = app->models[app->lights[i].modelIndex];
+            mesh = app->meshes[model.meshIdx];
+            for (u32 j = 0; j < mesh.submeshes.size(); ++j) {
+                Submesh& submesh = mesh.submeshes[j];
+                GLStateBindVertexArray(app->glState, app->vertexFormats[submesh.vertexFormatIdx].vao);
+                glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)(submesh.firstIndex * sizeof(u32)), 1, submesh.baseVertex, app->lights[i].instanceIdx);
+                app->stats.drawCalls++;
+            }
+            GpuTimerEnd(app->gpuTimers);
+
+            GLStateCullFace(app->glState, GL_BACK);
+            GLStateDisable(app->glState, GL_STENCIL_TEST);
+            GLStateStencilMask(app->glState, GL_TRUE);
+            glClear(GL_STENCIL_BUFFER_BIT);
         }
     }
+    GLStateBindVertexArray(app->glState, 0);
+    GLStateUseProgram(app->glState, 0);
+}
+
+// One full screen pass for all the lights, each pixel only shades the lights of its
+// cluster, the shadows come from the atlas
+void RenderLightsClustered(App* app, const RenderGraph& graph, const GBufferResources& gbuffer)
+{
+    PROFILE_FUNCTION();
+    GPU_PROFILE_SCOPE(app->gpuTimers, "Lighting pass");
+
+    GLStateDisable(app->glState, GL_DEPTH_TEST);
+    GLStateDepthMask(app->glState, GL_FALSE);
+
+    //every pixel is written, nothing to clear or blend
+    Program& program = app->programs[app->clusteredLightingIdx];
+    GLStateUseProgram(app->glState, program.handle);
+    BindLightClusters(app);
+    BindGBufferTextures(app, graph, gbuffer);
+    GLStateBindTexture(app->glState, TextureUnit_Shadow, GL_TEXTURE_2D, app->shadowAtlas.texture);
+    GLStateBindVertexArray(app->glState, app->vao);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+    app->stats.drawCalls++;
+
+    GLStateBindVertexArray(app->glState, 0);
+    GLStateUseProgram(app->glState, 0);
+}
+
+// Shows the resource picked in the UI on the default framebuffer
+static void RenderScreenComposite(App* app, const RenderGraph& graph, const GBufferResources& gbuffer, RenderResource shown)
+{
+    PROFILE_PASS(app->gpuTimers, "Screen composite");
+    GLStateBindFramebuffer(app->glState, 0);
+    GLStateViewport(app->glState, 0, 0, app->displaySize.x, app->displaySize.y);
+    GLStateDisable(app->glState, GL_BLEND);
+    GLStateClearColor(app->glState, 0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    const AttachmentOutputs output = app->currentAttachmentType;
+    if (output == AttachmentOutputs::SHADOW_ATLAS)
+    {
+        GLStateUseProgram(app->glState, app->programs[app->texturedGeometryProgramIdx].handle);
+        GLStateBindTexture(app->glState, TextureUnit_Albedo, GL_TEXTURE_2D, RenderGraphTexture(graph, shown));
+    }
+    else
+    {
+        //read by texel, the pooled G-buffer textures can be bigger than the screen
+        const Program& debugProgram = app->programs[app->gbufferDebugIdx];
+        GLStateUseProgram(app->glState, debugProgram.handle);
+        SetUniform(debugProgram, UniformSlot_DebugView, (u32)output);
+        GLStateBindTexture(app->glState, TextureUnit_Albedo, GL_TEXTURE_2D, RenderGraphTexture(graph, shown));
+
+        //only what the pass reads, the other G-buffer textures may be aliased by then
+        const bool readsNormals = output == AttachmentOutputs::NORMALS;
+        const bool readsDepth = readsNormals || shown == gbuffer.depth;
+        GLStateBindTexture(app->glState, TextureUnit_Normal, GL_TEXTURE_2D, readsNormals ? RenderGraphTexture(graph, shown) : 0);
+        GLStateBindTexture(app->glState, TextureUnit_Depth, GL_TEXTURE_2D, readsDepth ? RenderGraphTexture(graph, gbuffer.depth) : 0);
+    }
+    GLStateBindVertexArray(app->glState, app->vao);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+    app->stats.drawCalls++;
+    GLStateBindTexture(app->glState, TextureUnit_Albedo, GL_TEXTURE_2D, 0);
+    GLStateBindVertexArray(app->glState, 0);
+    GLStateUseProgram(app->glState, 0);
 }
 
 void Render(App* app)
 {
+    PROFILE_FUNCTION();
+
+    app->stats = {};
+    GLStateBeginFrame(app->glState);
+    GpuTimersBeginFrame(app->gpuTimers);
+    GpuTimerBegin(app->gpuTimers, "Frame");
+
     switch (app->mode)
     {
         case Mode_TexturedQuad:
@@ -1270,290 +1946,135 @@ void Render(App* app)
                 //   (...and make its texture sample from unit 0)
                 // - bind the vao
                 // - glDrawElements() !!!
-                glClearColor(0.1f,0.1f,0.1f,1.0f);
+                GLStateClearColor(app->glState, 0.1f,0.1f,0.1f,1.0f);
                 glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
                 //glViewport(0,0,app->displaySize.x,app->displaySize.y);
 
                 Program& programTexturedGeometry = app->programs[app->texturedGeometryProgramIdx];
-                glUseProgram(programTexturedGeometry.handle);
-                glBindVertexArray(app->vao);
+                GLStateUseProgram(app->glState, programTexturedGeometry.handle);
+                GLStateBindVertexArray(app->glState, app->vao);
 
-                glEnable(GL_BLEND);
-                glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
+                GLStateEnable(app->glState, GL_BLEND);
+                GLStateBlendFunc(app->glState, GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
 
-                glUniform1i(app->programUniformTexture,0);
-                glActiveTexture(GL_TEXTURE0);
                 GLuint textureHandle = app->textures[app->diceTexIdx].handle;
-                glBindTexture(GL_TEXTURE_2D,textureHandle);
+                GLStateBindTexture(app->glState, TextureUnit_Albedo, GL_TEXTURE_2D, textureHandle);
 
                 glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+                app->stats.drawCalls++;
 
-                glBindVertexArray(0);
-                glUseProgram(0);
+                GLStateBindVertexArray(app->glState, 0);
+                GLStateUseProgram(app->glState, 0);
 
             }
             break;
         case Mode_Patrick:
             {
-                glBindFramebuffer(GL_FRAMEBUFFER, app->framebufferHandle);
-                GLenum buffers[5];
-                for (unsigned int i = 0; i < 5; ++i)
-                    buffers[i] = GL_COLOR_ATTACHMENT0 + i;
-                glDrawBuffers(5, buffers);
-                
-                glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-                glStencilMask(0xff);
-                glDepthMask(0xff);
-                glEnable(GL_DEPTH_TEST);
-                glDepthMask(GL_TRUE);
-                glDisable(GL_BLEND);
-                //glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
-                
-                glBindBufferRange(GL_UNIFORM_BUFFER, 2, app->cbuffer.handle, app->cameraParamsOffset, app->cameraParamsSize);
-                glBindBufferRange(GL_UNIFORM_BUFFER, 3, app->cbuffer.handle, app->vpParamsOffset, app->vpParamsSize);
-                //Geometry pass
-                RenderEntities(app);
-
-                //Lighting pass
-                glBindVertexArray(0);
-                glUseProgram(0);
-                glDrawBuffer(GL_COLOR_ATTACHMENT0);
-                glDepthMask(GL_FALSE);
-                glDisable(GL_DEPTH_TEST);
-                glEnable(GL_BLEND);
-                glBlendEquation(GL_FUNC_ADD);
-                glBlendFunc(GL_ONE, GL_ONE);
-
-                glClear(GL_COLOR_BUFFER_BIT |GL_STENCIL_BUFFER_BIT);
-
-                for (int i = 0; i < app->lights.size(); ++i)
+                GLStateBindBufferRange(app->glState, GL_UNIFORM_BUFFER, 2, app->cbuffer.handle, app->cameraParamsOffset, app->cameraParamsSize);
+                GLStateBindBufferRange(app->glState, GL_UNIFORM_BUFFER, 3, app->cbuffer.handle, app->vpParamsOffset, app->vpParamsSize);
+                GLStateBindBufferRange(app->glState, GL_SHADER_STORAGE_BUFFER, 0, app->objectsBuffer.handle, app->objectsParamsOffset, app->objectsParamsSize);
+
+                RenderGraph& graph = app->renderGraph;
+                RenderGraphBegin(graph);
+                GBufferResources gbuffer;
+                for (u32 i = 0; i < GBuffer_Count; ++i)
+                    gbuffer.color[i] = RenderGraphCreateTexture(graph, GBufferNames[i], { GBufferFormats[i], app->displaySize });
+                gbuffer.depth = RenderGraphCreateTexture(graph, "Depth", { GL_DEPTH24_STENCIL8, app->displaySize });
+                const RenderResource shadowAtlas = RenderGraphImport(graph, "Shadow atlas", app->shadowAtlas.texture);
+                const RenderResource drawCommands = RenderGraphImport(graph, "Draw commands", app->drawCommandsBuffer.handle);
+
+                if (app->useGpuCulling)
                 {
-                    glBindBufferRange(GL_UNIFORM_BUFFER, 0, app->cbuffer.handle, app->lights[i].lightParamsOffset, app->lights[i].lightParamsSize);
-                    glBindBufferRange(GL_UNIFORM_BUFFER, 1, app->cbuffer.handle, app->lights[i].localParamsOffset, app->lights[i].localParamsSize);
+                    const u32 cullPass = RenderGraphAddPass(graph, "GPU culling", [](App* app, const RenderGraph&) { DispatchGpuCulling(app); });
+                    RenderGraphWrite(graph, cullPass, drawCommands);
+                }
 
-                    Program* currProgram = &app->programs[app->directionalLightIdx];
-                    switch (app->lights[i].type)
-                    {
-                    case LightType::LightType_Directional: currProgram = &app->programs[app->directionalLightIdx]; break;
-                    case LightType::LightType_Point:currProgram = &app->programs[app->pointLightIdx]; break;
-                    default: ELOG("Light type unknown: BAD SHADER PROGRAM FOR LIGHT")break;
-                    }
-
-                    //render from light point of view to create shadowMap
-                    glm::mat4 lightSpaceMatrix;
-                    glm::mat4 lightProjection;
-                    Program* shadowProgram = &app->programs[app->noFragmentIdx];
-                    //if (app->lights[i].type == LightType::LightType_Directional)
-                    //{
-                        if (app->lights[i].type == LightType::LightType_Directional)
-                        {
-                            //glm::mat4 lightProjection = glm::ortho(-35.0f, 35.0f, -35.0f, 35.0f, app->zNear, app->zFar);
-                            lightProjection = glm::ortho(-35.0f, 35.0f, -35.0f, 35.0f, 0.1f, 75.f);
-                            //glm::vec3 zDir = glm::normalize(app->lights[i].direction);
-                            //glm::vec3 xDir = glm::cross(zDir, glm::vec3(0, 1, 0));
-                            //glm::vec3 up = glm::cross(xDir, zDir);
-                            ////glm::mat4 lightView = glm::lookAt(app->zFar * zDir, glm::vec3(0.0f, 0.0f, 0.0f), up);
-                            //glm::mat4 lightView = glm::lookAt(app->zFar/5.f * zDir, glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0, 1, 0));
-                            glm::mat4 lightView = glm::lookAt(20.f * app->lights[i].direction, glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0, 1, 0));
-                            lightSpaceMatrix = lightProjection * lightView;
-
-                            glBindFramebuffer(GL_FRAMEBUFFER, app->shadowFramebufferHandle);
-                            shadowProgram = &app->programs[app->noFragmentIdx];
-                            glUseProgram(shadowProgram->handle);
-                        }
-                        else if (app->lights[i].type == LightType::LightType_Point)
-                        {
-                            lightProjection = glm::perspective(glm::radians(90.f), 1.0f, 0.1f, app->zFar);
-                            glm::mat4 lightSpaceMatrices[] = {
-                                lightProjection * glm::lookAt(app->lights[i].pos, app->lights[i].pos + glm::vec3(1.0,0.0,0.0), glm::vec3(0.0,-1.0, 0.0)),
-                                lightProjection * glm::lookAt(app->lights[i].pos, app->lights[i].pos + glm::vec3(-1.0,0.0,0.0), glm::vec3(0.0,-1.0, 0.0)),
-                                lightProjection * glm::lookAt(app->lights[i].pos, app->lights[i].pos + glm::vec3(0.0,1.0,0.0), glm::vec3(0.0,0.0, 1.0)),
-                                lightProjection * glm::lookAt(app->lights[i].pos, app->lights[i].pos + glm::vec3(0.0,-1.0,0.0), glm::vec3(0.0,0.0, -1.0)),
-                                lightProjection * glm::lookAt(app->lights[i].pos, app->lights[i].pos + glm::vec3(0.0,0.0,1.0), glm::vec3(0.0,-1.0, 0.0)),
-                                lightProjection * glm::lookAt(app->lights[i].pos, app->lights[i].pos + glm::vec3(0.0,0.0,-1.0), glm::vec3(0.0,-1.0, 0.0))
-                            };
-                        
-                            glBindFramebuffer(GL_FRAMEBUFFER, app->shadowPointFramebufferHandle);
-                            shadowProgram = &app->programs[app->shadowCubemapIdx];
-                            glUseProgram(shadowProgram->handle);
-                            glUniformMatrix4fv(glGetUniformLocation(shadowProgram->handle, "shadowMatrices[0]"), 1, GL_FALSE, glm::value_ptr(lightSpaceMatrices[0]));
-                            glUniformMatrix4fv(glGetUniformLocation(shadowProgram->handle, "shadowMatrices[1]"), 1, GL_FALSE, glm::value_ptr(lightSpaceMatrices[1]));
-                            glUniformMatrix4fv(glGetUniformLocation(shadowProgram->handle, "shadowMatrices[2]"), 1, GL_FALSE, glm::value_ptr(lightSpaceMatrices[2]));
-                            glUniformMatrix4fv(glGetUniformLocation(shadowProgram->handle, "shadowMatrices[3]"), 1, GL_FALSE, glm::value_ptr(lightSpaceMatrices[3]));
-                            glUniformMatrix4fv(glGetUniformLocation(shadowProgram->handle, "shadowMatrices[4]"), 1, GL_FALSE, glm::value_ptr(lightSpaceMatrices[4]));
-                            glUniformMatrix4fv(glGetUniformLocation(shadowProgram->handle, "shadowMatrices[5]"), 1, GL_FALSE, glm::value_ptr(lightSpaceMatrices[5]));
-                            glUniform3f(glGetUniformLocation(shadowProgram->handle, "lightPos"), app->lights[i].pos.x, app->lights[i].pos.y, app->lights[i].pos.z);
-                            glUniform1f(glGetUniformLocation(shadowProgram->handle, "farPlane"), app->zFar);
-                        
-                        }
-
-                        glViewport(0, 0, app->shadowMapWidth, app->shadowMapHeight);
-                        glEnable(GL_DEPTH_TEST);
-                        glDepthMask(0xff);
-                        //glDisable(GL_CULL_FACE);
-                        glClear(GL_DEPTH_BUFFER_BIT);
-                        if (app->lights[i].type == LightType::LightType_Directional)
-                        {
-                            glBindBuffer(GL_UNIFORM_BUFFER, app->cbuffer.handle);
-                            glBufferSubData(GL_UNIFORM_BUFFER, app->vpParamsOffset, app->vpParamsSize, glm::value_ptr(lightSpaceMatrix));
-                            glBindBuffer(GL_UNIFORM_BUFFER, 0);
-                        }
-                        for (Entity entity : app->entities)
-                        {
-                            //binding local uniform buffer params
-                            glBindBufferRange(GL_UNIFORM_BUFFER, 1, app->cbuffer.handle, entity.localParamsOffset, entity.localParamsSize);
-                            Model& model = app->models[entity.modelIndex];
-                            Mesh& mesh = app->meshes[model.meshIdx];
-                            for (u32 i = 0; i < mesh.submeshes.size(); ++i) {
-                                GLuint vao = FindVAO(mesh, i, *shadowProgram);
-                                glBindVertexArray(vao);
-                                //u32 submeshMaterialIdx = model.materialIdx[i];
-                                //Material& submeshMaterial = app->materials[submeshMaterialIdx];
-                                //glActiveTexture(GL_TEXTURE0);
-                                //glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.albedoTextureIdx].handle);
-
-                                Submesh& submesh = mesh.submeshes[i];
-                                glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
-                            }
-                        }
-                        if (app->lights[i].type == LightType::LightType_Directional)
-                        {
-                            glBindBuffer(GL_UNIFORM_BUFFER, app->cbuffer.handle);
-                            glBufferSubData(GL_UNIFORM_BUFFER, app->vpParamsOffset, app->vpParamsSize, glm::value_ptr(app->vpMatrix));
-                            glBindBuffer(GL_UNIFORM_BUFFER, 0);
-                        }
-
-                        glBindFramebuffer(GL_FRAMEBUFFER, app->framebufferHandle);
-                        glDisable(GL_DEPTH_TEST);
-                        glDepthMask(0x00);
-                        glViewport(0, 0, app->displaySize.x, app->displaySize.y);
-                    //}
-                    //End render shadowmaps ---------------------------------------------------------------------------------------------------------   
-
-                    glUseProgram(currProgram->handle);
-                    GLint loc = glGetUniformLocation(currProgram->handle, "uTextureAlb");
-                    glUniform1i(loc, 0);
-                    glActiveTexture(GL_TEXTURE0);
-                    glBindTexture(GL_TEXTURE_2D, app->ColorAttachmentHandles[1]);
-                    loc = glGetUniformLocation(currProgram->handle, "uTextureNorm");
-                    glUniform1i(loc, 1);
-                    glActiveTexture(GL_TEXTURE1);
-                    glBindTexture(GL_TEXTURE_2D, app->ColorAttachmentHandles[2]);
-                    //loc = glGetUniformLocation(currProgram->handle, "uTextureDepth");
-                    //glUniform1i(loc, 2);
-                    loc = glGetUniformLocation(currProgram->handle, "uTexturePos");
-                    glUniform1i(loc, 2);
-                    glActiveTexture(GL_TEXTURE2);
-                    glBindTexture(GL_TEXTURE_2D, app->ColorAttachmentHandles[4]);
-
-                    //unsigned int idx = 1;
-                    //for (; idx < app->ColorAttachmentHandles.size(); ++idx)
-                    //{
-                    //    glActiveTexture(GL_TEXTURE0 + (idx - 1));
-                    //    glBindTexture(GL_TEXTURE_2D, app->ColorAttachmentHandles[idx]);
-                    //}
-
-                    if (app->lights[i].type == LightType::LightType_Directional) {
-                        loc = glGetUniformLocation(currProgram->handle, "shadowMap");
-                        glUniform1i(loc, 3);
-                        loc = glGetUniformLocation(currProgram->handle, "lightSpaceMatrix");
-                        glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(lightSpaceMatrix));
-                        glActiveTexture(GL_TEXTURE3);
-                        glBindTexture(GL_TEXTURE_2D, app->shadowDepthAttachmentHandle);
-                    }
-                    else if (app->lights[i].type == LightType::LightType_Point)
+                //Geometry pass, writes albedo and normals, the lighting fills the light buffer
+                const u32 geometryPass = RenderGraphAddPass(graph, "Geometry", [](App* app, const RenderGraph&)
+                {
+                    GLStateClearColor(app->glState, 0.0f, 0.0f, 0.0f, 1.0f);
+                    GLStateStencilMask(app->glState, 0xff);
+                    GLStateEnable(app->glState, GL_DEPTH_TEST);
+                    GLStateDepthMask(app->glState, GL_TRUE);
+                    GLStateDisable(app->glState, GL_BLEND);
+                    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+                    RenderEntities(app);
+                });
+                RenderGraphRead(graph, geometryPass, drawCommands);
+                RenderGraphWriteColor(graph, geometryPass, gbuffer.color[GBuffer_Albedo], 1);
+                RenderGraphWriteColor(graph, geometryPass, gbuffer.color[GBuffer_Normals], 2);
+                RenderGraphWriteDepth(graph, geometryPass, gbuffer.depth);
+
+                //culls the next frame, kept whatever is shown
+                if (app->useGpuCulling)
+                {
+                    const u32 pyramidPass = RenderGraphAddPass(graph, "Depth pyramid", [gbuffer](App* app, const RenderGraph& graph)
                     {
-                        loc = glGetUniformLocation(currProgram->handle, "shadowCubeMap");
-                        glUniform1i(loc, 3);
-                        glActiveTexture(GL_TEXTURE3);
-                        glBindTexture(GL_TEXTURE_CUBE_MAP, app->shadowPointDepthAttachmentHandle);
-                    }
+                        BuildDepthPyramid(app, RenderGraphTexture(graph, gbuffer.depth));
+                    }, true);
+                    RenderGraphRead(graph, pyramidPass, gbuffer.depth);
+                }
 
-                    if (app->lights[i].type == LightType::LightType_Directional) 
-                    {
-                        glBindVertexArray(app->vao);
-                        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
-                    }
+                //Lighting pass, every shadow map first
+                const u32 shadowPass = RenderGraphAddPass(graph, "Shadows", [](App* app, const RenderGraph&) { RenderShadows(app); });
+                RenderGraphRead(graph, shadowPass, drawCommands);
+                RenderGraphWrite(graph, shadowPass, shadowAtlas);
+
+                const u32 lightingPass = RenderGraphAddPass(graph, "Lighting", [gbuffer](App* app, const RenderGraph& graph)
+                {
+                    if (app->useClusteredLighting)
+                        RenderLightsClustered(app, graph, gbuffer);
                     else
-                    {
-                        glBindBufferRange(GL_UNIFORM_BUFFER, 1, app->cbuffer.handle, app->lights[i].localParamsOffset, app->lights[i].localParamsSize);
-
-                        glDisable(GL_CULL_FACE);
-                        glEnable(GL_DEPTH_TEST); //glDepthMask(GL_FALSE);
-                        glEnable(GL_STENCIL_TEST);
-                        glStencilMask(GL_TRUE);
-                        glStencilFunc(GL_ALWAYS, 0, 0);
-                        glStencilOpSeparate(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
-                        glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
-                        //glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-                        glDrawBuffer(GL_NONE);
-                        
-                        glUseProgram(app->programs[app->noFragmentIdx].handle);
-                        Model& model = app->models[app->lights[i].modelIndex];
-                        Mesh& mesh = app->meshes[model.meshIdx];
-                        for (u32 j = 0; j < mesh.submeshes.size(); ++j) {
-                            GLuint vao = FindVAO(mesh, j, *currProgram);
-                            glBindVertexArray(vao);
-                        
-                            Submesh& submesh = mesh.submeshes[j];
-                            glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
-                        }
-
-                        //glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-                        glDrawBuffer(GL_COLOR_ATTACHMENT0);
-                        glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
-                        glStencilMask(GL_FALSE);
-                        glEnable(GL_CULL_FACE);
-                        glCullFace(GL_FRONT);
-                        glDisable(GL_DEPTH_TEST);
-
-                        glUseProgram(currProgram->handle);
-                        model = app->models[app->lights[i].modelIndex];
-                        mesh = app->meshes[model.meshIdx];
-                        for (u32 j = 0; j < mesh.submeshes.size(); ++j) {
-                            GLuint vao = FindVAO(mesh, j, *currProgram);
-                            glBindVertexArray(vao);
-
-                            Submesh& submesh = mesh.submeshes[j];
-                            glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
-                        }
-
-                        glCullFace(GL_BACK);
-                        glDisable(GL_STENCIL_TEST);
-                        glStencilMask(GL_TRUE);
-                        glClear(GL_STENCIL_BUFFER_BIT);
-                    }
+                        RenderLights(app, graph, gbuffer);
+                });
+                RenderGraphRead(graph, lightingPass, gbuffer.color[GBuffer_Albedo]);
+                RenderGraphRead(graph, lightingPass, gbuffer.color[GBuffer_Normals]);
+                RenderGraphRead(graph, lightingPass, gbuffer.depth);
+                RenderGraphRead(graph, lightingPass, shadowAtlas);
+                RenderGraphWriteColor(graph, lightingPass, gbuffer.color[GBuffer_Light], 0);
+                //the light volumes mark their pixels in the stencil
+                if (!app->useClusteredLighting)
+                    RenderGraphWriteDepth(graph, lightingPass, gbuffer.depth);
+
+                //screen render pass, only what is shown is needed
+                RenderResource shown = gbuffer.color[GBuffer_Light];
+                switch (app->currentAttachmentType)
+                {
+                case AttachmentOutputs::ALBEDO: shown = gbuffer.color[GBuffer_Albedo]; break;
+                case AttachmentOutputs::NORMALS: shown = gbuffer.color[GBuffer_Normals]; break;
+                case AttachmentOutputs::DEPTH:
+                case AttachmentOutputs::POSITION: shown = gbuffer.depth; break;
+                case AttachmentOutputs::SHADOW_ATLAS: shown = shadowAtlas; break;
+                default: break;
                 }
-                glBindVertexArray(0);
-                glUseProgram(0);
-                
-                //screen render pass
-                glBindFramebuffer(GL_FRAMEBUFFER, 0);
-                glEnable(GL_BLEND);
-                glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-                //glDisable(GL_DEPTH_TEST);
-                //glDepthMask(GL_TRUE);
-                //glDepthMask(GL_TRUE);
-                glDisable(GL_BLEND);
-                
-                glUseProgram(app->programs[app->texturedGeometryProgramIdx].handle);
-                glBindVertexArray(app->vao);               
-                
-                //glUniform1i(app->programUniformTexture, 0);
-                glActiveTexture(GL_TEXTURE0);
-                glBindTexture(GL_TEXTURE_2D, app->currentAttachmentTextureHandle);
-                glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
-                glBindTexture(GL_TEXTURE_2D, 0);
-                glBindVertexArray(0);
-                glUseProgram(0);
-
+                const u32 compositePass = RenderGraphAddPass(graph, "Screen composite", [gbuffer, shown](App* app, const RenderGraph& graph)
+                {
+                    RenderScreenComposite(app, graph, gbuffer, shown);
+                }, true);
+                RenderGraphRead(graph, compositePass, shown);
+                if (app->currentAttachmentType == AttachmentOutputs::NORMALS)
+                    RenderGraphRead(graph, compositePass, gbuffer.depth); //masks out the background
+
+                RenderGraphCompile(graph);
+                if (graph.passes[shadowPass].culled)
+                    SkipShadowCacheFrame(app);
+                RenderGraphExecute(app, graph);
             }
             break;
 
         default:;
     }
+
+    GpuTimerEnd(app->gpuTimers);
+    GpuTimersEndFrame(app->gpuTimers);
+    UpdateRenderTargets(app);
+    app->stats.stateChanges = GLStateIssuedCount(app->glState.counters);
+
+    //every command reading this frame's ring buffer regions has been issued
+    FenceRingFrame(app->cbuffer);
+    FenceRingFrame(app->objectsBuffer);
+    FenceRingFrame(app->drawCommandsBuffer);
+    FenceRingFrame(app->instanceBuffer);
+    FenceRingFrame(app->clustersBuffer);
 }
\ No newline at end of file
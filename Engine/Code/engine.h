@@ -5,7 +5,21 @@
 #pragma once
 
 #include "platform.h"
+#include "gpu_timers.h"
+#include "gl_state.h"
+#include "culling.h"
+#include "aabb_tree.h"
+#include "occlusion.h"
+#include "gpu_culling.h"
+#include "light_clusters.h"
+#include "shadow_atlas.h"
+#include "shadow_cascades.h"
+#include "shadow_cache.h"
+#include "render_queue.h"
+#include "render_graph.h"
+#include "asset_streaming.h"
 #include <glad/glad.h>
+#include <unordered_map>
 
 typedef glm::vec2  vec2;
 typedef glm::vec3  vec3;
@@ -52,10 +66,56 @@ struct VertexShaderLayout
     std::vector<VertexShaderAttribute> attributes;
 };
 
-struct Vao
+
+// Uniforms the renderer sets by hand. Their locations are resolved once when the
+// program is loaded, and samplers get their texture unit assigned at that point too.
+enum UniformSlot
 {
-    GLuint handle;
-    GLuint programHandle;
+    UniformSlot_Texture,
+    UniformSlot_NormalMap,
+    UniformSlot_HeightMap,
+    UniformSlot_TextureAlb,
+    UniformSlot_TextureNorm,
+    UniformSlot_ShadowMap,
+    UniformSlot_ShadowMatrices,
+    UniformSlot_LightPos,
+    UniformSlot_FarPlane,
+    UniformSlot_DepthTexture,
+    UniformSlot_DepthPyramid,
+    UniformSlot_PrevViewProjection,
+    UniformSlot_ItemCount,
+    UniformSlot_DrawableCount,
+    UniformSlot_UseDepthPyramid,
+    UniformSlot_FaceMask,
+    UniformSlot_ShadowRects,
+    UniformSlot_DebugView,
+    UniformSlot_Count
+};
+
+// Texture units of the sampler slots
+enum TextureUnit
+{
+    TextureUnit_Albedo = 0,
+    TextureUnit_Normal = 1,
+    TextureUnit_Height = 2,
+    TextureUnit_Shadow = 3,
+    TextureUnit_Depth = 4,
+};
+
+struct ProgramUniform
+{
+    std::string name; // Without the [0] of arrays
+    GLint       location;
+    GLenum      type;
+    GLint       arraySize;
+};
+
+struct ProgramBlock
+{
+    std::string name;
+    GLint       binding;
+    GLint       dataSize;
+    bool        storage; // Shader storage block, otherwise uniform block
 };
 
 struct Program
@@ -65,27 +125,40 @@ struct Program
     std::string        programName;
     u64                lastWriteTimestamp; // What is this for?
     VertexShaderLayout vertexInputLayout;
+
+    std::vector<ProgramUniform> uniforms; // Default block uniforms
+    std::vector<ProgramBlock>   blocks;
+    GLint uniformSlots[UniformSlot_Count]; // Location, -1 if the program doesn't use it
+};
+
+enum OccluderShape
+{
+    OccluderShape_None,
+    OccluderShape_Mesh, // Its own triangles, for flat or low poly models
+    OccluderShape_Box   // Its bounding box, for models that fill it
 };
 
 struct Model {
     u32 meshIdx;
     std::vector<u32> materialIdx;
+    OccluderShape occluder; //drawn into the software occlusion buffer
 };
 
 struct Submesh {
     VertexBufferLayout vertexBufferLayout;
     std::vector<float> vertices;
     std::vector<u32> indices;
-    u32 vertexOffset;
-    u32 indexOffset;
+    u32 vertexFormatIdx;
+    u32 baseVertex; // In the vertex arena of the format
+    u32 firstIndex; // In app->indexArena
 
-    std::vector<Vao> vaos;
+    // Local space, computed at load time
+    Aabb aabb;
+    glm::vec4 boundingSphere; // Center and radius
 };
 
 struct Mesh {
     std::vector<Submesh> submeshes;
-    GLuint vertexBufferHandle;
-    GLuint indexBufferHandle;
 };
 
 struct Entity {
@@ -94,8 +167,10 @@ struct Entity {
     glm::vec3 rot;
     glm::vec3 scale;
     u32 modelIndex;
-    u32 localParamsOffset;
-    u32 localParamsSize;
+    u32 objectIndex; //slot in the objects buffer, assigned by Update()
+    u32 handle;      //stable id, assigned by AddEntity()
+    u32 treeLeaf;    //leaf of app->entityTree
+    u32 movedFrame;  //shadowCache.frame it last moved in
     std::string name;
 };
 
@@ -129,14 +204,24 @@ struct Light
     LightType type;
     glm::mat4 worldMatrix;
     u32 modelIndex;
-    u32 localParamsOffset;
-    u32 localParamsSize;
+    u32 objectIndex;
     u32 lightParamsOffset;
     u32 lightParamsSize;
     //for pointlights
     vec3 pos = vec3(0.0f);
+    //view projections of the shadow atlas tiles: one per cube face of point lights,
+    //one per cascade of directional lights (shadow_cascades.h)
+    glm::mat4 shadowMatrices[6] = {};
+    u32 shadowMatrixCount = 0;
+    f32 cascadeSplits[SHADOW_MAX_CASCADES] = {}; //view depth where each cascade ends
+    u32 instanceIdx = 0; //slot of the light volume in the instance buffer
 };
 
+#define BUFFER_RING_FRAMES 3 // Frames the CPU can write ahead of the GPU
+
+#define OBJECT_INDEX_LOCATION 5         // Vertex attribute with the object index, read from the instance buffer at the draw base instance
+#define MAX_OBJECTS           (1 << 20)
+
 struct Buffer
 {
     GLuint handle;
@@ -144,8 +229,29 @@ struct Buffer
     u32 size;
     u32 head;
     void* data; //mapped data
+    u32 mappedOffset; //offset of data inside the buffer
+
+    //ring buffers: one region per frame in flight, each protected by a fence
+    u32 regionSize;
+    u32 regionIdx;
+    bool persistent; //mapped once with glBufferStorage, otherwise remapped unsynchronized every frame
+    GLsync fences[BUFFER_RING_FRAMES];
 };
 
+// One VAO per distinct vertex buffer layout, shared by every submesh that uses it.
+// Submeshes of the same layout are packed in its vertex arena and all indices in
+// app->indexArena, both permanently attached to the VAO, so draws of a layout only
+// differ in firstIndex/baseVertex and go through glMultiDrawElementsIndirect.
+struct VertexFormat
+{
+    VertexBufferLayout layout;
+    GLuint vao;
+    Buffer vertexArena;
+};
+
+#define VERTEX_BUFFER_BINDING       0
+#define OBJECT_INDEX_BUFFER_BINDING 1
+
 enum Mode
 {
     Mode_TexturedQuad,
@@ -153,12 +259,32 @@ enum Mode
     Mode_Count
 };
 
+// Counters filled by Render() every frame. Used by the headless benchmark report.
+struct RenderStats
+{
+    u32 drawCalls;    // API calls, a multi-draw counts once
+    u32 drawCommands; // Draws inside the multi-draw calls
+    u32 instances;    // Instances drawn by those commands
+    u32 stateChanges; // GL calls the state cache actually issued
+};
+
+// Colour attachments of the G-buffer, the position is rebuilt from the depth attachment
+enum GBufferAttachment
+{
+    GBuffer_Light,   // R11G11B10F, the lighting passes add up into it
+    GBuffer_Albedo,  // RGBA8
+    GBuffer_Normals, // RG16, octahedral world normal
+    GBuffer_Count
+};
+
+// Screen outputs, GBufferDebug.glsl shows all of them but the shadow atlas
 enum AttachmentOutputs {
     SCENE,
     ALBEDO,
     NORMALS,
     DEPTH,
-    POSITION
+    POSITION,
+    SHADOW_ATLAS
 };
 
 struct App
@@ -202,6 +328,9 @@ struct App
     u32 pointLightIdx;
     u32 noFragmentIdx;
     u32 shadowCubemapIdx;
+    u32 shadowCubeFaceIdx;
+    u32 shadowCascadesIdx;
+    u32 clusteredLightingIdx;
     
     // texture indices
     u32 diceTexIdx;
@@ -213,13 +342,27 @@ struct App
     // Mode
     Mode mode;
 
+    RenderStats  stats;
+    GpuTimers    gpuTimers;
+    RenderQueue  renderQueue;
+
+    // Spatial index of the entities, leaves hold entity handles
+    AabbTree entityTree;
+    std::vector<u32> entityIndices;     // Handle -> index in entities, UINT32_MAX if free
+    std::vector<u32> freeEntityHandles;
+
+    OcclusionCuller occlusion;
+    GpuCulling gpuCulling;
+    LightClusters lightClusters;
+    ShadowAtlas shadowAtlas;
+    ShadowCache shadowCache;
+    GLStateCache glState;
+
     // Embedded geometry (in-editor simple meshes such as
     // a screen filling quad, a cube, a sphere...)
     GLuint embeddedVertices;
     GLuint embeddedElements;
 
-    // Location of the texture uniform in the textured quad shader
-    GLuint programUniformTexture;
     int uniformBlockAlignment;
     u32 cameraParamsOffset;
     u32 cameraParamsSize;
@@ -227,23 +370,43 @@ struct App
     u32 vpParamsSize;
     Buffer cbuffer;
 
+    // Per-object data: world matrices packed as 3x4 in a shader storage buffer,
+    // entities first and then the light volumes
+    int storageBlockAlignment;
+    u32 objectsCapacity;
+    u32 objectsParamsOffset;
+    u32 objectsParamsSize;
+    Buffer objectsBuffer;
+
+    // Object indices of the instances every draw covers, written per view after culling
+    u32 instancesCapacity;
+    Buffer instanceBuffer;
+    GLuint attachedInstanceBuffer; // instanceBuffer, or the GPU culling one
+
+    std::vector<VertexFormat> vertexFormats;
+    std::unordered_map<u64, u32> vertexFormatLookup; // Layout hash -> index in vertexFormats
+    Buffer indexArena;
+
+    // Lights and froxel light lists of the clustered lighting pass
+    Buffer clustersBuffer;
+
+    // Indirect draw commands of the render queue batches, rewritten every frame
+    u32 drawCommandsCapacity;
+    Buffer drawCommandsBuffer;
+
     glm::mat4 vpMatrix;
 
     // VAO object to link our screen filling quad with our textured quad shader
     GLuint vao;
 
+    // Passes of the frame, the G-buffer textures come from the render target pool
+    RenderGraph renderGraph;
+    RenderTargetPool renderTargets;
+
+    // Models and textures still loading show placeholders
+    AssetStreaming streaming;
     AttachmentOutputs currentAttachmentType = AttachmentOutputs::SCENE;
-    GLuint currentAttachmentTextureHandle = 0;
-    GLuint framebufferHandle = 0;
-    std::vector<GLuint> ColorAttachmentHandles;
-    GLuint depthAttachmentHandle = 0;
-
-    unsigned int shadowMapWidth = 2048;
-    unsigned int shadowMapHeight = 2048;
-    GLuint shadowFramebufferHandle = 0;
-    GLuint shadowDepthAttachmentHandle = 0;
-    GLuint shadowPointFramebufferHandle = 0;
-    GLuint shadowPointDepthAttachmentHandle = 0;
+    u32 gbufferDebugIdx;
 
     //Camera Settings
     glm::vec3 cameraPos = glm::vec3(1.2f, 7.550f, 7.550f);
@@ -254,6 +417,15 @@ struct App
     //Debugging
     bool useNormalMap = true;
     bool useRelifMap = true;
+    bool useOcclusionCulling = true;
+    bool useGpuCulling = false;
+    bool useClusteredLighting = true; // Otherwise one stencil volume and lighting pass per light
+    bool usePointShadowGS = false;    // Otherwise one draw per cube face, see SubmitShadowCasters()
+
+    //Directional shadows
+    u32 cascadeCount = 4;
+    f32 cascadeSplitLambda = 0.75f; // 0 uniform splits, 1 logarithmic
+    f32 shadowDistance = 150.f;
 };
 
 void Init(App* app);
@@ -264,6 +436,61 @@ void Update(App* app);
 
 void Render(App* app);
 
+/**
+ * Returns the vertex format matching the layout, creating its VAO the first time
+ * the layout is seen.
+ */
+u32 FindOrCreateVertexFormat(App* app, const VertexBufferLayout& layout);
+
+/**
+ * Copies the submesh vertices and indices to the shared arenas of its vertex format
+ * and fills vertexFormatIdx, baseVertex and firstIndex.
+ */
+void UploadSubmesh(App* app, Submesh& submesh);
+
+/**
+ * Points the object index attribute of every vertex format at an instance buffer,
+ * after it has been (re)created or when switching between CPU and GPU culling.
+ */
+void AttachInstanceBuffer(App* app, GLuint buffer);
+
+// Local AABB and bounding sphere of the submesh vertices
+void ComputeSubmeshBounds(Submesh& submesh);
+
+/**
+ * Adds an entity (world matrix and model set) to the scene and the entity tree.
+ * Returns its handle.
+ */
+u32 AddEntity(App* app, const Entity& entity);
+
+void RemoveEntity(App* app, u32 entityIdx);
+
+// Updates the entity tree after the world matrix of an entity changed
+void RefitEntity(App* app, u32 entityIdx);
+
+Aabb EntityWorldAabb(App* app, const Entity& entity);
+
+/**
+ * Logs every attribute the program reads that the submesh layout doesn't provide.
+ * Called at load time for the programs each model can be drawn with.
+ */
+bool ValidateVertexFormat(App* app, const Submesh& submesh, const Program& program, const char* modelName);
+
+// ValidateVertexFormat() of every submesh against the programs the model can be drawn with
+void ValidateModelVertexFormats(App* app, u32 modelIdx, const char* modelName);
+
+u32 LoadComputeProgram(App* app, const char* filepath, const char* programName);
+
+void SetUniform(const Program& program, UniformSlot slot, f32 value);
+void SetUniform(const Program& program, UniformSlot slot, u32 value);
+void SetUniform(const Program& program, UniformSlot slot, const glm::vec3& value);
+void SetUniform(const Program& program, UniformSlot slot, const glm::vec4* values, u32 count = 1);
+void SetUniform(const Program& program, UniformSlot slot, const glm::mat4* values, u32 count = 1);
+
+// Decodes an image file, flipped for GL. Thread safe.
+Image LoadImage(const char* filename);
+void FreeImage(Image image);
+GLuint CreateTexture2DFromImage(App* app, Image image);
 u32 LoadTexture2D(App* app, const char* filepath);
 glm::mat4 TransformScale(const glm::vec3& scaleFactors);
 glm::mat4 TransformPositionScale(const glm::vec3& pos, const glm::vec3& scaleFactor);
@@ -1,6 +1,7 @@
 #include "engine.h"
 #include <imgui.h>
 #include "engine_ui.h"
+#include "profiler.h"
 
 void InitializeDocking()
 {
@@ -40,31 +41,30 @@ void SelectFrameBufferTexture(App*app)
     case AttachmentOutputs::NORMALS: currentValue = (char*)"NORMALS"; break;
     case AttachmentOutputs::DEPTH: currentValue = (char*)"DEPTH"; break;
     case AttachmentOutputs::POSITION: currentValue = (char*)"POSITION"; break;
+    case AttachmentOutputs::SHADOW_ATLAS: currentValue = (char*)"SHADOW ATLAS"; break;
     default:
         break;
     }
     if (ImGui::BeginCombo("##Screen Output", currentValue, ImGuiComboFlags_PopupAlignLeft))
     {
         if (ImGui::Selectable("SCENE")) {
-            app->currentAttachmentTextureHandle = app->ColorAttachmentHandles[0];
             app->currentAttachmentType = AttachmentOutputs::SCENE;
         }
         if (ImGui::Selectable("ALBEDO")) {
-            app->currentAttachmentTextureHandle = app->ColorAttachmentHandles[1];
             app->currentAttachmentType = AttachmentOutputs::ALBEDO;
         }
         if (ImGui::Selectable("NORMALS")) {
-            app->currentAttachmentTextureHandle = app->ColorAttachmentHandles[2];
             app->currentAttachmentType = AttachmentOutputs::NORMALS;
         }
         if (ImGui::Selectable("DEPTH")) {
-            app->currentAttachmentTextureHandle = app->ColorAttachmentHandles[3];
             app->currentAttachmentType = AttachmentOutputs::DEPTH;
         }
         if (ImGui::Selectable("POSITION")) {
-            app->currentAttachmentTextureHandle = app->ColorAttachmentHandles[4];
             app->currentAttachmentType = AttachmentOutputs::POSITION;
         }
+        if (ImGui::Selectable("SHADOW ATLAS")) {
+            app->currentAttachmentType = AttachmentOutputs::SHADOW_ATLAS;
+        }
         ImGui::EndCombo();
     }
     ImGui::Separator();
@@ -103,7 +103,7 @@ void LightsSettings(App* app)
                 }
             }
             if (ImGui::Button("Add directional light"))
-                app->lights.push_back({ vec3(1,1,1), vec3(1,1,1), 0 , LightType::LightType_Directional, TransformScale(vec3(1.f)), app->sphereModelIdx, 0, 0, 0, 0 });
+                app->lights.push_back({ vec3(1,1,1), vec3(1,1,1), 0 , LightType::LightType_Directional, TransformScale(vec3(1.f)), app->sphereModelIdx, 0, 0, 0 });
             
             ImGui::TreePop();
         }
@@ -136,7 +136,7 @@ void LightsSettings(App* app)
             if (ImGui::Button("Add point light"))
             {
                 float radius = 15.f;
-                app->lights.push_back({ vec3(1.,1.,1.), GetAttenuationValuesFromRange(radius), radius , LightType::LightType_Point, TransformPositionScale(vec3(0.f, 1.f, 0.f), vec3(radius)), app->sphereModelIdx, 0, 0, 0, 0, glm::vec3(0,3,0) });
+                app->lights.push_back({ vec3(1.,1.,1.), GetAttenuationValuesFromRange(radius), radius , LightType::LightType_Point, TransformPositionScale(vec3(0.f, 1.f, 0.f), vec3(radius)), app->sphereModelIdx, 0, 0, 0, glm::vec3(0,3,0) });
             }
             ImGui::TreePop();
         }
@@ -161,7 +161,10 @@ void EntitiesSetings(App* app)
                 entity.name = buffer;
             glm::vec3 prevPos = entity.pos;
             if (ImGui::DragFloat3(("pos " + entity.name).c_str(), glm::value_ptr(entity.pos), 0.05f, 0.0f, 0.0f, "%.3f", NULL))
+            {
                 entity.worldMatrix = glm::translate(entity.worldMatrix, entity.pos - prevPos);
+                RefitEntity(app, i);
+            }
             glm::vec3 prevRot = entity.rot;
             if (ImGui::DragFloat3(("rot " + entity.name).c_str(), glm::value_ptr(entity.rot), 0.3f, -360.f, 360.0f, "%.3f", NULL))
             {
@@ -169,15 +172,17 @@ void EntitiesSetings(App* app)
                 entity.worldMatrix = glm::rotate(entity.worldMatrix, rotation.x, glm::vec3(1.f, 0.f, 0.f));
                 entity.worldMatrix = glm::rotate(entity.worldMatrix, rotation.y, glm::vec3(0.f, 1.f, 0.f));
                 entity.worldMatrix = glm::rotate(entity.worldMatrix, rotation.z, glm::vec3(0.f, 0.f, 1.f));
+                RefitEntity(app, i);
             }
             glm::vec3 prevScale = entity.scale;
             if (ImGui::DragFloat3(("scale " + entity.name).c_str(), glm::value_ptr(entity.scale), 0.02f, 0.0f, 0.0f, "%.3f", NULL))
             {
                 entity.worldMatrix = glm::scale(entity.worldMatrix, glm::vec3(1.f / prevScale));
                 entity.worldMatrix = glm::scale(entity.worldMatrix, entity.scale);
+                RefitEntity(app, i);
             }
             if (ImGui::Button(("Remove " + entity.name).c_str()))
-                app->entities.erase(app->entities.begin() + i);
+                RemoveEntity(app, i);
             ImGui::Separator();
         }
         if (ImGui::Button("Add Sphere"))
@@ -188,10 +193,8 @@ void EntitiesSetings(App* app)
             sphere.scale = vec3(1.f);
             sphere.worldMatrix = TransformPositionScale(sphere.pos, sphere.scale);
             sphere.modelIndex = app->sphereModelIdx;
-            sphere.localParamsOffset = 0;
-            sphere.localParamsSize = 0;
             sphere.name = "Sphere " + std::to_string(app->entities.size());
-            app->entities.push_back(sphere);
+            AddEntity(app, sphere);
         }
         if (ImGui::Button("Add Patrick"))
         {
@@ -201,10 +204,8 @@ void EntitiesSetings(App* app)
             patrick.scale = vec3(0.45f);
             patrick.worldMatrix = TransformPositionScale(patrick.pos, patrick.scale);
             patrick.modelIndex = app->patrickModelIdx;
-            patrick.localParamsOffset = 0;
-            patrick.localParamsSize = 0;
             patrick.name = "Patrick " + std::to_string(app->entities.size());
-            app->entities.push_back(patrick);
+            AddEntity(app, patrick);
         }
         if (ImGui::Button("Add Rock"))
         {
@@ -214,10 +215,8 @@ void EntitiesSetings(App* app)
             rock.scale = vec3(0.45f);
             rock.worldMatrix = TransformPositionScale(rock.pos, rock.scale);
             rock.modelIndex = app->rockModelIdx;
-            rock.localParamsOffset = 0;
-            rock.localParamsSize = 0;
             rock.name = "Rock " + std::to_string(app->entities.size());
-            app->entities.push_back(rock);
+            AddEntity(app, rock);
         }
         if (ImGui::Button("Add Plane"))
         {
@@ -227,12 +226,370 @@ void EntitiesSetings(App* app)
             plane.scale = vec3(1.f);
             plane.worldMatrix = TransformPositionScale(plane.pos, plane.scale);
             plane.modelIndex = app->wallModelIdx;
-            plane.localParamsOffset = 0;
-            plane.localParamsSize = 0;
             plane.name = "Plane " + std::to_string(app->entities.size());
-            app->entities.push_back(plane);
+            AddEntity(app, plane);
+        }
+        ImGui::TreePop();
+    }
+    ImGui::Separator();
+}
+
+static ImU32 ProfileZoneColor(const char* name)
+{
+    // Stable color per zone name
+    u32 hash = 2166136261u;
+    for (const char* c = name; *c; ++c)
+        hash = (hash ^ (u8)*c) * 16777619u;
+    return ImColor::HSV((hash % 360) / 360.0f, 0.55f, 0.75f);
+}
+
+void ProfilerSettings(App* app)
+{
+    if (!ImGui::TreeNodeEx("CPU Profiler", ImGuiTreeNodeFlags_DefaultOpen))
+    {
+        ImGui::Separator();
+        return;
+    }
+
+    static ProfilerFrame frames[PROFILER_MAX_FRAMES];
+    static float frameTimes[PROFILER_MAX_FRAMES];
+    static std::vector<ProfileZoneView> zones;
+    static int selectedFrame = 0;
+    static int exportFrameCount = 60;
+    static char exportStatus[128] = "";
+
+    const u32 frameCount = ProfilerGetFrames(frames, PROFILER_MAX_FRAMES);
+    if (frameCount == 0)
+    {
+        ImGui::Text("No frames recorded yet");
+        ImGui::TreePop();
+        ImGui::Separator();
+        return;
+    }
+
+    u32 worstFrame = 0;
+    for (u32 i = 0; i < frameCount; ++i)
+    {
+        frameTimes[i] = (float)ProfilerTicksToMs(frames[i].end - frames[i].start);
+        if (frameTimes[i] > frameTimes[worstFrame])
+            worstFrame = i;
+    }
+
+    bool paused = ProfilerIsPaused();
+    if (ImGui::Checkbox("Pause", &paused))
+        ProfilerSetPaused(paused);
+    ImGui::SameLine();
+    if (ImGui::Button("Select worst frame"))
+    {
+        ProfilerSetPaused(paused = true);
+        selectedFrame = worstFrame;
+    }
+
+    // Frame history, click a bar to inspect that frame
+    ImGui::PlotHistogram("##Frame times", frameTimes, frameCount, 0, "Frame times (ms)", 0.0f, FLT_MAX, ImVec2(ImGui::GetContentRegionAvail().x, 60.0f));
+    if (ImGui::IsItemHovered() && ImGui::IsMouseClicked(ImGuiMouseButton_Left))
+    {
+        float t = (ImGui::GetIO().MousePos.x - ImGui::GetItemRectMin().x) / ImGui::GetItemRectSize().x;
+        selectedFrame = glm::clamp((int)(t * frameCount), 0, (int)frameCount - 1);
+        ProfilerSetPaused(paused = true);
+    }
+
+    if (paused)
+        ImGui::SliderInt("Frame", &selectedFrame, 0, frameCount - 1);
+    else
+        selectedFrame = frameCount - 1;
+    selectedFrame = glm::clamp(selectedFrame, 0, (int)frameCount - 1);
+
+    const ProfilerFrame& frame = frames[selectedFrame];
+    const f64 frameMs = ProfilerTicksToMs(frame.end - frame.start);
+    ImGui::Text("Frame %u: %.3f ms", frame.index, frameMs);
+
+    // Flame graph: one band per thread, one row per nesting level
+    ProfilerGetFrameZones(frame.index, zones);
+
+    ImDrawList* drawList = ImGui::GetWindowDrawList();
+    const ImVec2 origin = ImGui::GetCursorScreenPos();
+    const float width = ImGui::GetContentRegionAvail().x;
+    const float rowHeight = ImGui::GetTextLineHeight() + 4.0f;
+    const f64 frameTicks = (f64)(frame.end - frame.start);
+    const ImVec2 mousePos = ImGui::GetIO().MousePos;
+
+    float bandY = origin.y;
+    size_t zoneIdx = 0;
+    while (zoneIdx < zones.size())
+    {
+        const u32 threadIdx = zones[zoneIdx].threadIdx;
+        drawList->AddText(ImVec2(origin.x, bandY), ImGui::GetColorU32(ImGuiCol_TextDisabled), ProfilerGetThreadName(threadIdx));
+        bandY += rowHeight;
+
+        u32 maxDepth = 0;
+        for (; zoneIdx < zones.size() && zones[zoneIdx].threadIdx == threadIdx; ++zoneIdx)
+        {
+            const ProfileZone& zone = zones[zoneIdx].zone;
+            maxDepth = glm::max(maxDepth, zone.depth);
+
+            f64 start = zone.start > frame.start ? (f64)(zone.start - frame.start) : 0.0;
+            f64 end = zone.end > frame.start ? (f64)(zone.end - frame.start) : 0.0;
+            float x0 = origin.x + (float)glm::min(start / frameTicks, 1.0) * width;
+            float x1 = origin.x + (float)glm::min(end / frameTicks, 1.0) * width;
+            x1 = glm::max(x1, x0 + 1.0f);
+            float y0 = bandY + zone.depth * rowHeight;
+            float y1 = y0 + rowHeight - 1.0f;
+
+            drawList->AddRectFilled(ImVec2(x0, y0), ImVec2(x1, y1), ProfileZoneColor(zone.name));
+            if (x1 - x0 > 20.0f)
+            {
+                drawList->PushClipRect(ImVec2(x0, y0), ImVec2(x1, y1), true);
+                drawList->AddText(ImVec2(x0 + 2.0f, y0 + 2.0f), IM_COL32_WHITE, zone.name);
+                drawList->PopClipRect();
+            }
+
+            if (mousePos.x >= x0 && mousePos.x < x1 && mousePos.y >= y0 && mousePos.y < y1 && ImGui::IsWindowHovered())
+                ImGui::SetTooltip("%s\n%.3f ms", zone.name, ProfilerTicksToMs(zone.end - zone.start));
         }
+        bandY += (maxDepth + 1) * rowHeight + 4.0f;
+    }
+    ImGui::Dummy(ImVec2(width, bandY - origin.y));
+
+    ImGui::InputInt("Frames to dump", &exportFrameCount);
+    exportFrameCount = glm::clamp(exportFrameCount, 1, PROFILER_MAX_FRAMES);
+    if (ImGui::Button("Export Chrome trace"))
+    {
+        const char* filepath = "profile_trace.json";
+        if (ProfilerExportChromeTrace(filepath, exportFrameCount))
+            snprintf(exportStatus, sizeof(exportStatus), "Saved %d frames to %s", exportFrameCount, filepath);
+        else
+            snprintf(exportStatus, sizeof(exportStatus), "Export failed");
+    }
+    if (exportStatus[0])
+        ImGui::Text("%s", exportStatus);
+
+    ImGui::TreePop();
+    ImGui::Separator();
+}
+
+void GpuTimersSettings(App* app)
+{
+    if (!ImGui::TreeNodeEx("GPU Passes", ImGuiTreeNodeFlags_DefaultOpen))
+    {
+        ImGui::Separator();
+        return;
+    }
+
+    const GpuTimers& timers = app->gpuTimers;
+    if (timers.resolved.empty())
+    {
+        ImGui::Text("No GPU frames resolved yet");
         ImGui::TreePop();
+        ImGui::Separator();
+        return;
+    }
+
+    // CPU column comes from the last completed profiler frame, zones with the same name are added up
+    static std::vector<ProfileZoneView> zones;
+    ProfilerFrame lastFrame;
+    if (ProfilerGetFrames(&lastFrame, 1) == 1)
+        ProfilerGetFrameZones(lastFrame.index, zones);
+    else
+        zones.clear();
+
+    ImGui::Text("Frame %u, %u frames dropped (results not ready in time)", timers.resolvedFrameIndex, timers.droppedFrames);
+    if (timers.droppedPasses > 0)
+        ImGui::Text("%u passes not timed (more than %d names)", timers.droppedPasses, GPU_TIMER_MAX_PASSES);
+    if (ImGui::BeginTable("##GPU passes", 4, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
+    {
+        ImGui::TableSetupColumn("Pass");
+        ImGui::TableSetupColumn("GPU ms");
+        ImGui::TableSetupColumn("GPU avg ms");
+        ImGui::TableSetupColumn("CPU ms");
+        ImGui::TableHeadersRow();
+
+        for (const GpuTimerResult& result : timers.resolved)
+        {
+            const GpuTimerPass& pass = timers.passes[result.passIdx];
+
+            f64 cpuMs = 0.0;
+            bool cpuFound = false;
+            for (const ProfileZoneView& view : zones)
+            {
+                if (pass.name == view.zone.name)
+                {
+                    cpuMs += ProfilerTicksToMs(view.zone.end - view.zone.start);
+                    cpuFound = true;
+                }
+            }
+
+            ImGui::TableNextRow();
+            ImGui::TableSetColumnIndex(0);
+            ImGui::Text("%*s%s", result.depth * 2, "", pass.name.c_str());
+            ImGui::TableSetColumnIndex(1);
+            ImGui::Text("%.3f", result.ms);
+            ImGui::TableSetColumnIndex(2);
+            ImGui::Text("%.3f", pass.averageMs);
+            ImGui::TableSetColumnIndex(3);
+            if (cpuFound)
+                ImGui::Text("%.3f", cpuMs);
+            else
+                ImGui::TextDisabled("-");
+        }
+        ImGui::EndTable();
+    }
+
+    ImGui::TreePop();
+    ImGui::Separator();
+}
+
+void GLStateSettings(App* app)
+{
+    if (!ImGui::TreeNodeEx("GL State", ImGuiTreeNodeFlags_DefaultOpen))
+    {
+        ImGui::Separator();
+        return;
+    }
+
+    const GLStateCounters& counters = app->glState.lastFrame;
+    ImGui::Text("Last frame: %u calls issued, %u elided", GLStateIssuedCount(counters), GLStateElidedCount(counters));
+    if (ImGui::BeginTable("##GL state", 3, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
+    {
+        ImGui::TableSetupColumn("Category");
+        ImGui::TableSetupColumn("Issued");
+        ImGui::TableSetupColumn("Elided");
+        ImGui::TableHeadersRow();
+
+        for (u32 i = 0; i < GLStateCategory_Count; ++i)
+        {
+            ImGui::TableNextRow();
+            ImGui::TableSetColumnIndex(0);
+            ImGui::Text("%s", GLStateCategoryName((GLStateCategory)i));
+            ImGui::TableSetColumnIndex(1);
+            ImGui::Text("%u", counters.issued[i]);
+            ImGui::TableSetColumnIndex(2);
+            ImGui::Text("%u", counters.elided[i]);
+        }
+        ImGui::EndTable();
+    }
+
+    ImGui::TreePop();
+    ImGui::Separator();
+}
+
+void CullingSettings(App* app)
+{
+    if (!ImGui::TreeNodeEx("Culling", ImGuiTreeNodeFlags_DefaultOpen))
+    {
+        ImGui::Separator();
+        return;
+    }
+
+    static const char* passNames[RenderPass_Count] = { "Geometry", "Directional shadows", "Point shadows" };
+
+    const RenderQueue& queue = app->renderQueue;
+    ImGui::Text("%u submesh instances, %u views", queue.itemCount, (u32)queue.views.size());
+    const AabbTree& tree = app->entityTree;
+    ImGui::Text("Entity tree: %u leaves, height %d", tree.leafCount, tree.root == AABB_TREE_NULL ? 0 : tree.nodes[tree.root].height);
+    const OcclusionCuller& occlusion = app->occlusion;
+    ImGui::Text("Occlusion: %u occluders (%u triangles), %u of %u entities hidden, %u submeshes",
+                occlusion.occluderCount, (u32)occlusion.triangles.size(),
+                occlusion.occludedCount, occlusion.testedCount, queue.occludedCount);
+    if (app->useGpuCulling)
+        ImGui::TextDisabled("GPU culling: counts stay on the GPU, not read back");
+    if (ImGui::BeginTable("##Culling", 3, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
+    {
+        ImGui::TableSetupColumn("Pass");
+        ImGui::TableSetupColumn("Drawn");
+        ImGui::TableSetupColumn("Culled");
+        ImGui::TableHeadersRow();
+
+        for (u32 i = 0; i < RenderPass_Count; ++i)
+        {
+            ImGui::TableNextRow();
+            ImGui::TableSetColumnIndex(0);
+            ImGui::Text("%s", passNames[i]);
+            ImGui::TableSetColumnIndex(1);
+            ImGui::Text("%u", queue.passDrawn[i]);
+            ImGui::TableSetColumnIndex(2);
+            ImGui::Text("%u", queue.passCulled[i]);
+        }
+        ImGui::EndTable();
     }
+
+    ImGui::TreePop();
     ImGui::Separator();
-}
\ No newline at end of file
+}
+
+static const char* RenderTargetFormatName(GLenum internalFormat)
+{
+    switch (internalFormat)
+    {
+    case GL_R11F_G11F_B10F:   return "R11G11B10F";
+    case GL_RGBA8:            return "RGBA8";
+    case GL_RG16:             return "RG16";
+    case GL_RGBA16F:          return "RGBA16F";
+    case GL_R32F:             return "R32F";
+    case GL_DEPTH24_STENCIL8: return "D24S8";
+    default:                  return "Other";
+    }
+}
+
+void RenderTargetSettings(App* app)
+{
+    if (!ImGui::TreeNodeEx("Render Targets", ImGuiTreeNodeFlags_DefaultOpen))
+    {
+        ImGui::Separator();
+        return;
+    }
+
+    const f64 megabyte = 1024.0 * 1024.0;
+    const RenderTargetPool& pool = app->renderTargets;
+    ImGui::Text("%u targets, %.1f MB allocated, %.1f MB used last frame", (u32)pool.targets.size(), pool.allocatedBytes / megabyte, pool.usedBytes / megabyte);
+    ImGui::Text("%u textures created, %u released, %u framebuffers", pool.allocationCount, pool.releaseCount, (u32)pool.framebuffers.size());
+    if (ImGui::BeginTable("##Render targets", 4, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
+    {
+        ImGui::TableSetupColumn("Format");
+        ImGui::TableSetupColumn("Size");
+        ImGui::TableSetupColumn("MB");
+        ImGui::TableSetupColumn("Unused frames");
+        ImGui::TableHeadersRow();
+
+        for (const RenderTarget& target : pool.targets)
+        {
+            ImGui::TableNextRow();
+            ImGui::TableSetColumnIndex(0);
+            ImGui::Text("%s", RenderTargetFormatName(target.desc.internalFormat));
+            ImGui::TableSetColumnIndex(1);
+            if (target.desc.samples > 1)
+                ImGui::Text("%dx%d x%u", target.desc.size.x, target.desc.size.y, target.desc.samples);
+            else
+                ImGui::Text("%dx%d", target.desc.size.x, target.desc.size.y);
+            ImGui::TableSetColumnIndex(2);
+            ImGui::Text("%.1f", target.bytes / megabyte);
+            ImGui::TableSetColumnIndex(3);
+            ImGui::Text("%u", pool.frame - 1 - target.lastUsedFrame);
+        }
+        ImGui::EndTable();
+    }
+
+    ImGui::TreePop();
+    ImGui::Separator();
+}
+
+void StreamingSettings(App* app)
+{
+    if (!ImGui::TreeNodeEx("Streaming", ImGuiTreeNodeFlags_DefaultOpen))
+    {
+        ImGui::Separator();
+        return;
+    }
+
+    const f64 megabyte = 1024.0 * 1024.0;
+    AssetStreaming& streaming = app->streaming;
+    ImGui::Text("%u pending, %u loaded, %u failed", streaming.pending, streaming.loadedCount, streaming.failedCount);
+    ImGui::Text("%.1f MB uploaded last frame", streaming.uploadedBytes / megabyte);
+
+    int budgetMegabytes = (int)(streaming.budgetBytes >> 20);
+    if (ImGui::SliderInt("Upload budget (MB)", &budgetMegabytes, 1, 64))
+        streaming.budgetBytes = (u32)budgetMegabytes << 20;
+
+    ImGui::TreePop();
+    ImGui::Separator();
+}
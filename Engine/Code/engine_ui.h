@@ -6,4 +6,10 @@ void InitializeDocking();
 void SelectFrameBufferTexture(App* app);
 void CameraSettings(App* app);
 void LightsSettings(App* app);
-void EntitiesSetings(App* app);
\ No newline at end of file
+void EntitiesSetings(App* app);
+void ProfilerSettings(App* app);
+void GpuTimersSettings(App* app);
+void GLStateSettings(App* app);
+void CullingSettings(App* app);
+void RenderTargetSettings(App* app);
+void StreamingSettings(App* app);
@@ -0,0 +1,316 @@
+#include "gl_state.h"
+
+static const char* CategoryNames[GLStateCategory_Count] =
+{
+    "Program",
+    "Vertex array",
+    "Framebuffer",
+    "Texture",
+    "Buffer range",
+    "Enable/Disable",
+    "Depth/Stencil",
+    "Blend",
+    "Rasterizer",
+};
+
+const char* GLStateCategoryName(GLStateCategory category)
+{
+    return CategoryNames[category];
+}
+
+void GLStateInvalidate(GLStateCache& cache)
+{
+    memset(&cache.values, 0xff, sizeof(cache.values));
+}
+
+void GLStateBeginFrame(GLStateCache& cache)
+{
+    cache.lastFrame = cache.counters;
+    memset(&cache.counters, 0, sizeof(cache.counters));
+    GLStateInvalidate(cache);
+}
+
+u32 GLStateIssuedCount(const GLStateCounters& counters)
+{
+    u32 count = 0;
+    for (u32 i = 0; i < GLStateCategory_Count; ++i)
+        count += counters.issued[i];
+    return count;
+}
+
+u32 GLStateElidedCount(const GLStateCounters& counters)
+{
+    u32 count = 0;
+    for (u32 i = 0; i < GLStateCategory_Count; ++i)
+        count += counters.elided[i];
+    return count;
+}
+
+// Stores the new value and returns true if the call has to be issued
+template <typename T>
+static bool Update(GLStateCache& cache, GLStateCategory category, T& cached, const T& value)
+{
+    if (cached == value)
+    {
+        cache.counters.elided[category]++;
+        return false;
+    }
+    cached = value;
+    cache.counters.issued[category]++;
+    return true;
+}
+
+static void Issue(GLStateCache& cache, GLStateCategory category)
+{
+    cache.counters.issued[category]++;
+}
+
+static void Elide(GLStateCache& cache, GLStateCategory category)
+{
+    cache.counters.elided[category]++;
+}
+
+void GLStateUseProgram(GLStateCache& cache, GLuint program)
+{
+    if (Update(cache, GLStateCategory_Program, cache.values.program, program))
+        glUseProgram(program);
+}
+
+void GLStateBindVertexArray(GLStateCache& cache, GLuint vertexArray)
+{
+    if (Update(cache, GLStateCategory_VertexArray, cache.values.vertexArray, vertexArray))
+        glBindVertexArray(vertexArray);
+}
+
+void GLStateBindFramebuffer(GLStateCache& cache, GLuint framebuffer)
+{
+    if (Update(cache, GLStateCategory_Framebuffer, cache.values.framebuffer, framebuffer))
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        cache.values.drawBufferCount = -1;
+    }
+}
+
+void GLStateBindTexture(GLStateCache& cache, u32 unit, GLenum target, GLuint texture)
+{
+    ASSERT(unit < GL_STATE_MAX_TEXTURE_UNITS, "Texture unit out of range");
+    GLuint* cached = NULL;
+    switch (target)
+    {
+    case GL_TEXTURE_2D:             cached = &cache.values.textures2D[unit]; break;
+    case GL_TEXTURE_CUBE_MAP:       cached = &cache.values.texturesCube[unit]; break;
+    case GL_TEXTURE_2D_ARRAY:       cached = &cache.values.textures2DArray[unit]; break;
+    case GL_TEXTURE_CUBE_MAP_ARRAY: cached = &cache.values.texturesCubeArray[unit]; break;
+    default: ASSERT(false, "Texture target not tracked by the state cache"); return;
+    }
+    if (!Update(cache, GLStateCategory_Texture, *cached, texture))
+        return;
+
+    // The active unit is only switched when something is actually bound
+    const GLenum activeTexture = GL_TEXTURE0 + unit;
+    if (cache.values.activeTexture != activeTexture)
+    {
+        glActiveTexture(activeTexture);
+        cache.values.activeTexture = activeTexture;
+    }
+    glBindTexture(target, texture);
+}
+
+void GLStateBindIndirectBuffer(GLStateCache& cache, GLuint buffer)
+{
+    if (Update(cache, GLStateCategory_Buffer, cache.values.indirectBuffer, buffer))
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer);
+}
+
+void GLStateBindBufferRange(GLStateCache& cache, GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+    ASSERT(index < GL_STATE_MAX_BUFFER_BINDINGS, "Buffer binding index out of range");
+    ASSERT(target == GL_UNIFORM_BUFFER || target == GL_SHADER_STORAGE_BUFFER, "Buffer target not tracked by the state cache");
+
+    GLBufferRange& cached = target == GL_UNIFORM_BUFFER ? cache.values.uniformBuffers[index] : cache.values.storageBuffers[index];
+    if (cached.buffer == buffer && cached.offset == offset && cached.size == size)
+    {
+        Elide(cache, GLStateCategory_Buffer);
+        return;
+    }
+    cached = { buffer, offset, size };
+    Issue(cache, GLStateCategory_Buffer);
+    glBindBufferRange(target, index, buffer, offset, size);
+}
+
+static GLCapability FindCapability(GLenum capability)
+{
+    switch (capability)
+    {
+        case GL_DEPTH_TEST:   return GLCapability_DepthTest;
+        case GL_STENCIL_TEST: return GLCapability_StencilTest;
+        case GL_BLEND:        return GLCapability_Blend;
+        case GL_CULL_FACE:    return GLCapability_CullFace;
+        default:              return GLCapability_Count;
+    }
+}
+
+static void SetCapability(GLStateCache& cache, GLenum capability, u8 enabled)
+{
+    GLCapability cap = FindCapability(capability);
+    if (cap == GLCapability_Count)
+        Issue(cache, GLStateCategory_Capability); // Not tracked, always issued
+    else if (!Update(cache, GLStateCategory_Capability, cache.values.capabilities[cap], enabled))
+        return;
+
+    if (enabled)
+        glEnable(capability);
+    else
+        glDisable(capability);
+}
+
+void GLStateEnable(GLStateCache& cache, GLenum capability)
+{
+    SetCapability(cache, capability, 1);
+}
+
+void GLStateDisable(GLStateCache& cache, GLenum capability)
+{
+    SetCapability(cache, capability, 0);
+}
+
+void GLStateDepthMask(GLStateCache& cache, GLboolean mask)
+{
+    if (Update(cache, GLStateCategory_DepthStencil, cache.values.depthMask, (u8)(mask ? 1 : 0)))
+        glDepthMask(mask);
+}
+
+void GLStateStencilMask(GLStateCache& cache, GLuint mask)
+{
+    if (Update(cache, GLStateCategory_DepthStencil, cache.values.stencilMask, mask))
+        glStencilMask(mask);
+}
+
+void GLStateStencilFunc(GLStateCache& cache, GLenum func, GLint ref, GLuint mask)
+{
+    GLStateValues& values = cache.values;
+    if (values.stencilFunc == func && values.stencilRef == ref && values.stencilFuncMask == mask)
+    {
+        Elide(cache, GLStateCategory_DepthStencil);
+        return;
+    }
+    values.stencilFunc = func;
+    values.stencilRef = ref;
+    values.stencilFuncMask = mask;
+    Issue(cache, GLStateCategory_DepthStencil);
+    glStencilFunc(func, ref, mask);
+}
+
+void GLStateStencilOpSeparate(GLStateCache& cache, GLenum face, GLenum sfail, GLenum dpfail, GLenum dppass)
+{
+    const bool front = face == GL_FRONT || face == GL_FRONT_AND_BACK;
+    const bool back = face == GL_BACK || face == GL_FRONT_AND_BACK;
+
+    GLenum (&ops)[2][3] = cache.values.stencilOps;
+    const bool frontSet = !front || (ops[0][0] == sfail && ops[0][1] == dpfail && ops[0][2] == dppass);
+    const bool backSet = !back || (ops[1][0] == sfail && ops[1][1] == dpfail && ops[1][2] == dppass);
+    if (frontSet && backSet)
+    {
+        Elide(cache, GLStateCategory_DepthStencil);
+        return;
+    }
+
+    for (u32 i = 0; i < 2; ++i)
+    {
+        if ((i == 0 && front) || (i == 1 && back))
+        {
+            ops[i][0] = sfail;
+            ops[i][1] = dpfail;
+            ops[i][2] = dppass;
+        }
+    }
+    Issue(cache, GLStateCategory_DepthStencil);
+    glStencilOpSeparate(face, sfail, dpfail, dppass);
+}
+
+void GLStateBlendEquation(GLStateCache& cache, GLenum mode)
+{
+    if (Update(cache, GLStateCategory_Blend, cache.values.blendEquation, mode))
+        glBlendEquation(mode);
+}
+
+void GLStateBlendFunc(GLStateCache& cache, GLenum src, GLenum dst)
+{
+    if (cache.values.blendSrc == src && cache.values.blendDst == dst)
+    {
+        Elide(cache, GLStateCategory_Blend);
+        return;
+    }
+    cache.values.blendSrc = src;
+    cache.values.blendDst = dst;
+    Issue(cache, GLStateCategory_Blend);
+    glBlendFunc(src, dst);
+}
+
+void GLStateCullFace(GLStateCache& cache, GLenum mode)
+{
+    if (Update(cache, GLStateCategory_Rasterizer, cache.values.cullFace, mode))
+        glCullFace(mode);
+}
+
+void GLStateViewport(GLStateCache& cache, GLint x, GLint y, GLsizei width, GLsizei height)
+{
+    GLint (&viewport)[4] = cache.values.viewport;
+    if (viewport[0] == x && viewport[1] == y && viewport[2] == width && viewport[3] == height)
+    {
+        Elide(cache, GLStateCategory_Rasterizer);
+        return;
+    }
+    viewport[0] = x;
+    viewport[1] = y;
+    viewport[2] = width;
+    viewport[3] = height;
+    Issue(cache, GLStateCategory_Rasterizer);
+    glViewport(x, y, width, height);
+}
+
+// Returns true if the draw buffers differ from the cached ones, and caches them
+static bool UpdateDrawBuffers(GLStateCache& cache, GLsizei count, const GLenum* buffers)
+{
+    ASSERT(count > 0 && count <= GL_STATE_MAX_DRAW_BUFFERS, "Too many draw buffers");
+
+    GLStateValues& values = cache.values;
+    if (values.drawBufferCount == count && memcmp(values.drawBuffers, buffers, count * sizeof(GLenum)) == 0)
+    {
+        Elide(cache, GLStateCategory_Rasterizer);
+        return false;
+    }
+    values.drawBufferCount = count;
+    memcpy(values.drawBuffers, buffers, count * sizeof(GLenum));
+    Issue(cache, GLStateCategory_Rasterizer);
+    return true;
+}
+
+void GLStateDrawBuffer(GLStateCache& cache, GLenum buffer)
+{
+    // Not glDrawBuffers(1, ...), it doesn't accept GL_BACK for the default framebuffer
+    if (UpdateDrawBuffers(cache, 1, &buffer))
+        glDrawBuffer(buffer);
+}
+
+void GLStateDrawBuffers(GLStateCache& cache, GLsizei count, const GLenum* buffers)
+{
+    if (UpdateDrawBuffers(cache, count, buffers))
+        glDrawBuffers(count, buffers);
+}
+
+void GLStateClearColor(GLStateCache& cache, f32 r, f32 g, f32 b, f32 a)
+{
+    f32 (&color)[4] = cache.values.clearColor;
+    if (color[0] == r && color[1] == g && color[2] == b && color[3] == a)
+    {
+        Elide(cache, GLStateCategory_Rasterizer);
+        return;
+    }
+    color[0] = r;
+    color[1] = g;
+    color[2] = b;
+    color[3] = a;
+    Issue(cache, GLStateCategory_Rasterizer);
+    glClearColor(r, g, b, a);
+}
@@ -0,0 +1,129 @@
+//
+// gl_state.h: Shadow copy of the GL state the renderer touches. Every state change
+// in the frame goes through these functions, which drop the calls that would set
+// a value that is already set and count issued/elided calls per category.
+//
+// Code that changes GL state behind the cache's back (resource creation, ImGui...)
+// has to run outside Render() or call GLStateInvalidate() afterwards.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <glad/glad.h>
+
+#define GL_STATE_MAX_TEXTURE_UNITS    16
+#define GL_STATE_MAX_BUFFER_BINDINGS  16
+#define GL_STATE_MAX_DRAW_BUFFERS     8
+
+enum GLStateCategory
+{
+    GLStateCategory_Program,
+    GLStateCategory_VertexArray,
+    GLStateCategory_Framebuffer,
+    GLStateCategory_Texture,
+    GLStateCategory_Buffer,
+    GLStateCategory_Capability,   // glEnable/glDisable
+    GLStateCategory_DepthStencil,
+    GLStateCategory_Blend,
+    GLStateCategory_Rasterizer,   // Viewport, cull face, draw buffers, clear color
+    GLStateCategory_Count
+};
+
+enum GLCapability
+{
+    GLCapability_DepthTest,
+    GLCapability_StencilTest,
+    GLCapability_Blend,
+    GLCapability_CullFace,
+    GLCapability_Count
+};
+
+struct GLStateCounters
+{
+    u32 issued[GLStateCategory_Count];
+    u32 elided[GLStateCategory_Count];
+};
+
+struct GLBufferRange
+{
+    GLuint     buffer;
+    GLintptr   offset;
+    GLsizeiptr size;
+};
+
+// Cached values. Invalidating fills it with 0xff bytes, a value no call uses
+// (and NaN for floats), so the next call of each kind is always issued.
+struct GLStateValues
+{
+    GLuint        program;
+    GLuint        vertexArray;
+    GLuint        framebuffer;
+    GLenum        activeTexture;
+    GLuint        textures2D[GL_STATE_MAX_TEXTURE_UNITS];
+    GLuint        texturesCube[GL_STATE_MAX_TEXTURE_UNITS];
+    GLuint        textures2DArray[GL_STATE_MAX_TEXTURE_UNITS];
+    GLuint        texturesCubeArray[GL_STATE_MAX_TEXTURE_UNITS];
+    GLuint        indirectBuffer;
+    GLBufferRange uniformBuffers[GL_STATE_MAX_BUFFER_BINDINGS];
+    GLBufferRange storageBuffers[GL_STATE_MAX_BUFFER_BINDINGS];
+    u8            capabilities[GLCapability_Count];
+    u8            depthMask;
+    GLuint        stencilMask;
+    GLenum        stencilFunc;
+    GLint         stencilRef;
+    GLuint        stencilFuncMask;
+    GLenum        stencilOps[2][3]; // Front/back: sfail, dpfail, dppass
+    GLenum        blendEquation;
+    GLenum        blendSrc;
+    GLenum        blendDst;
+    GLenum        cullFace;
+    GLint         viewport[4];
+    GLsizei       drawBufferCount; // Draw buffers belong to the framebuffer, forgotten when it changes
+    GLenum        drawBuffers[GL_STATE_MAX_DRAW_BUFFERS];
+    f32           clearColor[4];
+};
+
+struct GLStateCache
+{
+    GLStateValues   values;
+    GLStateCounters counters;  // Current frame
+    GLStateCounters lastFrame; // Last completed frame, shown in the Info window
+};
+
+const char* GLStateCategoryName(GLStateCategory category);
+
+void GLStateInvalidate(GLStateCache& cache);
+
+/**
+ * Forgets the cached values (other code may have changed the state since the last
+ * frame, ImGui for instance) and starts counting a new frame.
+ */
+void GLStateBeginFrame(GLStateCache& cache);
+
+u32 GLStateIssuedCount(const GLStateCounters& counters);
+u32 GLStateElidedCount(const GLStateCounters& counters);
+
+void GLStateUseProgram(GLStateCache& cache, GLuint program);
+void GLStateBindVertexArray(GLStateCache& cache, GLuint vertexArray);
+void GLStateBindFramebuffer(GLStateCache& cache, GLuint framebuffer);
+void GLStateBindTexture(GLStateCache& cache, u32 unit, GLenum target, GLuint texture);
+void GLStateBindIndirectBuffer(GLStateCache& cache, GLuint buffer);
+void GLStateBindBufferRange(GLStateCache& cache, GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+
+void GLStateEnable(GLStateCache& cache, GLenum capability);
+void GLStateDisable(GLStateCache& cache, GLenum capability);
+
+void GLStateDepthMask(GLStateCache& cache, GLboolean mask);
+void GLStateStencilMask(GLStateCache& cache, GLuint mask);
+void GLStateStencilFunc(GLStateCache& cache, GLenum func, GLint ref, GLuint mask);
+void GLStateStencilOpSeparate(GLStateCache& cache, GLenum face, GLenum sfail, GLenum dpfail, GLenum dppass);
+
+void GLStateBlendEquation(GLStateCache& cache, GLenum mode);
+void GLStateBlendFunc(GLStateCache& cache, GLenum src, GLenum dst);
+
+void GLStateCullFace(GLStateCache& cache, GLenum mode);
+void GLStateViewport(GLStateCache& cache, GLint x, GLint y, GLsizei width, GLsizei height);
+void GLStateDrawBuffer(GLStateCache& cache, GLenum buffer);
+void GLStateDrawBuffers(GLStateCache& cache, GLsizei count, const GLenum* buffers);
+void GLStateClearColor(GLStateCache& cache, f32 r, f32 g, f32 b, f32 a);
@@ -0,0 +1,200 @@
+#include "gpu_culling.h"
+#include "engine.h"
+#include "profiler.h"
+
+void InitGpuCulling(App* app)
+{
+    GpuCulling& gpu = app->gpuCulling;
+    glGenBuffers(1, &gpu.itemsBuffer);
+    glGenBuffers(1, &gpu.viewsBuffer);
+    glGenBuffers(1, &gpu.lookupBuffer);
+    glGenBuffers(1, &gpu.instanceBuffer);
+    gpu.itemsCapacity = 0;
+    gpu.instancesCapacity = 0;
+    gpu.itemsRevision = UINT32_MAX;
+
+    gpu.depthPyramid = 0;
+    gpu.pyramidSize = glm::ivec2(0);
+    gpu.pyramidLevels = 0;
+    gpu.pyramidValid = false;
+    ResizeDepthPyramid(app);
+}
+
+void ResizeDepthPyramid(App* app)
+{
+    GpuCulling& gpu = app->gpuCulling;
+    if (gpu.depthPyramid != 0 && gpu.pyramidSize == app->displaySize)
+        return;
+
+    // Immutable storage, so a new texture. Its content is undefined until rebuilt.
+    if (gpu.depthPyramid != 0)
+        glDeleteTextures(1, &gpu.depthPyramid);
+    gpu.pyramidValid = false;
+
+    // Max reduction of the depth buffer, down to 1x1
+    gpu.pyramidSize = glm::max(app->displaySize, glm::ivec2(1));
+    gpu.pyramidLevels = 1;
+    for (i32 size = glm::max(gpu.pyramidSize.x, gpu.pyramidSize.y); size > 1; size /= 2)
+        gpu.pyramidLevels++;
+
+    glGenTextures(1, &gpu.depthPyramid);
+    GLStateBindTexture(app->glState, TextureUnit_Depth, GL_TEXTURE_2D, gpu.depthPyramid);
+    glTexStorage2D(GL_TEXTURE_2D, gpu.pyramidLevels, GL_R32F, gpu.pyramidSize.x, gpu.pyramidSize.y);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+// Replaces the whole content, through the copy target so no VAO state changes
+static void UploadBufferData(GLuint buffer, const void* data, u32 size)
+{
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, glm::max(size, 4u), data, GL_STREAM_DRAW);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void UpdateGpuCullItems(App* app)
+{
+    PROFILE_FUNCTION();
+    GpuCulling& gpu = app->gpuCulling;
+    const RenderQueue& queue = app->renderQueue;
+
+    gpu.modelFirstDrawable.resize(app->models.size());
+    gpu.drawableCount = 0;
+    for (u32 modelIdx = 0; modelIdx < app->models.size(); ++modelIdx)
+    {
+        gpu.modelFirstDrawable[modelIdx] = gpu.drawableCount;
+        gpu.drawableCount += (u32)app->meshes[app->models[modelIdx].meshIdx].submeshes.size();
+    }
+
+    // Object indices only change along with the entities, which rebuilds the queue
+    if (gpu.itemsRevision == queue.rebuildCount && gpu.itemsCasterRevision == app->shadowCache.casterRevision)
+        return;
+
+    std::vector<GpuCullItem> items;
+    items.reserve(queue.itemCount);
+    for (u32 objectIndex = 0; objectIndex < queue.instanceEntities.size(); ++objectIndex)
+    {
+        const Entity& entity = app->entities[queue.instanceEntities[objectIndex]];
+        const Mesh& mesh = app->meshes[app->models[entity.modelIndex].meshIdx];
+        for (u32 s = 0; s < mesh.submeshes.size(); ++s)
+        {
+            const Aabb& aabb = mesh.submeshes[s].aabb;
+            GpuCullItem item = {};
+            item.center = glm::vec4((aabb.min + aabb.max) * 0.5f, 0.0f);
+            item.extent = glm::vec4((aabb.max - aabb.min) * 0.5f, 0.0f);
+            item.objectIndex = objectIndex;
+            item.drawable = gpu.modelFirstDrawable[entity.modelIndex] + s;
+            item.dynamic = IsDynamicCaster(app, entity);
+            items.push_back(item);
+        }
+    }
+
+    UploadBufferData(gpu.itemsBuffer, items.data(), (u32)(items.size() * sizeof(GpuCullItem)));
+    gpu.itemCount = (u32)items.size();
+    gpu.itemsRevision = queue.rebuildCount;
+    gpu.itemsCasterRevision = app->shadowCache.casterRevision;
+}
+
+void UploadGpuCullViews(App* app, u32 instanceCount)
+{
+    PROFILE_FUNCTION();
+    GpuCulling& gpu = app->gpuCulling;
+
+    UploadBufferData(gpu.viewsBuffer, gpu.views.data(), (u32)(gpu.views.size() * sizeof(GpuCullView)));
+    UploadBufferData(gpu.lookupBuffer, gpu.commandLookup.data(), (u32)(gpu.commandLookup.size() * sizeof(u32)));
+
+    // The shader overwrites the ranges every frame, nothing to keep when growing
+    const u32 required = instanceCount + (u32)app->lights.size();
+    if (required > gpu.instancesCapacity)
+    {
+        u32 capacity = gpu.instancesCapacity ? gpu.instancesCapacity : 4096;
+        while (capacity < required)
+            capacity *= 2;
+        glBindBuffer(GL_COPY_WRITE_BUFFER, gpu.instanceBuffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, capacity * sizeof(u32), NULL, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        gpu.instancesCapacity = capacity;
+    }
+
+    std::vector<u32> lightObjects(app->lights.size());
+    for (u32 i = 0; i < app->lights.size(); ++i)
+    {
+        app->lights[i].instanceIdx = instanceCount + i;
+        lightObjects[i] = app->lights[i].objectIndex;
+    }
+    if (!lightObjects.empty())
+    {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, gpu.instanceBuffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, instanceCount * sizeof(u32), lightObjects.size() * sizeof(u32), lightObjects.data());
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
+    if (app->attachedInstanceBuffer != gpu.instanceBuffer)
+        AttachInstanceBuffer(app, gpu.instanceBuffer);
+}
+
+void DispatchGpuCulling(App* app)
+{
+    PROFILE_FUNCTION();
+    GPU_PROFILE_SCOPE(app->gpuTimers, "GPU culling");
+    GpuCulling& gpu = app->gpuCulling;
+    if (gpu.itemCount == 0 || gpu.views.empty() || gpu.commandsSize == 0)
+        return;
+
+    //after a resize last frame's pyramid no longer maps onto the screen
+    ResizeDepthPyramid(app);
+
+    ASSERT(gpu.commandsOffset % app->storageBlockAlignment == 0, "Draw commands region not aligned for a storage block");
+    GLStateCache& state = app->glState;
+    GLStateBindBufferRange(state, GL_SHADER_STORAGE_BUFFER, GPU_CULL_ITEMS_BINDING, gpu.itemsBuffer, 0, gpu.itemCount * sizeof(GpuCullItem));
+    GLStateBindBufferRange(state, GL_SHADER_STORAGE_BUFFER, GPU_CULL_VIEWS_BINDING, gpu.viewsBuffer, 0, gpu.views.size() * sizeof(GpuCullView));
+    GLStateBindBufferRange(state, GL_SHADER_STORAGE_BUFFER, GPU_CULL_LOOKUP_BINDING, gpu.lookupBuffer, 0, gpu.commandLookup.size() * sizeof(u32));
+    GLStateBindBufferRange(state, GL_SHADER_STORAGE_BUFFER, GPU_CULL_COMMANDS_BINDING, app->drawCommandsBuffer.handle, gpu.commandsOffset, gpu.commandsSize);
+    GLStateBindBufferRange(state, GL_SHADER_STORAGE_BUFFER, GPU_CULL_INSTANCES_BINDING, gpu.instanceBuffer, 0, gpu.instancesCapacity * sizeof(u32));
+
+    const Program& program = app->programs[gpu.cullProgramIdx];
+    GLStateUseProgram(state, program.handle);
+    SetUniform(program, UniformSlot_ItemCount, gpu.itemCount);
+    SetUniform(program, UniformSlot_DrawableCount, gpu.drawableCount);
+    SetUniform(program, UniformSlot_UseDepthPyramid, (u32)gpu.pyramidValid);
+    SetUniform(program, UniformSlot_PrevViewProjection, &gpu.pyramidViewProjection);
+    GLStateBindTexture(state, TextureUnit_Depth, GL_TEXTURE_2D, gpu.depthPyramid);
+
+    glDispatchCompute((gpu.itemCount + GPU_CULL_GROUP_SIZE - 1) / GPU_CULL_GROUP_SIZE, (GLuint)gpu.views.size(), 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+}
+
+void BuildDepthPyramid(App* app, GLuint depthTexture)
+{
+    PROFILE_FUNCTION();
+    GPU_PROFILE_SCOPE(app->gpuTimers, "Depth pyramid");
+    GpuCulling& gpu = app->gpuCulling;
+    GLStateCache& state = app->glState;
+    ResizeDepthPyramid(app);
+
+    const Program& copy = app->programs[gpu.pyramidCopyProgramIdx];
+    GLStateUseProgram(state, copy.handle);
+    GLStateBindTexture(state, TextureUnit_Depth, GL_TEXTURE_2D, depthTexture);
+    glBindImageTexture(1, gpu.depthPyramid, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+    glDispatchCompute((gpu.pyramidSize.x + GPU_PYRAMID_GROUP_SIZE - 1) / GPU_PYRAMID_GROUP_SIZE,
+                      (gpu.pyramidSize.y + GPU_PYRAMID_GROUP_SIZE - 1) / GPU_PYRAMID_GROUP_SIZE, 1);
+
+    const Program& reduce = app->programs[gpu.pyramidReduceProgramIdx];
+    GLStateUseProgram(state, reduce.handle);
+    glm::ivec2 size = gpu.pyramidSize;
+    for (u32 level = 1; level < gpu.pyramidLevels; ++level)
+    {
+        size = glm::max(size / 2, glm::ivec2(1));
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        glBindImageTexture(0, gpu.depthPyramid, level - 1, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+        glBindImageTexture(1, gpu.depthPyramid, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        glDispatchCompute((size.x + GPU_PYRAMID_GROUP_SIZE - 1) / GPU_PYRAMID_GROUP_SIZE,
+                          (size.y + GPU_PYRAMID_GROUP_SIZE - 1) / GPU_PYRAMID_GROUP_SIZE, 1);
+    }
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+    gpu.pyramidViewProjection = app->vpMatrix;
+    gpu.pyramidValid = true;
+}
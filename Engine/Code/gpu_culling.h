@@ -0,0 +1,120 @@
+//
+// gpu_culling.h: GPU driven culling, the alternative to the CPU path of the render
+// queue. A compute shader (GL 4.3) reads the bounds of every entity submesh from a
+// shader storage buffer, tests them against each view (frustum or light sphere, plus
+// last frame's depth pyramid for the camera) and appends the survivors to the indirect
+// commands the render queue wrote with zero instances, each with its own range of the
+// GPU instance buffer. The CPU only writes per view and per model submesh data every
+// frame; the item buffer is rewritten when the render queue is rebuilt or an entity
+// switches between static and dynamic caster.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <glad/glad.h>
+
+struct App;
+
+#define GPU_CULL_GROUP_SIZE     64 // Items per work group, matches GpuCulling.glsl
+#define GPU_PYRAMID_GROUP_SIZE  8
+
+// Shader storage block bindings of GpuCulling.glsl, the objects buffer is 0
+#define GPU_CULL_ITEMS_BINDING     4
+#define GPU_CULL_VIEWS_BINDING     5
+#define GPU_CULL_LOOKUP_BINDING    6
+#define GPU_CULL_COMMANDS_BINDING  7
+#define GPU_CULL_INSTANCES_BINDING 8
+
+#define GPU_CULL_NO_COMMAND 0xffffffff
+#define GPU_CULL_MAX_FRUSTUMS 4 // Per view, the cascades of a directional light
+
+// std430 layouts of GpuCulling.glsl
+struct GpuCullItem
+{
+    glm::vec4 center;      // Local AABB of the submesh, w unused
+    glm::vec4 extent;
+    u32       objectIndex;
+    u32       drawable;    // Model submesh, see GpuCulling::modelFirstDrawable
+    u32       dynamic;     // Dynamic shadow caster
+    u32       padding;
+};
+
+struct GpuCullView
+{
+    glm::vec4 planes[GPU_CULL_MAX_FRUSTUMS * 6];
+    glm::vec4 sphere;       // Center and radius, 0 without a sphere
+    u32       frustumCount; // Visible in any of them
+    u32       occlusion;   // Tested against the depth pyramid
+    u32       casters;     // ShadowCasters
+    u32       padding;
+};
+
+struct GpuCulling
+{
+    u32 cullProgramIdx;
+    u32 pyramidCopyProgramIdx;
+    u32 pyramidReduceProgramIdx;
+
+    // Model submeshes, drawable modelFirstDrawable[m] + s
+    std::vector<u32> modelFirstDrawable;
+    u32 drawableCount;
+
+    GLuint itemsBuffer;
+    u32    itemsCapacity;
+    u32    itemCount;
+    u32    itemsRevision; // renderQueue.rebuildCount the items were written for
+    u32    itemsCasterRevision; // and shadowCache.casterRevision
+
+    std::vector<GpuCullView> views;
+    GLuint viewsBuffer;
+    std::vector<u32> commandLookup; // Command of every drawable in every view, relative to commandsOffset
+    GLuint lookupBuffer;
+    u32    commandsOffset;          // This frame's commands in app->drawCommandsBuffer
+    u32    commandsSize;
+
+    GLuint instanceBuffer;          // Object indices written by the shader, light volumes at the end
+    u32    instancesCapacity;
+
+    // Max depth reduction of the geometry pass depth, used one frame later
+    GLuint    depthPyramid;
+    glm::ivec2 pyramidSize;
+    u32       pyramidLevels;
+    glm::mat4 pyramidViewProjection;
+    bool      pyramidValid;
+};
+
+/**
+ * Creates the buffers and the depth pyramid. The programs are loaded by Init().
+ */
+void InitGpuCulling(App* app);
+
+/**
+ * Recreates the depth pyramid if the display size changed since it was built, and
+ * invalidates it until BuildDepthPyramid() runs again.
+ */
+void ResizeDepthPyramid(App* app);
+
+/**
+ * Numbers the model submeshes and rewrites the items if the render queue was
+ * rebuilt. Called by the render queue before it writes the commands.
+ */
+void UpdateGpuCullItems(App* app);
+
+/**
+ * Uploads the views and the command lookup the render queue filled, and writes
+ * the light volume entries after the instanceCount entries reserved by the commands.
+ */
+void UploadGpuCullViews(App* app, u32 instanceCount);
+
+/**
+ * Runs the culling shader over every item and view. Has to be issued before the
+ * first pass that draws the commands; the objects buffer is expected at binding 0.
+ */
+void DispatchGpuCulling(App* app);
+
+/**
+ * Reduces the depth of the geometry pass into the pyramid the next frame tests
+ * against.
+ */
+void BuildDepthPyramid(App* app, GLuint depthTexture);
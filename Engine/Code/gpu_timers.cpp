@@ -0,0 +1,173 @@
+#include "gpu_timers.h"
+
+void GpuTimersInit(GpuTimers& timers)
+{
+    timers.passCount = 0;
+    timers.frameIndex = 0;
+    timers.depth = 0;
+    timers.resolvedFrameIndex = 0;
+    timers.droppedFrames = 0;
+    timers.droppedPasses = 0;
+    for (u32 i = 0; i < GPU_TIMER_FRAME_LATENCY; ++i)
+    {
+        timers.frames[i].queriesUsed = 0;
+        timers.frames[i].lastEndQuery = 0;
+        timers.frames[i].frameIndex = 0;
+        timers.frames[i].pending = false;
+    }
+}
+
+void GpuTimersShutdown(GpuTimers& timers)
+{
+    for (u32 i = 0; i < GPU_TIMER_FRAME_LATENCY; ++i)
+    {
+        GpuTimerFrame& frame = timers.frames[i];
+        if (!frame.queryPool.empty())
+            glDeleteQueries((GLsizei)frame.queryPool.size(), frame.queryPool.data());
+        frame.queryPool.clear();
+        frame.queries.clear();
+    }
+}
+
+static GLuint AcquireQuery(GpuTimerFrame& frame)
+{
+    if (frame.queriesUsed == frame.queryPool.size())
+    {
+        GLuint query;
+        glGenQueries(1, &query);
+        frame.queryPool.push_back(query);
+    }
+    return frame.queryPool[frame.queriesUsed++];
+}
+
+static u32 FindOrAddPass(GpuTimers& timers, const char* name)
+{
+    for (u32 i = 0; i < timers.passCount; ++i)
+        if (timers.passes[i].name == name)
+            return i;
+
+    if (timers.passCount == GPU_TIMER_MAX_PASSES)
+    {
+        if (timers.droppedPasses++ == 0)
+            ELOG("More than %d GPU timer passes, %s and later ones are not timed", GPU_TIMER_MAX_PASSES, name);
+        return UINT32_MAX;
+    }
+
+    GpuTimerPass& pass = timers.passes[timers.passCount];
+    pass.name = name;
+    pass.lastMs = 0.0;
+    pass.averageMs = 0.0;
+    pass.lastFrame = 0;
+    return timers.passCount++;
+}
+
+static void ResolveFrame(GpuTimers& timers, GpuTimerFrame& frame)
+{
+    if (!frame.pending)
+        return;
+    frame.pending = false;
+
+    if (!frame.queries.empty())
+    {
+        // Queries complete in order, so the last timestamp tells if the whole frame is done
+        GLint available = 0;
+        glGetQueryObjectiv(frame.lastEndQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+        {
+            timers.droppedFrames++;
+            return;
+        }
+    }
+
+    timers.resolved.clear();
+    for (const GpuTimerQuery& query : frame.queries)
+    {
+        GLuint64 begin = 0;
+        GLuint64 end = 0;
+        glGetQueryObjectui64v(query.beginQuery, GL_QUERY_RESULT, &begin);
+        glGetQueryObjectui64v(query.endQuery, GL_QUERY_RESULT, &end);
+        f64 ms = (f64)(end - begin) / 1000000.0;
+
+        bool merged = false;
+        for (GpuTimerResult& result : timers.resolved)
+        {
+            if (result.passIdx == query.passIdx)
+            {
+                result.ms += ms;
+                merged = true;
+                break;
+            }
+        }
+        if (!merged)
+            timers.resolved.push_back({ query.passIdx, query.depth, ms });
+    }
+
+    for (const GpuTimerResult& result : timers.resolved)
+    {
+        GpuTimerPass& pass = timers.passes[result.passIdx];
+        pass.averageMs = pass.lastFrame == 0 ? result.ms : pass.averageMs * 0.9 + result.ms * 0.1;
+        pass.lastMs = result.ms;
+        pass.lastFrame = frame.frameIndex;
+    }
+    timers.resolvedFrameIndex = frame.frameIndex;
+}
+
+void GpuTimersBeginFrame(GpuTimers& timers)
+{
+    timers.frameIndex++;
+    GpuTimerFrame& frame = timers.frames[timers.frameIndex % GPU_TIMER_FRAME_LATENCY];
+
+    // This slot was recorded GPU_TIMER_FRAME_LATENCY frames ago
+    ResolveFrame(timers, frame);
+
+    frame.queriesUsed = 0;
+    frame.queries.clear();
+    frame.frameIndex = timers.frameIndex;
+    timers.depth = 0;
+    timers.openQueries.clear();
+}
+
+void GpuTimersEndFrame(GpuTimers& timers)
+{
+    ASSERT(timers.openQueries.empty(), "GPU timer passes left open at the end of the frame");
+    GpuTimerFrame& frame = timers.frames[timers.frameIndex % GPU_TIMER_FRAME_LATENCY];
+    frame.pending = true;
+}
+
+void GpuTimerBegin(GpuTimers& timers, const char* name)
+{
+    GpuTimerFrame& frame = timers.frames[timers.frameIndex % GPU_TIMER_FRAME_LATENCY];
+
+    GpuTimerQuery query = {};
+    query.passIdx = FindOrAddPass(timers, name);
+    if (query.passIdx == UINT32_MAX)
+    {
+        // Still pushed so that the matching GpuTimerEnd() pops it
+        timers.openQueries.push_back(UINT32_MAX);
+        timers.depth++;
+        return;
+    }
+    query.depth = timers.depth++;
+    query.beginQuery = AcquireQuery(frame);
+    query.endQuery = AcquireQuery(frame);
+    glQueryCounter(query.beginQuery, GL_TIMESTAMP);
+
+    timers.openQueries.push_back((u32)frame.queries.size());
+    frame.queries.push_back(query);
+}
+
+void GpuTimerEnd(GpuTimers& timers)
+{
+    ASSERT(!timers.openQueries.empty(), "GpuTimerEnd() without a matching GpuTimerBegin()");
+    GpuTimerFrame& frame = timers.frames[timers.frameIndex % GPU_TIMER_FRAME_LATENCY];
+
+    if (timers.openQueries.back() != UINT32_MAX)
+    {
+        GpuTimerQuery& query = frame.queries[timers.openQueries.back()];
+        glQueryCounter(query.endQuery, GL_TIMESTAMP);
+        frame.lastEndQuery = query.endQuery;
+    }
+
+    timers.openQueries.pop_back();
+    timers.depth--;
+}
@@ -0,0 +1,96 @@
+//
+// gpu_timers.h: Per-pass GPU timings. Every pass brackets its commands with two
+// GL_TIMESTAMP queries. Queries live in a ring several frames deep and a frame is
+// only read back once the GPU has finished it, so the CPU never waits on results.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "profiler.h"
+#include <glad/glad.h>
+
+#define GPU_TIMER_FRAME_LATENCY 4   // Frames in flight before a query slot is reused
+#define GPU_TIMER_MAX_PASSES    128
+
+struct GpuTimerPass
+{
+    std::string name;
+    f64         lastMs;     // Time of the last resolved frame (summed if the pass ran several times)
+    f64         averageMs;  // Exponential moving average
+    u32         lastFrame;  // Last resolved frame the pass appeared in
+};
+
+struct GpuTimerQuery
+{
+    u32    passIdx;
+    u32    depth;
+    GLuint beginQuery;
+    GLuint endQuery;
+};
+
+struct GpuTimerFrame
+{
+    std::vector<GLuint>        queryPool;  // Reused every time the slot comes around
+    u32                        queriesUsed;
+    std::vector<GpuTimerQuery> queries;
+    GLuint                     lastEndQuery; // Last timestamp issued in the frame
+    u32                        frameIndex;
+    bool                       pending;
+};
+
+struct GpuTimerResult
+{
+    u32 passIdx;
+    u32 depth;
+    f64 ms;
+};
+
+struct GpuTimers
+{
+    GpuTimerPass  passes[GPU_TIMER_MAX_PASSES];
+    u32           passCount;
+    GpuTimerFrame frames[GPU_TIMER_FRAME_LATENCY];
+    u32           frameIndex;
+    u32           depth;
+    std::vector<u32> openQueries; // Stack of indices into the current frame queries
+
+    // Last fully resolved frame, in submission order
+    std::vector<GpuTimerResult> resolved;
+    u32 resolvedFrameIndex;
+    u32 droppedFrames; // Frames whose results were still not available when their slot was reused
+    u32 droppedPasses; // Timed passes skipped because passes was full
+};
+
+void GpuTimersInit(GpuTimers& timers);
+
+void GpuTimersShutdown(GpuTimers& timers);
+
+/**
+ * Resolves the oldest frame in the ring (if the GPU is done with it) and starts recording a new one.
+ */
+void GpuTimersBeginFrame(GpuTimers& timers);
+
+void GpuTimersEndFrame(GpuTimers& timers);
+
+/**
+ * Opens/closes a timed pass. Passes can be nested and a name can be used several
+ * times per frame, in which case its times are added up. Names are never freed, so
+ * they must come from a fixed set: past GPU_TIMER_MAX_PASSES new names are not timed.
+ */
+void GpuTimerBegin(GpuTimers& timers, const char* name);
+void GpuTimerEnd(GpuTimers& timers);
+
+struct GpuTimerScope
+{
+    GpuTimers& timers;
+    GpuTimerScope(GpuTimers& gpuTimers, const char* name) : timers(gpuTimers) { GpuTimerBegin(timers, name); }
+    ~GpuTimerScope() { GpuTimerEnd(timers); }
+};
+
+#define GPU_TIMER_CONCAT_INNER(a, b) a##b
+#define GPU_TIMER_CONCAT(a, b) GPU_TIMER_CONCAT_INNER(a, b)
+#define GPU_PROFILE_SCOPE(timers, name) GpuTimerScope GPU_TIMER_CONCAT(gpuTimerScope, __LINE__)(timers, name)
+
+// CPU zone + GPU timer with the same name, so both show up side by side in the UI
+#define PROFILE_PASS(timers, name) PROFILE_SCOPE(name); GPU_PROFILE_SCOPE(timers, name)
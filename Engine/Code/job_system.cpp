@@ -0,0 +1,412 @@
+#include "job_system.h"
+#include "profiler.h"
+#include <condition_variable>
+#include <thread>
+
+#ifdef _WIN32
+#define VC_EXTRALEAN
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Chase-Lev deque over a fixed ring ("Correct and Efficient Work-Stealing for Weak
+// Memory Models", Le et al.). The owner pushes and pops at the bottom, thieves take
+// from the top, only the last job is contended. Jobs are copied in and out of the ring;
+// a thief copies before claiming the slot, so the copy is only kept if no one else took
+// it, and the owner only reuses a slot once top is past it.
+struct JobWorker
+{
+    std::atomic<i64>  top;          // Written by the thieves
+    u8                padding[56];  // Keeps bottom off the cache line of top
+    std::atomic<i64>  bottom;       // Written by the owner
+    Job               jobs[JOB_DEQUE_SIZE];
+    u32               randomState; // Picks the victims
+    std::atomic<u32>  executed;
+    std::atomic<u32>  stolen;
+};
+
+struct JobSystem
+{
+    JobWorker*               workers;
+    u32                      threadCount;
+    std::vector<std::thread> threads;
+
+    // Idle workers sleep on it, queued counts the jobs in every deque
+    std::mutex               mutex;
+    std::condition_variable  wake;
+    std::atomic<i32>         queued;
+    std::atomic<u32>         sleeping;
+    bool                     quit;
+
+    std::vector<Job>         background;      // Guarded by mutex
+    std::atomic<u32>         backgroundCount; // Checked without the lock
+};
+
+static JobSystem*            Jobs = NULL;
+static thread_local u32      CurrentWorker = UINT32_MAX;
+
+static bool DequePush(JobWorker& worker, const Job& job)
+{
+    const i64 b = worker.bottom.load(std::memory_order_relaxed);
+    const i64 t = worker.top.load(std::memory_order_acquire);
+    if (b - t >= JOB_DEQUE_SIZE)
+        return false;
+    worker.jobs[b & (JOB_DEQUE_SIZE - 1)] = job;
+    std::atomic_thread_fence(std::memory_order_release);
+    worker.bottom.store(b + 1, std::memory_order_relaxed);
+    return true;
+}
+
+static bool DequePop(JobWorker& worker, Job& job)
+{
+    const i64 b = worker.bottom.load(std::memory_order_relaxed) - 1;
+    worker.bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    i64 t = worker.top.load(std::memory_order_relaxed);
+    if (t > b)
+    {
+        worker.bottom.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    job = worker.jobs[b & (JOB_DEQUE_SIZE - 1)];
+    bool taken = true;
+    if (t == b)
+    {
+        //the last one, a thief may be taking it too
+        taken = worker.top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        worker.bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return taken;
+}
+
+static bool DequeSteal(JobWorker& worker, Job& job)
+{
+    i64 t = worker.top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const i64 b = worker.bottom.load(std::memory_order_acquire);
+    if (t >= b)
+        return false;
+
+    job = worker.jobs[t & (JOB_DEQUE_SIZE - 1)];
+    return worker.top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+static u32 NextRandom(u32& state)
+{
+    //xorshift32
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static bool FindJob(u32 workerIdx, Job& job)
+{
+    JobWorker& self = Jobs->workers[workerIdx];
+    bool found = DequePop(self, job);
+    if (!found && Jobs->threadCount > 1)
+    {
+        //one round over the others, starting at a random one
+        const u32 first = NextRandom(self.randomState) % Jobs->threadCount;
+        for (u32 i = 0; i < Jobs->threadCount && !found; ++i)
+        {
+            const u32 victim = (first + i) % Jobs->threadCount;
+            if (victim != workerIdx)
+                found = DequeSteal(Jobs->workers[victim], job);
+        }
+        if (found)
+            self.stolen.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (found)
+        Jobs->queued.fetch_sub(1);
+    return found;
+}
+
+static void ExecuteJob(Job job);
+
+static void PushJob(const Job& job)
+{
+    ASSERT(CurrentWorker < Jobs->threadCount, "Jobs can only be submitted from the job system threads");
+    if (!DequePush(Jobs->workers[CurrentWorker], job))
+    {
+        ExecuteJob(job);
+        return;
+    }
+
+    Jobs->queued.fetch_add(1);
+    if (Jobs->sleeping.load() > 0)
+    {
+        //taking the lock orders the wake up after the sleeper checked queued
+        std::lock_guard<std::mutex> lock(Jobs->mutex);
+        Jobs->wake.notify_one();
+    }
+}
+
+static void FinishJob(JobCounter* counter)
+{
+    if (!counter)
+        return;
+
+    //the waiter may free the counter once finishing is back to 0, nothing touches it after
+    counter->finishing.fetch_add(1);
+    if (counter->pending.fetch_sub(1) == 1)
+    {
+        std::vector<Job> continuations;
+        {
+            std::lock_guard<std::mutex> lock(counter->mutex);
+            continuations.swap(counter->continuations);
+        }
+        for (const Job& job : continuations)
+            PushJob(job);
+    }
+    counter->finishing.fetch_sub(1);
+}
+
+static void ExecuteJob(Job job)
+{
+    job.function(job.data, job.begin, job.end);
+    if (CurrentWorker < Jobs->threadCount)
+        Jobs->workers[CurrentWorker].executed.fetch_add(1, std::memory_order_relaxed);
+    FinishJob(job.counter);
+}
+
+static bool TakeBackgroundJob(Job& job)
+{
+    if (Jobs->backgroundCount.load() == 0)
+        return false;
+
+    std::lock_guard<std::mutex> lock(Jobs->mutex);
+    if (Jobs->quit || Jobs->background.empty())
+        return false;
+    job = Jobs->background.front();
+    Jobs->background.erase(Jobs->background.begin());
+    Jobs->backgroundCount.fetch_sub(1);
+    return true;
+}
+
+static void PinThread(std::thread::native_handle_type thread, u32 core)
+{
+    //more threads than cores share them round robin
+    core %= glm::max(std::thread::hardware_concurrency(), 1u);
+#ifdef _WIN32
+    if (!SetThreadAffinityMask((HANDLE)thread, (DWORD_PTR)1 << core))
+        ELOG("SetThreadAffinityMask() failed pinning a job thread to core %u", core);
+#else
+    cpu_set_t cores;
+    CPU_ZERO(&cores);
+    CPU_SET(core, &cores);
+    if (pthread_setaffinity_np(thread, sizeof(cores), &cores) != 0)
+        ELOG("pthread_setaffinity_np() failed pinning a job thread to core %u", core);
+#endif
+}
+
+static void WorkerLoop(u32 workerIdx, bool nameThread)
+{
+    CurrentWorker = workerIdx;
+    if (nameThread)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "Job worker %u", workerIdx);
+        ProfilerSetThreadName(name);
+    }
+
+    JobSystem& jobs = *Jobs;
+    u32 idleRounds = 0;
+    while (true)
+    {
+        Job job;
+        if (FindJob(workerIdx, job) || TakeBackgroundJob(job))
+        {
+            ExecuteJob(job);
+            idleRounds = 0;
+            continue;
+        }
+
+        //yield a few rounds before sleeping, jobs often come in bursts
+        if (++idleRounds < 64)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(jobs.mutex);
+        if (jobs.quit)
+            break;
+        jobs.sleeping.fetch_add(1);
+        jobs.wake.wait(lock, [&] { return jobs.quit || jobs.queued.load() > 0 || !jobs.background.empty(); });
+        jobs.sleeping.fetch_sub(1);
+        idleRounds = 0;
+    }
+}
+
+void JobSystemInit(u32 threadCount, bool pinThreads, bool nameThreads)
+{
+    ASSERT(!Jobs, "The job system is already running");
+    if (threadCount == 0)
+        threadCount = glm::max(std::thread::hardware_concurrency(), 1u);
+    threadCount = glm::min(threadCount, (u32)JOB_MAX_THREADS);
+
+    Jobs = new JobSystem;
+    Jobs->threadCount = threadCount;
+    Jobs->workers = new JobWorker[threadCount];
+    Jobs->queued.store(0);
+    Jobs->sleeping.store(0);
+    Jobs->quit = false;
+    Jobs->backgroundCount.store(0);
+    for (u32 i = 0; i < threadCount; ++i)
+    {
+        JobWorker& worker = Jobs->workers[i];
+        worker.top.store(0);
+        worker.bottom.store(0);
+        worker.randomState = 0x9e3779b9u * (i + 1);
+        worker.executed.store(0);
+        worker.stolen.store(0);
+    }
+
+    CurrentWorker = 0;
+    if (pinThreads)
+    {
+#ifdef _WIN32
+        PinThread(GetCurrentThread(), 0);
+#else
+        PinThread(pthread_self(), 0);
+#endif
+    }
+    for (u32 i = 1; i < threadCount; ++i)
+    {
+        Jobs->threads.push_back(std::thread(WorkerLoop, i, nameThreads));
+        if (pinThreads)
+            PinThread(Jobs->threads.back().native_handle(), i);
+    }
+}
+
+void JobSystemShutdown()
+{
+    if (!Jobs)
+        return;
+
+    //whatever is left runs before the workers are told to quit
+    Job job;
+    while (FindJob(0, job))
+        ExecuteJob(job);
+    {
+        std::lock_guard<std::mutex> lock(Jobs->mutex);
+        Jobs->quit = true;
+    }
+    Jobs->wake.notify_all();
+    for (std::thread& thread : Jobs->threads)
+        thread.join();
+
+    delete[] Jobs->workers;
+    delete Jobs;
+    Jobs = NULL;
+    CurrentWorker = UINT32_MAX;
+}
+
+u32 JobSystemThreadCount()
+{
+    return Jobs ? Jobs->threadCount : 1;
+}
+
+JobSystemStats JobSystemFrameStats()
+{
+    JobSystemStats stats = {};
+    stats.threadCount = JobSystemThreadCount();
+    if (!Jobs)
+        return stats;
+
+    for (u32 i = 0; i < Jobs->threadCount; ++i)
+    {
+        stats.executed += Jobs->workers[i].executed.exchange(0, std::memory_order_relaxed);
+        stats.stolen += Jobs->workers[i].stolen.exchange(0, std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+void RunJob(JobFunction* function, void* data, u32 begin, u32 end, JobCounter* counter, JobCounter* dependency)
+{
+    Job job = { function, data, begin, end, counter };
+    if (counter)
+        counter->pending.fetch_add(1);
+
+    if (!Jobs)
+    {
+        ASSERT(!dependency || dependency->pending.load() == 0, "Without workers the dependencies have to be done already");
+        function(data, begin, end);
+        FinishJob(counter);
+        return;
+    }
+
+    if (dependency)
+    {
+        //the decrement to 0 takes the lock after it, either it sees the job or the job sees 0
+        std::lock_guard<std::mutex> lock(dependency->mutex);
+        if (dependency->pending.load() > 0)
+        {
+            dependency->continuations.push_back(job);
+            return;
+        }
+    }
+    PushJob(job);
+}
+
+void RunBackgroundJob(JobFunction* function, void* data)
+{
+    if (!Jobs || Jobs->threadCount == 1)
+    {
+        function(data, 0, 0);
+        return;
+    }
+
+    Job job = { function, data, 0, 0, NULL };
+    {
+        std::lock_guard<std::mutex> lock(Jobs->mutex);
+        Jobs->background.push_back(job);
+        Jobs->backgroundCount.fetch_add(1);
+    }
+    Jobs->wake.notify_one();
+}
+
+void WaitForCounter(JobCounter* counter)
+{
+    //threads the job system didn't start have no deque, they can only wait
+    const bool worker = Jobs && CurrentWorker < Jobs->threadCount;
+    while (counter->pending.load() > 0 || counter->finishing.load() > 0)
+    {
+        Job job;
+        if (worker && FindJob(CurrentWorker, job))
+            ExecuteJob(job);
+        else
+            std::this_thread::yield();
+    }
+}
+
+void ParallelFor(u32 count, u32 batchSize, JobFunction* function, void* data)
+{
+    ASSERT(batchSize > 0, "ParallelFor() needs a batch size");
+    if (count == 0)
+        return;
+    if (!Jobs || Jobs->threadCount == 1 || count <= batchSize || CurrentWorker >= Jobs->threadCount)
+    {
+        function(data, 0, count);
+        return;
+    }
+
+    JobCounter counter;
+    const u32 batchCount = (count + batchSize - 1) / batchSize;
+    counter.pending.store(batchCount);
+    //the first batch runs here, the others go to the deque for the thieves
+    for (u32 batch = 1; batch < batchCount; ++batch)
+    {
+        Job job = { function, data, batch * batchSize, glm::min(count, (batch + 1) * batchSize), &counter };
+        PushJob(job);
+    }
+    function(data, 0, batchSize);
+    Jobs->workers[CurrentWorker].executed.fetch_add(1, std::memory_order_relaxed);
+    FinishJob(&counter);
+    WaitForCounter(&counter);
+}
@@ -0,0 +1,99 @@
+//
+// job_system.h: Work-stealing job system. The platform layer starts it in main() with a
+// worker thread per core besides the main thread, which is worker 0 and runs jobs too
+// while it waits for them. Every worker owns a Chase-Lev deque: it pushes and pops its
+// own jobs at the bottom, lock free, and when it runs out it steals from the top of the
+// deque of a random worker. Idle workers sleep until jobs are pushed.
+//
+// A job is a function pointer with a data pointer and an index range, nothing is
+// allocated to submit one. Counters track groups of jobs: WaitForCounter() is the fence,
+// and a job submitted with a dependency is only pushed once that counter reaches 0.
+// Jobs can be submitted from the workers only (the main thread included).
+//
+// Background jobs (asset loading) take long enough to miss a frame, so they go to a
+// queue of their own that only the worker threads take from once they have nothing
+// else to do, never the main thread while it waits for its own jobs.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <atomic>
+#include <mutex>
+
+#define JOB_MAX_THREADS 64
+#define JOB_DEQUE_SIZE  4096 // Jobs in flight per worker, a power of 2. A full deque runs the job in place.
+
+typedef void JobFunction(void* data, u32 begin, u32 end);
+
+struct JobCounter;
+
+struct Job
+{
+    JobFunction* function;
+    void*        data;
+    u32          begin;
+    u32          end;
+    JobCounter*  counter; // Decremented once the job is done, can be NULL
+};
+
+struct JobCounter
+{
+    std::atomic<u32> pending{0};    // Submitted jobs not done yet
+    std::atomic<u32> finishing{0};  // Done jobs still touching the counter
+    std::mutex       mutex;         // Guards the continuations
+    std::vector<Job> continuations; // Waiting for pending to reach 0
+};
+
+struct JobSystemStats
+{
+    u32 threadCount;
+    u32 executed;  // Since the last JobSystemFrameStats()
+    u32 stolen;
+};
+
+/**
+ * Starts threadCount - 1 workers, 0 for one per hardware thread. Pinning binds worker i
+ * (the calling thread being worker 0) to logical core i, modulo the core count. Named threads are registered
+ * in the profiler, the benchmark restarting the system over and over leaves it out.
+ */
+void JobSystemInit(u32 threadCount, bool pinThreads, bool nameThreads = true);
+
+// Waits for the workers to finish their jobs and joins them
+void JobSystemShutdown();
+
+// Workers including the main thread, 1 before JobSystemInit()
+u32 JobSystemThreadCount();
+
+// Jobs executed and stolen since the last call, once per frame from the UI
+JobSystemStats JobSystemFrameStats();
+
+/**
+ * Pushes a job to the deque of the calling worker. The counter is incremented right
+ * away; with a dependency, the job is held until the dependency counter reaches 0.
+ */
+void RunJob(JobFunction* function, void* data, u32 begin, u32 end, JobCounter* counter, JobCounter* dependency = NULL);
+
+/**
+ * Queues a job for the worker threads, first in first out. Without workers it runs
+ * right away on the calling thread. Background jobs not started by JobSystemShutdown()
+ * are dropped.
+ */
+void RunBackgroundJob(JobFunction* function, void* data);
+
+// Runs other jobs until the counter reaches 0. Other threads than the workers only yield.
+void WaitForCounter(JobCounter* counter);
+
+/**
+ * Splits [0, count) in ranges of batchSize, runs them on every worker and returns once
+ * they are all done. Inline without workers, from another thread or when it fits in one batch.
+ */
+void ParallelFor(u32 count, u32 batchSize, JobFunction* function, void* data);
+
+// Same, with a callable body(begin, end)
+template <typename Body>
+void ParallelFor(u32 count, u32 batchSize, const Body& body)
+{
+    JobFunction* thunk = [](void* data, u32 begin, u32 end) { (*(const Body*)data)(begin, end); };
+    ParallelFor(count, batchSize, thunk, (void*)&body);
+}
@@ -0,0 +1,266 @@
+#include "light_clusters.h"
+#include "engine.h"
+#include "buffer_management.h"
+#include "profiler.h"
+#include <float.h>
+#include <immintrin.h>
+
+static u32 ClusterIndex(u32 x, u32 y, u32 z)
+{
+    return (z * CLUSTER_COUNT_Y + y) * CLUSTER_COUNT_X + x;
+}
+
+static f32 SliceDepth(const LightClusters& clusters, f32 slice)
+{
+    return expf((slice + clusters.depthBias) / clusters.depthScale);
+}
+
+static i32 DepthSlice(const LightClusters& clusters, f32 depth)
+{
+    i32 slice = (i32)floorf(logf(depth) * clusters.depthScale - clusters.depthBias);
+    return glm::clamp(slice, 0, CLUSTER_COUNT_Z - 1);
+}
+
+// View space boxes of the froxels, the corners of each tile at both slice depths
+static void BuildClusterBoxes(LightClusters& clusters, const glm::mat4& projection, f32 zNear, f32 zFar)
+{
+    clusters.depthScale = CLUSTER_COUNT_Z / logf(zFar / zNear);
+    clusters.depthBias = CLUSTER_COUNT_Z * logf(zNear) / logf(zFar / zNear);
+    clusters.minX.resize(CLUSTER_COUNT); clusters.maxX.resize(CLUSTER_COUNT);
+    clusters.minY.resize(CLUSTER_COUNT); clusters.maxY.resize(CLUSTER_COUNT);
+    clusters.minZ.resize(CLUSTER_COUNT); clusters.maxZ.resize(CLUSTER_COUNT);
+
+    const glm::mat4 inverseProjection = glm::inverse(projection);
+    for (u32 y = 0; y < CLUSTER_COUNT_Y; ++y)
+    {
+        for (u32 x = 0; x < CLUSTER_COUNT_X; ++x)
+        {
+            // Rays through the tile corners, scaled to a view depth of 1
+            glm::vec3 rays[4];
+            for (u32 c = 0; c < 4; ++c)
+            {
+                glm::vec2 ndc(-1.0f + 2.0f * (x + (c & 1)) / CLUSTER_COUNT_X, -1.0f + 2.0f * (y + (c >> 1)) / CLUSTER_COUNT_Y);
+                glm::vec4 p = inverseProjection * glm::vec4(ndc, -1.0f, 1.0f);
+                glm::vec3 view = glm::vec3(p) / p.w;
+                rays[c] = view / -view.z;
+            }
+            for (u32 z = 0; z < CLUSTER_COUNT_Z; ++z)
+            {
+                const f32 depths[2] = { SliceDepth(clusters, (f32)z), SliceDepth(clusters, (f32)z + 1.0f) };
+                glm::vec3 boxMin(FLT_MAX), boxMax(-FLT_MAX);
+                for (f32 depth : depths)
+                {
+                    for (const glm::vec3& ray : rays)
+                    {
+                        boxMin = glm::min(boxMin, ray * depth);
+                        boxMax = glm::max(boxMax, ray * depth);
+                    }
+                }
+                const u32 i = ClusterIndex(x, y, z);
+                clusters.minX[i] = boxMin.x; clusters.maxX[i] = boxMax.x;
+                clusters.minY[i] = boxMin.y; clusters.maxY[i] = boxMax.y;
+                clusters.minZ[i] = boxMin.z; clusters.maxZ[i] = boxMax.z;
+            }
+        }
+    }
+    clusters.boxesProjection = projection;
+}
+
+/**
+ * Adds a hit for every froxel the view space sphere touches. The screen rect of the
+ * sphere and its slice range narrow the search, then each tile row of the rect is
+ * tested 4 froxels at a time.
+ */
+static void BinPointLight(LightClusters& clusters, const glm::mat4& projection, f32 zNear, f32 zFar, const glm::vec3& center, f32 radius, u32 lightIdx)
+{
+    const f32 depth = -center.z;
+    if (depth + radius < zNear || depth - radius > zFar)
+        return;
+
+    const i32 z0 = DepthSlice(clusters, glm::max(depth - radius, zNear));
+    const i32 z1 = DepthSlice(clusters, glm::min(depth + radius, zFar));
+
+    // Screen rect of the sphere box, the whole screen if it crosses the near plane
+    i32 x0 = 0, x1 = CLUSTER_COUNT_X - 1;
+    i32 y0 = 0, y1 = CLUSTER_COUNT_Y - 1;
+    if (depth - radius > zNear)
+    {
+        glm::vec2 rectMin(FLT_MAX), rectMax(-FLT_MAX);
+        for (u32 c = 0; c < 8; ++c)
+        {
+            glm::vec3 corner = center + radius * glm::vec3(c & 1 ? 1.0f : -1.0f, c & 2 ? 1.0f : -1.0f, c & 4 ? 1.0f : -1.0f);
+            glm::vec4 clip = projection * glm::vec4(corner, 1.0f);
+            glm::vec2 ndc = glm::vec2(clip) / clip.w;
+            rectMin = glm::min(rectMin, ndc);
+            rectMax = glm::max(rectMax, ndc);
+        }
+        if (rectMax.x < -1.0f || rectMin.x > 1.0f || rectMax.y < -1.0f || rectMin.y > 1.0f)
+            return;
+        x0 = glm::clamp((i32)floorf((rectMin.x * 0.5f + 0.5f) * CLUSTER_COUNT_X), 0, CLUSTER_COUNT_X - 1);
+        x1 = glm::clamp((i32)floorf((rectMax.x * 0.5f + 0.5f) * CLUSTER_COUNT_X), 0, CLUSTER_COUNT_X - 1);
+        y0 = glm::clamp((i32)floorf((rectMin.y * 0.5f + 0.5f) * CLUSTER_COUNT_Y), 0, CLUSTER_COUNT_Y - 1);
+        y1 = glm::clamp((i32)floorf((rectMax.y * 0.5f + 0.5f) * CLUSTER_COUNT_Y), 0, CLUSTER_COUNT_Y - 1);
+    }
+
+    const __m128 cx = _mm_set1_ps(center.x);
+    const __m128 cy = _mm_set1_ps(center.y);
+    const __m128 cz = _mm_set1_ps(center.z);
+    const __m128 radiusSq = _mm_set1_ps(radius * radius);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i first = _mm_set1_epi32(x0 - 1);
+    const __m128i last = _mm_set1_epi32(x1 + 1);
+    for (i32 z = z0; z <= z1; ++z)
+    {
+        for (i32 y = y0; y <= y1; ++y)
+        {
+            for (i32 x = x0 & ~3; x <= x1; x += 4)
+            {
+                // Squared distance from the sphere center to the boxes
+                const u32 i = ClusterIndex(x, y, z);
+                __m128 dx = _mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&clusters.minX[i]), cx), _mm_sub_ps(cx, _mm_loadu_ps(&clusters.maxX[i])));
+                __m128 dy = _mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&clusters.minY[i]), cy), _mm_sub_ps(cy, _mm_loadu_ps(&clusters.maxY[i])));
+                __m128 dz = _mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&clusters.minZ[i]), cz), _mm_sub_ps(cz, _mm_loadu_ps(&clusters.maxZ[i])));
+                dx = _mm_max_ps(dx, zero);
+                dy = _mm_max_ps(dy, zero);
+                dz = _mm_max_ps(dz, zero);
+                __m128 distanceSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+                __m128 touched = _mm_cmple_ps(distanceSq, radiusSq);
+
+                // Lanes outside of the rect
+                __m128i column = _mm_add_epi32(_mm_set1_epi32(x), lane);
+                __m128i inRect = _mm_and_si128(_mm_cmpgt_epi32(column, first), _mm_cmplt_epi32(column, last));
+                const u32 mask = (u32)_mm_movemask_ps(_mm_and_ps(touched, _mm_castsi128_ps(inRect)));
+                for (u32 bit = 0; bit < 4; ++bit)
+                {
+                    if (mask & (1u << bit))
+                        clusters.hits.push_back(glm::uvec2(i + bit, lightIdx));
+                }
+            }
+        }
+    }
+}
+
+// Grows the ring buffer so a frame fits regionSize bytes
+static void ReserveClustersBuffer(App* app, u32 regionSize)
+{
+    if (app->clustersBuffer.handle && regionSize <= app->clustersBuffer.regionSize)
+        return;
+
+    u32 capacity = app->clustersBuffer.handle ? app->clustersBuffer.regionSize : KB(64);
+    while (capacity < regionSize)
+        capacity *= 2;
+
+    if (app->clustersBuffer.handle)
+        DestroyRingBuffer(app->clustersBuffer);
+    app->clustersBuffer = CreateRingBuffer(Align(capacity, app->storageBlockAlignment), GL_SHADER_STORAGE_BUFFER);
+}
+
+void BuildLightClusters(App* app, const glm::mat4& view, const glm::mat4& projection)
+{
+    PROFILE_FUNCTION();
+    LightClusters& clusters = app->lightClusters;
+    if (clusters.minX.empty() || clusters.boxesProjection != projection)
+        BuildClusterBoxes(clusters, projection, app->zNear, app->zFar);
+
+    // Directional lights first, they are not binned
+    clusters.lights.clear();
+    clusters.directionalCount = clusters.pointCount = 0;
+    for (u32 i = 0; i < app->lights.size(); ++i)
+    {
+        const Light& light = app->lights[i];
+        if (light.type != LightType::LightType_Directional)
+            continue;
+        ClusterLight gpuLight = {};
+        gpuLight.color = glm::vec4(light.color, 0.0f);
+        gpuLight.direction = glm::vec4(light.direction, 0.0f);
+        for (u32 c = 0; c < light.shadowMatrixCount; ++c)
+        {
+            gpuLight.shadowMatrices[c] = light.shadowMatrices[c];
+            gpuLight.shadowRects[c] = ShadowTileRect(app->shadowAtlas.lights[i], c);
+        }
+        gpuLight.type = ClusterLightType_Directional;
+        clusters.lights.push_back(gpuLight);
+        clusters.directionalCount++;
+    }
+
+    clusters.hits.clear();
+    for (u32 i = 0; i < app->lights.size(); ++i)
+    {
+        const Light& light = app->lights[i];
+        if (light.type != LightType::LightType_Point)
+            continue;
+        ClusterLight gpuLight = {};
+        gpuLight.color = glm::vec4(light.color, 0.0f);
+        gpuLight.direction = glm::vec4(light.direction, 0.0f);
+        gpuLight.positionRadius = glm::vec4(light.pos, light.radius);
+        for (u32 face = 0; face < 6; ++face)
+            gpuLight.shadowRects[face] = ShadowTileRect(app->shadowAtlas.lights[i], face);
+        gpuLight.type = ClusterLightType_Point;
+        clusters.pointCount++;
+
+        const glm::vec3 center = glm::vec3(view * glm::vec4(light.pos, 1.0f));
+        BinPointLight(clusters, projection, app->zNear, app->zFar, center, light.radius, (u32)clusters.lights.size());
+        clusters.lights.push_back(gpuLight);
+    }
+
+    // Counting sort of the hits by froxel
+    clusters.grid.assign(CLUSTER_COUNT, glm::uvec2(0));
+    for (const glm::uvec2& hit : clusters.hits)
+        clusters.grid[hit.x].y++;
+    u32 offset = 0;
+    clusters.usedClusters = clusters.maxClusterLights = 0;
+    for (glm::uvec2& range : clusters.grid)
+    {
+        range.x = offset;
+        offset += range.y;
+        clusters.usedClusters += range.y > 0;
+        clusters.maxClusterLights = glm::max(clusters.maxClusterLights, range.y);
+        range.y = 0;
+    }
+    clusters.indices.resize(glm::max(offset, 1u));
+    for (const glm::uvec2& hit : clusters.hits)
+    {
+        glm::uvec2& range = clusters.grid[hit.x];
+        clusters.indices[range.x + range.y++] = hit.y;
+    }
+
+    ClusterParams params = {};
+    params.view = view;
+    params.depthParams = glm::vec4(clusters.depthScale, clusters.depthBias, (f32)app->displaySize.x, (f32)app->displaySize.y);
+    params.counts = glm::uvec4(clusters.directionalCount, (u32)clusters.lights.size(), 0, 0);
+
+    const u32 alignment = app->storageBlockAlignment;
+    const u32 lightsSize = sizeof(ClusterParams) + (u32)(clusters.lights.size() * sizeof(ClusterLight));
+    const u32 gridSize = CLUSTER_COUNT * sizeof(glm::uvec2);
+    const u32 indicesSize = (u32)(clusters.indices.size() * sizeof(u32));
+    ReserveClustersBuffer(app, Align(lightsSize, alignment) + Align(gridSize, alignment) + Align(indicesSize, alignment));
+
+    Buffer& buffer = app->clustersBuffer;
+    BeginRingFrame(buffer);
+    clusters.lightsOffset = buffer.head;
+    PushAlignedData(buffer, &params, sizeof(params), alignment);
+    if (!clusters.lights.empty())
+        PushData(buffer, clusters.lights.data(), (u32)(clusters.lights.size() * sizeof(ClusterLight)));
+    clusters.lightsSize = buffer.head - clusters.lightsOffset;
+
+    AlignHead(buffer, alignment);
+    clusters.gridOffset = buffer.head;
+    PushData(buffer, clusters.grid.data(), gridSize);
+    clusters.gridSize = gridSize;
+
+    AlignHead(buffer, alignment);
+    clusters.indicesOffset = buffer.head;
+    PushData(buffer, clusters.indices.data(), indicesSize);
+    clusters.indicesSize = indicesSize;
+    EndRingFrame(buffer);
+}
+
+void BindLightClusters(App* app)
+{
+    const LightClusters& clusters = app->lightClusters;
+    const GLuint handle = app->clustersBuffer.handle;
+    GLStateBindBufferRange(app->glState, GL_SHADER_STORAGE_BUFFER, CLUSTER_LIGHTS_BINDING, handle, clusters.lightsOffset, clusters.lightsSize);
+    GLStateBindBufferRange(app->glState, GL_SHADER_STORAGE_BUFFER, CLUSTER_GRID_BINDING, handle, clusters.gridOffset, clusters.gridSize);
+    GLStateBindBufferRange(app->glState, GL_SHADER_STORAGE_BUFFER, CLUSTER_INDICES_BINDING, handle, clusters.indicesOffset, clusters.indicesSize);
+}
@@ -0,0 +1,88 @@
+//
+// light_clusters.h: Clustered lighting. The camera frustum is split in froxels, a
+// screen tile grid times exponential depth slices, and every point light is binned
+// on the CPU into the froxels its sphere touches (4 froxels of a tile row at a time
+// with SSE). The lights, the per froxel ranges and the light index list go to shader
+// storage blocks, and ClusteredLighting.glsl shades every light in a single full
+// screen pass that reads the G-buffer once. Directional lights affect every froxel
+// and are not binned. The shadows of every light come from the shadow atlas.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <glad/glad.h>
+#include "shadow_cascades.h"
+
+struct App;
+
+#define CLUSTER_COUNT_X 16 // A multiple of 4, a tile row is binned 4 froxels at a time
+#define CLUSTER_COUNT_Y 9
+#define CLUSTER_COUNT_Z 24
+#define CLUSTER_COUNT   (CLUSTER_COUNT_X * CLUSTER_COUNT_Y * CLUSTER_COUNT_Z)
+
+// Shader storage block bindings of ClusteredLighting.glsl
+#define CLUSTER_LIGHTS_BINDING  1
+#define CLUSTER_GRID_BINDING    2
+#define CLUSTER_INDICES_BINDING 3
+
+enum ClusterLightType
+{
+    ClusterLightType_Directional,
+    ClusterLightType_Point,
+};
+
+// std430 layout of ClusteredLighting.glsl
+struct ClusterLight
+{
+    glm::vec4 color;         // w unused
+    glm::vec4 direction;     // Directional lights, or the attenuation terms of point lights
+    glm::vec4 positionRadius;
+    glm::mat4 shadowMatrices[SHADOW_MAX_CASCADES]; // Directional lights
+    glm::vec4 shadowRects[6]; // Atlas tiles, see ShadowTileRect(). One per cascade of directional lights.
+    u32       type;
+    u32       padding[3];
+};
+
+// Header of the lights block
+struct ClusterParams
+{
+    glm::mat4  view;
+    glm::vec4  depthParams;  // Slice scale and bias, viewport width and height
+    glm::uvec4 counts;       // Directional lights, lights
+};
+
+struct LightClusters
+{
+    // View space boxes of the froxels, x fastest then y then z
+    std::vector<f32> minX, minY, minZ, maxX, maxY, maxZ;
+    glm::mat4 boxesProjection; // The boxes were built for
+    f32 depthScale;            // slice = log(depth) * depthScale - depthBias
+    f32 depthBias;
+
+    std::vector<ClusterLight> lights;     // Directional lights first
+    std::vector<glm::uvec2>   grid;       // Offset and count in indices of every froxel
+    std::vector<u32>          indices;
+    std::vector<glm::uvec2>   hits;       // Froxel and light pairs, before the counting sort
+    u32 directionalCount;
+    u32 pointCount;
+
+    // Sections of this frame in app->clustersBuffer
+    u32 lightsOffset, lightsSize;
+    u32 gridOffset, gridSize;
+    u32 indicesOffset, indicesSize;
+
+    // Last BuildLightClusters()
+    u32 usedClusters;
+    u32 maxClusterLights;
+};
+
+/**
+ * Bins the lights for the camera and uploads this frame's blocks. Rebuilds the
+ * froxel boxes when the projection changes. Called by Update() once the light
+ * matrices and the shadow atlas tiles are known.
+ */
+void BuildLightClusters(App* app, const glm::mat4& view, const glm::mat4& projection);
+
+// Binds the storage blocks of ClusteredLighting.glsl
+void BindLightClusters(App* app);
@@ -0,0 +1,263 @@
+#include "occlusion.h"
+#include "job_system.h"
+#include "profiler.h"
+#include <float.h>
+#include <immintrin.h>
+
+#define OCCLUSION_BAND_COUNT (OCCLUSION_HEIGHT / OCCLUSION_BAND_HEIGHT)
+#define OCCLUSION_TILES_X    (OCCLUSION_WIDTH / OCCLUSION_TILE_SIZE)
+#define OCCLUSION_TILES_Y    (OCCLUSION_HEIGHT / OCCLUSION_TILE_SIZE)
+
+static void RasterizeTriangle(OcclusionCuller& culler, const OccluderTriangle& triangle, i32 bandBegin, i32 bandEnd)
+{
+    glm::vec3 a = triangle.v[0];
+    glm::vec3 b = triangle.v[1];
+    glm::vec3 c = triangle.v[2];
+    f32 area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    if (fabsf(area) < 1e-6f)
+        return;
+    if (area < 0.0f)
+    {
+        std::swap(b, c);
+        area = -area;
+    }
+
+    const i32 minX = glm::max(0, (i32)floorf(glm::min(a.x, glm::min(b.x, c.x))));
+    const i32 maxX = glm::min(OCCLUSION_WIDTH - 1, (i32)ceilf(glm::max(a.x, glm::max(b.x, c.x))));
+    const i32 minY = glm::max(bandBegin, (i32)floorf(glm::min(a.y, glm::min(b.y, c.y))));
+    const i32 maxY = glm::min(bandEnd - 1, (i32)ceilf(glm::max(a.y, glm::max(b.y, c.y))));
+    if (minX > maxX || minY > maxY)
+        return;
+
+    // Edge functions A * x + B * y + C, positive inside. Edge i is opposite to vertex i,
+    // so its value over the area is the barycentric weight of that vertex.
+    const glm::vec3 v[3] = { a, b, c };
+    f32 edgeA[3], edgeB[3], edgeC[3];
+    for (u32 i = 0; i < 3; ++i)
+    {
+        const glm::vec3& p = v[(i + 1) % 3];
+        const glm::vec3& q = v[(i + 2) % 3];
+        edgeA[i] = p.y - q.y;
+        edgeB[i] = q.x - p.x;
+        edgeC[i] = -(edgeA[i] * p.x + edgeB[i] * p.y);
+    }
+
+    // 1/w is linear in screen space
+    const f32 invArea = 1.0f / area;
+    f32 zA = 0.0f, zB = 0.0f, zC = 0.0f;
+    for (u32 i = 0; i < 3; ++i)
+    {
+        zA += v[i].z * edgeA[i] * invArea;
+        zB += v[i].z * edgeB[i] * invArea;
+        zC += v[i].z * edgeC[i] * invArea;
+    }
+
+    const i32 startX = minX & ~3;
+    const __m128 laneX = _mm_add_ps(_mm_set1_ps((f32)startX + 0.5f), _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f));
+    const __m128 zero = _mm_setzero_ps();
+    __m128 stepE[3];
+    for (u32 i = 0; i < 3; ++i)
+        stepE[i] = _mm_set1_ps(edgeA[i] * 4.0f);
+    const __m128 stepZ = _mm_set1_ps(zA * 4.0f);
+
+    for (i32 y = minY; y <= maxY; ++y)
+    {
+        const f32 py = (f32)y + 0.5f;
+        __m128 e[3];
+        for (u32 i = 0; i < 3; ++i)
+            e[i] = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(edgeA[i]), laneX), _mm_set1_ps(edgeB[i] * py + edgeC[i]));
+        __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(zA), laneX), _mm_set1_ps(zB * py + zC));
+
+        f32* row = &culler.depth[y * OCCLUSION_WIDTH];
+        for (i32 x = startX; x <= maxX; x += 4)
+        {
+            const __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e[0], zero), _mm_cmpge_ps(e[1], zero)), _mm_cmpge_ps(e[2], zero));
+            if (_mm_movemask_ps(inside))
+            {
+                const __m128 old = _mm_loadu_ps(row + x);
+                const __m128 nearest = _mm_max_ps(old, z);
+                _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+            }
+            for (u32 i = 0; i < 3; ++i)
+                e[i] = _mm_add_ps(e[i], stepE[i]);
+            z = _mm_add_ps(z, stepZ);
+        }
+    }
+}
+
+static void RasterizeBand(OcclusionCuller& culler, u32 band)
+{
+    const i32 bandBegin = band * OCCLUSION_BAND_HEIGHT;
+    const i32 bandEnd = bandBegin + OCCLUSION_BAND_HEIGHT;
+    memset(&culler.depth[bandBegin * OCCLUSION_WIDTH], 0, OCCLUSION_BAND_HEIGHT * OCCLUSION_WIDTH * sizeof(f32));
+
+    for (const OccluderTriangle& triangle : culler.triangles)
+        RasterizeTriangle(culler, triangle, bandBegin, bandEnd);
+
+    // Farthest depth of the tiles of the band
+    for (i32 tileY = bandBegin / OCCLUSION_TILE_SIZE; tileY < bandEnd / OCCLUSION_TILE_SIZE; ++tileY)
+    {
+        for (i32 tileX = 0; tileX < OCCLUSION_TILES_X; ++tileX)
+        {
+            __m128 farthest = _mm_set1_ps(FLT_MAX);
+            for (i32 y = tileY * OCCLUSION_TILE_SIZE; y < (tileY + 1) * OCCLUSION_TILE_SIZE; ++y)
+            {
+                const f32* row = &culler.depth[y * OCCLUSION_WIDTH + tileX * OCCLUSION_TILE_SIZE];
+                for (i32 x = 0; x < OCCLUSION_TILE_SIZE; x += 4)
+                    farthest = _mm_min_ps(farthest, _mm_loadu_ps(row + x));
+            }
+            farthest = _mm_min_ps(farthest, _mm_shuffle_ps(farthest, farthest, _MM_SHUFFLE(1, 0, 3, 2)));
+            farthest = _mm_min_ps(farthest, _mm_shuffle_ps(farthest, farthest, _MM_SHUFFLE(2, 3, 0, 1)));
+            culler.tileDepth[tileY * OCCLUSION_TILES_X + tileX] = _mm_cvtss_f32(farthest);
+        }
+    }
+}
+
+void OcclusionInit(OcclusionCuller& culler)
+{
+    culler.depth.assign(OCCLUSION_WIDTH * OCCLUSION_HEIGHT, 0.0f);
+    culler.tileDepth.assign(OCCLUSION_TILES_X * OCCLUSION_TILES_Y, 0.0f);
+}
+
+void OcclusionBeginFrame(OcclusionCuller& culler, const glm::mat4& viewProjection)
+{
+    culler.viewProjection = viewProjection;
+    culler.triangles.clear();
+    culler.occluderCount = 0;
+    culler.testedCount = 0;
+    culler.occludedCount = 0;
+}
+
+static glm::vec3 ToScreen(const glm::vec4& clip)
+{
+    const f32 invW = 1.0f / clip.w;
+    return glm::vec3((clip.x * invW * 0.5f + 0.5f) * OCCLUSION_WIDTH, (clip.y * invW * 0.5f + 0.5f) * OCCLUSION_HEIGHT, invW);
+}
+
+// Clips against the near plane (z >= -w) and adds the remaining triangles
+static void AddClipTriangle(OcclusionCuller& culler, const glm::vec4& a, const glm::vec4& b, const glm::vec4& c)
+{
+    // Completely outside one of the side planes
+    const glm::vec4 v[3] = { a, b, c };
+    for (u32 axis = 0; axis < 2; ++axis)
+    {
+        if (a[axis] > a.w && b[axis] > b.w && c[axis] > c.w)
+            return;
+        if (a[axis] < -a.w && b[axis] < -b.w && c[axis] < -c.w)
+            return;
+    }
+
+    glm::vec4 polygon[4];
+    u32 count = 0;
+    for (u32 i = 0; i < 3; ++i)
+    {
+        const glm::vec4& p = v[i];
+        const glm::vec4& q = v[(i + 1) % 3];
+        const f32 dp = p.z + p.w;
+        const f32 dq = q.z + q.w;
+        if (dp >= 0.0f)
+            polygon[count++] = p;
+        if ((dp >= 0.0f) != (dq >= 0.0f))
+            polygon[count++] = p + (q - p) * (dp / (dp - dq));
+    }
+
+    for (u32 i = 2; i < count; ++i)
+        culler.triangles.push_back({ { ToScreen(polygon[0]), ToScreen(polygon[i - 1]), ToScreen(polygon[i]) } });
+}
+
+void OcclusionAddMesh(OcclusionCuller& culler, const f32* vertices, u32 stride, u32 positionOffset, const u32* indices, u32 indexCount, const glm::mat4& world)
+{
+    const glm::mat4 transform = culler.viewProjection * world;
+    const u8* bytes = (const u8*)vertices + positionOffset;
+    for (u32 i = 0; i + 2 < indexCount; i += 3)
+    {
+        glm::vec4 clip[3];
+        for (u32 j = 0; j < 3; ++j)
+        {
+            const f32* position = (const f32*)(bytes + indices[i + j] * stride);
+            clip[j] = transform * glm::vec4(position[0], position[1], position[2], 1.0f);
+        }
+        AddClipTriangle(culler, clip[0], clip[1], clip[2]);
+    }
+    culler.occluderCount++;
+}
+
+void OcclusionAddBox(OcclusionCuller& culler, const Aabb& box, const glm::mat4& world)
+{
+    static const u32 indices[] = {
+        0, 1, 3, 0, 3, 2,  4, 6, 7, 4, 7, 5, // -x, +x
+        0, 4, 5, 0, 5, 1,  2, 3, 7, 2, 7, 6, // -y, +y
+        0, 2, 6, 0, 6, 4,  1, 5, 7, 1, 7, 3, // -z, +z
+    };
+
+    f32 corners[8 * 3];
+    for (u32 i = 0; i < 8; ++i)
+    {
+        corners[i * 3 + 0] = (i & 4) ? box.max.x : box.min.x;
+        corners[i * 3 + 1] = (i & 2) ? box.max.y : box.min.y;
+        corners[i * 3 + 2] = (i & 1) ? box.max.z : box.min.z;
+    }
+    OcclusionAddMesh(culler, corners, 3 * sizeof(f32), 0, indices, ARRAY_COUNT(indices), world);
+}
+
+void OcclusionRasterize(OcclusionCuller& culler)
+{
+    PROFILE_FUNCTION();
+    // The bands don't share pixels or tiles, one per batch
+    ParallelFor(OCCLUSION_BAND_COUNT, 1, [&](u32 begin, u32 end)
+    {
+        for (u32 band = begin; band < end; ++band)
+            RasterizeBand(culler, band);
+    });
+}
+
+bool OcclusionTestAabb(OcclusionCuller& culler, const Aabb& box)
+{
+    culler.testedCount++;
+
+    glm::vec2 screenMin(FLT_MAX), screenMax(-FLT_MAX);
+    f32 nearest = 0.0f;
+    for (u32 i = 0; i < 8; ++i)
+    {
+        const glm::vec3 corner((i & 4) ? box.max.x : box.min.x, (i & 2) ? box.max.y : box.min.y, (i & 1) ? box.max.z : box.min.z);
+        const glm::vec4 clip = culler.viewProjection * glm::vec4(corner, 1.0f);
+        if (clip.z < -clip.w)
+            return true;
+        const glm::vec3 screen = ToScreen(clip);
+        screenMin = glm::min(screenMin, glm::vec2(screen));
+        screenMax = glm::max(screenMax, glm::vec2(screen));
+        nearest = glm::max(nearest, screen.z);
+    }
+
+    const i32 x0 = glm::max(0, (i32)floorf(screenMin.x));
+    const i32 x1 = glm::min(OCCLUSION_WIDTH - 1, (i32)floorf(screenMax.x));
+    const i32 y0 = glm::max(0, (i32)floorf(screenMin.y));
+    const i32 y1 = glm::min(OCCLUSION_HEIGHT - 1, (i32)floorf(screenMax.y));
+    if (x0 > x1 || y0 > y1)
+        return true; // Off screen, that's for frustum culling to decide
+
+    const __m128 nearestZ = _mm_set1_ps(nearest);
+    for (i32 y = y0; y <= y1; ++y)
+    {
+        const f32* row = &culler.depth[y * OCCLUSION_WIDTH];
+        const f32* tileRow = &culler.tileDepth[(y / OCCLUSION_TILE_SIZE) * OCCLUSION_TILES_X];
+        for (i32 x = x0 & ~3; x <= x1; x += 4)
+        {
+            // The whole tile is covered by something nearer
+            if (tileRow[x / OCCLUSION_TILE_SIZE] > nearest)
+                continue;
+
+            u32 lanes = 0xf;
+            if (x < x0)
+                lanes &= 0xf << (x0 - x);
+            if (x + 3 > x1)
+                lanes &= 0xf >> (x + 3 - x1);
+            const u32 notCovered = (u32)_mm_movemask_ps(_mm_cmple_ps(_mm_loadu_ps(row + x), nearestZ));
+            if (notCovered & lanes)
+                return true;
+        }
+    }
+
+    culler.occludedCount++;
+    return false;
+}
@@ -0,0 +1,65 @@
+//
+// occlusion.h: Software occlusion culling. A few occluders (flat or low poly models)
+// are rasterized every frame into a small depth buffer on the CPU, split in bands
+// run as job system jobs, 4 pixels at a time with SSE. Entity bounds are then tested
+// against it, first against the farthest depth of each 8x8 tile, then per pixel.
+//
+// Depth is stored as 1/w (linear in screen space, larger is nearer), 0 where no
+// occluder was drawn. No GL involved, it runs on machines without a GPU.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "culling.h"
+
+#define OCCLUSION_WIDTH       256
+#define OCCLUSION_HEIGHT      128
+#define OCCLUSION_TILE_SIZE   8
+#define OCCLUSION_BAND_HEIGHT 16 // Rows rasterized by a job, a multiple of the tile size
+
+// Screen space triangle: x and y in pixels, z = 1/w
+struct OccluderTriangle
+{
+    glm::vec3 v[3];
+};
+
+struct OcclusionCuller
+{
+    std::vector<f32> depth;     // OCCLUSION_WIDTH * OCCLUSION_HEIGHT
+    std::vector<f32> tileDepth; // Farthest depth of every tile
+    std::vector<OccluderTriangle> triangles;
+    glm::mat4 viewProjection;
+
+    // Since OcclusionBeginFrame()
+    u32 occluderCount;
+    u32 testedCount;
+    u32 occludedCount;
+};
+
+void OcclusionInit(OcclusionCuller& culler);
+
+// Forgets the occluders of the last frame
+void OcclusionBeginFrame(OcclusionCuller& culler, const glm::mat4& viewProjection);
+
+/**
+ * Adds the triangles of an indexed mesh, position being 3 floats at positionOffset
+ * bytes of every stride bytes. Triangles are clipped against the near plane here,
+ * rasterization waits for OcclusionRasterize().
+ */
+void OcclusionAddMesh(OcclusionCuller& culler, const f32* vertices, u32 stride, u32 positionOffset, const u32* indices, u32 indexCount, const glm::mat4& world);
+
+// Adds the 12 triangles of a box, for models that are (mostly) solid boxes
+void OcclusionAddBox(OcclusionCuller& culler, const Aabb& box, const glm::mat4& world);
+
+/**
+ * Clears the depth buffer and rasterizes the occluders with ParallelFor(), so from a
+ * job system worker. Returns once every band is done.
+ */
+void OcclusionRasterize(OcclusionCuller& culler);
+
+/**
+ * Returns false if the world space box is completely hidden behind the occluders.
+ * Boxes crossing the near plane are always visible.
+ */
+bool OcclusionTestAabb(OcclusionCuller& culler, const Aabb& box);
@@ -16,9 +16,13 @@
 #endif
 
 #include "engine.h"
+#include "benchmark.h"
+#include "profiler.h"
+#include "job_system.h"
 
 #include <GLFW/glfw3.h>
 #include <stdio.h>
+#include <string.h>
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
 #include <imgui_impl_opengl3.h>
@@ -107,16 +111,6 @@ void OnGlfwResizeFramebuffer(GLFWwindow* window, int width, int height)
     App* app = (App*)glfwGetWindowUserPointer(window);
     app->displaySize = vec2(width, height);
     glViewport(0, 0, app->displaySize.x, app->displaySize.y);
-
-    //resize framebuffer textures
-    for (unsigned int i = 0; i < app->ColorAttachmentHandles.size(); ++i)
-    {
-        glBindTexture(GL_TEXTURE_2D, app->ColorAttachmentHandles[i]);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_FLOAT, NULL);
-    }
-    glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, app->displaySize.x, app->displaySize.y, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL);
-    glBindTexture(GL_TEXTURE_2D, 0);
 }
 
 void OnGlfwCloseWindow(GLFWwindow* window)
@@ -125,13 +119,168 @@ void OnGlfwCloseWindow(GLFWwindow* window)
     app->isRunning = false;
 }
 
-int main()
+void SetGlfwContextHints()
+{
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+}
+
+// Loader of the current context, set once the window or the headless context is created
+static GLADloadproc GLProcLoader = NULL;
+
+// Offscreen OpenGL 4.3 core context of the headless benchmark: an invisible window, so
+// it still needs a desktop (X11 or Wayland on Linux)
+struct HeadlessContext
+{
+    GLFWwindow* window;
+};
+
+bool CreateHeadlessContext(const BenchmarkSettings& settings, HeadlessContext& headless)
+{
+    glfwSetErrorCallback(OnGlfwError);
+    if (!glfwInit())
+        return false;
+
+    SetGlfwContextHints();
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    headless.window = glfwCreateWindow(settings.resolution.x, settings.resolution.y, WINDOW_TITLE, NULL, NULL);
+    if (!headless.window)
+    {
+        glfwTerminate();
+        return false;
+    }
+    glfwMakeContextCurrent(headless.window);
+    return true;
+}
+
+void DestroyHeadlessContext(HeadlessContext& headless)
+{
+    glfwDestroyWindow(headless.window);
+    glfwTerminate();
+}
+
+int RunHeadless(App& app, const BenchmarkSettings& settings)
+{
+    if (strcmp(settings.mode, "quad") == 0)
+        app.mode = Mode_TexturedQuad;
+    else if (strcmp(settings.mode, "patrick") == 0)
+        app.mode = Mode_Patrick;
+    else
+    {
+        ELOG("Unknown benchmark mode %s", settings.mode);
+        return -1;
+    }
+
+    const u32 totalFrames = settings.warmupFrames + settings.frameCount;
+
+    // One query per frame, only read back once all frames have been submitted
+    std::vector<GLuint> gpuQueries(totalFrames);
+    glGenQueries(totalFrames, gpuQueries.data());
+
+    std::vector<BenchmarkFrame> frames(totalFrames);
+
+    // The frames are measured with every model and texture in, not the placeholders
+    FinishStreaming(&app);
+
+    f64 lastFrameTime = glfwGetTime();
+    for (u32 frameIdx = 0; frameIdx < totalFrames; ++frameIdx)
+    {
+        ProfilerBeginFrame();
+
+        f64 cpuBegin = glfwGetTime();
+        glBeginQuery(GL_TIME_ELAPSED, gpuQueries[frameIdx]);
+
+        Update(&app);
+        Render(&app);
+
+        glEndQuery(GL_TIME_ELAPSED);
+        f64 cpuEnd = glfwGetTime();
+
+        frames[frameIdx].cpuMs = (cpuEnd - cpuBegin) * 1000.0;
+        frames[frameIdx].drawCalls = app.stats.drawCalls;
+        frames[frameIdx].stateChanges = app.stats.stateChanges;
+
+        // Nothing to present offscreen, the frames are paced by the GPU queries only
+        f64 currentFrameTime = glfwGetTime();
+        app.deltaTime = (f32)(currentFrameTime - lastFrameTime);
+        lastFrameTime = currentFrameTime;
+
+        GlobalFrameArenaHead = 0;
+        ProfilerEndFrame();
+    }
+
+    glFinish();
+    for (u32 frameIdx = 0; frameIdx < totalFrames; ++frameIdx)
+    {
+        GLuint64 elapsedNs = 0;
+        glGetQueryObjectui64v(gpuQueries[frameIdx], GL_QUERY_RESULT, &elapsedNs);
+        frames[frameIdx].gpuMs = (f64)elapsedNs / 1000000.0;
+    }
+    glDeleteQueries(totalFrames, gpuQueries.data());
+
+    frames.erase(frames.begin(), frames.begin() + settings.warmupFrames);
+
+    // Remapping the ring buffers every frame would measure the fallback, not the renderer
+    const bool persistentMapping = app.cbuffer.persistent && app.objectsBuffer.persistent &&
+                                   app.instanceBuffer.persistent && app.clustersBuffer.persistent &&
+                                   app.drawCommandsBuffer.persistent;
+
+    const char* renderer = (const char*)glGetString(GL_RENDERER);
+    return WriteBenchmarkReport(settings, renderer, persistentMapping, frames) ? 0 : -1;
+}
+
+int main(int argc, char** argv)
 {
+    BenchmarkSettings benchmark = {};
+    if (!ParseBenchmarkArgs(argc, argv, benchmark))
+        return -1;
+
+    if (benchmark.jobsBenchmark)
+        return RunJobsBenchmark(benchmark);
+    if (benchmark.occlusionBenchmark)
+        return RunOcclusionBenchmark(benchmark);
+    if (benchmark.occlusionCheck)
+        return RunOcclusionCheck(benchmark);
+
     App app         = {};
     app.deltaTime   = 1.0f/60.0f;
-    app.displaySize = ivec2(WINDOW_WIDTH, WINDOW_HEIGHT);
+    app.displaySize = benchmark.headless ? benchmark.resolution : ivec2(WINDOW_WIDTH, WINDOW_HEIGHT);
     app.isRunning   = true;
 
+    if (benchmark.headless)
+    {
+        HeadlessContext headless = {};
+        if (!CreateHeadlessContext(benchmark, headless))
+        {
+            ELOG("Failed to create an offscreen OpenGL 4.3 context\n");
+            return -1;
+        }
+
+        GLProcLoader = (GLADloadproc) glfwGetProcAddress;
+        if (!gladLoadGLLoader(GLProcLoader))
+        {
+            ELOG("Failed to initialize OpenGL context\n");
+            DestroyHeadlessContext(headless);
+            return -1;
+        }
+
+        GlobalFrameArenaMemory = (u8*)malloc(GLOBAL_FRAME_ARENA_SIZE);
+
+        ProfilerInit();
+        JobSystemInit(benchmark.jobThreads, benchmark.pinThreads);
+        Init(&app);
+        int result = RunHeadless(app, benchmark);
+
+        GpuTimersShutdown(app.gpuTimers);
+        JobSystemShutdown();
+        StreamingShutdown(app.streaming);
+        free(GlobalFrameArenaMemory);
+        DestroyHeadlessContext(headless);
+        return result;
+    }
+
 		glfwSetErrorCallback(OnGlfwError);
 
     if (!glfwInit())
@@ -140,10 +289,7 @@ int main()
         return -1;
     }
 
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    SetGlfwContextHints();
 
     GLFWwindow* window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
     if (!window)
@@ -165,7 +311,8 @@ int main()
     glfwMakeContextCurrent(window);
 
     // Load all OpenGL functions using the glfw loader function
-    if (!gladLoadGLLoader((GLADloadproc) glfwGetProcAddress))
+    GLProcLoader = (GLADloadproc) glfwGetProcAddress;
+    if (!gladLoadGLLoader(GLProcLoader))
     {
         ELOG("Failed to initialize OpenGL context\n");
         return -1;
@@ -210,10 +357,14 @@ int main()
 
     GlobalFrameArenaMemory = (u8*)malloc(GLOBAL_FRAME_ARENA_SIZE);
 
+    ProfilerInit();
+    JobSystemInit(benchmark.jobThreads, benchmark.pinThreads);
     Init(&app);
 
     while (app.isRunning)
     {
+        ProfilerBeginFrame();
+
         // Tell GLFW to call platform callbacks
         glfwPollEvents();
 
@@ -262,7 +413,10 @@ int main()
         }
 
         // Present image on screen
-        glfwSwapBuffers(window);
+        {
+            PROFILE_SCOPE("Swap buffers");
+            glfwSwapBuffers(window);
+        }
 
         // Frame time
         f64 currentFrameTime = glfwGetTime();
@@ -271,8 +425,13 @@ int main()
 
         // Reset frame allocator
         GlobalFrameArenaHead = 0;
+
+        ProfilerEndFrame();
     }
 
+    GpuTimersShutdown(app.gpuTimers);
+    JobSystemShutdown();
+    StreamingShutdown(app.streaming);
     free(GlobalFrameArenaMemory);
 
     ImGui_ImplOpenGL3_Shutdown();
@@ -419,3 +578,23 @@ void LogString(const char* str)
     fprintf(stderr, "%s\n", str);
 #endif
 }
+
+void WriteJsonString(FILE* file, const char* str)
+{
+    fputc('"', file);
+    for (const char* c = str; *c; ++c)
+    {
+        if (*c == '"' || *c == '\\')
+            fprintf(file, "\\%c", *c);
+        else if ((u8)*c < 0x20)
+            fprintf(file, "\\u%04x", (u8)*c);
+        else
+            fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+void* GetGLProcAddress(const char* name)
+{
+    return GLProcLoader(name);
+}
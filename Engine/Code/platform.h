@@ -87,6 +87,18 @@ u64 GetFileLastWriteTimestamp(const char *filepath);
  */
 void LogString(const char* str);
 
+/**
+ * Writes the string quoted as a JSON string. Quotes, backslashes and control characters
+ * are escaped, so driver strings and zone names can be written as they are.
+ */
+void WriteJsonString(FILE* file, const char* str);
+
+/**
+ * Returns the address of an OpenGL entry point (or NULL if the driver doesn't have it).
+ * Used for functions newer than the GL version the glad loader was generated for.
+ */
+void* GetGLProcAddress(const char* name);
+
 #define ILOG(...)                 \
 {                                 \
 char logBuffer[1024] = {};        \
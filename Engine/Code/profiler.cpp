@@ -0,0 +1,265 @@
+#include "profiler.h"
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define PROFILER_HAS_RDTSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILER_HAS_RDTSC 1
+#else
+#define PROFILER_HAS_RDTSC 0
+#endif
+
+typedef std::chrono::steady_clock ProfilerClock;
+
+static ProfilerThreadBuffer* ThreadBuffers[PROFILER_MAX_THREADS];
+static std::atomic<u32>      ThreadCount(0);
+static std::mutex            ThreadRegistrationMutex;
+static thread_local ProfilerThreadBuffer* LocalThreadBuffer = NULL;
+
+static ProfilerFrame    FrameHistory[PROFILER_MAX_FRAMES];
+static u32              CompletedFrameCount = 0;
+static std::atomic<u32> CurrentFrame(0);
+static u64              CurrentFrameStart = 0;
+static std::atomic<bool> Paused(false);
+
+static u64                       CalibrationTicks = 0;
+static ProfilerClock::time_point CalibrationTime;
+static f64                       MsPerTick = 1.0e-6;
+
+u64 ProfilerTicks()
+{
+#if PROFILER_HAS_RDTSC
+    return __rdtsc();
+#else
+    return (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(ProfilerClock::now().time_since_epoch()).count();
+#endif
+}
+
+f64 ProfilerTicksToMs(u64 ticks)
+{
+    return (f64)ticks * MsPerTick;
+}
+
+static void CalibrateTicks()
+{
+#if PROFILER_HAS_RDTSC
+    f64 elapsedMs = std::chrono::duration<f64, std::milli>(ProfilerClock::now() - CalibrationTime).count();
+    u64 elapsedTicks = ProfilerTicks() - CalibrationTicks;
+    if (elapsedTicks > 0 && elapsedMs > 0.0)
+        MsPerTick = elapsedMs / (f64)elapsedTicks;
+#else
+    MsPerTick = 1.0e-6;
+#endif
+}
+
+void ProfilerInit()
+{
+    CalibrationTicks = ProfilerTicks();
+    CalibrationTime = ProfilerClock::now();
+
+    // Rough estimate for the first frames, refined every frame afterwards
+    while (std::chrono::duration<f64, std::milli>(ProfilerClock::now() - CalibrationTime).count() < 5.0);
+    CalibrateTicks();
+
+    ProfilerSetThreadName("Main thread");
+}
+
+static ProfilerThreadBuffer* GetThreadBuffer()
+{
+    if (!LocalThreadBuffer)
+    {
+        std::lock_guard<std::mutex> lock(ThreadRegistrationMutex);
+        u32 threadIdx = ThreadCount.load();
+        ASSERT(threadIdx < PROFILER_MAX_THREADS, "Too many threads registered in the profiler");
+
+        ProfilerThreadBuffer* buffer = new ProfilerThreadBuffer;
+        buffer->zoneCount.store(0);
+        buffer->threadIdx = threadIdx;
+        buffer->depth = 0;
+        snprintf(buffer->name, sizeof(buffer->name), "Thread %u", threadIdx);
+
+        ThreadBuffers[threadIdx] = buffer;
+        ThreadCount.store(threadIdx + 1);
+        LocalThreadBuffer = buffer;
+    }
+    return LocalThreadBuffer;
+}
+
+void ProfilerSetThreadName(const char* name)
+{
+    ProfilerThreadBuffer* buffer = GetThreadBuffer();
+    snprintf(buffer->name, sizeof(buffer->name), "%s", name);
+}
+
+ProfileScope::ProfileScope(const char* zoneName)
+{
+    ProfilerThreadBuffer* buffer = GetThreadBuffer();
+    name = zoneName;
+    depth = buffer->depth++;
+    start = ProfilerTicks();
+}
+
+ProfileScope::~ProfileScope()
+{
+    u64 end = ProfilerTicks();
+    ProfilerThreadBuffer* buffer = LocalThreadBuffer;
+    buffer->depth--;
+
+    if (Paused.load(std::memory_order_relaxed))
+        return;
+
+    // The slot still holds the zone from PROFILER_MAX_ZONES_PER_THREAD zones ago, which a
+    // reader may be copying: it sees zoneCount move past it and drops the copy
+    u64 zoneIdx = buffer->zoneCount.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    ProfileZone& zone = buffer->zones[zoneIdx % PROFILER_MAX_ZONES_PER_THREAD];
+    zone.name = name;
+    zone.start = start;
+    zone.end = end;
+    zone.frame = CurrentFrame.load(std::memory_order_relaxed);
+    zone.depth = depth;
+    buffer->zoneCount.store(zoneIdx + 1, std::memory_order_release);
+}
+
+void ProfilerBeginFrame()
+{
+    CurrentFrameStart = ProfilerTicks();
+    CalibrateTicks();
+}
+
+void ProfilerEndFrame()
+{
+    if (!Paused.load())
+    {
+        ProfilerFrame& frame = FrameHistory[CompletedFrameCount % PROFILER_MAX_FRAMES];
+        frame.index = CurrentFrame.load();
+        frame.start = CurrentFrameStart;
+        frame.end = ProfilerTicks();
+        CompletedFrameCount++;
+    }
+    CurrentFrame.fetch_add(1);
+}
+
+void ProfilerSetPaused(bool paused)
+{
+    Paused.store(paused);
+}
+
+bool ProfilerIsPaused()
+{
+    return Paused.load();
+}
+
+u32 ProfilerGetFrames(ProfilerFrame* frames, u32 maxFrames)
+{
+    u32 available = std::min<u32>(CompletedFrameCount, PROFILER_MAX_FRAMES);
+    u32 count = std::min(available, maxFrames);
+    for (u32 i = 0; i < count; ++i)
+        frames[i] = FrameHistory[(CompletedFrameCount - count + i) % PROFILER_MAX_FRAMES];
+    return count;
+}
+
+void ProfilerGetFrameZones(u32 frameIndex, std::vector<ProfileZoneView>& zones)
+{
+    zones.clear();
+    u32 threadCount = ThreadCount.load();
+    for (u32 threadIdx = 0; threadIdx < threadCount; ++threadIdx)
+    {
+        ProfilerThreadBuffer* buffer = ThreadBuffers[threadIdx];
+        u64 zoneCount = buffer->zoneCount.load(std::memory_order_acquire);
+        u64 firstZone = zoneCount > PROFILER_MAX_ZONES_PER_THREAD ? zoneCount - PROFILER_MAX_ZONES_PER_THREAD : 0;
+
+        // Zones are written when they close, so walking backwards we can stop a couple
+        // of frames before the requested one (zones spanning frames close late)
+        for (u64 zoneIdx = zoneCount; zoneIdx > firstZone; --zoneIdx)
+        {
+            ProfileZone zone = buffer->zones[(zoneIdx - 1) % PROFILER_MAX_ZONES_PER_THREAD];
+
+            // The owner thread keeps writing while we copy: once it reaches the slot again
+            // the copy may be torn, and every older slot is being overwritten as well
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (buffer->zoneCount.load(std::memory_order_relaxed) - (zoneIdx - 1) >= PROFILER_MAX_ZONES_PER_THREAD)
+                break;
+
+            if (zone.frame == frameIndex)
+                zones.push_back({ zone, threadIdx });
+            else if (zone.frame + 2 < frameIndex)
+                break;
+        }
+    }
+
+    std::sort(zones.begin(), zones.end(), [](const ProfileZoneView& a, const ProfileZoneView& b) {
+        if (a.threadIdx != b.threadIdx)
+            return a.threadIdx < b.threadIdx;
+        if (a.zone.start != b.zone.start)
+            return a.zone.start < b.zone.start;
+        return a.zone.depth < b.zone.depth;
+    });
+}
+
+u32 ProfilerGetThreadCount()
+{
+    return ThreadCount.load();
+}
+
+const char* ProfilerGetThreadName(u32 threadIdx)
+{
+    return threadIdx < ThreadCount.load() ? ThreadBuffers[threadIdx]->name : "";
+}
+
+bool ProfilerExportChromeTrace(const char* filepath, u32 frameCount)
+{
+    std::vector<ProfilerFrame> frames(std::min<u32>(frameCount, PROFILER_MAX_FRAMES));
+    frames.resize(ProfilerGetFrames(frames.data(), (u32)frames.size()));
+    if (frames.empty())
+        return false;
+
+    FILE* file = fopen(filepath, "wb");
+    if (!file)
+    {
+        ELOG("fopen() failed writing chrome trace %s", filepath);
+        return false;
+    }
+
+    const u64 baseTicks = frames.front().start;
+    bool first = true;
+    fprintf(file, "{\"traceEvents\":[\n");
+
+    for (u32 threadIdx = 0; threadIdx < ProfilerGetThreadCount(); ++threadIdx)
+    {
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":", first ? "" : ",\n", threadIdx);
+        WriteJsonString(file, ProfilerGetThreadName(threadIdx));
+        fprintf(file, "}}");
+        first = false;
+    }
+
+    std::vector<ProfileZoneView> zones;
+    for (const ProfilerFrame& frame : frames)
+    {
+        fprintf(file, ",\n{\"name\":\"Frame %u\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                frame.index, PROFILER_MAX_THREADS,
+                ProfilerTicksToMs(frame.start - baseTicks) * 1000.0,
+                ProfilerTicksToMs(frame.end - frame.start) * 1000.0);
+
+        ProfilerGetFrameZones(frame.index, zones);
+        for (const ProfileZoneView& view : zones)
+        {
+            if (view.zone.start < baseTicks)
+                continue;
+            fprintf(file, ",\n{\"name\":");
+            WriteJsonString(file, view.zone.name);
+            fprintf(file, ",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    view.threadIdx,
+                    ProfilerTicksToMs(view.zone.start - baseTicks) * 1000.0,
+                    ProfilerTicksToMs(view.zone.end - view.zone.start) * 1000.0);
+        }
+    }
+
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(file);
+    return true;
+}
@@ -0,0 +1,103 @@
+//
+// profiler.h: Hierarchical CPU profiler. Scoped zones are recorded into per-thread
+// ring buffers with the time stamp counter, so opening/closing a zone costs a couple
+// of rdtsc and a store. Completed frames can be inspected in the UI or dumped as a
+// Chrome trace (chrome://tracing, https://ui.perfetto.dev).
+//
+
+#pragma once
+
+#include "platform.h"
+#include <atomic>
+
+#define PROFILER_MAX_ZONES_PER_THREAD 32768
+#define PROFILER_MAX_FRAMES           256
+#define PROFILER_MAX_THREADS          64
+
+struct ProfileZone
+{
+    const char* name;  // Has to be a string literal (or outlive the profiler)
+    u64         start; // Ticks
+    u64         end;   // Ticks
+    u32         frame;
+    u32         depth;
+};
+
+struct ProfilerThreadBuffer
+{
+    ProfileZone      zones[PROFILER_MAX_ZONES_PER_THREAD];
+    std::atomic<u64> zoneCount; // Total zones written, the ring index is zoneCount % PROFILER_MAX_ZONES_PER_THREAD
+    u32              threadIdx;
+    u32              depth;
+    char             name[32];
+};
+
+struct ProfilerFrame
+{
+    u32 index;
+    u64 start; // Ticks
+    u64 end;   // Ticks
+};
+
+struct ProfileScope
+{
+    const char* name;
+    u64         start;
+    u32         depth;
+
+    ProfileScope(const char* zoneName);
+    ~ProfileScope();
+};
+
+#define PROFILER_CONCAT_INNER(a, b) a##b
+#define PROFILER_CONCAT(a, b) PROFILER_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILER_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_FUNCTION() PROFILE_SCOPE(__FUNCTION__)
+
+u64 ProfilerTicks();
+
+f64 ProfilerTicksToMs(u64 ticks);
+
+void ProfilerInit();
+
+/**
+ * Frame markers, called by the platform layer around each iteration of the main loop.
+ */
+void ProfilerBeginFrame();
+void ProfilerEndFrame();
+
+/**
+ * Names the calling thread in the flame view and in the exported traces.
+ */
+void ProfilerSetThreadName(const char* name);
+
+/**
+ * While paused, nothing is recorded: scopes and frames that end are dropped, so the
+ * history the UI shows stays frozen until recording resumes.
+ */
+void ProfilerSetPaused(bool paused);
+bool ProfilerIsPaused();
+
+/**
+ * Returns the completed frames still in the history, the oldest first.
+ */
+u32 ProfilerGetFrames(ProfilerFrame* frames, u32 maxFrames);
+
+/**
+ * Collects the zones of a completed frame. Zones are grouped by thread (threadIdx)
+ * and sorted by start time. Zones their thread overwrites while they are copied are left out.
+ */
+struct ProfileZoneView
+{
+    ProfileZone zone;
+    u32         threadIdx;
+};
+void ProfilerGetFrameZones(u32 frameIndex, std::vector<ProfileZoneView>& zones);
+
+u32 ProfilerGetThreadCount();
+const char* ProfilerGetThreadName(u32 threadIdx);
+
+/**
+ * Writes the last frameCount completed frames as a Chrome trace_event JSON file.
+ */
+bool ProfilerExportChromeTrace(const char* filepath, u32 frameCount);
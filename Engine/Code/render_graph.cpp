@@ -0,0 +1,191 @@
+#include "render_graph.h"
+#include "engine.h"
+#include "profiler.h"
+#include <algorithm>
+
+void RenderGraphBegin(RenderGraph& graph)
+{
+    graph.resources.clear();
+    graph.passes.clear();
+}
+
+RenderResource RenderGraphCreateTexture(RenderGraph& graph, const char* name, const RenderTargetDesc& desc)
+{
+    RenderGraphResource resource = {};
+    resource.name = name;
+    resource.desc = desc;
+    graph.resources.push_back(resource);
+    return (RenderResource)graph.resources.size() - 1;
+}
+
+RenderResource RenderGraphImport(RenderGraph& graph, const char* name, GLuint handle)
+{
+    RenderGraphResource resource = {};
+    resource.name = name;
+    resource.handle = handle;
+    resource.imported = true;
+    graph.resources.push_back(resource);
+    return (RenderResource)graph.resources.size() - 1;
+}
+
+u32 RenderGraphAddPass(RenderGraph& graph, const char* name, RenderPassFunction execute, bool sideEffects)
+{
+    RenderGraphPass pass = {};
+    pass.name = name;
+    pass.execute = execute;
+    for (RenderResource& write : pass.colorWrites)
+        write = RENDER_RESOURCE_NONE;
+    pass.depthWrite = RENDER_RESOURCE_NONE;
+    pass.sideEffects = sideEffects;
+    graph.passes.push_back(pass);
+    return (u32)graph.passes.size() - 1;
+}
+
+void RenderGraphRead(RenderGraph& graph, u32 pass, RenderResource resource)
+{
+    ASSERT(resource < graph.resources.size(), "Unknown render graph resource");
+    graph.passes[pass].reads.push_back(resource);
+}
+
+void RenderGraphWrite(RenderGraph& graph, u32 pass, RenderResource resource)
+{
+    ASSERT(resource < graph.resources.size(), "Unknown render graph resource");
+    graph.passes[pass].writes.push_back(resource);
+}
+
+void RenderGraphWriteColor(RenderGraph& graph, u32 pass, RenderResource resource, u32 location)
+{
+    ASSERT(location < RENDER_TARGET_MAX_COLOR, "Colour write location out of range");
+    ASSERT(!graph.resources[resource].imported && !IsDepthFormat(graph.resources[resource].desc.internalFormat), "Only transient colour textures are attached");
+    RenderGraphWrite(graph, pass, resource);
+    graph.passes[pass].colorWrites[location] = resource;
+}
+
+void RenderGraphWriteDepth(RenderGraph& graph, u32 pass, RenderResource resource)
+{
+    ASSERT(!graph.resources[resource].imported && IsDepthFormat(graph.resources[resource].desc.internalFormat), "Only transient depth textures are attached");
+    RenderGraphWrite(graph, pass, resource);
+    graph.passes[pass].depthWrite = resource;
+}
+
+void RenderGraphCompile(RenderGraph& graph)
+{
+    PROFILE_FUNCTION();
+
+    // From the last pass back, a pass is kept if it has side effects or a kept pass
+    // reads something it writes; then what it reads is needed too
+    std::vector<bool> needed(graph.resources.size(), false);
+    graph.culledPasses = 0;
+    for (u32 p = (u32)graph.passes.size(); p-- > 0;)
+    {
+        RenderGraphPass& pass = graph.passes[p];
+        pass.culled = !pass.sideEffects;
+        for (RenderResource write : pass.writes)
+            pass.culled = pass.culled && !needed[write];
+        if (pass.culled)
+        {
+            graph.culledPasses++;
+            continue;
+        }
+        for (RenderResource read : pass.reads)
+            needed[read] = true;
+    }
+
+    // Lifetimes of the transients, over the kept passes
+    for (RenderGraphResource& resource : graph.resources)
+        resource.firstPass = resource.lastPass = UINT32_MAX;
+    for (u32 p = 0; p < graph.passes.size(); ++p)
+    {
+        const RenderGraphPass& pass = graph.passes[p];
+        if (pass.culled)
+            continue;
+        for (RenderResource write : pass.writes)
+        {
+            RenderGraphResource& resource = graph.resources[write];
+            if (resource.firstPass == UINT32_MAX)
+                resource.firstPass = p;
+            resource.lastPass = p;
+        }
+        for (RenderResource read : pass.reads)
+        {
+            RenderGraphResource& resource = graph.resources[read];
+            ASSERT(resource.imported || resource.firstPass != UINT32_MAX, "Transient read before any pass writes it");
+            resource.lastPass = p;
+        }
+    }
+
+    graph.transientCount = 0;
+    for (const RenderGraphResource& resource : graph.resources)
+        graph.transientCount += !resource.imported && resource.firstPass != UINT32_MAX;
+}
+
+static void BindPassTargets(App* app, const RenderGraph& graph, const RenderGraphPass& pass)
+{
+    RenderResource first = pass.depthWrite;
+    GLuint colors[RENDER_TARGET_MAX_COLOR];
+    GLenum buffers[RENDER_TARGET_MAX_COLOR];
+    u32 bufferCount = 0;
+    for (u32 i = 0; i < RENDER_TARGET_MAX_COLOR; ++i)
+    {
+        colors[i] = RenderGraphTexture(graph, pass.colorWrites[i]);
+        buffers[i] = GL_NONE;
+        if (pass.colorWrites[i] == RENDER_RESOURCE_NONE)
+            continue;
+        buffers[i] = GL_COLOR_ATTACHMENT0 + i;
+        bufferCount = i + 1;
+        first = pass.colorWrites[i];
+    }
+    if (first == RENDER_RESOURCE_NONE)
+        return;
+
+    GLStateBindFramebuffer(app->glState, RenderTargetFramebuffer(app, colors, RenderGraphTexture(graph, pass.depthWrite)));
+    if (bufferCount)
+        GLStateDrawBuffers(app->glState, bufferCount, buffers);
+    else
+        GLStateDrawBuffer(app->glState, GL_NONE);
+    //the requested size, the pool textures can be bigger
+    const glm::ivec2 size = graph.resources[first].desc.size;
+    GLStateViewport(app->glState, 0, 0, size.x, size.y);
+}
+
+void RenderGraphExecute(App* app, RenderGraph& graph)
+{
+    PROFILE_FUNCTION();
+
+    std::vector<GLuint> textures;
+    for (u32 p = 0; p < graph.passes.size(); ++p)
+    {
+        const RenderGraphPass& pass = graph.passes[p];
+        if (pass.culled)
+            continue;
+
+        for (RenderGraphResource& resource : graph.resources)
+        {
+            if (!resource.imported && resource.firstPass == p)
+            {
+                resource.handle = AcquireRenderTarget(app, resource.desc);
+                if (std::find(textures.begin(), textures.end(), resource.handle) == textures.end())
+                    textures.push_back(resource.handle);
+            }
+        }
+
+        BindPassTargets(app, graph, pass);
+        pass.execute(app, graph);
+
+        // The texture goes back to the pool for the next passes, the handle stays
+        // valid until the end of the frame
+        for (const RenderGraphResource& resource : graph.resources)
+        {
+            if (!resource.imported && resource.lastPass == p)
+                ReleaseRenderTarget(app, resource.handle);
+        }
+    }
+    graph.pooledCount = (u32)textures.size();
+}
+
+GLuint RenderGraphTexture(const RenderGraph& graph, RenderResource resource)
+{
+    if (resource >= graph.resources.size())
+        return 0;
+    return graph.resources[resource].handle;
+}
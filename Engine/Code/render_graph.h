@@ -0,0 +1,98 @@
+//
+// render_graph.h: The passes of a frame, declared with the resources they read and
+// write and rebuilt by Render() every frame. Compiling walks the passes backwards from
+// the ones with side effects (the screen, history kept for the next frame) and culls
+// every pass whose writes no kept pass reads; the shadows and the lighting are skipped
+// while a G-buffer attachment is on screen, for instance. Each transient texture then
+// lives from the first to the last kept pass that uses it. Executing takes it from a
+// pool when its lifetime starts and gives it back when it ends, so a later transient
+// with the same description aliases the storage of an earlier one, and binds a
+// framebuffer with the colour and depth writes of each pass before running it. The
+// textures and framebuffers come from the render target pool (render_targets.h).
+//
+// Passes run in the order they were added, which has to be a valid one: a pass reads
+// what earlier passes wrote. A write is taken to add to what the earlier writers left
+// (the lighting adds stencil to the depth), so they are kept with it. Imported resources
+// (the shadow atlas, buffers) are only tracked for the culling, the passes writing them
+// bind their own targets.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "render_targets.h"
+#include <glad/glad.h>
+#include <functional>
+
+struct App;
+struct RenderGraph;
+
+#define RENDER_RESOURCE_NONE 0xffffffff
+
+typedef u32 RenderResource; // Index in RenderGraph::resources, valid for one frame
+typedef std::function<void(App* app, const RenderGraph& graph)> RenderPassFunction;
+
+struct RenderGraphResource
+{
+    const char*      name;
+    RenderTargetDesc desc;     // Transient textures
+    GLuint           handle;   // Imported, or the pool texture of the transient
+    bool             imported;
+    u32              firstPass; // Kept passes using it, UINT32_MAX if none
+    u32              lastPass;
+};
+
+struct RenderGraphPass
+{
+    const char*                 name;
+    RenderPassFunction          execute;
+    std::vector<RenderResource> reads;
+    std::vector<RenderResource> writes;      // Every write, attached or not
+    RenderResource colorWrites[RENDER_TARGET_MAX_COLOR]; // By output location
+    RenderResource depthWrite;
+    bool sideEffects;
+    bool culled;
+};
+
+struct RenderGraph
+{
+    std::vector<RenderGraphResource> resources;
+    std::vector<RenderGraphPass>     passes;
+
+    // Last RenderGraphCompile()/RenderGraphExecute()
+    u32 culledPasses;
+    u32 transientCount; // Transient textures of the kept passes
+    u32 pooledCount;    // Pool textures behind them, fewer when lifetimes alias
+};
+
+// Forgets the passes and resources of the last frame
+void RenderGraphBegin(RenderGraph& graph);
+
+RenderResource RenderGraphCreateTexture(RenderGraph& graph, const char* name, const RenderTargetDesc& desc);
+RenderResource RenderGraphImport(RenderGraph& graph, const char* name, GLuint handle);
+
+/**
+ * Adds a pass, run by RenderGraphExecute() after the passes added before it. Passes
+ * with side effects are never culled.
+ */
+u32 RenderGraphAddPass(RenderGraph& graph, const char* name, RenderPassFunction execute, bool sideEffects = false);
+
+void RenderGraphRead(RenderGraph& graph, u32 pass, RenderResource resource);
+// A write the pass does on its own: an imported texture, a buffer, an image store
+void RenderGraphWrite(RenderGraph& graph, u32 pass, RenderResource resource);
+// Attached to the framebuffer of the pass at the fragment output location
+void RenderGraphWriteColor(RenderGraph& graph, u32 pass, RenderResource resource, u32 location);
+void RenderGraphWriteDepth(RenderGraph& graph, u32 pass, RenderResource resource);
+
+// Culls the passes and computes the transient lifetimes
+void RenderGraphCompile(RenderGraph& graph);
+
+/**
+ * Runs the kept passes in order. The framebuffer of a pass with attachments is bound
+ * with its draw buffers and a full viewport; the others get the state the last pass
+ * left.
+ */
+void RenderGraphExecute(App* app, RenderGraph& graph);
+
+// GL handle of a resource, 0 for a transient only used by culled passes
+GLuint RenderGraphTexture(const RenderGraph& graph, RenderResource resource);
@@ -0,0 +1,685 @@
+#include "render_queue.h"
+#include "engine.h"
+#include "buffer_management.h"
+#include <algorithm>
+
+u64 MakeSortKey(RenderPass pass, u32 programIdx, u32 materialIdx, u32 vertexFormatIdx, u32 depth)
+{
+    u64 key = (u64)pass & ((1 << SORT_KEY_PASS_BITS) - 1);
+    key = (key << SORT_KEY_PROGRAM_BITS) | (programIdx & ((1 << SORT_KEY_PROGRAM_BITS) - 1));
+    key = (key << SORT_KEY_MATERIAL_BITS) | (materialIdx & ((1 << SORT_KEY_MATERIAL_BITS) - 1));
+    key = (key << SORT_KEY_FORMAT_BITS) | (vertexFormatIdx & ((1 << SORT_KEY_FORMAT_BITS) - 1));
+    key = (key << SORT_KEY_DEPTH_BITS) | (depth & ((1 << SORT_KEY_DEPTH_BITS) - 1));
+    return key;
+}
+
+void RadixSortProxies(std::vector<RenderProxy>& proxies, std::vector<RenderProxy>& scratch)
+{
+    const u32 count = (u32)proxies.size();
+    scratch.resize(count);
+
+    for (u32 shift = 0; shift < 64; shift += 8)
+    {
+        u32 histogram[256] = {};
+        for (u32 i = 0; i < count; ++i)
+            histogram[(proxies[i].sortKey >> shift) & 0xff]++;
+
+        // Every key has the same digit, nothing to move
+        if (count == 0 || histogram[(proxies[0].sortKey >> shift) & 0xff] == count)
+            continue;
+
+        u32 offset = 0;
+        for (u32 digit = 0; digit < 256; ++digit)
+        {
+            u32 digitCount = histogram[digit];
+            histogram[digit] = offset;
+            offset += digitCount;
+        }
+
+        for (u32 i = 0; i < count; ++i)
+            scratch[histogram[(proxies[i].sortKey >> shift) & 0xff]++] = proxies[i];
+
+        proxies.swap(scratch);
+    }
+}
+
+static u32 SelectGeometryProgram(App* app, const Material& material)
+{
+    if (material.normalsTextureIdx != 0 && app->useNormalMap)
+    {
+        if (material.bumpTextureIdx != 0 && app->useRelifMap)
+            return app->relGeoPassIdx;
+        return app->normGeoPassIdx;
+    }
+    return app->geometryPassIdx;
+}
+
+static void PushProxy(App* app, RenderPass pass, u32 modelIdx, u32 submeshIdx, u32 programIdx, u32 materialIdx)
+{
+    const Mesh& mesh = app->meshes[app->models[modelIdx].meshIdx];
+    const Submesh& submesh = mesh.submeshes[submeshIdx];
+
+    RenderProxy proxy = {};
+    proxy.modelIdx = modelIdx;
+    proxy.submeshIdx = submeshIdx;
+    proxy.programIdx = programIdx;
+    proxy.materialIdx = materialIdx;
+    proxy.vao = app->vertexFormats[submesh.vertexFormatIdx].vao;
+    proxy.indexCount = submesh.indices.size();
+    proxy.firstIndex = submesh.firstIndex;
+    proxy.baseVertex = submesh.baseVertex;
+    proxy.sortKey = MakeSortKey(pass, programIdx, materialIdx, submesh.vertexFormatIdx, 0);
+    app->renderQueue.proxies.push_back(proxy);
+}
+
+static void RebuildRenderQueue(App* app)
+{
+    PROFILE_FUNCTION();
+    RenderQueue& queue = app->renderQueue;
+    queue.proxies.clear();
+
+    // One proxy per model submesh, drawn with as many instances as entities use the model
+    for (u32 modelIdx = 0; modelIdx < app->models.size(); ++modelIdx)
+    {
+        if (queue.modelInstanceCount[modelIdx] == 0)
+            continue;
+
+        const Model& model = app->models[modelIdx];
+        const Mesh& mesh = app->meshes[model.meshIdx];
+        for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+        {
+            const u32 materialIdx = model.materialIdx[i];
+            PushProxy(app, RenderPass_Geometry, modelIdx, i, SelectGeometryProgram(app, app->materials[materialIdx]), materialIdx);
+            PushProxy(app, RenderPass_ShadowDirectional, modelIdx, i, app->shadowCascadesIdx, RENDER_PROXY_NO_MATERIAL);
+            PushProxy(app, RenderPass_ShadowPoint, modelIdx, i, app->usePointShadowGS ? app->shadowCubemapIdx : app->shadowCubeFaceIdx, RENDER_PROXY_NO_MATERIAL);
+        }
+    }
+
+    queue.entityCount = app->entities.size();
+    queue.modelCount = app->models.size();
+    queue.materialCount = app->materials.size();
+    queue.useNormalMap = app->useNormalMap;
+    queue.useRelifMap = app->useRelifMap;
+    queue.usePointShadowGS = app->usePointShadowGS;
+    queue.dirty = false;
+    queue.rebuildCount++;
+}
+
+// Grows the commands buffer (by powers of 2) so it fits count commands per frame
+static void ReserveDrawCommands(App* app, u32 count)
+{
+    if (count <= app->drawCommandsCapacity)
+        return;
+
+    u32 capacity = app->drawCommandsCapacity ? app->drawCommandsCapacity : 1024;
+    while (capacity < count)
+        capacity *= 2;
+
+    if (app->drawCommandsBuffer.handle)
+        DestroyRingBuffer(app->drawCommandsBuffer);
+    // The GPU culling binds a frame of commands as a storage block
+    app->drawCommandsBuffer = CreateRingBuffer(Align(capacity * sizeof(DrawElementsIndirectCommand), app->storageBlockAlignment), GL_DRAW_INDIRECT_BUFFER);
+    app->drawCommandsCapacity = capacity;
+}
+
+// Grows the instance buffer (by powers of 2) so it fits count object indices per frame
+static void ReserveInstances(App* app, u32 count)
+{
+    if (count <= app->instancesCapacity)
+        return;
+
+    u32 capacity = app->instancesCapacity ? app->instancesCapacity : 4096;
+    while (capacity < count)
+        capacity *= 2;
+
+    if (app->instanceBuffer.handle)
+        DestroyRingBuffer(app->instanceBuffer);
+    app->instanceBuffer = CreateRingBuffer(capacity * sizeof(u32), GL_ARRAY_BUFFER);
+    app->instancesCapacity = capacity;
+    AttachInstanceBuffer(app, app->instanceBuffer.handle);
+}
+
+static void CountCullItems(App* app)
+{
+    RenderQueue& queue = app->renderQueue;
+    queue.modelFirstItem.resize(app->models.size());
+    queue.itemCount = 0;
+    for (u32 modelIdx = 0; modelIdx < app->models.size(); ++modelIdx)
+    {
+        queue.modelFirstItem[modelIdx] = queue.itemCount;
+        const Mesh& mesh = app->meshes[app->models[modelIdx].meshIdx];
+        queue.itemCount += queue.modelInstanceCount[modelIdx] * (u32)mesh.submeshes.size();
+    }
+}
+
+// Calls f(item, submeshIdx) for every submesh of the entity
+template <typename F>
+static void ForEachEntityItem(App* app, const Entity& entity, F f)
+{
+    const RenderQueue& queue = app->renderQueue;
+    const u32 modelIdx = entity.modelIndex;
+    const u32 instanceCount = queue.modelInstanceCount[modelIdx];
+    const u32 item = queue.modelFirstItem[modelIdx] + entity.objectIndex - queue.modelFirstInstance[modelIdx];
+    const u32 submeshCount = (u32)app->meshes[app->models[modelIdx].meshIdx].submeshes.size();
+    for (u32 s = 0; s < submeshCount; ++s)
+        f(item + s * instanceCount, s);
+}
+
+/**
+ * Rasterizes the occluders the camera sees and hides the entities behind them,
+ * tested with their tree boxes. Returns the number of items hidden.
+ */
+static u32 OcclusionCullCamera(App* app)
+{
+    PROFILE_FUNCTION();
+    RenderQueue& queue = app->renderQueue;
+    OcclusionCuller& culler = app->occlusion;
+    OcclusionBeginFrame(culler, app->vpMatrix);
+
+    const std::vector<u32>* handleLists[] = { &queue.insideHandles, &queue.intersectingHandles };
+    for (const std::vector<u32>* handles : handleLists)
+    {
+        for (u32 handle : *handles)
+        {
+            const Entity& entity = app->entities[app->entityIndices[handle]];
+            const Model& model = app->models[entity.modelIndex];
+            if (model.occluder == OccluderShape_None)
+                continue;
+
+            const Mesh& mesh = app->meshes[model.meshIdx];
+            for (const Submesh& submesh : mesh.submeshes)
+            {
+                if (model.occluder == OccluderShape_Box)
+                {
+                    OcclusionAddBox(culler, submesh.aabb, entity.worldMatrix);
+                    continue;
+                }
+                const VertexBufferLayout& layout = submesh.vertexBufferLayout;
+                OcclusionAddMesh(culler, submesh.vertices.data(), layout.stride, layout.attributes[0].offset,
+                                 submesh.indices.data(), (u32)submesh.indices.size(), entity.worldMatrix);
+            }
+        }
+    }
+
+    if (culler.occluderCount == 0)
+        return 0;
+    OcclusionRasterize(culler);
+
+    u32 hiddenCount = 0;
+    for (const std::vector<u32>* handles : handleLists)
+    {
+        for (u32 handle : *handles)
+        {
+            const Entity& entity = app->entities[app->entityIndices[handle]];
+            if (OcclusionTestAabb(culler, app->entityTree.nodes[entity.treeLeaf].box))
+                continue;
+            ForEachEntityItem(app, entity, [&](u32 item, u32)
+            {
+                if (queue.visibleStamp[item] != queue.cullStamp)
+                    return;
+                queue.visibleStamp[item] = 0;
+                hiddenCount++;
+            });
+        }
+    }
+    return hiddenCount;
+}
+
+/**
+ * Appends the visible items of a view to queue.visibleItems, sorted, and sets its
+ * range. The entity tree gives the candidates: entities in subtrees fully inside the
+ * frustum are visible as a whole, the submeshes of the ones crossing its planes are
+ * tested in SIMD batches. The camera view then goes through occlusion culling.
+ * Nothing here touches the items the tree didn't return.
+ */
+static void CullView(App* app, RenderView& view)
+{
+    PROFILE_FUNCTION();
+    RenderQueue& queue = app->renderQueue;
+    queue.insideHandles.clear();
+    queue.intersectingHandles.clear();
+
+    // A new stamp forgets the marks of the last view, the items are only cleared
+    // when their count changes (or the stamp wraps around)
+    queue.cullStamp++;
+    if (queue.visibleStamp.size() != queue.itemCount || queue.cullStamp == 0)
+    {
+        queue.visibleStamp.assign(queue.itemCount, 0);
+        queue.cullStamp = 1;
+    }
+
+    view.visibleBegin = (u32)queue.visibleItems.size();
+    auto markVisible = [&](u32 item, u32)
+    {
+        // An entity can be reported by several frustums
+        if (queue.visibleStamp[item] == queue.cullStamp)
+            return;
+        queue.visibleStamp[item] = queue.cullStamp;
+        queue.visibleItems.push_back(item);
+    };
+
+    if (view.pass == RenderPass_ShadowPoint)
+    {
+        // Casters beyond the light radius can't shadow anything it lights. The view of
+        // one cube face then tests the submeshes against the face, the view of all the
+        // faces covers every direction and the sphere is the whole test.
+        AabbTreeQuerySphere(app->entityTree, view.sphereCenter, view.sphereRadius, view.frustumCount ? queue.intersectingHandles : queue.insideHandles);
+    }
+    else
+    {
+        for (u32 f = 0; f < view.frustumCount; ++f)
+            AabbTreeQueryFrustum(app->entityTree, view.frustums[f], queue.intersectingHandles, &queue.insideHandles);
+    }
+
+    if (view.casters != ShadowCasters_All)
+    {
+        const bool dynamic = view.casters == ShadowCasters_Dynamic;
+        auto otherKind = [&](u32 handle) { return IsDynamicCaster(app, app->entities[app->entityIndices[handle]]) != dynamic; };
+        queue.insideHandles.erase(std::remove_if(queue.insideHandles.begin(), queue.insideHandles.end(), otherKind), queue.insideHandles.end());
+        queue.intersectingHandles.erase(std::remove_if(queue.intersectingHandles.begin(), queue.intersectingHandles.end(), otherKind), queue.intersectingHandles.end());
+    }
+
+    for (u32 handle : queue.insideHandles)
+        ForEachEntityItem(app, app->entities[app->entityIndices[handle]], markVisible);
+
+    // Submesh boxes of the entities crossing the frustum planes
+    queue.candidateItems.clear();
+    for (u32 handle : queue.intersectingHandles)
+    {
+        const Entity& entity = app->entities[app->entityIndices[handle]];
+        ForEachEntityItem(app, entity, [&](u32 item, u32 submeshIdx) {
+            queue.candidateItems.push_back({ item, app->entityIndices[handle], submeshIdx });
+        });
+    }
+
+    const u32 candidateCount = (u32)queue.candidateItems.size();
+    ResizeCullBounds(queue.candidates, candidateCount);
+    for (u32 i = 0; i < candidateCount; ++i)
+    {
+        const CullCandidate& candidate = queue.candidateItems[i];
+        const Entity& entity = app->entities[candidate.entityIdx];
+        const Submesh& submesh = app->meshes[app->models[entity.modelIndex].meshIdx].submeshes[candidate.submeshIdx];
+        glm::vec3 center, extent;
+        TransformAabb(submesh.aabb, entity.worldMatrix, center, extent);
+        SetCullBounds(queue.candidates, i, center, extent);
+    }
+
+    queue.candidateVisible.resize(candidateCount);
+    CullFrustums(queue.candidates, view.frustums, view.frustumCount, queue.candidateVisible.data());
+    for (u32 i = 0; i < candidateCount; ++i)
+    {
+        if (queue.candidateVisible[i])
+            markVisible(queue.candidateItems[i].item, 0);
+    }
+
+    if (view.pass == RenderPass_Geometry && app->useOcclusionCulling)
+    {
+        queue.occludedCount = OcclusionCullCamera(app);
+        if (queue.occludedCount > 0)
+        {
+            auto hidden = [&](u32 item) { return queue.visibleStamp[item] != queue.cullStamp; };
+            queue.visibleItems.erase(std::remove_if(queue.visibleItems.begin() + view.visibleBegin, queue.visibleItems.end(), hidden), queue.visibleItems.end());
+        }
+    }
+
+    // The items of a proxy become one run, its instances in object order
+    std::sort(queue.visibleItems.begin() + view.visibleBegin, queue.visibleItems.end());
+    view.visibleEnd = (u32)queue.visibleItems.size();
+}
+
+static void UpdateViews(App* app)
+{
+    RenderQueue& queue = app->renderQueue;
+    queue.views.resize(1 + 2 * RENDER_VIEW_LIGHT_FACES * app->lights.size());
+
+    RenderView& camera = queue.views[RENDER_VIEW_CAMERA];
+    camera.pass = RenderPass_Geometry;
+    camera.frustums[0] = FrustumFromMatrix(app->vpMatrix);
+    camera.frustumCount = 1;
+    camera.sphereRadius = 0.0f;
+    camera.casters = ShadowCasters_All;
+    camera.active = true;
+
+    for (u32 i = 0; i < app->lights.size(); ++i)
+    {
+        const Light& light = app->lights[i];
+        const ShadowCasters kinds[] = { ShadowCasters_Static, ShadowCasters_Dynamic };
+        for (ShadowCasters casters : kinds)
+        {
+            for (u32 face = 0; face < RENDER_VIEW_LIGHT_FACES; ++face)
+            {
+                RenderView& view = queue.views[LightRenderView(i, casters, face)];
+                view.casters = casters;
+                view.sphereRadius = 0.0f;
+                view.frustumCount = 0;
+                if (light.type == LightType::LightType_Directional)
+                {
+                    // Casters of any cascade, ShadowCascades.glsl culls the triangles per cascade
+                    view.pass = RenderPass_ShadowDirectional;
+                    for (u32 c = 0; c < light.shadowMatrixCount && face == 0; ++c)
+                        view.frustums[c] = FrustumFromMatrix(light.shadowMatrices[c]);
+                    view.frustumCount = face == 0 ? light.shadowMatrixCount : 0;
+                    view.active = face == 0 && ShadowViewActive(app, i, casters, ~0u);
+                }
+                else if (app->usePointShadowGS)
+                {
+                    // ShadowCubemap.glsl culls the triangles per face
+                    view.pass = RenderPass_ShadowPoint;
+                    view.sphereCenter = light.pos;
+                    view.sphereRadius = light.radius;
+                    view.active = face == 0 && ShadowViewActive(app, i, casters, ~0u);
+                }
+                else
+                {
+                    view.pass = RenderPass_ShadowPoint;
+                    view.sphereCenter = light.pos;
+                    view.sphereRadius = light.radius;
+                    view.frustums[0] = FrustumFromMatrix(light.shadowMatrices[face]);
+                    view.frustumCount = 1;
+                    view.active = ShadowViewActive(app, i, casters, 1u << face);
+                }
+            }
+        }
+    }
+}
+
+// Appends the command of a proxy to the view, starting a batch if the state changes
+static void PushDrawCommand(App* app, RenderView& view, const RenderProxy& proxy, const DrawElementsIndirectCommand& command, u32 instanceCount)
+{
+    RenderQueue& queue = app->renderQueue;
+    DrawBatch* batch = queue.batches.size() > view.batchBegin ? &queue.batches.back() : NULL;
+    if (!batch || batch->programIdx != proxy.programIdx || batch->materialIdx != proxy.materialIdx || batch->vao != proxy.vao)
+    {
+        queue.batches.push_back({ proxy.programIdx, proxy.materialIdx, proxy.vao, app->drawCommandsBuffer.head, 0, 0 });
+        batch = &queue.batches.back();
+    }
+    PushAlignedData(app->drawCommandsBuffer, &command, sizeof(command), 4);
+    batch->commandCount++;
+    batch->instanceCount += instanceCount;
+    view.batchEnd = (u32)queue.batches.size();
+}
+
+static void WriteDrawCommands(App* app)
+{
+    PROFILE_FUNCTION();
+    RenderQueue& queue = app->renderQueue;
+    queue.batches.clear();
+    for (u32 pass = 0; pass < RenderPass_Count; ++pass)
+        queue.passDrawn[pass] = queue.passCulled[pass] = 0;
+    queue.occludedCount = 0;
+
+    // Culled up front, so the instance buffer is sized by what is visible
+    queue.visibleItems.clear();
+    u32 commandCount = 0;
+    for (RenderView& view : queue.views)
+    {
+        view.visibleBegin = view.visibleEnd = (u32)queue.visibleItems.size();
+        if (!view.active || queue.passBegin[view.pass] == queue.passEnd[view.pass])
+            continue;
+
+        CullView(app, view);
+        const u32 drawn = view.visibleEnd - view.visibleBegin;
+        queue.passDrawn[view.pass] += drawn;
+        queue.passCulled[view.pass] += queue.itemCount - drawn;
+        commandCount += queue.passEnd[view.pass] - queue.passBegin[view.pass];
+    }
+
+    // One entry per visible item, plus one per light volume
+    ReserveDrawCommands(app, commandCount);
+    ReserveInstances(app, (u32)queue.visibleItems.size() + (u32)app->lights.size());
+
+    BeginRingFrame(app->drawCommandsBuffer);
+    BeginRingFrame(app->instanceBuffer);
+    for (RenderView& view : queue.views)
+    {
+        view.batchBegin = (u32)queue.batches.size();
+        view.batchEnd = view.batchBegin;
+        if (view.visibleBegin == view.visibleEnd)
+            continue;
+
+        const u32* visibleBegin = queue.visibleItems.data() + view.visibleBegin;
+        const u32* visibleEnd = queue.visibleItems.data() + view.visibleEnd;
+        for (u32 i = queue.passBegin[view.pass]; i < queue.passEnd[view.pass]; ++i)
+        {
+            const RenderProxy& proxy = queue.proxies[i];
+            const u32 instanceCount = queue.modelInstanceCount[proxy.modelIdx];
+            const u32 firstItem = queue.modelFirstItem[proxy.modelIdx] + proxy.submeshIdx * instanceCount;
+            const u32 firstObject = queue.modelFirstInstance[proxy.modelIdx];
+
+            DrawElementsIndirectCommand command = {};
+            command.count = proxy.indexCount;
+            command.firstIndex = proxy.firstIndex;
+            command.baseVertex = (i32)proxy.baseVertex;
+            command.baseInstance = app->instanceBuffer.head / sizeof(u32);
+
+            // The visible instances of the proxy are a run of the sorted range
+            for (const u32* item = std::lower_bound(visibleBegin, visibleEnd, firstItem); item != visibleEnd && *item < firstItem + instanceCount; ++item)
+            {
+                PushUInt(app->instanceBuffer, firstObject + (*item - firstItem));
+                command.instanceCount++;
+            }
+            if (command.instanceCount > 0)
+                PushDrawCommand(app, view, proxy, command, command.instanceCount);
+        }
+    }
+
+    // Light volumes are drawn one at a time, never culled
+    for (Light& light : app->lights)
+    {
+        light.instanceIdx = app->instanceBuffer.head / sizeof(u32);
+        PushUInt(app->instanceBuffer, light.objectIndex);
+    }
+    EndRingFrame(app->instanceBuffer);
+    EndRingFrame(app->drawCommandsBuffer);
+
+    if (app->attachedInstanceBuffer != app->instanceBuffer.handle)
+        AttachInstanceBuffer(app, app->instanceBuffer.handle);
+}
+
+/**
+ * GPU culling counterpart of WriteDrawCommands(): every proxy of every view gets a
+ * command with no instances and room for all of its model instances, which
+ * DispatchGpuCulling() fills with the survivors. Nothing is culled here, so the
+ * batches are the same every frame until the queue is rebuilt.
+ */
+static void WriteGpuDrawCommands(App* app)
+{
+    PROFILE_FUNCTION();
+    RenderQueue& queue = app->renderQueue;
+    GpuCulling& gpu = app->gpuCulling;
+    queue.batches.clear();
+    for (u32 pass = 0; pass < RenderPass_Count; ++pass)
+        queue.passDrawn[pass] = queue.passCulled[pass] = 0;
+    queue.occludedCount = 0;
+
+    UpdateGpuCullItems(app);
+
+    u32 commandCount = 0;
+    for (const RenderView& view : queue.views)
+        commandCount += view.active ? queue.passEnd[view.pass] - queue.passBegin[view.pass] : 0;
+    ReserveDrawCommands(app, commandCount);
+
+    gpu.views.resize(queue.views.size());
+    gpu.commandLookup.assign(queue.views.size() * gpu.drawableCount, GPU_CULL_NO_COMMAND);
+
+    BeginRingFrame(app->drawCommandsBuffer);
+    gpu.commandsOffset = app->drawCommandsBuffer.head;
+    u32 instanceCount = 0;
+    for (u32 v = 0; v < queue.views.size(); ++v)
+    {
+        RenderView& view = queue.views[v];
+        view.batchBegin = (u32)queue.batches.size();
+        view.batchEnd = view.batchBegin;
+
+        GpuCullView& gpuView = gpu.views[v];
+        gpuView = {};
+        if (view.frustumCount > 0)
+        {
+            ASSERT(view.frustumCount <= GPU_CULL_MAX_FRUSTUMS, "Too many frustums for the GPU culling view");
+            for (u32 f = 0; f < view.frustumCount; ++f)
+            {
+                for (u32 p = 0; p < 6; ++p)
+                    gpuView.planes[f * 6 + p] = view.frustums[f].planes[p];
+            }
+            gpuView.frustumCount = view.frustumCount;
+        }
+        gpuView.sphere = glm::vec4(view.sphereCenter, view.sphereRadius);
+        gpuView.occlusion = view.pass == RenderPass_Geometry;
+        gpuView.casters = view.casters;
+        if (!view.active)
+            continue;
+
+        for (u32 i = queue.passBegin[view.pass]; i < queue.passEnd[view.pass]; ++i)
+        {
+            const RenderProxy& proxy = queue.proxies[i];
+            const u32 modelInstances = queue.modelInstanceCount[proxy.modelIdx];
+            if (modelInstances == 0)
+                continue;
+
+            DrawElementsIndirectCommand command = {};
+            command.count = proxy.indexCount;
+            command.firstIndex = proxy.firstIndex;
+            command.baseVertex = (i32)proxy.baseVertex;
+            command.baseInstance = instanceCount;
+            instanceCount += modelInstances;
+
+            const u32 drawable = gpu.modelFirstDrawable[proxy.modelIdx] + proxy.submeshIdx;
+            gpu.commandLookup[v * gpu.drawableCount + drawable] = (app->drawCommandsBuffer.head - gpu.commandsOffset) / sizeof(command);
+            PushDrawCommand(app, view, proxy, command, modelInstances);
+        }
+    }
+    gpu.commandsSize = app->drawCommandsBuffer.head - gpu.commandsOffset;
+    EndRingFrame(app->drawCommandsBuffer);
+
+    UploadGpuCullViews(app, instanceCount);
+}
+
+void AssignObjectIndices(App* app)
+{
+    PROFILE_FUNCTION();
+    RenderQueue& queue = app->renderQueue;
+
+    // Counting sort of the entities by model
+    queue.modelInstanceCount.assign(app->models.size(), 0);
+    for (const Entity& entity : app->entities)
+        queue.modelInstanceCount[entity.modelIndex]++;
+
+    queue.modelFirstInstance.resize(app->models.size());
+    u32 first = 0;
+    for (u32 i = 0; i < app->models.size(); ++i)
+    {
+        queue.modelFirstInstance[i] = first;
+        first += queue.modelInstanceCount[i];
+    }
+
+    queue.instanceEntities.resize(app->entities.size());
+    std::vector<u32>& next = queue.scratchIndices;
+    next = queue.modelFirstInstance;
+    for (u32 i = 0; i < app->entities.size(); ++i)
+    {
+        Entity& entity = app->entities[i];
+        entity.objectIndex = next[entity.modelIndex]++;
+        queue.instanceEntities[entity.objectIndex] = i;
+    }
+}
+
+void UpdateRenderQueue(App* app)
+{
+    PROFILE_FUNCTION();
+    RenderQueue& queue = app->renderQueue;
+
+    if (queue.dirty ||
+        queue.entityCount != app->entities.size() ||
+        queue.modelCount != app->models.size() ||
+        queue.materialCount != app->materials.size() ||
+        queue.useNormalMap != app->useNormalMap ||
+        queue.useRelifMap != app->useRelifMap ||
+        queue.usePointShadowGS != app->usePointShadowGS)
+    {
+        RebuildRenderQueue(app);
+    }
+
+    // Front to back for the geometry pass, by the nearest instance of each model.
+    // The depth only passes don't care.
+    queue.modelDepth.assign(app->models.size(), 1.0f);
+    for (const Entity& entity : app->entities)
+    {
+        glm::vec3 position = glm::vec3(entity.worldMatrix[3]);
+        f32 depth = glm::clamp(glm::distance(position, app->cameraPos) / app->zFar, 0.0f, 1.0f);
+        queue.modelDepth[entity.modelIndex] = glm::min(queue.modelDepth[entity.modelIndex], depth);
+    }
+
+    const u64 depthMask = (1ull << SORT_KEY_DEPTH_BITS) - 1;
+    const f32 maxDepth = (f32)depthMask;
+    for (RenderProxy& proxy : queue.proxies)
+    {
+        if ((proxy.sortKey >> (64 - SORT_KEY_PASS_BITS)) != RenderPass_Geometry)
+            continue;
+        proxy.sortKey = (proxy.sortKey & ~depthMask) | (u64)(queue.modelDepth[proxy.modelIdx] * maxDepth);
+    }
+
+    RadixSortProxies(queue.proxies, queue.scratch);
+
+    for (u32 pass = 0; pass < RenderPass_Count; ++pass)
+        queue.passBegin[pass] = queue.passEnd[pass] = 0;
+    for (u32 i = 0; i < queue.proxies.size(); ++i)
+    {
+        u32 pass = (u32)(queue.proxies[i].sortKey >> (64 - SORT_KEY_PASS_BITS));
+        if (i == 0 || pass != (u32)(queue.proxies[i - 1].sortKey >> (64 - SORT_KEY_PASS_BITS)))
+            queue.passBegin[pass] = i;
+        queue.passEnd[pass] = i + 1;
+    }
+
+    CountCullItems(app);
+    UpdateViews(app);
+    if (app->useGpuCulling)
+        WriteGpuDrawCommands(app);
+    else
+        WriteDrawCommands(app);
+}
+
+static void BindMaterial(App* app, const Program& program, const Material& material)
+{
+    GLStateBindTexture(app->glState, TextureUnit_Albedo, GL_TEXTURE_2D, app->textures[material.albedoTextureIdx].handle);
+    if (program.uniformSlots[UniformSlot_NormalMap] != -1)
+        GLStateBindTexture(app->glState, TextureUnit_Normal, GL_TEXTURE_2D, app->textures[material.normalsTextureIdx].handle);
+    if (program.uniformSlots[UniformSlot_HeightMap] != -1)
+        GLStateBindTexture(app->glState, TextureUnit_Height, GL_TEXTURE_2D, app->textures[material.bumpTextureIdx].handle);
+}
+
+void SubmitRenderView(App* app, u32 viewIdx)
+{
+    const RenderQueue& queue = app->renderQueue;
+    if (viewIdx >= queue.views.size())
+        return;
+
+    const RenderView& view = queue.views[viewIdx];
+    GLStateBindIndirectBuffer(app->glState, app->drawCommandsBuffer.handle);
+
+    u32 currentProgram = UINT32_MAX;
+    u32 currentMaterial = UINT32_MAX;
+    for (u32 i = view.batchBegin; i < view.batchEnd; ++i)
+    {
+        const DrawBatch& batch = queue.batches[i];
+        const Program& program = app->programs[batch.programIdx];
+
+        if (batch.programIdx != currentProgram)
+        {
+            GLStateUseProgram(app->glState, program.handle);
+            currentProgram = batch.programIdx;
+            currentMaterial = UINT32_MAX;
+        }
+
+        if (batch.materialIdx != currentMaterial && batch.materialIdx != RENDER_PROXY_NO_MATERIAL)
+        {
+            BindMaterial(app, program, app->materials[batch.materialIdx]);
+            currentMaterial = batch.materialIdx;
+        }
+
+        GLStateBindVertexArray(app->glState, batch.vao);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(u64)batch.commandsOffset, batch.commandCount, 0);
+        app->stats.drawCalls++;
+        app->stats.drawCommands += batch.commandCount;
+        app->stats.instances += batch.instanceCount;
+    }
+}
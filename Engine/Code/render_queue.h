@@ -0,0 +1,192 @@
+//
+// render_queue.h: Persistent draw list. Every entity submesh gets one render proxy
+// per pass, built only when the scene changes (entities, models, materials or the
+// program selection toggles). Entities sharing a model get consecutive object indices,
+// so a proxy stands for a model submesh and is drawn as one instanced command covering
+// all of them. Every frame only the depth bits of the sort keys are refreshed and the
+// list is radix sorted.
+//
+// Every frame the entity submeshes are culled against each view: the camera for the
+// geometry pass, and every light for its shadow pass (the cascades of directional
+// ones, each cube face and the radius of point lights). Each light has views for its
+// static and its dynamic casters, so cached shadow maps only redraw what moves, and
+// point lights one per cube face unless the geometry shader draws all the faces from
+// one view (app->usePointShadowGS). The entity tree narrows each view down to the
+// entities it overlaps before the submesh boxes are tested, and the survivors go to a
+// compact list per view, so the cost follows what the tree returns rather than the
+// scene size. The object indices of the visible instances are written to
+// app->instanceBuffer, and runs of proxies sharing
+// program, material and vertex format become a batch, drawn with one
+// glMultiDrawElementsIndirect.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "culling.h"
+#include <glad/glad.h>
+
+struct App;
+
+enum RenderPass
+{
+    RenderPass_Geometry,
+    RenderPass_ShadowDirectional,
+    RenderPass_ShadowPoint,
+    RenderPass_Count
+};
+
+#define RENDER_PROXY_NO_MATERIAL 0xffff // Depth only passes don't bind any material
+
+// Entities that moved in the last SHADOW_SETTLE_FRAMES are dynamic casters
+enum ShadowCasters
+{
+    ShadowCasters_All,
+    ShadowCasters_Static,
+    ShadowCasters_Dynamic,
+};
+
+#define RENDER_VIEW_CAMERA      0 // The casters of light i are views LightRenderView(i, ...)
+#define RENDER_VIEW_LIGHT_FACES 6 // Views per light and caster kind, face 0 when one view draws every face
+
+inline u32 LightRenderView(u32 lightIdx, ShadowCasters casters, u32 face = 0)
+{
+    return 1 + (2 * lightIdx + (casters == ShadowCasters_Dynamic)) * RENDER_VIEW_LIGHT_FACES + face;
+}
+
+// Sort key layout, most significant first:
+// pass (4 bits) | program (8 bits) | material (16 bits) | vertex format (12 bits) | depth (24 bits)
+#define SORT_KEY_DEPTH_BITS    24
+#define SORT_KEY_FORMAT_BITS   12
+#define SORT_KEY_MATERIAL_BITS 16
+#define SORT_KEY_PROGRAM_BITS  8
+#define SORT_KEY_PASS_BITS     4
+
+struct RenderProxy
+{
+    u64    sortKey;
+    u32    modelIdx;
+    u32    submeshIdx;
+    u32    programIdx;
+    u32    materialIdx;
+    GLuint vao;         // Of the submesh vertex format
+    u32    indexCount;
+    u32    firstIndex;
+    u32    baseVertex;
+};
+
+// Layout read by glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand
+{
+    u32 count;
+    u32 instanceCount;
+    u32 firstIndex;
+    i32 baseVertex;
+    u32 baseInstance; // First entry of app->instanceBuffer, the shaders get the object index through the per-instance attribute
+};
+
+struct DrawBatch
+{
+    u32    programIdx;
+    u32    materialIdx;
+    GLuint vao;
+    u32    commandsOffset; // Bytes into app->drawCommandsBuffer
+    u32    commandCount;
+    u32    instanceCount;
+};
+
+// Something the proxies of a pass are drawn from
+struct RenderView
+{
+    RenderPass pass;
+    Frustum    frustums[6]; // Visible in any of them
+    u32        frustumCount;
+    glm::vec3  sphereCenter; // Point lights, and inside the frustums if there are any
+    f32        sphereRadius; // 0 without a sphere
+    ShadowCasters casters;
+    bool       active;       // Inactive views get no commands, see UpdateShadowCache()
+    u32        batchBegin;
+    u32        batchEnd;
+    u32        visibleBegin; // Range of RenderQueue::visibleItems
+    u32        visibleEnd;
+};
+
+struct CullCandidate
+{
+    u32 item;
+    u32 entityIdx;
+    u32 submeshIdx;
+};
+
+struct RenderQueue
+{
+    std::vector<RenderProxy> proxies; // Sorted by sortKey after UpdateRenderQueue()
+    std::vector<RenderProxy> scratch; // Ping-pong buffer for the radix sort
+    u32  passBegin[RenderPass_Count];
+    u32  passEnd[RenderPass_Count];
+    std::vector<DrawBatch> batches; // Rebuilt every frame along with the commands
+    std::vector<RenderView> views;
+
+    // Culling. Item modelFirstItem[m] + s * modelInstanceCount[m] + k is instance k
+    // of submesh s of model m.
+    u32              itemCount;
+    std::vector<u32> modelFirstItem;
+    std::vector<u32> visibleItems;        // Of every active view, each view a sorted range
+    std::vector<u32> visibleStamp;        // Items marked visible hold cullStamp, never cleared per view
+    u32              cullStamp;           // Bumped for every view
+    std::vector<u32> insideHandles;       // Entity tree query results
+    std::vector<u32> intersectingHandles;
+    std::vector<CullCandidate> candidateItems; // Submeshes of the intersecting entities
+    CullBounds       candidates;
+    std::vector<u8>  candidateVisible;
+    u32  passDrawn[RenderPass_Count];  // Instances summed over the views of the pass, last frame
+    u32  passCulled[RenderPass_Count]; // Frustum and occlusion culling
+    u32  occludedCount;                // Camera items hidden by occluders
+
+    // Instancing, refreshed every frame by AssignObjectIndices()
+    std::vector<u32> modelFirstInstance; // First object index of the model entities
+    std::vector<u32> modelInstanceCount; // Entities using the model
+    std::vector<u32> instanceEntities;   // Entity of every object index
+    std::vector<f32> modelDepth;         // Nearest instance, for the front to back sort
+    std::vector<u32> scratchIndices;
+    bool dirty;
+    u32  rebuildCount;
+
+    // What the proxies were built from, any change triggers a rebuild
+    u32  entityCount;
+    u32  modelCount;
+    u32  materialCount;
+    bool useNormalMap;
+    bool useRelifMap;
+    bool usePointShadowGS;
+};
+
+u64 MakeSortKey(RenderPass pass, u32 programIdx, u32 materialIdx, u32 vertexFormatIdx, u32 depth);
+
+/**
+ * Stable LSD radix sort by sortKey, 8 bits per pass. Passes where every key has the
+ * same digit (usually the high bytes) are skipped.
+ */
+void RadixSortProxies(std::vector<RenderProxy>& proxies, std::vector<RenderProxy>& scratch);
+
+/**
+ * Gives the entities object indices grouped by model, so the instances of a model
+ * are a contiguous range of the objects buffer. Called by Update() before it writes
+ * the world matrices.
+ */
+void AssignObjectIndices(App* app);
+
+/**
+ * Rebuilds the proxies if the scene changed, refreshes the depth of the geometry
+ * proxies (front to back from the camera), sorts them, culls the instances against
+ * every view and writes this frame's instance indices, indirect commands and batches.
+ * Also writes the instance entry of each light volume (light.instanceIdx). Called
+ * once per frame by Update(), after the light matrices.
+ */
+void UpdateRenderQueue(App* app);
+
+/**
+ * Issues the batches of a view in sort order, one multi-draw per batch. Program,
+ * material textures and VAO only change between batches.
+ */
+void SubmitRenderView(App* app, u32 viewIdx);
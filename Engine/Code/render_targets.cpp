@@ -0,0 +1,196 @@
+#include "render_targets.h"
+#include "engine.h"
+#include "profiler.h"
+#include <algorithm>
+
+bool IsDepthFormat(GLenum internalFormat)
+{
+    switch (internalFormat)
+    {
+    case GL_DEPTH_COMPONENT16:
+    case GL_DEPTH_COMPONENT24:
+    case GL_DEPTH_COMPONENT32F:
+    case GL_DEPTH24_STENCIL8:
+    case GL_DEPTH32F_STENCIL8:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool HasStencil(GLenum internalFormat)
+{
+    return internalFormat == GL_DEPTH24_STENCIL8 || internalFormat == GL_DEPTH32F_STENCIL8;
+}
+
+// Per sample, as drivers usually store them
+static u32 FormatBytes(GLenum internalFormat)
+{
+    switch (internalFormat)
+    {
+    case GL_R8:                return 1;
+    case GL_RG8:
+    case GL_R16F:
+    case GL_DEPTH_COMPONENT16: return 2;
+    case GL_RGBA16F:
+    case GL_RG32F:
+    case GL_DEPTH32F_STENCIL8: return 8;
+    case GL_RGBA32F:           return 16;
+    default:                   return 4;
+    }
+}
+
+static i32 BucketSize(i32 size)
+{
+    return (size + RENDER_TARGET_GRANULARITY - 1) / RENDER_TARGET_GRANULARITY * RENDER_TARGET_GRANULARITY;
+}
+
+static bool Serves(const RenderTarget& target, const RenderTargetDesc& desc)
+{
+    return target.desc.internalFormat == desc.internalFormat && target.desc.samples == desc.samples &&
+           glm::all(glm::greaterThanEqual(target.desc.size, desc.size)) &&
+           glm::all(glm::lessThanEqual(target.desc.size, desc.size + RENDER_TARGET_SLACK));
+}
+
+GLuint AcquireRenderTarget(App* app, const RenderTargetDesc& desc)
+{
+    RenderTargetPool& pool = app->renderTargets;
+    RenderTarget* best = NULL;
+    for (RenderTarget& target : pool.targets)
+    {
+        if (!target.busy && Serves(target, desc) && (!best || target.bytes < best->bytes))
+            best = &target;
+    }
+    if (best)
+    {
+        best->busy = true;
+        best->lastUsedFrame = pool.frame;
+        return best->handle;
+    }
+
+    RenderTarget target = {};
+    target.desc = desc;
+    target.desc.size = glm::ivec2(BucketSize(desc.size.x), BucketSize(desc.size.y));
+    target.target = desc.samples > 1 ? GL_TEXTURE_2D_MULTISAMPLE : GL_TEXTURE_2D;
+    target.bytes = target.desc.size.x * target.desc.size.y * desc.samples * FormatBytes(desc.internalFormat);
+    target.lastUsedFrame = pool.frame;
+    target.busy = true;
+    glGenTextures(1, &target.handle);
+    if (desc.samples > 1)
+    {
+        //the state cache doesn't track this target
+        glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, target.handle);
+        glTexStorage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, desc.samples, desc.internalFormat, target.desc.size.x, target.desc.size.y, GL_TRUE);
+        glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, 0);
+    }
+    else
+    {
+        GLStateBindTexture(app->glState, TextureUnit_Albedo, GL_TEXTURE_2D, target.handle);
+        glTexStorage2D(GL_TEXTURE_2D, 1, desc.internalFormat, target.desc.size.x, target.desc.size.y);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+
+    pool.targets.push_back(target);
+    pool.allocatedBytes += target.bytes;
+    pool.allocationCount++;
+    return target.handle;
+}
+
+static RenderTarget* FindTarget(RenderTargetPool& pool, GLuint handle)
+{
+    for (RenderTarget& target : pool.targets)
+    {
+        if (target.handle == handle)
+            return &target;
+    }
+    return NULL;
+}
+
+void ReleaseRenderTarget(App* app, GLuint handle)
+{
+    RenderTarget* target = FindTarget(app->renderTargets, handle);
+    ASSERT(target && target->busy, "Render target released twice");
+    target->busy = false;
+}
+
+GLuint RenderTargetFramebuffer(App* app, const GLuint* colors, GLuint depth)
+{
+    RenderTargetPool& pool = app->renderTargets;
+    PooledFramebuffer key = {};
+    for (u32 i = 0; i < RENDER_TARGET_MAX_COLOR; ++i)
+        key.attachments[i] = colors[i];
+    key.attachments[RENDER_TARGET_MAX_COLOR] = depth;
+    for (const PooledFramebuffer& framebuffer : pool.framebuffers)
+    {
+        if (memcmp(framebuffer.attachments, key.attachments, sizeof(key.attachments)) == 0)
+            return framebuffer.handle;
+    }
+
+    glGenFramebuffers(1, &key.handle);
+    GLStateBindFramebuffer(app->glState, key.handle);
+    for (u32 i = 0; i < ARRAY_COUNT(key.attachments); ++i)
+    {
+        const RenderTarget* target = FindTarget(pool, key.attachments[i]);
+        if (!target)
+            continue;
+        GLenum attachment = GL_COLOR_ATTACHMENT0 + i;
+        if (i == RENDER_TARGET_MAX_COLOR)
+            attachment = HasStencil(target->desc.internalFormat) ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT;
+        glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, target->target, target->handle, 0);
+    }
+    const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+        ELOG("Render target framebuffer incomplete: 0x%x", status);
+
+    pool.framebuffers.push_back(key);
+    return key.handle;
+}
+
+// The state cache forgets the deleted names at the next GLStateBeginFrame()
+static void DeleteTarget(App* app, u32 targetIdx)
+{
+    RenderTargetPool& pool = app->renderTargets;
+    RenderTarget& target = pool.targets[targetIdx];
+    for (u32 i = 0; i < pool.framebuffers.size();)
+    {
+        const PooledFramebuffer& framebuffer = pool.framebuffers[i];
+        const GLuint* end = framebuffer.attachments + ARRAY_COUNT(framebuffer.attachments);
+        if (std::find(framebuffer.attachments, end, target.handle) == end)
+        {
+            ++i;
+            continue;
+        }
+        GLStateBindFramebuffer(app->glState, 0);
+        glDeleteFramebuffers(1, &framebuffer.handle);
+        pool.framebuffers[i] = pool.framebuffers.back();
+        pool.framebuffers.pop_back();
+    }
+
+    glDeleteTextures(1, &target.handle);
+    pool.allocatedBytes -= target.bytes;
+    pool.releaseCount++;
+    pool.targets[targetIdx] = pool.targets.back();
+    pool.targets.pop_back();
+}
+
+void UpdateRenderTargets(App* app)
+{
+    PROFILE_FUNCTION();
+    RenderTargetPool& pool = app->renderTargets;
+    pool.usedBytes = 0;
+    for (u32 i = 0; i < pool.targets.size();)
+    {
+        const RenderTarget& target = pool.targets[i];
+        ASSERT(!target.busy, "Render target not released by the end of the frame");
+        if (target.lastUsedFrame == pool.frame)
+            pool.usedBytes += target.bytes;
+        if (pool.frame - target.lastUsedFrame >= RENDER_TARGET_RELEASE_FRAMES)
+            DeleteTarget(app, i);
+        else
+            ++i;
+    }
+    pool.frame++;
+}
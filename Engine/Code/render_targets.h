@@ -0,0 +1,81 @@
+//
+// render_targets.h: Pool of the textures and framebuffers the render graph draws into,
+// keyed by format, size and samples. Sizes are rounded up to buckets of
+// RENDER_TARGET_GRANULARITY pixels, and a free target keeps serving smaller requests
+// until they are RENDER_TARGET_SLACK pixels under it, so the steps of a window drag
+// reuse the same storage instead of reallocating every G-buffer texture each time. The
+// passes draw and read the requested size at the bottom left corner, the shaders read
+// the G-buffer by texel (texelFetch at gl_FragCoord) so the rest is never seen.
+//
+// Targets no frame has used for RENDER_TARGET_RELEASE_FRAMES frames are deleted, with
+// the framebuffers they are attached to.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <glad/glad.h>
+
+struct App;
+
+#define RENDER_TARGET_GRANULARITY     256 // Pixels, allocated sizes are multiples of it
+#define RENDER_TARGET_SLACK           512 // Pixels a target can be bigger than a request it serves
+#define RENDER_TARGET_RELEASE_FRAMES  120
+#define RENDER_TARGET_MAX_COLOR       4   // Colour attachments of a framebuffer
+
+struct RenderTargetDesc
+{
+    GLenum     internalFormat;
+    glm::ivec2 size;        // Requested, the texture can be bigger
+    u32        samples = 1; // Multisampled textures above 1
+};
+
+struct RenderTarget
+{
+    RenderTargetDesc desc;  // Allocated size
+    GLuint handle;
+    GLenum target;          // GL_TEXTURE_2D or GL_TEXTURE_2D_MULTISAMPLE
+    u32    bytes;
+    u32    lastUsedFrame;
+    bool   busy;            // Handed out and not released yet
+};
+
+struct PooledFramebuffer
+{
+    GLuint attachments[RENDER_TARGET_MAX_COLOR + 1]; // Colour by location, then depth
+    GLuint handle;
+};
+
+struct RenderTargetPool
+{
+    std::vector<RenderTarget>      targets;
+    std::vector<PooledFramebuffer> framebuffers;
+    u32 frame;
+
+    // Shown in the UI
+    u64 allocatedBytes;
+    u64 usedBytes;       // Of the targets the last frame used
+    u32 allocationCount; // Textures created since the start
+    u32 releaseCount;    // Textures deleted since the start
+};
+
+bool IsDepthFormat(GLenum internalFormat);
+
+/**
+ * Hands out a free target of the format and samples at least as big as desc.size,
+ * the smallest one within RENDER_TARGET_SLACK of it, or allocates one of the bucketed
+ * size. It stays busy until ReleaseRenderTarget().
+ */
+GLuint AcquireRenderTarget(App* app, const RenderTargetDesc& desc);
+
+// The target can be handed out again, its content is left as is
+void ReleaseRenderTarget(App* app, GLuint handle);
+
+/**
+ * Framebuffer with the targets attached, colour i at GL_COLOR_ATTACHMENT0 + i, 0 for
+ * none. Made the first time the set is seen and kept while its targets live.
+ */
+GLuint RenderTargetFramebuffer(App* app, const GLuint* colors, GLuint depth);
+
+// Deletes the targets unused for RENDER_TARGET_RELEASE_FRAMES frames. Called once per frame by Render().
+void UpdateRenderTargets(App* app);
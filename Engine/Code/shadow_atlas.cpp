@@ -0,0 +1,216 @@
+#include "shadow_atlas.h"
+#include "engine.h"
+#include "profiler.h"
+#include <algorithm>
+
+static u32 TileLevel(u32 size)
+{
+    u32 level = 0;
+    while (((u32)SHADOW_ATLAS_SIZE >> level) > size)
+        level++;
+    ASSERT(level < SHADOW_ATLAS_LEVELS && ((u32)SHADOW_ATLAS_SIZE >> level) == size, "Not a shadow tile size");
+    return level;
+}
+
+static bool AllocTile(ShadowAtlas& atlas, u32 level, ShadowTile& tile)
+{
+    std::vector<glm::uvec2>& freeTiles = atlas.freeTiles[level];
+    if (!freeTiles.empty())
+    {
+        tile = { freeTiles.back().x, freeTiles.back().y, (u32)SHADOW_ATLAS_SIZE >> level };
+        freeTiles.pop_back();
+        return true;
+    }
+    if (level == 0)
+        return false;
+
+    // Splits a bigger tile, keeps its first quarter
+    ShadowTile parent;
+    if (!AllocTile(atlas, level - 1, parent))
+        return false;
+    const u32 size = parent.size / 2;
+    freeTiles.push_back(glm::uvec2(parent.x + size, parent.y));
+    freeTiles.push_back(glm::uvec2(parent.x, parent.y + size));
+    freeTiles.push_back(glm::uvec2(parent.x + size, parent.y + size));
+    tile = { parent.x, parent.y, size };
+    return true;
+}
+
+static void FreeTile(ShadowAtlas& atlas, ShadowTile tile)
+{
+    u32 level = TileLevel(tile.size);
+    // Merges the tile with its three siblings while they are all free
+    while (level > 0)
+    {
+        const u32 parentMask = ~(tile.size * 2 - 1);
+        const glm::uvec2 parent(tile.x & parentMask, tile.y & parentMask);
+        auto sibling = [parentMask, parent](const glm::uvec2& corner)
+        {
+            return (corner.x & parentMask) == parent.x && (corner.y & parentMask) == parent.y;
+        };
+        std::vector<glm::uvec2>& freeTiles = atlas.freeTiles[level];
+        if (std::count_if(freeTiles.begin(), freeTiles.end(), sibling) < 3)
+            break;
+        freeTiles.erase(std::remove_if(freeTiles.begin(), freeTiles.end(), sibling), freeTiles.end());
+        tile = { parent.x, parent.y, tile.size * 2 };
+        level--;
+    }
+    atlas.freeTiles[level].push_back(glm::uvec2(tile.x, tile.y));
+}
+
+static void FreeLightTiles(ShadowAtlas& atlas, ShadowAtlasLight& light)
+{
+    for (u32 i = 0; i < light.tileCount; ++i)
+        FreeTile(atlas, light.tiles[i]);
+    light.tileCount = 0;
+}
+
+// Tries size, then halves it down to minSize. All the tiles of a light have the same size.
+static bool AllocLightTiles(ShadowAtlas& atlas, ShadowAtlasLight& light, u32 count, u32 size, u32 minSize)
+{
+    for (; size >= minSize; size /= 2)
+    {
+        u32 allocated = 0;
+        while (allocated < count && AllocTile(atlas, TileLevel(size), light.tiles[allocated]))
+            allocated++;
+        if (allocated == count)
+        {
+            light.tileCount = count;
+            return true;
+        }
+        while (allocated > 0)
+            FreeTile(atlas, light.tiles[--allocated]);
+    }
+    return false;
+}
+
+static u32 ShadowTileCount(const App* app, const Light& light)
+{
+    return light.type == LightType::LightType_Point ? 6 : app->cascadeCount;
+}
+
+static u32 NextPowerOfTwo(u32 value)
+{
+    u32 result = 1;
+    while (result < value)
+        result *= 2;
+    return result;
+}
+
+static u32 WantedTileSize(const App* app, const Light& light, const glm::mat4& view, const glm::mat4& projection)
+{
+    const f32 screenSize = (f32)glm::max(app->displaySize.x, app->displaySize.y);
+    if (light.type == LightType::LightType_Directional)
+    {
+        // Every cascade spans the whole screen
+        const u32 size = NextPowerOfTwo((u32)(screenSize * app->shadowAtlas.resolutionScale));
+        return glm::clamp(size, (u32)SHADOW_TILE_MIN_SIZE, (u32)SHADOW_TILE_MAX_SIZE);
+    }
+
+    // Screen diameter of the light sphere, the whole screen from inside it
+    const glm::vec3 center = glm::vec3(view * glm::vec4(light.pos, 1.0f));
+    const f32 distance = glm::length(center);
+    f32 coverage = screenSize;
+    if (center.z - light.radius > 0.0f)
+        coverage = 0.0f; // Behind the camera
+    else if (distance > light.radius)
+        coverage = glm::min(light.radius / sqrtf(distance * distance - light.radius * light.radius) * projection[1][1] * app->displaySize.y, screenSize);
+
+    // A face sees a quarter of the directions around the light, about half of its width on screen
+    const u32 size = NextPowerOfTwo((u32)(0.5f * coverage * app->shadowAtlas.resolutionScale));
+    return glm::clamp(size, (u32)SHADOW_TILE_MIN_SIZE, (u32)SHADOW_FACE_MAX_SIZE);
+}
+
+static GLuint CreateAtlasTexture(GLuint& framebuffer)
+{
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    // Sized, glCopyImageSubData() copies the static tiles to the live ones
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    // The shaders keep their samples inside the tiles
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texture, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    glDepthMask(GL_TRUE);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return texture;
+}
+
+void CreateShadowAtlas(App* app)
+{
+    ShadowAtlas& atlas = app->shadowAtlas;
+    atlas.texture = CreateAtlasTexture(atlas.framebuffer);
+    atlas.staticTexture = CreateAtlasTexture(atlas.staticFramebuffer);
+    atlas.freeTiles[0].push_back(glm::uvec2(0));
+}
+
+void UpdateShadowAtlas(App* app, const glm::mat4& view, const glm::mat4& projection)
+{
+    PROFILE_FUNCTION();
+    ShadowAtlas& atlas = app->shadowAtlas;
+
+    // Removed lights and lights that changed type or tile count give their tiles back
+    for (u32 i = (u32)app->lights.size(); i < atlas.lights.size(); ++i)
+        FreeLightTiles(atlas, atlas.lights[i]);
+    atlas.lights.resize(app->lights.size());
+
+    atlas.order.clear();
+    for (u32 i = 0; i < app->lights.size(); ++i)
+    {
+        const Light& light = app->lights[i];
+        ShadowAtlasLight& slot = atlas.lights[i];
+        if (slot.type != (u32)light.type || (slot.tileCount && slot.tileCount != ShadowTileCount(app, light)))
+            FreeLightTiles(atlas, slot);
+        slot.type = (u32)light.type;
+        slot.wantedSize = WantedTileSize(app, light, view, projection);
+        atlas.order.push_back(i);
+    }
+    std::stable_sort(atlas.order.begin(), atlas.order.end(), [&atlas](u32 a, u32 b)
+    {
+        return atlas.lights[a].wantedSize > atlas.lights[b].wantedSize;
+    });
+
+    for (u32 i : atlas.order)
+    {
+        ShadowAtlasLight& slot = atlas.lights[i];
+        const u32 size = slot.tileCount ? slot.tiles[0].size : 0;
+        if (size >= slot.wantedSize && size < 4 * slot.wantedSize)
+            continue;
+
+        // The new tiles are taken before the old ones are freed, a light that can't
+        // grow keeps the tiles it has
+        const u32 minSize = size && size < slot.wantedSize ? size * 2 : SHADOW_TILE_MIN_SIZE;
+        ShadowAtlasLight resized = slot;
+        if (!AllocLightTiles(atlas, resized, ShadowTileCount(app, app->lights[i]), slot.wantedSize, minSize))
+            continue;
+        FreeLightTiles(atlas, slot);
+        slot = resized;
+        slot.allocation = ++atlas.allocationCount;
+    }
+
+    atlas.usedTexels = atlas.shadowlessLights = 0;
+    for (const ShadowAtlasLight& slot : atlas.lights)
+    {
+        for (u32 i = 0; i < slot.tileCount; ++i)
+            atlas.usedTexels += slot.tiles[i].size * slot.tiles[i].size;
+        atlas.shadowlessLights += slot.tileCount == 0;
+    }
+}
+
+glm::vec4 ShadowTileRect(const ShadowAtlasLight& light, u32 face)
+{
+    if (face >= light.tileCount)
+        return glm::vec4(0.0f);
+    const ShadowTile& tile = light.tiles[face];
+    return glm::vec4(glm::vec3(tile.x, tile.y, tile.size) / (f32)SHADOW_ATLAS_SIZE, 0.0f);
+}
@@ -0,0 +1,72 @@
+//
+// shadow_atlas.h: Shadow maps of every light in one depth texture. Lights get square
+// tiles of it, one per cascade of directional lights and one per cube face of point lights,
+// from a quadtree allocator: a tile is split in four to make smaller ones and merged
+// back when its four quarters are free again. The tile size follows the screen area
+// the light covers, so far away point lights take less of the atlas.
+//
+// All the tiles are drawn by RenderShadows() before any lighting, and both lighting
+// paths sample the same texture. A second atlas with the same tiles keeps the cached
+// depth of the static casters (shadow_cache.h).
+//
+
+#pragma once
+
+#include "platform.h"
+#include <glad/glad.h>
+
+struct App;
+
+#define SHADOW_ATLAS_SIZE     4096
+#define SHADOW_ATLAS_LEVELS   6    // Tile sizes, from the whole atlas down to SHADOW_TILE_MIN_SIZE
+#define SHADOW_TILE_MIN_SIZE  (SHADOW_ATLAS_SIZE >> (SHADOW_ATLAS_LEVELS - 1))
+#define SHADOW_TILE_MAX_SIZE  1024 // Directional light cascades
+#define SHADOW_FACE_MAX_SIZE  1024 // Point light faces
+
+struct ShadowTile
+{
+    u32 x, y; // Texels, bottom left corner
+    u32 size;
+};
+
+struct ShadowAtlasLight
+{
+    u32        type;        // LightType the tiles were allocated for
+    u32        wantedSize;  // From the screen coverage, last UpdateShadowAtlas()
+    u32        tileCount;   // 0 when the atlas had no room, the light has no shadow
+    ShadowTile tiles[6];    // In light.shadowMatrices order
+    u32        allocation;  // Changes every time the tiles do
+};
+
+struct ShadowAtlas
+{
+    GLuint texture;
+    GLuint staticTexture;
+    GLuint framebuffer;
+    GLuint staticFramebuffer;
+
+    std::vector<glm::uvec2> freeTiles[SHADOW_ATLAS_LEVELS]; // Corners of the free tiles of each size
+    std::vector<ShadowAtlasLight> lights;                   // Parallel to app->lights
+    std::vector<u32> order;                                 // Lights by wanted size, biggest first
+    u32 allocationCount;
+    f32 resolutionScale = 1.0f;                             // Texels per covered pixel
+
+    // Last UpdateShadowAtlas()
+    u32 usedTexels;
+    u32 shadowlessLights;
+};
+
+// Creates the textures, the whole atlas starts free. Called once by Init().
+void CreateShadowAtlas(App* app);
+
+/**
+ * Picks the tile size of every light from the screen area it covers and reallocates
+ * the tiles of the lights whose size changed. Sizes grow right away and shrink only
+ * when a quarter of the texels would do, so lights at a threshold keep their tiles.
+ * Bigger lights are placed first, when the atlas is full the others get smaller
+ * tiles or none. Called by Update() once the light matrices are known.
+ */
+void UpdateShadowAtlas(App* app, const glm::mat4& view, const glm::mat4& projection);
+
+// Offset and size of the tile in atlas texture coordinates, w unused. All 0 without a tile.
+glm::vec4 ShadowTileRect(const ShadowAtlasLight& light, u32 face);
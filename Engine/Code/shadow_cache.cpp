@@ -0,0 +1,186 @@
+#include "shadow_cache.h"
+#include "engine.h"
+#include "profiler.h"
+
+bool IsDynamicCaster(const App* app, const Entity& entity)
+{
+    return app->shadowCache.frame - entity.movedFrame < SHADOW_SETTLE_FRAMES;
+}
+
+void InvalidateShadowCasters(App* app, const Aabb& box)
+{
+    app->shadowCache.dirtyBoxes.push_back(box);
+}
+
+void MarkShadowCasterMoved(App* app, Entity& entity)
+{
+    ShadowCache& cache = app->shadowCache;
+    if (!IsDynamicCaster(app, entity))
+    {
+        // Its depth is in the static faces at the old place
+        InvalidateShadowCasters(app, app->entityTree.nodes[entity.treeLeaf].box);
+        cache.casterRevision++;
+    }
+    entity.movedFrame = cache.frame;
+}
+
+static bool AabbTouchesSphere(const Aabb& box, const glm::vec3& center, f32 radius)
+{
+    const glm::vec3 closest = glm::clamp(center, box.min, box.max);
+    const glm::vec3 d = closest - center;
+    return glm::dot(d, d) <= radius * radius;
+}
+
+// Faces of the light the box overlaps, within the radius of point lights
+static u32 TouchedFaces(const Light& light, const Frustum* faces, u32 faceCount, const Aabb& box)
+{
+    if (light.type == LightType::LightType_Point && !AabbTouchesSphere(box, light.pos, light.radius))
+        return 0;
+    u32 mask = 0;
+    for (u32 f = 0; f < faceCount; ++f)
+    {
+        if (TestAabbFrustum(faces[f], box) != FrustumTest_Outside)
+            mask |= 1u << f;
+    }
+    return mask;
+}
+
+// Faces whose matrix changed, all of them if the light did
+static u32 ChangedFaces(const ShadowCacheEntry& entry, const Light& light, u32 allFaces)
+{
+    if (entry.type != (u32)light.type || entry.faceCount != light.shadowMatrixCount || entry.radius != light.radius)
+        return allFaces;
+    u32 mask = 0;
+    for (u32 f = 0; f < light.shadowMatrixCount; ++f)
+    {
+        if (entry.faceMatrices[f] != light.shadowMatrices[f])
+            mask |= 1u << f;
+    }
+    return mask;
+}
+
+void UpdateShadowCache(App* app)
+{
+    PROFILE_FUNCTION();
+    ShadowCache& cache = app->shadowCache;
+    cache.frame++;
+
+    // Entities that stopped moving go back into the static faces
+    cache.dynamicBoxes.clear();
+    for (const Entity& entity : app->entities)
+    {
+        const Aabb& box = app->entityTree.nodes[entity.treeLeaf].box;
+        if (entity.movedFrame + SHADOW_SETTLE_FRAMES == cache.frame)
+        {
+            InvalidateShadowCasters(app, box);
+            cache.casterRevision++;
+        }
+        else if (IsDynamicCaster(app, entity))
+        {
+            cache.dynamicBoxes.push_back(box);
+        }
+    }
+
+    cache.lights.resize(app->lights.size());
+    for (u32 i = 0; i < app->lights.size(); ++i)
+    {
+        const Light& light = app->lights[i];
+        const ShadowAtlasLight& tiles = app->shadowAtlas.lights[i];
+        ShadowCacheEntry& entry = cache.lights[i];
+        const u32 faceCount = light.shadowMatrixCount;
+        const u32 allFaces = (1u << faceCount) - 1;
+
+        entry.staticDirty |= entry.allocation != tiles.allocation ? allFaces : ChangedFaces(entry, light, allFaces);
+        entry.staticDirty &= allFaces;
+        entry.type = (u32)light.type;
+        entry.radius = light.radius;
+        for (u32 f = 0; f < faceCount; ++f)
+            entry.faceMatrices[f] = light.shadowMatrices[f];
+        entry.faceCount = faceCount;
+        entry.allocation = tiles.allocation;
+        if (tiles.tileCount == 0)
+        {
+            // No shadow, nothing to draw until the light gets tiles
+            entry.staticDirty = entry.dynamicFaces = entry.refreshFaces = entry.compositeFaces = 0;
+            continue;
+        }
+
+        Frustum faces[6];
+        for (u32 f = 0; f < faceCount; ++f)
+            faces[f] = FrustumFromMatrix(light.shadowMatrices[f]);
+        for (const Aabb& box : cache.dirtyBoxes)
+            entry.staticDirty |= TouchedFaces(light, faces, faceCount, box);
+
+        // Faces that had dynamic casters last frame are rebuilt once more to erase them
+        const u32 lastDynamicFaces = entry.dynamicFaces;
+        entry.dynamicFaces = 0;
+        for (const Aabb& box : cache.dynamicBoxes)
+            entry.dynamicFaces |= TouchedFaces(light, faces, faceCount, box);
+        entry.refreshFaces = 0;
+        entry.compositeFaces = entry.dynamicFaces | lastDynamicFaces;
+
+        // A stale cascade would put the shadows in the wrong place, they don't wait
+        if (light.type == LightType::LightType_Directional)
+        {
+            entry.refreshFaces = entry.staticDirty;
+            entry.compositeFaces |= entry.refreshFaces;
+            entry.staticDirty = 0;
+        }
+    }
+    cache.dirtyBoxes.clear();
+
+    // Spends the budget on the stale faces, starting where the last frame stopped
+    cache.refreshedFaces = cache.compositedFaces = cache.pendingFaces = 0;
+    const u32 lightCount = (u32)cache.lights.size();
+    u32 budget = cache.faceBudget;
+    for (u32 n = 0; n < lightCount; ++n)
+    {
+        const u32 i = (cache.nextLight + n) % lightCount;
+        ShadowCacheEntry& entry = cache.lights[i];
+        for (u32 f = 0; f < 6 && budget > 0; ++f)
+        {
+            const u32 bit = 1u << f;
+            if (!(entry.staticDirty & bit))
+                continue;
+            entry.staticDirty &= ~bit;
+            entry.refreshFaces |= bit;
+            budget--;
+        }
+        entry.compositeFaces |= entry.refreshFaces;
+        if (budget == 0)
+        {
+            cache.nextLight = entry.staticDirty ? i : (i + 1) % lightCount;
+            break;
+        }
+    }
+
+    for (const ShadowCacheEntry& entry : cache.lights)
+    {
+        for (u32 f = 0; f < 6; ++f)
+        {
+            cache.refreshedFaces += (entry.refreshFaces >> f) & 1;
+            cache.compositedFaces += (entry.compositeFaces >> f) & 1;
+            cache.pendingFaces += (entry.staticDirty >> f) & 1;
+        }
+    }
+}
+
+void SkipShadowCacheFrame(App* app)
+{
+    for (ShadowCacheEntry& entry : app->shadowCache.lights)
+    {
+        entry.staticDirty |= entry.refreshFaces;
+        // Taken as last frame's dynamic faces by the next update
+        entry.dynamicFaces |= entry.compositeFaces;
+        entry.refreshFaces = entry.compositeFaces = 0;
+    }
+}
+
+bool ShadowViewActive(const App* app, u32 lightIdx, ShadowCasters casters, u32 faces)
+{
+    if (lightIdx >= app->shadowCache.lights.size())
+        return false;
+
+    const ShadowCacheEntry& entry = app->shadowCache.lights[lightIdx];
+    return ((casters == ShadowCasters_Static ? entry.refreshFaces : entry.dynamicFaces) & faces) != 0;
+}
@@ -0,0 +1,78 @@
+//
+// shadow_cache.h: Cached shadow maps. Every shadow atlas tile (one per point light
+// face, one per directional light cascade) has a copy in the static atlas with only the
+// static casters, next to the live one the lighting reads. A static tile is redrawn when
+// its matrix or the light tiles change or a static caster in it moves, appears or
+// disappears, at most faceBudget point light faces per frame. The cascades follow the
+// camera and are redrawn the frame they move, outside the budget. Tiles with dynamic casters (entities that moved in
+// the last SHADOW_SETTLE_FRAMES frames) copy their static depth to the live atlas and
+// draw the dynamic casters on top, every frame; the other tiles are left alone.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "culling.h"
+#include "render_queue.h"
+
+struct App;
+struct Entity;
+
+#define SHADOW_SETTLE_FRAMES 30 // Frames without moving before an entity is a static caster again
+
+struct ShadowCacheEntry
+{
+    // What the static faces were drawn for, any change redraws them
+    u32       type;
+    f32       radius;
+    glm::mat4 faceMatrices[6]; // light.shadowMatrices
+    u32       faceCount;
+    u32       allocation;      // Of the atlas tiles
+
+    u32 staticDirty;    // Faces with stale static depth
+    u32 dynamicFaces;   // Faces with dynamic casters, this frame
+    u32 refreshFaces;   // Static faces redrawn this frame
+    u32 compositeFaces; // Live faces rebuilt this frame
+};
+
+struct ShadowCache
+{
+    std::vector<ShadowCacheEntry> lights; // Parallel to app->lights
+    std::vector<Aabb> dirtyBoxes;         // Static caster changes since the last update
+    std::vector<Aabb> dynamicBoxes;
+    u32 frame = SHADOW_SETTLE_FRAMES;     // Entities start out static
+    u32 faceBudget = 8;
+    u32 nextLight;                        // Where the budget starts, round robin
+    u32 casterRevision;                   // Bumped when an entity switches between static and dynamic
+
+    // Last UpdateShadowCache()
+    u32 refreshedFaces;
+    u32 compositedFaces;
+    u32 pendingFaces;
+};
+
+bool IsDynamicCaster(const App* app, const Entity& entity);
+
+// Static casters changed inside the box, the faces it touches get redrawn
+void InvalidateShadowCasters(App* app, const Aabb& box);
+
+/**
+ * Called when an entity moves, before its tree box is updated. A static entity becomes
+ * dynamic and the faces it was drawn in are invalidated.
+ */
+void MarkShadowCasterMoved(App* app, Entity& entity);
+
+/**
+ * Decides which faces are redrawn and composited this frame. Called by Update() once
+ * the light matrices and the atlas tiles are known, before the render queue culls the
+ * caster views.
+ */
+void UpdateShadowCache(App* app);
+
+// The shadow pass was culled this frame: the faces it would have redrawn stay stale and
+// the faces it would have composited are composited next time
+void SkipShadowCacheFrame(App* app);
+
+// Whether the render queue has to cull and draw a caster view of the light this frame,
+// for a view that draws the given faces
+bool ShadowViewActive(const App* app, u32 lightIdx, ShadowCasters casters, u32 faces);
@@ -0,0 +1,76 @@
+#include "shadow_cascades.h"
+#include "engine.h"
+#include "profiler.h"
+
+// View depth where each cascade ends, a blend of logarithmic and uniform splits
+static void ComputeCascadeSplits(App* app, u32 count, f32* splits)
+{
+    const f32 nearDepth = app->zNear;
+    const f32 farDepth = glm::clamp(app->shadowDistance, nearDepth + 1.0f, app->zFar);
+    for (u32 c = 0; c < count; ++c)
+    {
+        const f32 p = (f32)(c + 1) / (f32)count;
+        const f32 logSplit = nearDepth * powf(farDepth / nearDepth, p);
+        const f32 uniformSplit = nearDepth + (farDepth - nearDepth) * p;
+        splits[c] = glm::mix(uniformSplit, logSplit, app->cascadeSplitLambda);
+    }
+}
+
+static glm::mat4 FitCascade(const glm::mat4& inverseView, const glm::mat4& projection, f32 nearDepth, f32 farDepth, const glm::vec3& toLight, u32 tileSize)
+{
+    // Bounding sphere of the slice, in view space it only depends on the depths
+    glm::vec3 corners[8];
+    glm::vec3 center = glm::vec3(0.0f);
+    for (u32 i = 0; i < 8; ++i)
+    {
+        const f32 depth = (i & 4) ? farDepth : nearDepth;
+        corners[i] = glm::vec3((i & 1 ? depth : -depth) / projection[0][0], (i & 2 ? depth : -depth) / projection[1][1], -depth);
+        center += corners[i] / 8.0f;
+    }
+    f32 radius = 0.0f;
+    for (const glm::vec3& corner : corners)
+        radius = glm::max(radius, glm::length(corner - center));
+    // Rounded, float noise would change the texel size
+    radius = ceilf(radius * 16.0f) / 16.0f;
+
+    const glm::vec3 worldCenter = glm::vec3(inverseView * glm::vec4(center, 1.0f));
+    const glm::vec3 up = fabsf(toLight.y) > 0.99f ? glm::vec3(0, 0, 1) : glm::vec3(0, 1, 0);
+    const glm::mat4 lightView = glm::lookAt(worldCenter + toLight * (radius + SHADOW_CASCADE_MARGIN), worldCenter, up);
+    glm::mat4 lightProjection = glm::ortho(-radius, radius, -radius, radius, 0.0f, 2.0f * radius + SHADOW_CASCADE_MARGIN);
+
+    // Moves the projection so the world origin falls on a texel corner, then every
+    // point does when the camera moves
+    const f32 halfTile = 0.5f * (f32)tileSize;
+    const glm::vec4 origin = lightProjection * lightView * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    const glm::vec2 texel = glm::vec2(origin) * halfTile;
+    const glm::vec2 offset = (glm::round(texel) - texel) / halfTile;
+    lightProjection[3][0] += offset.x;
+    lightProjection[3][1] += offset.y;
+    return lightProjection * lightView;
+}
+
+void UpdateShadowCascades(App* app, const glm::mat4& view, const glm::mat4& projection)
+{
+    PROFILE_FUNCTION();
+    const glm::mat4 inverseView = glm::inverse(view);
+    for (u32 i = 0; i < app->lights.size(); ++i)
+    {
+        Light& light = app->lights[i];
+        if (light.type != LightType::LightType_Directional)
+            continue;
+
+        // Without tiles the matrices only cull, the wanted size stands in for the texel size
+        const ShadowAtlasLight& tiles = app->shadowAtlas.lights[i];
+        const u32 tileSize = tiles.tileCount ? tiles.tiles[0].size : tiles.wantedSize;
+        light.shadowMatrixCount = app->cascadeCount;
+        ComputeCascadeSplits(app, app->cascadeCount, light.cascadeSplits);
+
+        const glm::vec3 toLight = glm::normalize(light.direction);
+        f32 nearDepth = app->zNear;
+        for (u32 c = 0; c < app->cascadeCount; ++c)
+        {
+            light.shadowMatrices[c] = FitCascade(inverseView, projection, nearDepth, light.cascadeSplits[c], toLight, tileSize);
+            nearDepth = light.cascadeSplits[c];
+        }
+    }
+}
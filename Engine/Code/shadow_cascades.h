@@ -0,0 +1,25 @@
+//
+// shadow_cascades.h: Cascaded shadow maps of the directional lights. The camera
+// frustum up to shadowDistance is split in slices, closer to logarithmic than to
+// uniform splits (cascadeSplitLambda), and every slice gets an orthographic light
+// matrix around its bounding sphere. The sphere doesn't change when the camera turns
+// and the matrix is snapped to whole texels of the cascade tile, so the shadow edges
+// don't crawl when the camera moves. The cascades are the shadow atlas tiles of the
+// light; ShadowCascades.glsl draws all of them in one pass and the lighting shaders
+// use the first cascade that contains the pixel.
+//
+
+#pragma once
+
+#include "platform.h"
+
+struct App;
+
+#define SHADOW_MAX_CASCADES    4
+#define SHADOW_CASCADE_MARGIN  50.0f // Distance towards the light where casters of a cascade are still drawn
+
+/**
+ * Fits light.shadowMatrices of every directional light to the slices of the camera
+ * frustum, one per atlas tile. Called by Update() after UpdateShadowAtlas().
+ */
+void UpdateShadowCascades(App* app, const glm::mat4& view, const glm::mat4& projection);
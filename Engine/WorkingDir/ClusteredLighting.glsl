@@ -0,0 +1,254 @@
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+#ifdef CLUSTERED_LIGHTING
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location=0) in vec3 aPosition;
+layout(location=1) in vec2 aTexCoord;
+
+out vec2 lTexCoord;
+
+void main()
+{
+	lTexCoord = aTexCoord;
+	gl_Position = vec4(aPosition, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+in vec2 lTexCoord;
+
+#define CLUSTER_COUNT_X 16
+#define CLUSTER_COUNT_Y 9
+#define CLUSTER_COUNT_Z 24
+
+#define LIGHT_DIRECTIONAL 0u
+#define LIGHT_POINT       1u
+
+struct Light
+{
+	vec4 color;
+	vec4 direction; //point lights: constant, linear and quadratic attenuation
+	vec4 positionRadius;
+	mat4 shadowMatrices[4]; //directional light cascades
+	vec4 shadowRects[6]; //shadow atlas tiles, offset and size. One per cascade or cube face
+	uint type;
+	uint padding[3];
+};
+
+layout(binding = 1, std430) readonly buffer ClusterLights
+{
+	mat4 uView;
+	vec4 uClusterDepth; //slice scale and bias, viewport size
+	uvec4 uLightCounts; //directional lights (first in uLights), lights
+	Light uLights[];
+};
+
+layout(binding = 2, std430) readonly buffer ClusterGrid
+{
+	uvec2 uClusters[]; //offset and count in uLightIndices
+};
+
+layout(binding = 3, std430) readonly buffer ClusterIndices
+{
+	uint uLightIndices[];
+};
+
+layout(binding = 2, std140) uniform CameraParams
+{
+	vec3 cameraPos;
+	float zNear;
+	float zFar;
+	mat4 inverseViewProjection;
+	vec2 viewportSize; //pixels, the G-buffer textures can be bigger
+};
+
+uniform sampler2D uTextureAlb;
+uniform sampler2D uTextureNorm;
+uniform sampler2D uDepthTexture; //the depth buffer, not written while the lighting reads it
+uniform sampler2D shadowMap; //the shadow atlas
+
+layout(location = 0)out vec4 oColor;
+
+//octahedral normals of the G-buffer, see EncodeNormal() in the geometry passes
+vec3 DecodeNormal(vec2 encoded)
+{
+	vec2 f = encoded * 2.0 - 1.0;
+	vec3 n = vec3(f, 1.0 - abs(f.x) - abs(f.y));
+	float t = max(-n.z, 0.0);
+	n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+	return normalize(n);
+}
+
+//world position of the pixel from the depth buffer
+vec3 WorldPosition(ivec2 texel)
+{
+	float depth = texelFetch(uDepthTexture, texel, 0).r;
+	vec2 uv = (vec2(texel) + 0.5) / viewportSize;
+	vec4 world = inverseViewProjection * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+	return world.xyz / world.w;
+}
+
+//depth at uv of an atlas tile, the samples stay inside it
+float ShadowAtlasDepth(vec4 rect, vec2 uv)
+{
+	vec2 halfTexel = 0.5 / (rect.z * vec2(textureSize(shadowMap, 0)));
+	return texture(shadowMap, rect.xy + clamp(uv, halfTexel, 1.0 - halfTexel) * rect.z).r;
+}
+
+//face of the direction from the light and its coordinates in the face, same faces as the shadow matrices
+vec2 CubeFaceCoords(vec3 dir, out int face)
+{
+	vec3 a = abs(dir);
+	vec2 coords;
+	if(a.x >= a.y && a.x >= a.z)
+	{
+		face = dir.x > 0.0 ? 0 : 1;
+		coords = vec2(dir.x > 0.0 ? -dir.z : dir.z, -dir.y) / a.x;
+	}
+	else if(a.y >= a.z)
+	{
+		face = dir.y > 0.0 ? 2 : 3;
+		coords = vec2(dir.x, dir.y > 0.0 ? dir.z : -dir.z) / a.y;
+	}
+	else
+	{
+		face = dir.z > 0.0 ? 4 : 5;
+		coords = vec2(dir.z > 0.0 ? dir.x : -dir.x, -dir.y) / a.z;
+	}
+	return coords * 0.5 + 0.5;
+}
+
+float DirectionalShadow(Light light, vec3 position, vec3 normals, vec3 lightDir)
+{
+	//first cascade with the PCF kernel inside, no shadow past the last one
+	int sampleRadius = 2;
+	int cascade = -1;
+	vec3 lightCoords;
+	for(int c = 0; c < 4 && light.shadowRects[c].z != 0.0; ++c)
+	{
+		vec4 fragPosLightSpace = light.shadowMatrices[c] * vec4(position, 1.0);
+		lightCoords = (fragPosLightSpace.xyz / fragPosLightSpace.w + 1.0f) / 2.0f;
+		float border = float(sampleRadius + 1) / (light.shadowRects[c].z * float(textureSize(shadowMap, 0).x));
+		if(all(greaterThanEqual(lightCoords.xy, vec2(border))) && all(lessThanEqual(lightCoords.xy, vec2(1.0 - border))) && lightCoords.z <= 1.0f)
+		{
+			cascade = c;
+			break;
+		}
+	}
+	if(cascade < 0)
+		return 0.0f;
+
+	//a few texels of the cascade in world units, then in its depth range
+	vec4 rect = light.shadowRects[cascade];
+	mat4 m = light.shadowMatrices[cascade];
+	float texelWorldSize = 2.0 / (length(vec3(m[0][0], m[1][0], m[2][0])) * rect.z * float(textureSize(shadowMap, 0).x));
+	float depthPerUnit = 0.5 * length(vec3(m[0][2], m[1][2], m[2][2]));
+	float bias = (1.0f + 2.0f * (1.0f - dot(normals,lightDir))) * texelWorldSize * depthPerUnit;
+	float currentDepth = lightCoords.z;
+
+	float shadow = 0.0f;
+	vec2 pixelSize = 1.0 / (rect.z * vec2(textureSize(shadowMap, 0)));
+	for(int y = -sampleRadius; y <= sampleRadius; ++y)
+	{
+		for(int x = -sampleRadius; x <= sampleRadius; ++x)
+		{
+			float closestDepth = ShadowAtlasDepth(rect, lightCoords.xy + vec2(x,y) * pixelSize);
+			if(currentDepth > closestDepth + bias)
+				shadow += 1.0f;
+		}
+	}
+	return shadow / pow((sampleRadius * 2 + 1), 2);
+}
+
+float PointShadow(Light light, vec3 position, vec3 normals, vec3 lightDir)
+{
+	vec3 fragToLight = position - light.positionRadius.xyz;
+	float currentDepth = length(fragToLight);
+	float bias = max(0.5f * (1.0f - dot(normals, lightDir)), 0.0005f);
+
+	int face;
+	vec2 faceCoords = CubeFaceCoords(fragToLight, face);
+	vec4 rect = light.shadowRects[face];
+	if(rect.z == 0.0)
+		return 0.0f;
+
+	float shadow = 0.0f;
+	int sampleRadius = 2;
+	vec2 pixelSize = 1.0 / (rect.z * vec2(textureSize(shadowMap, 0)));
+	for(int y = -sampleRadius; y <= sampleRadius; ++y)
+	{
+		for(int x = -sampleRadius; x <= sampleRadius; ++x)
+		{
+			float closestDepth = ShadowAtlasDepth(rect, faceCoords + vec2(x,y) * pixelSize);
+			closestDepth *= light.positionRadius.w; //the far plane of the faces
+			if(currentDepth > closestDepth + bias)
+				shadow += 1.f;
+		}
+	}
+	return shadow / pow((sampleRadius * 2 + 1), 2);
+}
+
+//same terms as DirectionalLight.glsl and PointLight.glsl
+vec3 Shade(Light light, vec3 position, vec3 normals, vec3 viewDir)
+{
+	vec3 color = light.color.rgb;
+	vec3 lightDir;
+	float attenuation = 1.0;
+	float shadow;
+	if(light.type == LIGHT_DIRECTIONAL)
+	{
+		lightDir = normalize(light.direction.xyz);
+		shadow = DirectionalShadow(light, position, normals, lightDir);
+	}
+	else
+	{
+		float distance = length(position - light.positionRadius.xyz);
+		attenuation = 1.0 / (light.direction.x + light.direction.y*distance + light.direction.z*distance*distance);
+		lightDir = normalize(light.positionRadius.xyz - position);
+		shadow = PointShadow(light, position, normals, lightDir);
+	}
+
+	vec3 ambient = color * 0.15f;
+	vec3 difCol = color * max(dot(normals, lightDir),0.0) * attenuation;
+
+	float matSpecularity = 64.;
+	vec3 halfwayDir = normalize(viewDir + lightDir);
+	vec3 specCol = color * pow(max(dot(normals,halfwayDir),0.0), matSpecularity);
+
+	return ambient + (1.-shadow) * (difCol+specCol);
+}
+
+void main()
+{
+	//the G-buffer is read by texel, its textures can be bigger than the viewport
+	ivec2 texel = ivec2(gl_FragCoord.xy);
+	vec3 albedo = texelFetch(uTextureAlb, texel, 0).rgb;
+	vec3 normals = DecodeNormal(texelFetch(uTextureNorm, texel, 0).rg);
+	vec3 position = WorldPosition(texel);
+	vec3 viewDir = normalize(cameraPos - position);
+
+	vec3 lighting = vec3(0.0);
+	for(uint i = 0u; i < uLightCounts.x; ++i)
+		lighting += Shade(uLights[i], position, normals, viewDir);
+
+	//froxel of the pixel
+	float depth = max(-(uView * vec4(position, 1.0)).z, zNear);
+	int slice = clamp(int(floor(log(depth) * uClusterDepth.x - uClusterDepth.y)), 0, CLUSTER_COUNT_Z - 1);
+	ivec2 tile = clamp(ivec2(gl_FragCoord.xy / uClusterDepth.zw * vec2(CLUSTER_COUNT_X, CLUSTER_COUNT_Y)), ivec2(0), ivec2(CLUSTER_COUNT_X - 1, CLUSTER_COUNT_Y - 1));
+	uvec2 range = uClusters[(slice * CLUSTER_COUNT_Y + tile.y) * CLUSTER_COUNT_X + tile.x];
+
+	for(uint i = 0u; i < range.y; ++i)
+	{
+		Light light = uLights[uLightIndices[range.x + i]];
+		//the stencil volumes only lit what is inside the radius
+		if(distance(position, light.positionRadius.xyz) <= light.positionRadius.w)
+			lighting += Shade(light, position, normals, viewDir);
+	}
+
+	oColor = vec4(lighting * albedo, 1.);
+}
+#endif
+#endif
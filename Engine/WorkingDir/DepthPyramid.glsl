@@ -0,0 +1,62 @@
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+#ifdef DEPTH_PYRAMID_COPY
+
+#if defined(COMPUTE) //////////////////////////////////////////////////
+
+layout(local_size_x = 8, local_size_y = 8) in; //GPU_PYRAMID_GROUP_SIZE
+
+uniform sampler2D uDepthTexture;
+layout(binding = 1, r32f) writeonly uniform image2D uDst;
+
+void main()
+{
+	ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+	if(any(greaterThanEqual(texel, imageSize(uDst))))
+		return;
+	imageStore(uDst, texel, vec4(texelFetch(uDepthTexture, texel, 0).r));
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+#ifdef DEPTH_PYRAMID_REDUCE
+
+#if defined(COMPUTE) //////////////////////////////////////////////////
+
+layout(local_size_x = 8, local_size_y = 8) in; //GPU_PYRAMID_GROUP_SIZE
+
+layout(binding = 0, r32f) readonly uniform image2D uSrc;
+layout(binding = 1, r32f) writeonly uniform image2D uDst;
+
+void main()
+{
+	ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+	ivec2 dstSize = imageSize(uDst);
+	if(any(greaterThanEqual(texel, dstSize)))
+		return;
+
+	ivec2 srcSize = imageSize(uSrc);
+	ivec2 src = texel * 2;
+	float farthest = max(max(imageLoad(uSrc, src).r, imageLoad(uSrc, min(src + ivec2(1, 0), srcSize - 1)).r),
+	                     max(imageLoad(uSrc, min(src + ivec2(0, 1), srcSize - 1)).r, imageLoad(uSrc, min(src + ivec2(1, 1), srcSize - 1)).r));
+
+	//odd sizes: the last texel also covers the extra column or row
+	bool extraColumn = (srcSize.x & 1) != 0 && texel.x == dstSize.x - 1;
+	bool extraRow = (srcSize.y & 1) != 0 && texel.y == dstSize.y - 1;
+	if(extraColumn)
+		farthest = max(farthest, max(imageLoad(uSrc, min(src + ivec2(2, 0), srcSize - 1)).r, imageLoad(uSrc, min(src + ivec2(2, 1), srcSize - 1)).r));
+	if(extraRow)
+		farthest = max(farthest, max(imageLoad(uSrc, min(src + ivec2(0, 2), srcSize - 1)).r, imageLoad(uSrc, min(src + ivec2(1, 2), srcSize - 1)).r));
+	if(extraColumn && extraRow)
+		farthest = max(farthest, imageLoad(uSrc, min(src + ivec2(2, 2), srcSize - 1)).r);
+
+	imageStore(uDst, texel, vec4(farthest));
+}
+
+#endif
+#endif
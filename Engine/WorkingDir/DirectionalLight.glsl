@@ -39,79 +39,121 @@ layout(binding = 2, std140) uniform CameraParams
 	vec3 cameraPos;
 	float zNear;
 	float zFar;
+	mat4 inverseViewProjection;
+	vec2 viewportSize; //pixels, the G-buffer textures can be bigger
 };
 
 uniform sampler2D uTextureAlb;
 uniform sampler2D uTextureNorm;
-//uniform sampler2D uTextureDepth;
-uniform sampler2D uTexturePos;
-uniform sampler2D shadowMap;
+uniform sampler2D uDepthTexture; //the depth buffer, not written while the lighting reads it
+uniform sampler2D shadowMap; //the shadow atlas
+uniform vec4 uShadowRects[4]; //tile of each cascade in the atlas, offset and size
 
-uniform mat4 lightSpaceMatrix;
+uniform mat4 shadowMatrices[4]; //one per cascade
 
 layout(location = 0)out vec4 oColor;
 
-//https://www.youtube.com/watch?v=9g-4aJhCnyY
-float HardShadow(vec4 fragPosLightSpace, vec3 normals, vec3 lightDir)
+//octahedral normals of the G-buffer, see EncodeNormal() in the geometry passes
+vec3 DecodeNormal(vec2 encoded)
 {
-	float shadow = 0.0f;
-	vec3 lightCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
-	//if we are inside the frustum of the shadow map projection matrix
-	if(lightCoords.z <=1.0f)
+	vec2 f = encoded * 2.0 - 1.0;
+	vec3 n = vec3(f, 1.0 - abs(f.x) - abs(f.y));
+	float t = max(-n.z, 0.0);
+	n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+	return normalize(n);
+}
+
+//world position of the pixel from the depth buffer
+vec3 WorldPosition(ivec2 texel)
+{
+	float depth = texelFetch(uDepthTexture, texel, 0).r;
+	vec2 uv = (vec2(texel) + 0.5) / viewportSize;
+	vec4 world = inverseViewProjection * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+	return world.xyz / world.w;
+}
+
+//depth at uv of the cascade tile, the samples stay inside it
+float ShadowAtlasDepth(int cascade, vec2 uv)
+{
+	vec4 rect = uShadowRects[cascade];
+	vec2 halfTexel = 0.5 / (rect.z * vec2(textureSize(shadowMap, 0)));
+	return texture(shadowMap, rect.xy + clamp(uv, halfTexel, 1.0 - halfTexel) * rect.z).r;
+}
+
+//first cascade with the position and the PCF kernel inside, -1 past the last one
+int SelectCascade(vec3 position, int sampleRadius, out vec3 lightCoords)
+{
+	for(int c = 0; c < 4; ++c)
 	{
+		if(uShadowRects[c].z == 0.0)
+			break;
+		vec4 fragPosLightSpace = shadowMatrices[c] * vec4(position, 1.0);
 		//make it to the same range coordinates as the depth buffer
-		lightCoords = (lightCoords + 1.0f) / 2.0f;
+		lightCoords = (fragPosLightSpace.xyz / fragPosLightSpace.w + 1.0f) / 2.0f;
+		float border = float(sampleRadius + 1) / (uShadowRects[c].z * float(textureSize(shadowMap, 0).x));
+		if(all(greaterThanEqual(lightCoords.xy, vec2(border))) && all(lessThanEqual(lightCoords.xy, vec2(1.0 - border))) && lightCoords.z <= 1.0f)
+			return c;
+	}
+	return -1;
+}
 
-		float closestDepth = texture(shadowMap, lightCoords.xy).r;
-		float currentDepth = lightCoords.z;
+//the cascades cover different depth ranges and texel sizes, the bias is a few texels in world units
+float CascadeBias(int cascade, vec3 normals, vec3 lightDir)
+{
+	mat4 m = shadowMatrices[cascade];
+	float texelWorldSize = 2.0 / (length(vec3(m[0][0], m[1][0], m[2][0])) * uShadowRects[cascade].z * float(textureSize(shadowMap, 0).x));
+	float depthPerUnit = 0.5 * length(vec3(m[0][2], m[1][2], m[2][2]));
+	return (1.0f + 2.0f * (1.0f - dot(normals,lightDir))) * texelWorldSize * depthPerUnit;
+}
 
-		//bias per evitar els quadradets de shadow
-		float bias = max(0.025f * (1.0f - dot(normals,lightDir)), 0.0005f);
-		if(currentDepth > closestDepth + bias)
-			shadow = 1.0f;
-	}
-	return shadow;
+//https://www.youtube.com/watch?v=9g-4aJhCnyY
+float HardShadow(vec3 position, vec3 normals, vec3 lightDir)
+{
+	vec3 lightCoords;
+	int cascade = SelectCascade(position, 0, lightCoords);
+	if(cascade < 0)
+		return 0.0f;
+
+	float closestDepth = ShadowAtlasDepth(cascade, lightCoords.xy);
+	float currentDepth = lightCoords.z;
+	//bias per evitar els quadradets de shadow
+	float bias = CascadeBias(cascade, normals, lightDir);
+	return currentDepth > closestDepth + bias ? 1.0f : 0.0f;
 }
 
-float SoftShadow(vec4 fragPosLightSpace, vec3 normals, vec3 lightDir)
+float SoftShadow(vec3 position, vec3 normals, vec3 lightDir)
 {
+	int sampleRadius = 2;
+	vec3 lightCoords;
+	int cascade = SelectCascade(position, sampleRadius, lightCoords);
+	if(cascade < 0)
+		return 0.0f;
+
 	float shadow = 0.0f;
-	vec3 lightCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
-	//if we are inside the frustum of the shadow map projection matrix
-	if(lightCoords.z <=1.0f)
+	float currentDepth = lightCoords.z;
+	//bias per evitar els quadradets de shadow
+	float bias = CascadeBias(cascade, normals, lightDir);
+	vec2 pixelSize = 1.0 / (uShadowRects[cascade].z * vec2(textureSize(shadowMap, 0)));
+	for(int y = -sampleRadius; y <= sampleRadius; ++y)
 	{
-		//make it to the same range coordinates as the depth buffer
-		lightCoords = (lightCoords + 1.0f) / 2.0f;
-		float currentDepth = lightCoords.z;
-		//bias per evitar els quadradets de shadow
-		float bias = max(0.025f * (1.0f - dot(normals,lightDir)), 0.0005f);
-
-		int sampleRadius = 2;
-		vec2 pixelSize = 1.0 / textureSize(shadowMap, 0);
-		for(int y = -sampleRadius; y <= sampleRadius; ++y)
+		for(int x = -sampleRadius; x <= sampleRadius; ++x)
 		{
-			for(int x = -sampleRadius; x <= sampleRadius; ++x)
-			{
-				float closestDepth = texture(shadowMap, lightCoords.xy + vec2(x,y) * pixelSize).r;
-				if(currentDepth > closestDepth + bias)
-					shadow += 1.0f;
-			}
+			float closestDepth = ShadowAtlasDepth(cascade, lightCoords.xy + vec2(x,y) * pixelSize);
+			if(currentDepth > closestDepth + bias)
+				shadow += 1.0f;
 		}
-		//divide by the amount of samples we took
-		shadow /= pow((sampleRadius * 2 + 1), 2);
 	}
-	return shadow;
+	//divide by the amount of samples we took
+	return shadow / pow((sampleRadius * 2 + 1), 2);
 }
 
 void main()
 {
-	//vec2 tCoords = gl_FragCoord.xy / textureSize(uTextureAlb, 0);
-	vec2 tCoords = lTexCoord;
-
-	vec3 albedo = texture(uTextureAlb,tCoords).rgb;
-	vec3 normals = texture(uTextureNorm,tCoords).rgb;
-	//vec3 depth = texture(uTextureDepth,tCoords).rgb;
-	vec3 position = texture(uTexturePos,tCoords).rgb;
+	//the G-buffer is read by texel, its textures can be bigger than the viewport
+	ivec2 texel = ivec2(gl_FragCoord.xy);
+	vec3 albedo = texelFetch(uTextureAlb, texel, 0).rgb;
+	vec3 normals = DecodeNormal(texelFetch(uTextureNorm, texel, 0).rg);
+	vec3 position = WorldPosition(texel);
 
 	vec3 lightDir = normalize(uLight.direction);
 
@@ -139,9 +181,8 @@ void main()
 	vec3 specCol = uLight.color * spec;
 
 	//shadow
-	vec4 fragPosLightSpace = lightSpaceMatrix * vec4(position, 1.0);
-	//float shadow = HardShadow(fragPosLightSpace, normals, lightDir);
-	float shadow = SoftShadow(fragPosLightSpace, normals, lightDir);
+	//float shadow = HardShadow(position, normals, lightDir);
+	float shadow = SoftShadow(position, normals, lightDir);
 	
 	oColor = vec4((ambient + (1.-shadow) * (difCol+specCol)) * albedo ,1.);
 	//oColor = vec4((ambient + (difCol+specCol)) * albedo ,1.);
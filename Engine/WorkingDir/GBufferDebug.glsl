@@ -0,0 +1,82 @@
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+#ifdef GBUFFER_DEBUG
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location=0) in vec3 aPosition;
+
+void main()
+{
+	gl_Position = vec4(aPosition, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+#define VIEW_SCENE    0u //AttachmentOutputs
+#define VIEW_ALBEDO   1u
+#define VIEW_NORMALS  2u
+#define VIEW_DEPTH    3u
+#define VIEW_POSITION 4u
+
+layout(binding = 2, std140) uniform CameraParams
+{
+	vec3 cameraPos;
+	float zNear;
+	float zFar;
+	mat4 inverseViewProjection;
+	vec2 viewportSize; //pixels, the G-buffer textures can be bigger
+};
+
+uniform sampler2D uTextureAlb; //the light buffer or the albedo
+uniform sampler2D uTextureNorm;
+uniform sampler2D uDepthTexture;
+uniform uint uDebugView;
+
+layout(location = 0)out vec4 oColor;
+
+//octahedral normals of the G-buffer, see EncodeNormal() in the geometry passes
+vec3 DecodeNormal(vec2 encoded)
+{
+	vec2 f = encoded * 2.0 - 1.0;
+	vec3 n = vec3(f, 1.0 - abs(f.x) - abs(f.y));
+	float t = max(-n.z, 0.0);
+	n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+	return normalize(n);
+}
+
+float LinearizeDepth(float depth)
+{
+	float z = depth * 2.0 - 1.0;
+	return (2.0 * zNear * zFar) / (zFar + zNear - z * (zFar - zNear));
+}
+
+void main()
+{
+	//the G-buffer is read by texel, its textures can be bigger than the screen
+	ivec2 texel = ivec2(gl_FragCoord.xy);
+	float depth = texelFetch(uDepthTexture, texel, 0).r;
+	vec3 color = vec3(0.0);
+	if(uDebugView == VIEW_SCENE || uDebugView == VIEW_ALBEDO)
+	{
+		color = texelFetch(uTextureAlb, texel, 0).rgb;
+	}
+	else if(uDebugView == VIEW_NORMALS)
+	{
+		color = depth < 1.0 ? DecodeNormal(texelFetch(uTextureNorm, texel, 0).rg) : vec3(0.0);
+	}
+	else if(uDebugView == VIEW_DEPTH)
+	{
+		color = vec3(LinearizeDepth(depth) / zFar);
+	}
+	else if(uDebugView == VIEW_POSITION && depth < 1.0)
+	{
+		vec2 uv = (vec2(texel) + 0.5) / viewportSize;
+		vec4 world = inverseViewProjection * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+		color = world.xyz / world.w;
+	}
+	oColor = vec4(color, 1.0);
+}
+#endif
+#endif
@@ -11,10 +11,11 @@ layout(location=1) in vec3 aNormal;
 layout(location=2) in vec2 aTexCoord;
 //layout(location=3) in vec3 aTangent;
 //layout(location=4) in vec3 aBiTangent;
+layout(location=5) in uint aObjectIndex;
 
-layout(binding = 1, std140) uniform LocalParams
+layout(binding = 0, std430) readonly buffer ObjectParams
 {
-	mat4 uWorldMatrix;
+	mat3x4 uWorldMatrices[]; //transposed affine world matrices, 48 bytes per object
 };
 
 layout(binding = 3, std140) uniform viewProjMat
@@ -28,10 +29,11 @@ out vec3 vNormal;
 
 void main()
 {
+	mat4 worldMatrix = mat4(transpose(uWorldMatrices[aObjectIndex]));
 	vTexCoord = aTexCoord;
-	vPosition = vec3(uWorldMatrix * vec4(aPosition, 1.0) );
-	vNormal = normalize(vec3( uWorldMatrix * vec4(aNormal, 0.0) ));
-	gl_Position = uViewProjectionMatrix * uWorldMatrix * vec4(aPosition, 1.0);
+	vPosition = vec3(worldMatrix * vec4(aPosition, 1.0) );
+	vNormal = normalize(vec3( worldMatrix * vec4(aNormal, 0.0) ));
+	gl_Position = uViewProjectionMatrix * worldMatrix * vec4(aPosition, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
@@ -48,24 +50,22 @@ layout(binding = 2, std140) uniform CameraParams
 	float zFar;
 };
 
-layout(location = 0)out vec4 oColor;
+//the lighting gets the position from the depth buffer
 layout(location = 1)out vec4 albedo;
-layout(location = 2)out vec4 nColor;
-layout(location = 3)out vec4 depth;
-layout(location = 4)out vec4 outPos;
+layout(location = 2)out vec2 nColor; //octahedral world normal
 
-float LinearizeDepth(float depth)
+//the unit octahedron unfolded on a square, 0 to 1
+vec2 EncodeNormal(vec3 n)
 {
-	float z = depth * 2.0 - 1.0;
-	return (2.0 * zNear * zFar) / (zFar + zNear - z * (zFar - zNear));
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	vec2 signs = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	vec2 folded = n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * signs;
+	return folded * 0.5 + 0.5;
 }
 void main()
 {
 	albedo = texture(uTexture,vTexCoord);
-	outPos = vec4(vPosition,1.);
-	nColor = vec4(vNormal,1.);
-	depth = vec4(vec3(LinearizeDepth(gl_FragCoord.z) / zFar),1.);
-	oColor = albedo;
+	nColor = EncodeNormal(vNormal);
 }
 #endif
 #endif
\ No newline at end of file
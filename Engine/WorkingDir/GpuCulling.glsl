@@ -0,0 +1,172 @@
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+#ifdef GPU_CULLING
+
+#if defined(COMPUTE) //////////////////////////////////////////////////
+
+layout(local_size_x = 64) in; //GPU_CULL_GROUP_SIZE
+
+struct CullItem
+{
+	vec4 center; //local AABB of the submesh
+	vec4 extent;
+	uint objectIndex;
+	uint drawable;
+	uint dynamic; //shadow caster kind
+	uint padding;
+};
+
+#define MAX_FRUSTUMS 4 //GPU_CULL_MAX_FRUSTUMS
+
+struct CullView
+{
+	vec4 planes[MAX_FRUSTUMS * 6]; //6 per frustum, the cascades of directional lights
+	vec4 sphere; //point lights, also tested with the frustum of a cube face. Radius 0 without it
+	uint frustumCount; //visible in any of them
+	uint occlusion;
+	uint casters; //0 all, 1 static, 2 dynamic
+	uint padding;
+};
+
+struct DrawCommand
+{
+	uint count;
+	uint instanceCount;
+	uint firstIndex;
+	int  baseVertex;
+	uint baseInstance;
+};
+
+layout(binding = 0, std430) readonly buffer ObjectParams
+{
+	mat3x4 uWorldMatrices[]; //transposed affine world matrices, 48 bytes per object
+};
+
+layout(binding = 4, std430) readonly buffer CullItems
+{
+	CullItem uItems[];
+};
+
+layout(binding = 5, std430) readonly buffer CullViews
+{
+	CullView uViews[];
+};
+
+layout(binding = 6, std430) readonly buffer CommandLookup
+{
+	uint uCommandLookup[]; //view * uDrawableCount + drawable, 0xffffffff if the view doesn't draw it
+};
+
+layout(binding = 7, std430) buffer DrawCommands
+{
+	DrawCommand uCommands[];
+};
+
+layout(binding = 8, std430) writeonly buffer Instances
+{
+	uint uInstances[];
+};
+
+uniform uint uItemCount;
+uniform uint uDrawableCount;
+uniform uint uUseDepthPyramid;
+uniform mat4 uPrevViewProjection;
+uniform sampler2D uDepthPyramid; //farthest depth, level 0 is the full resolution
+
+//visible in any of the view frustums, read in place, the views are big
+bool FrustumTest(uint viewIdx, vec3 center, vec3 extent)
+{
+	for(uint f = 0u; f < uViews[viewIdx].frustumCount; ++f)
+	{
+		bool inside = true;
+		for(uint i = 0u; i < 6u && inside; ++i)
+		{
+			vec4 plane = uViews[viewIdx].planes[f * 6u + i];
+			inside = dot(plane.xyz, center) + plane.w >= -dot(abs(plane.xyz), extent);
+		}
+		if(inside)
+			return true;
+	}
+	return false;
+}
+
+bool SphereTest(vec4 sphere, vec3 center, vec3 extent)
+{
+	vec3 closest = clamp(sphere.xyz, center - extent, center + extent);
+	vec3 d = closest - sphere.xyz;
+	return dot(d, d) <= sphere.w * sphere.w;
+}
+
+//true if the box is behind the depth of last frame, reprojected with last frame's matrix
+bool OcclusionTest(vec3 center, vec3 extent)
+{
+	vec2 rectMin = vec2(1.0);
+	vec2 rectMax = vec2(-1.0);
+	float nearest = 1.0;
+	for(int i = 0; i < 8; ++i)
+	{
+		vec3 corner = center + extent * vec3((i & 1) != 0 ? 1.0 : -1.0, (i & 2) != 0 ? 1.0 : -1.0, (i & 4) != 0 ? 1.0 : -1.0);
+		vec4 clip = uPrevViewProjection * vec4(corner, 1.0);
+		if(clip.w <= 0.0 || clip.z < -clip.w)
+			return false; //crosses the near plane
+		vec3 ndc = clip.xyz / clip.w;
+		rectMin = min(rectMin, ndc.xy);
+		rectMax = max(rectMax, ndc.xy);
+		nearest = min(nearest, ndc.z * 0.5 + 0.5);
+	}
+	rectMin = clamp(rectMin * 0.5 + 0.5, 0.0, 1.0);
+	rectMax = clamp(rectMax * 0.5 + 0.5, 0.0, 1.0);
+
+	//the level where the rect spans about 2x2 texels
+	ivec2 size = textureSize(uDepthPyramid, 0);
+	vec2 extentPixels = (rectMax - rectMin) * vec2(size);
+	int level = int(ceil(log2(max(max(extentPixels.x, extentPixels.y), 1.0))));
+	level = clamp(level, 0, textureQueryLevels(uDepthPyramid) - 1);
+
+	ivec2 levelSize = textureSize(uDepthPyramid, level);
+	ivec2 texelMin = clamp(ivec2(rectMin * vec2(levelSize)), ivec2(0), levelSize - 1);
+	ivec2 texelMax = clamp(ivec2(rectMax * vec2(levelSize)), ivec2(0), levelSize - 1);
+	float farthest = 0.0;
+	for(int y = texelMin.y; y <= texelMax.y; ++y)
+		for(int x = texelMin.x; x <= texelMax.x; ++x)
+			farthest = max(farthest, texelFetch(uDepthPyramid, ivec2(x, y), level).r);
+
+	return nearest > farthest;
+}
+
+void main()
+{
+	uint itemIdx = gl_GlobalInvocationID.x;
+	uint viewIdx = gl_WorkGroupID.y;
+	if(itemIdx >= uItemCount)
+		return;
+
+	CullItem item = uItems[itemIdx];
+	uint casters = uViews[viewIdx].casters;
+	if(casters != 0u && (item.dynamic != 0u) != (casters == 2u))
+		return;
+
+	uint commandIdx = uCommandLookup[viewIdx * uDrawableCount + item.drawable];
+	if(commandIdx == 0xffffffffu)
+		return;
+
+	//world space box of the local one
+	mat4 worldMatrix = mat4(transpose(uWorldMatrices[item.objectIndex]));
+	vec3 center = (worldMatrix * vec4(item.center.xyz, 1.0)).xyz;
+	mat3 absolute = mat3(abs(worldMatrix[0].xyz), abs(worldMatrix[1].xyz), abs(worldMatrix[2].xyz));
+	vec3 extent = absolute * item.extent.xyz;
+
+	vec4 sphere = uViews[viewIdx].sphere;
+	bool visible = (uViews[viewIdx].frustumCount == 0u || FrustumTest(viewIdx, center, extent)) && (sphere.w == 0.0 || SphereTest(sphere, center, extent));
+	if(visible && uViews[viewIdx].occlusion != 0u && uUseDepthPyramid != 0u)
+		visible = !OcclusionTest(center, extent);
+	if(!visible)
+		return;
+
+	uint slot = atomicAdd(uCommands[commandIdx].instanceCount, 1u);
+	uInstances[uCommands[commandIdx].baseInstance + slot] = item.objectIndex;
+}
+
+#endif
+#endif
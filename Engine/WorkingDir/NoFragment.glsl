@@ -6,10 +6,11 @@
 #if defined(VERTEX) ///////////////////////////////////////////////////
 
 layout(location=0) in vec3 aPosition;
+layout(location=5) in uint aObjectIndex;
 
-layout(binding = 1, std140) uniform LocalParams
+layout(binding = 0, std430) readonly buffer ObjectParams
 {
-	mat4 uWorldMatrix;
+	mat3x4 uWorldMatrices[]; //transposed affine world matrices, 48 bytes per object
 };
 
 layout(binding = 3, std140) uniform viewProjMat
@@ -19,8 +20,9 @@ layout(binding = 3, std140) uniform viewProjMat
 
 void main()
 {
+	mat4 worldMatrix = mat4(transpose(uWorldMatrices[aObjectIndex]));
 
-	gl_Position = uViewProjectionMatrix * uWorldMatrix * vec4(aPosition, 1.0);
+	gl_Position = uViewProjectionMatrix * worldMatrix * vec4(aPosition, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
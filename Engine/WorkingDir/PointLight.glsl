@@ -8,13 +8,14 @@
 layout(location=0) in vec3 aPosition;
 layout(location=1) in vec3 aNormal;
 layout(location=2) in vec2 aTexCoord;
+layout(location=5) in uint aObjectIndex;
 
 out vec2 lTexCoord;
 out vec3 lNormal;
 
-layout(binding = 1, std140) uniform LocalParams
+layout(binding = 0, std430) readonly buffer ObjectParams
 {
-	mat4 uWorldMatrix;
+	mat3x4 uWorldMatrices[]; //transposed affine world matrices, 48 bytes per object
 };
 
 layout(binding = 3, std140) uniform viewProjMat
@@ -24,14 +25,15 @@ layout(binding = 3, std140) uniform viewProjMat
 
 void main()
 {
+	mat4 worldMatrix = mat4(transpose(uWorldMatrices[aObjectIndex]));
 	lTexCoord = aTexCoord;
-	vec3 lFrag = vec3(uWorldMatrix * vec4(aPosition, 1.0) );
-	lNormal = normalize(vec3( uWorldMatrix * vec4(aNormal, 0.0)));
+	vec3 lFrag = vec3(worldMatrix * vec4(aPosition, 1.0) );
+	lNormal = normalize(vec3( worldMatrix * vec4(aNormal, 0.0)));
 
 	//center of the sphere
 	//lPosition.xyz = lFrag + (-lNormal * uLight.radius);
 
-	gl_Position = uViewProjectionMatrix * uWorldMatrix * vec4(aPosition, 1.0);
+	gl_Position = uViewProjectionMatrix * worldMatrix * vec4(aPosition, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
@@ -54,24 +56,68 @@ layout(binding = 2, std140) uniform CameraParams
 	vec3 cameraPos;
 	float zNear;
 	float zFar;
+	mat4 inverseViewProjection;
+	vec2 viewportSize; //pixels, the G-buffer textures can be bigger
 };
 
 uniform sampler2D uTextureAlb;
 uniform sampler2D uTextureNorm;
-//uniform sampler2D uTextureDepth;
-uniform sampler2D uTexturePos;
-uniform samplerCube shadowCubeMap;
+uniform sampler2D uDepthTexture; //the depth buffer, not written while the lighting reads it
+uniform sampler2D shadowMap; //the shadow atlas
+uniform vec4 uShadowRects[6]; //tiles of the cube faces in the atlas, offset and size
+uniform float farPlane; //the light radius, the shadow depth is the distance over it
 
 layout(location = 0)out vec4 oColor;
 
+//octahedral normals of the G-buffer, see EncodeNormal() in the geometry passes
+vec3 DecodeNormal(vec2 encoded)
+{
+	vec2 f = encoded * 2.0 - 1.0;
+	vec3 n = vec3(f, 1.0 - abs(f.x) - abs(f.y));
+	float t = max(-n.z, 0.0);
+	n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+	return normalize(n);
+}
+
+//world position of the pixel from the depth buffer
+vec3 WorldPosition(ivec2 texel)
+{
+	float depth = texelFetch(uDepthTexture, texel, 0).r;
+	vec2 uv = (vec2(texel) + 0.5) / viewportSize;
+	vec4 world = inverseViewProjection * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+	return world.xyz / world.w;
+}
+
+//face of the direction from the light and its coordinates in the face, same faces as the shadow matrices
+vec2 CubeFaceCoords(vec3 dir, out int face)
+{
+	vec3 a = abs(dir);
+	vec2 coords;
+	if(a.x >= a.y && a.x >= a.z)
+	{
+		face = dir.x > 0.0 ? 0 : 1;
+		coords = vec2(dir.x > 0.0 ? -dir.z : dir.z, -dir.y) / a.x;
+	}
+	else if(a.y >= a.z)
+	{
+		face = dir.y > 0.0 ? 2 : 3;
+		coords = vec2(dir.x, dir.y > 0.0 ? dir.z : -dir.z) / a.y;
+	}
+	else
+	{
+		face = dir.z > 0.0 ? 4 : 5;
+		coords = vec2(dir.z > 0.0 ? dir.x : -dir.x, -dir.y) / a.z;
+	}
+	return coords * 0.5 + 0.5;
+}
+
 void main()
 {
-	vec2 tCoords = gl_FragCoord.xy / textureSize(uTextureAlb, 0);
-	//vec2 tCoords = lTexCoord;
-	vec3 albedo = texture(uTextureAlb,tCoords).rgb;
-	vec3 normals = texture(uTextureNorm,tCoords).rgb;
-	//vec3 depth = texture(uTextureDepth,tCoords).rgb;
-	vec3 position = texture(uTexturePos,tCoords).rgb;
+	//the G-buffer is read by texel, its textures can be bigger than the viewport
+	ivec2 texel = ivec2(gl_FragCoord.xy);
+	vec3 albedo = texelFetch(uTextureAlb, texel, 0).rgb;
+	vec3 normals = DecodeNormal(texelFetch(uTextureNorm, texel, 0).rg);
+	vec3 position = WorldPosition(texel);
 
 	//ambient
 	vec3 ambient = uLight.color * 0.15f;
@@ -110,22 +156,28 @@ void main()
 	float currentDepth = length(fragToLight);
 	float bias = max(0.5f * (1.0f - dot(normals, lDir)), 0.0005f);
 	
-	int sampleRadius = 2;
-	float pixelSize = 1.0f / 1024.f;
-	for(int z = -sampleRadius; z <= sampleRadius; ++z)
+	int face;
+	vec2 faceCoords = CubeFaceCoords(fragToLight, face);
+	vec4 rect = uShadowRects[face];
+	if(rect.z > 0.0)
 	{
+		//the samples stay inside the face tile
+		vec2 tileSize = rect.z * vec2(textureSize(shadowMap, 0));
+		vec2 halfTexel = 0.5 / tileSize;
+		int sampleRadius = 2;
 		for(int y = -sampleRadius; y <= sampleRadius; ++y)
 		{
 			for(int x = -sampleRadius; x <= sampleRadius; ++x)
 			{
-				float closestDepth = texture(shadowCubeMap, fragToLight + vec3(x,y,z) * pixelSize).r;
-				closestDepth *= zFar;
+				vec2 uv = clamp(faceCoords + vec2(x,y) / tileSize, halfTexel, 1.0 - halfTexel);
+				float closestDepth = texture(shadowMap, rect.xy + uv * rect.z).r;
+				closestDepth *= farPlane;
 				if(currentDepth > closestDepth + bias)
 					shadow += 1.f;
 			}
 		}
+		shadow /= pow((sampleRadius * 2 + 1), 2);
 	}
-	shadow /= pow((sampleRadius * 2 + 1), 3);
 
 	oColor = vec4((ambient + (1.-shadow) * (difCol+specCol)) * albedo ,1.);
 }
@@ -11,10 +11,11 @@ layout(location=1) in vec3 aNormal;
 layout(location=2) in vec2 aTexCoord;
 layout(location=3) in vec3 aTangent;
 layout(location=4) in vec3 aBiTangent;
+layout(location=5) in uint aObjectIndex;
 
-layout(binding = 1, std140) uniform LocalParams
+layout(binding = 0, std430) readonly buffer ObjectParams
 {
-	mat4 uWorldMatrix;
+	mat3x4 uWorldMatrices[]; //transposed affine world matrices, 48 bytes per object
 };
 
 layout(binding = 3, std140) uniform viewProjMat
@@ -28,16 +29,19 @@ out vec3 vNormal;
 out vec3 tangentLocalSpace;
 out vec3 biTangentLocalSpace;
 out vec3 normalLocalSpace;
+flat out uint vObjectIndex;
 
 void main()
 {
+	mat4 worldMatrix = mat4(transpose(uWorldMatrices[aObjectIndex]));
 	vTexCoord = aTexCoord;
-	vPosition = vec3(uWorldMatrix * vec4(aPosition, 1.0) );
-	vNormal = normalize(vec3( uWorldMatrix * vec4(aNormal, 0.0) ));
+	vPosition = vec3(worldMatrix * vec4(aPosition, 1.0) );
+	vNormal = normalize(vec3( worldMatrix * vec4(aNormal, 0.0) ));
 	tangentLocalSpace = aTangent;
 	biTangentLocalSpace = aBiTangent;
 	normalLocalSpace = aNormal;
-	gl_Position = uViewProjectionMatrix * uWorldMatrix * vec4(aPosition, 1.0);
+	vObjectIndex = aObjectIndex;
+	gl_Position = uViewProjectionMatrix * worldMatrix * vec4(aPosition, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
@@ -48,6 +52,7 @@ in vec3 vNormal;
 in vec3 tangentLocalSpace;
 in vec3 biTangentLocalSpace;
 in vec3 normalLocalSpace;
+flat in uint vObjectIndex;
 
 uniform sampler2D uTexture;
 uniform sampler2D normalMap;
@@ -60,24 +65,26 @@ layout(binding = 2, std140) uniform CameraParams
 	float zFar;
 };
 
-layout(binding = 1, std140) uniform LocalParams
+layout(binding = 0, std430) readonly buffer ObjectParams
 {
-	mat4 uWorldMatrix;
+	mat3x4 uWorldMatrices[]; //transposed affine world matrices, 48 bytes per object
 };
 
-layout(location = 0)out vec4 oColor;
+//the lighting gets the position from the depth buffer
 layout(location = 1)out vec4 albedo;
-layout(location = 2)out vec4 nColor;
-layout(location = 3)out vec4 depth;
-layout(location = 4)out vec4 outPos;
+layout(location = 2)out vec2 nColor; //octahedral world normal
 
-float LinearizeDepth(float depth)
+//the unit octahedron unfolded on a square, 0 to 1
+vec2 EncodeNormal(vec3 n)
 {
-	float z = depth * 2.0 - 1.0;
-	return (2.0 * zNear * zFar) / (zFar + zNear - z * (zFar - zNear));
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	vec2 signs = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	vec2 folded = n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * signs;
+	return folded * 0.5 + 0.5;
 }
 void main()
 {
+	mat4 worldMatrix = mat4(transpose(uWorldMatrices[vObjectIndex]));
 	vec3 T = normalize(tangentLocalSpace);
 	vec3 B = normalize(biTangentLocalSpace);
 	vec3 N = normalize(normalLocalSpace);
@@ -119,17 +126,14 @@ void main()
 		discard;
 
 	albedo = texture(uTexture,UVs);
-	outPos = vec4(vPosition,1.);
-	nColor = vec4(vNormal,1.);
-	depth = vec4(vec3(LinearizeDepth(gl_FragCoord.z) / zFar),1.);
-	oColor = albedo;
+	nColor = EncodeNormal(vNormal);
 
 
 	vec3 tangentSpaceNormal = texture(normalMap, UVs).xyz *2.0 - vec3(1.0);
 	vec3 localSpaceNormal = TBN * tangentSpaceNormal;
 	//vec3 viewSpaceNormal = normalize(worldViewMatrix * vec4(localSpaceNormal, 0.0)).xyz;
-	vec3 worldSpaceNormal = normalize(uWorldMatrix * vec4(localSpaceNormal, 0.0)).xyz;
-	nColor = vec4(worldSpaceNormal,1.);
+	vec3 worldSpaceNormal = normalize(worldMatrix * vec4(localSpaceNormal, 0.0)).xyz;
+	nColor = EncodeNormal(worldSpaceNormal);
 }
 #endif
 #endif
\ No newline at end of file
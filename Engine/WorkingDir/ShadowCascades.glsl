@@ -0,0 +1,63 @@
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+#ifdef SHADOW_CASCADES
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location=0) in vec3 aPosition;
+layout(location=5) in uint aObjectIndex;
+
+layout(binding = 0, std430) readonly buffer ObjectParams
+{
+	mat3x4 uWorldMatrices[]; //transposed affine world matrices, 48 bytes per object
+};
+
+void main()
+{
+	mat4 worldMatrix = mat4(transpose(uWorldMatrices[aObjectIndex]));
+
+	gl_Position = worldMatrix * vec4(aPosition, 1.0);
+}
+
+#elif defined(GEOMETRY) ///////////////////////////////////////////////
+
+layout(triangles) in;
+layout(triangle_strip, max_vertices = 12) out;
+
+uniform mat4 shadowMatrices[4]; //one per cascade
+uniform uint uFaceMask; //cascades to draw, the cached ones are skipped
+
+void main()
+{
+	for(int cascade = 0; cascade < 4; ++cascade)
+	{
+		if((uFaceMask & (1u << cascade)) == 0u)
+			continue;
+
+		vec4 clip[3];
+		for(int i = 0; i < 3; ++i)
+			clip[i] = shadowMatrices[cascade] * gl_in[i].gl_Position;
+		//triangles out of the sides of the cascade are not drawn in it, depth is clamped
+		vec2 minClip = min(min(clip[0].xy, clip[1].xy), clip[2].xy);
+		vec2 maxClip = max(max(clip[0].xy, clip[1].xy), clip[2].xy);
+		if(any(greaterThan(minClip, vec2(1.0))) || any(lessThan(maxClip, vec2(-1.0))))
+			continue;
+
+		for(int i = 0; i < 3; ++i)
+		{
+			gl_ViewportIndex = cascade + 1; //set to the cascade tile of the shadow atlas
+			gl_Position = clip[i];
+			EmitVertex();
+		}
+		EndPrimitive();
+	}
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+void main()
+{
+}
+#endif
+#endif
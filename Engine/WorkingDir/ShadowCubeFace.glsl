@@ -0,0 +1,41 @@
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+#ifdef SHADOW_CUBE_FACE
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location=0) in vec3 aPosition;
+layout(location=5) in uint aObjectIndex;
+
+layout(binding = 0, std430) readonly buffer ObjectParams
+{
+	mat3x4 uWorldMatrices[]; //transposed affine world matrices, 48 bytes per object
+};
+
+uniform mat4 shadowMatrices[1]; //the face drawn, one draw per face
+
+out vec3 fragPos;
+
+void main()
+{
+	mat4 worldMatrix = mat4(transpose(uWorldMatrices[aObjectIndex]));
+
+	vec4 worldPos = worldMatrix * vec4(aPosition, 1.0);
+	fragPos = worldPos.xyz;
+	gl_Position = shadowMatrices[0] * worldPos;
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+in vec3 fragPos;
+
+uniform vec3 lightPos;
+uniform float farPlane; //the light radius
+
+void main()
+{
+	gl_FragDepth = length(fragPos - lightPos) / farPlane;
+}
+#endif
+#endif
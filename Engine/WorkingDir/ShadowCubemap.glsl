@@ -6,16 +6,18 @@
 #if defined(VERTEX) ///////////////////////////////////////////////////
 
 layout(location=0) in vec3 aPosition;
+layout(location=5) in uint aObjectIndex;
 
-layout(binding = 1, std140) uniform LocalParams
+layout(binding = 0, std430) readonly buffer ObjectParams
 {
-	mat4 uWorldMatrix;
+	mat3x4 uWorldMatrices[]; //transposed affine world matrices, 48 bytes per object
 };
 
 void main()
 {
+	mat4 worldMatrix = mat4(transpose(uWorldMatrices[aObjectIndex]));
 
-	gl_Position = uWorldMatrix * vec4(aPosition, 1.0);
+	gl_Position = worldMatrix * vec4(aPosition, 1.0);
 }
 
 #elif defined(GEOMETRY) ///////////////////////////////////////////////
@@ -24,6 +26,7 @@ layout(triangles) in;
 layout(triangle_strip, max_vertices = 18) out;
 
 uniform mat4 shadowMatrices[6];
+uniform uint uFaceMask; //faces to draw, the cached ones are skipped
 
 out vec4 fragPos;
 
@@ -31,11 +34,24 @@ void main()
 {
 	for(int face = 0; face < 6; ++face)
 	{
-		gl_Layer = face;
+		if((uFaceMask & (1u << face)) == 0u)
+			continue;
+
+		vec4 clip[3];
+		for(int i = 0; i < 3; ++i)
+			clip[i] = shadowMatrices[face] * gl_in[i].gl_Position;
+		//only to the faces the triangle touches: skipped when all the vertices are out of the same side plane
+		vec4 inside = vec4(-1.0);
+		for(int i = 0; i < 3; ++i)
+			inside = max(inside, vec4(clip[i].w - clip[i].x, clip[i].w + clip[i].x, clip[i].w - clip[i].y, clip[i].w + clip[i].y));
+		if(any(lessThan(inside, vec4(0.0))))
+			continue;
+
 		for(int i = 0; i < 3; ++i)
 		{
+			gl_ViewportIndex = face + 1; //set to the face tile of the shadow atlas
 			fragPos = gl_in[i].gl_Position;
-			gl_Position = shadowMatrices[face] * fragPos;
+			gl_Position = clip[i];
 			EmitVertex();
 		}
 		EndPrimitive();
@@ -47,7 +63,7 @@ void main()
 in vec4 fragPos;
 
 uniform vec3 lightPos;
-uniform float farPlane;
+uniform float farPlane; //the light radius
 
 void main()
 {